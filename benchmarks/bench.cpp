@@ -0,0 +1,485 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bench_util.h"
+#include "rdma_util.h"
+
+/**
+ * A single driver for the bandwidth benchmarks. Every QP pair connects a device of --dev1 to a
+ * device of --dev2, the i-th pair uses the (i % n)-th entry of both lists, and so do the GPU lists.
+ * Each pair carries one lane per direction, a lane keeps --dop messages of --size bytes in flight.
+ *
+ * Modes:
+ *   tccl       TcclContext send/recv, latency from submission to handle completion
+ *   write      raw RDMA writes
+ *   read       raw RDMA reads
+ *   send_recv  raw two-sided sends
+ */
+
+struct Point {
+    std::string mode;
+    uint64_t size;
+    uint64_t dop;
+    uint64_t qps;
+    bool bidirectional;
+};
+
+struct Lane {
+    rdma_util::LatencyHistogram latency;
+    uint64_t iterations = 0;
+};
+
+// Released once every lane is set up, so that the lanes start at the same time
+static std::atomic<bool> g_started(false);
+
+static void wait_for_start() {
+    while (!g_started.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+}
+
+static void tccl_send_lane(
+    rdma_util::Arc<rdma_util::TcclContext> context,
+    uint32_t stream_id,
+    uint64_t base_addr,
+    uint32_t lkey,
+    uint64_t size,
+    uint64_t dop,
+    Lane* lane
+) {
+    // Every lane thread submits through its own producer tokens
+    rdma_util::Box<rdma_util::TcclSubmitter> submitter = rdma_util::TcclSubmitter::create(context);
+    std::vector<rdma_util::Handle> handles(dop);
+    std::vector<uint64_t> submit_ns(dop, 0);
+    wait_for_start();
+
+    for (uint64_t i = 0; i < lane->iterations + dop; ++i) {
+        const uint64_t slot = i % dop;
+        if (i >= dop) {
+            handles[slot].wait();
+            lane->latency.record(rdma_util::stats_now_ns() - submit_ns[slot]);
+        }
+        if (i < lane->iterations) {
+            submit_ns[slot] = rdma_util::stats_now_ns();
+            handles[slot] = submitter->send(stream_id, base_addr + slot * size, size, lkey);
+        }
+    }
+}
+
+static void tccl_recv_lane(
+    rdma_util::Arc<rdma_util::TcclContext> context,
+    uint32_t stream_id,
+    uint64_t base_addr,
+    uint32_t rkey,
+    uint64_t size,
+    uint64_t dop,
+    uint64_t iterations
+) {
+    rdma_util::Box<rdma_util::TcclSubmitter> submitter = rdma_util::TcclSubmitter::create(context);
+    std::vector<rdma_util::Handle> handles(dop);
+    wait_for_start();
+
+    for (uint64_t i = 0; i < iterations + dop; ++i) {
+        const uint64_t slot = i % dop;
+        if (i >= dop) {
+            handles[slot].wait();
+        }
+        if (i < iterations) {
+            handles[slot] = submitter->recv(stream_id, base_addr + slot * size, size, rkey);
+        }
+    }
+}
+
+/**
+ * @brief Keep `dop` one-sided or two-sided operations in flight, every wr_id is the slot of its message.
+ */
+static void verbs_send_lane(
+    rdma_util::Arc<rdma_util::RcQueuePair> qp,
+    ibv_wr_opcode opcode,
+    uint64_t laddr,
+    uint64_t raddr,
+    uint32_t lkey,
+    uint32_t rkey,
+    uint64_t size,
+    uint64_t dop,
+    Lane* lane
+) {
+    std::vector<uint64_t> post_ns(dop, 0);
+    std::vector<rdma_util::WorkCompletion> wcs;
+    wcs.reserve(dop);
+    uint64_t posted = 0;
+    uint64_t polled = 0;
+
+    auto post = [&](uint64_t slot) {
+        post_ns[slot] = rdma_util::stats_now_ns();
+        int ret = 0;
+        if (opcode == IBV_WR_RDMA_READ) {
+            ret = qp->post_send_read(slot, laddr + slot * size, raddr + slot * size, size, lkey, rkey, true);
+        } else if (opcode == IBV_WR_RDMA_WRITE) {
+            ret = qp->post_send_write(slot, laddr + slot * size, raddr + slot * size, size, lkey, rkey, true);
+        } else {
+            ret = qp->post_send_send(slot, laddr + slot * size, size, lkey, true);
+        }
+        if (ret) {
+            throw std::runtime_error("Failed to post send");
+        }
+        posted++;
+    };
+
+    wait_for_start();
+    for (uint64_t slot = 0; slot < dop && posted < lane->iterations; ++slot) {
+        post(slot);
+    }
+    while (polled < lane->iterations) {
+        if (qp->poll_send_cq_once(dop, wcs) < 0) {
+            throw std::runtime_error("Failed to poll send CQ");
+        }
+        for (const auto& wc : wcs) {
+            if (wc.status != IBV_WC_SUCCESS) {
+                throw std::runtime_error("Work request failed: " + wc.to_string());
+            }
+            lane->latency.record(rdma_util::stats_now_ns() - post_ns[wc.wr_id]);
+            polled++;
+            if (posted < lane->iterations) {
+                post(wc.wr_id);
+            }
+        }
+    }
+}
+
+static void verbs_recv_lane(
+    rdma_util::Arc<rdma_util::RcQueuePair> qp,
+    uint64_t base_addr,
+    uint32_t lkey,
+    uint64_t size,
+    uint64_t dop,
+    uint64_t iterations
+) {
+    std::vector<rdma_util::WorkCompletion> wcs;
+    wcs.reserve(2 * dop);
+    uint64_t posted = 0;
+    uint64_t polled = 0;
+
+    // Twice the window of the sender, so that a send never runs into a missing recv
+    for (uint64_t i = 0; i < 2 * dop && posted < iterations; ++i) {
+        if (qp->post_recv(i, base_addr + (i % dop) * size, size, lkey)) {
+            throw std::runtime_error("Failed to post recv");
+        }
+        posted++;
+    }
+    wait_for_start();
+    while (polled < iterations) {
+        if (qp->poll_recv_cq_once(2 * dop, wcs) < 0) {
+            throw std::runtime_error("Failed to poll recv CQ");
+        }
+        for (const auto& wc : wcs) {
+            if (wc.status != IBV_WC_SUCCESS) {
+                throw std::runtime_error("Recv failed: " + wc.to_string());
+            }
+            polled++;
+            if (posted < iterations) {
+                if (qp->post_recv(wc.wr_id, base_addr + (wc.wr_id % dop) * size, size, lkey)) {
+                    throw std::runtime_error("Failed to post recv");
+                }
+                posted++;
+            }
+        }
+    }
+}
+
+class Runner {
+  private:
+    const bench::Options& options_;
+    std::vector<std::string> devices1_;
+    std::vector<std::string> devices2_;
+    std::vector<uint64_t> gpus1_;
+    std::vector<uint64_t> gpus2_;
+    bool on_gpu_;
+    uint64_t bytes_per_lane_;
+    uint64_t max_iterations_;
+    rdma_util::BringUpOptions bring_up_options_;
+    rdma_util::MemoryRegionOptions mr_options_;
+
+    // Protection domains are opened once per device and shared by every point
+    std::map<std::string, rdma_util::Arc<rdma_util::ProtectionDomain>> pds_;
+
+    rdma_util::Arc<rdma_util::ProtectionDomain> get_pd(const std::string& device) {
+        auto it = this->pds_.find(device);
+        if (it == this->pds_.end()) {
+            auto pd = rdma_util::Arc<rdma_util::ProtectionDomain>(
+                rdma_util::ProtectionDomain::create(rdma_util::Context::create(device.c_str()))
+            );
+            it = this->pds_.emplace(device, pd).first;
+        }
+        return it->second;
+    }
+
+    static uint64_t get_gpu(const std::vector<uint64_t>& gpus, uint64_t index) {
+        return gpus.empty() ? 0 : gpus[index % gpus.size()];
+    }
+
+  public:
+    explicit Runner(const bench::Options& options) : options_(options) {
+        this->devices1_ = options.get_list("dev1");
+        this->devices2_ = options.get_list("dev2");
+        this->gpus1_ = options.get_sizes("gpu1");
+        this->gpus2_ = options.get_sizes("gpu2");
+        this->on_gpu_ = options.get("mem") == "gpu";
+        this->bytes_per_lane_ = options.get_size("bytes");
+        this->max_iterations_ = options.get_size("max-iters");
+        // Tune with the NANOGDR_IB_* environment variables, e.g. NANOGDR_IB_RELAXED_ORDERING=1 or NANOGDR_IB_MTU=2048
+        this->bring_up_options_ = rdma_util::BringUpOptions::from_env();
+        this->mr_options_ = rdma_util::MemoryRegionOptions::from_env();
+        if (this->devices1_.empty() || this->devices2_.empty()) {
+            throw std::runtime_error("--dev1 and --dev2 need at least one device");
+        }
+        if (options.get("mem") != "host" && options.get("mem") != "gpu") {
+            throw std::runtime_error("--mem must be host or gpu");
+        }
+    }
+
+    bench::Result run(const Point& point) {
+        const uint64_t iterations =
+            std::min(std::max(this->bytes_per_lane_ / point.size, point.dop), this->max_iterations_);
+        // Both directions of a pair get their own half of the buffers
+        const uint64_t buffer_size = 2 * point.dop * point.size;
+
+        rdma_util::QueuePairConfig qp_config = rdma_util::TcclContext::get_queue_pair_config(point.dop);
+        if (point.mode != "tccl") {
+            qp_config.max_send_wr = std::max<uint32_t>(qp_config.max_send_wr, point.dop);
+            qp_config.max_recv_wr = std::max<uint32_t>(qp_config.max_recv_wr, 2 * point.dop);
+            qp_config.send_cq_depth = std::max<uint32_t>(qp_config.send_cq_depth, 2 * point.dop);
+            qp_config.recv_cq_depth = std::max<uint32_t>(qp_config.recv_cq_depth, 2 * point.dop);
+        }
+
+        std::vector<rdma_util::Box<Lane>> lanes;
+        std::vector<std::thread> threads;
+        std::vector<rdma_util::Arc<rdma_util::MemoryRegion>> mrs;
+        std::vector<rdma_util::Arc<rdma_util::TcclContext>> contexts;
+        rdma_util::Arc<rdma_util::PollingEngine> engine;
+        if (point.mode == "tccl" && this->options_.get("polling") == "engine") {
+            rdma_util::PollingEngineConfig engine_config;
+            engine_config.num_threads = this->options_.get_size("engine-threads");
+            engine = rdma_util::PollingEngine::create(engine_config);
+        }
+
+        g_started.store(false);
+        for (uint64_t i = 0; i < point.qps; ++i) {
+            auto pd1 = this->get_pd(this->devices1_[i % this->devices1_.size()]);
+            auto pd2 = this->get_pd(this->devices2_[i % this->devices2_.size()]);
+            rdma_util::Box<rdma_util::RcQueuePair> qp1 = rdma_util::RcQueuePair::create(pd1, qp_config);
+            rdma_util::Box<rdma_util::RcQueuePair> qp2 = rdma_util::RcQueuePair::create(pd2, qp_config);
+            qp1->bring_up(qp2->get_handshake_data(this->bring_up_options_), this->bring_up_options_);
+            qp2->bring_up(qp1->get_handshake_data(this->bring_up_options_), this->bring_up_options_);
+
+            rdma_util::Arc<rdma_util::MemoryRegion> mr1 = rdma_util::MemoryRegion::create(
+                pd1,
+                bench::allocate_buffer(this->on_gpu_, get_gpu(this->gpus1_, i), buffer_size),
+                buffer_size,
+                this->mr_options_
+            );
+            rdma_util::Arc<rdma_util::MemoryRegion> mr2 = rdma_util::MemoryRegion::create(
+                pd2,
+                bench::allocate_buffer(this->on_gpu_, get_gpu(this->gpus2_, i), buffer_size),
+                buffer_size,
+                this->mr_options_
+            );
+            mrs.push_back(mr1);
+            mrs.push_back(mr2);
+
+            const uint64_t num_directions = point.bidirectional ? 2 : 1;
+            if (point.mode == "tccl") {
+                rdma_util::TcclContextConfig config;
+                config.chunk_size = this->options_.get_size("chunk-size");
+                config.eager_threshold = uint32_t(this->options_.get_size("eager-threshold"));
+                const bool own_thread = engine == nullptr;
+                auto context1 = rdma_util::TcclContext::create(std::move(qp1), own_thread, point.dop, config);
+                auto context2 = rdma_util::TcclContext::create(std::move(qp2), own_thread, point.dop, config);
+                if (engine != nullptr) {
+                    engine->register_context(context1);
+                    engine->register_context(context2);
+                }
+                contexts.push_back(context1);
+                contexts.push_back(context2);
+
+                for (uint64_t d = 0; d < num_directions; ++d) {
+                    auto& sender = d == 0 ? context1 : context2;
+                    auto& recver = d == 0 ? context2 : context1;
+                    auto& send_mr = d == 0 ? mr1 : mr2;
+                    auto& recv_mr = d == 0 ? mr2 : mr1;
+                    const uint64_t offset = d * point.dop * point.size;
+                    lanes.push_back(rdma_util::Box<Lane>(new Lane()));
+                    lanes.back()->iterations = iterations;
+                    threads.push_back(std::thread(
+                        tccl_send_lane,
+                        sender,
+                        uint32_t(d),
+                        uint64_t(send_mr->get_addr()) + offset,
+                        send_mr->get_lkey(),
+                        point.size,
+                        point.dop,
+                        lanes.back().get()
+                    ));
+                    threads.push_back(std::thread(
+                        tccl_recv_lane,
+                        recver,
+                        uint32_t(d),
+                        uint64_t(recv_mr->get_addr()) + offset,
+                        recv_mr->get_rkey(),
+                        point.size,
+                        point.dop,
+                        iterations
+                    ));
+                }
+                continue;
+            }
+
+            rdma_util::Arc<rdma_util::RcQueuePair> shared_qp1 = std::move(qp1);
+            rdma_util::Arc<rdma_util::RcQueuePair> shared_qp2 = std::move(qp2);
+            const ibv_wr_opcode opcode = point.mode == "read" ? IBV_WR_RDMA_READ
+                : point.mode == "write"                       ? IBV_WR_RDMA_WRITE
+                                                              : IBV_WR_SEND;
+            for (uint64_t d = 0; d < num_directions; ++d) {
+                auto& initiator = d == 0 ? shared_qp1 : shared_qp2;
+                auto& target = d == 0 ? shared_qp2 : shared_qp1;
+                auto& local_mr = d == 0 ? mr1 : mr2;
+                auto& remote_mr = d == 0 ? mr2 : mr1;
+                const uint64_t offset = d * point.dop * point.size;
+                lanes.push_back(rdma_util::Box<Lane>(new Lane()));
+                lanes.back()->iterations = iterations;
+                if (opcode == IBV_WR_SEND) {
+                    threads.push_back(std::thread(
+                        verbs_recv_lane,
+                        target,
+                        uint64_t(remote_mr->get_addr()) + offset,
+                        remote_mr->get_lkey(),
+                        point.size,
+                        point.dop,
+                        iterations
+                    ));
+                }
+                threads.push_back(std::thread(
+                    verbs_send_lane,
+                    initiator,
+                    opcode,
+                    uint64_t(local_mr->get_addr()) + offset,
+                    uint64_t(remote_mr->get_addr()) + offset,
+                    local_mr->get_lkey(),
+                    remote_mr->get_rkey(),
+                    point.size,
+                    point.dop,
+                    lanes.back().get()
+                ));
+            }
+        }
+
+        // Give the recv lanes a moment to pre-post their recvs
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const auto start = std::chrono::steady_clock::now();
+        g_started.store(true, std::memory_order_release);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        bench::Result result;
+        result.parameters = {
+            {"mode", point.mode},
+            {"mem", this->options_.get("mem")},
+            {"size", bench::format_size(point.size)},
+            {"dop", std::to_string(point.dop)},
+            {"qps", std::to_string(point.qps)},
+            {"direction", point.bidirectional ? "bi" : "uni"},
+        };
+        result.seconds = std::chrono::duration<double>(end - start).count();
+        for (const auto& lane : lanes) {
+            result.messages += lane->iterations;
+            result.latency.merge(lane->latency.snapshot());
+        }
+        result.bytes = result.messages * point.size;
+
+        if (this->options_.get("stats") == "1") {
+            for (auto& context : contexts) {
+                printf("%s", context->get_stats().to_string().c_str());
+            }
+        }
+        return result;
+    }
+};
+
+int main(int argc, char** argv) {
+    bench::Options options(argv[0], "Sweeps bandwidth, message rate and latency over loopback QP pairs.");
+    options.declare("mode", "tccl", "tccl, write, read or send_recv, a list is swept");
+    options.declare("dev1", "mlx5_0", "devices of the first side of every QP pair");
+    options.declare("dev2", "mlx5_1", "devices of the second side of every QP pair");
+    options.declare("mem", "host", "host or gpu memory");
+    options.declare("gpu1", "0", "GPUs of the first side, with --mem gpu");
+    options.declare("gpu2", "1", "GPUs of the second side, with --mem gpu");
+    options.declare("size", "256K", "message sizes");
+    options.declare("dop", "64", "messages in flight per lane");
+    options.declare("qps", "1", "QP pairs");
+    options.declare("direction", "uni", "uni, bi or both");
+    options.declare("bytes", "4G", "bytes moved per lane and point");
+    options.declare("max-iters", "1000000", "upper bound of the messages per lane and point");
+    options.declare("chunk-size", "256K", "TcclContextConfig::chunk_size");
+    options.declare("eager-threshold", "0", "TcclContextConfig::eager_threshold, needs --mem host");
+    options.declare("polling", "thread", "thread (one per context) or engine (a shared PollingEngine)");
+    options.declare("engine-threads", "1", "threads of the PollingEngine with --polling engine");
+    options.declare("stats", "0", "1 prints the TcclContext stats after every point");
+    options.declare("json", "", "write the results as JSON to this path, - for stdout");
+
+    try {
+        if (!options.parse(argc, argv)) {
+            return 0;
+        }
+
+        std::vector<bool> directions;
+        const std::string direction = options.get("direction");
+        if (direction == "uni" || direction == "both") {
+            directions.push_back(false);
+        }
+        if (direction == "bi" || direction == "both") {
+            directions.push_back(true);
+        }
+        if (directions.empty()) {
+            throw std::runtime_error("--direction must be uni, bi or both");
+        }
+
+        Runner runner(options);
+        std::vector<bench::Result> results;
+        bench::print_result_header({"mode", "mem", "size", "dop", "qps", "direction"});
+        for (const auto& mode : options.get_list("mode")) {
+            if (mode != "tccl" && mode != "write" && mode != "read" && mode != "send_recv") {
+                throw std::runtime_error("Unknown mode: " + mode);
+            }
+            for (uint64_t qps : options.get_sizes("qps")) {
+                for (uint64_t dop : options.get_sizes("dop")) {
+                    for (uint64_t size : options.get_sizes("size")) {
+                        for (bool bidirectional : directions) {
+                            results.push_back(runner.run(Point {mode, size, dop, qps, bidirectional}));
+                            bench::print_result(results.back());
+                        }
+                    }
+                }
+            }
+        }
+
+        if (!options.get("json").empty()) {
+            bench::write_json(options.get("json"), results);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,475 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "bench_util.h"
+#include "rdma_util.h"
+
+/**
+ * Small-message benchmarks over one loopback QP pair between --dev1 and --dev2.
+ *
+ * Modes:
+ *   pingpong  one message in flight, the first side sends and the second side answers with a message
+ *             of the same size. The latency is half of the round trip.
+ *   rate      --dop messages in flight from the first side to the second one, spread over --streams
+ *             streams. The latency of tccl is the one of every message from submission to handle
+ *             completion, the one of verbs is the one of a whole doorbell batch of --dop sends.
+ *
+ * Transports:
+ *   verbs     raw two-sided sends on the RcQueuePair
+ *   tccl      TcclContext send/recv, which pays for the Ticket rendezvous unless --eager-threshold
+ *             covers the message size
+ */
+
+struct Point {
+    std::string mode;
+    std::string transport;
+    std::string polling;
+    uint64_t size;
+    uint64_t dop;
+    uint64_t streams;
+};
+
+// Released once both sides are set up
+static std::atomic<bool> g_started(false);
+
+static void wait_for_start() {
+    while (!g_started.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+    }
+}
+
+/**
+ * @brief Wait for a handle, driving the context from the calling thread if it has no polling thread.
+ */
+static inline void wait_handle(const rdma_util::Handle& handle, rdma_util::TcclContext* manual_context) {
+    if (manual_context == nullptr) {
+        handle.wait();
+        return;
+    }
+    while (!handle.is_finished()) {
+        manual_context->poll_both();
+    }
+}
+
+static void wait_one(rdma_util::RcQueuePair* qp, bool send_cq, std::vector<rdma_util::WorkCompletion>& wcs) {
+    const int ret = send_cq ? qp->wait_until_send_completion(1, wcs) : qp->wait_until_recv_completion(1, wcs);
+    if (ret != 0) {
+        throw std::runtime_error("Failed to poll CQ");
+    }
+    for (const auto& wc : wcs) {
+        if (wc.status != IBV_WC_SUCCESS) {
+            throw std::runtime_error("Work request failed: " + wc.to_string());
+        }
+    }
+}
+
+static void verbs_pingpong(
+    rdma_util::RcQueuePair* qp,
+    bool initiator,
+    uint64_t send_addr,
+    uint64_t recv_addr,
+    uint32_t lkey,
+    uint64_t size,
+    uint64_t iterations,
+    rdma_util::LatencyHistogram* latency
+) {
+    std::vector<rdma_util::WorkCompletion> wcs;
+    wcs.reserve(rdma_util::RcQueuePair::kPollBatchSize);
+    if (qp->post_recv(0, recv_addr, size, lkey)) {
+        throw std::runtime_error("Failed to post recv");
+    }
+    wait_for_start();
+
+    for (uint64_t i = 0; i < iterations; ++i) {
+        const uint64_t start_ns = rdma_util::stats_now_ns();
+        if (!initiator) {
+            wait_one(qp, false, wcs);
+        }
+        // The recv of the next message must be posted before the peer can send it
+        if (qp->post_recv(0, recv_addr, size, lkey) || qp->post_send_send(0, send_addr, size, lkey, true)) {
+            throw std::runtime_error("Failed to post");
+        }
+        wait_one(qp, true, wcs);
+        if (initiator) {
+            wait_one(qp, false, wcs);
+            latency->record((rdma_util::stats_now_ns() - start_ns) / 2);
+        }
+    }
+}
+
+static void tccl_pingpong(
+    rdma_util::Arc<rdma_util::TcclContext> context,
+    bool initiator,
+    bool manual_polling,
+    uint64_t send_addr,
+    uint64_t recv_addr,
+    uint32_t lkey,
+    uint32_t rkey,
+    uint64_t size,
+    uint64_t iterations,
+    rdma_util::LatencyHistogram* latency
+) {
+    rdma_util::TcclContext* manual_context = manual_polling ? context.get() : nullptr;
+    // Stream 0 carries the pings, stream 1 the pongs
+    const uint32_t send_stream = initiator ? 0 : 1;
+    const uint32_t recv_stream = initiator ? 1 : 0;
+    wait_for_start();
+
+    // The recv of the next message is always posted ahead, so its Ticket is on the way early
+    rdma_util::Handle recv_handle = context->recv(recv_stream, recv_addr, size, rkey);
+    for (uint64_t i = 0; i < iterations; ++i) {
+        const uint64_t start_ns = rdma_util::stats_now_ns();
+        if (!initiator) {
+            wait_handle(recv_handle, manual_context);
+            recv_handle = i + 1 < iterations ? context->recv(recv_stream, recv_addr, size, rkey) : rdma_util::Handle();
+        }
+        wait_handle(context->send(send_stream, send_addr, size, lkey), manual_context);
+        if (initiator) {
+            wait_handle(recv_handle, manual_context);
+            latency->record((rdma_util::stats_now_ns() - start_ns) / 2);
+            recv_handle = i + 1 < iterations ? context->recv(recv_stream, recv_addr, size, rkey) : rdma_util::Handle();
+        }
+    }
+}
+
+static void verbs_rate_sender(
+    rdma_util::RcQueuePair* qp,
+    uint64_t base_addr,
+    uint32_t lkey,
+    uint64_t size,
+    uint64_t dop,
+    uint64_t iterations,
+    bool inlined,
+    rdma_util::LatencyHistogram* latency
+) {
+    rdma_util::SendWorkRequestBatch batch(dop);
+    std::vector<rdma_util::WorkCompletion> wcs;
+    wcs.reserve(rdma_util::RcQueuePair::kPollBatchSize);
+    wait_for_start();
+
+    // Only the last send of a batch is signaled, which is how message rate is usually measured
+    for (uint64_t sent = 0; sent < iterations;) {
+        const uint64_t count = std::min(dop, iterations - sent);
+        for (uint64_t j = 0; j < count; ++j) {
+            batch.add_send(j, base_addr + j * size, size, lkey, j + 1 == count, inlined);
+        }
+        const uint64_t start_ns = rdma_util::stats_now_ns();
+        if (qp->post_send_batch(batch)) {
+            throw std::runtime_error("Failed to post send batch");
+        }
+        wait_one(qp, true, wcs);
+        latency->record(rdma_util::stats_now_ns() - start_ns);
+        sent += count;
+    }
+}
+
+static void verbs_rate_recver(
+    rdma_util::RcQueuePair* qp,
+    uint64_t base_addr,
+    uint32_t lkey,
+    uint64_t size,
+    uint64_t dop,
+    uint64_t iterations
+) {
+    rdma_util::RecvWorkRequestBatch batch(2 * dop);
+    std::vector<rdma_util::WorkCompletion> wcs;
+    wcs.reserve(2 * dop);
+    uint64_t posted = 0;
+    uint64_t polled = 0;
+
+    // Two windows of the sender are posted ahead, so its sends rarely wait for a recv
+    for (; posted < std::min(2 * dop, iterations); ++posted) {
+        batch.add_recv(posted, base_addr + (posted % dop) * size, size, lkey);
+    }
+    if (qp->post_recv_batch(batch)) {
+        throw std::runtime_error("Failed to post recv batch");
+    }
+    wait_for_start();
+
+    while (polled < iterations) {
+        if (qp->poll_recv_cq_once(2 * dop, wcs) < 0) {
+            throw std::runtime_error("Failed to poll recv CQ");
+        }
+        for (const auto& wc : wcs) {
+            if (wc.status != IBV_WC_SUCCESS) {
+                throw std::runtime_error("Recv failed: " + wc.to_string());
+            }
+            polled++;
+            if (posted < iterations) {
+                batch.add_recv(wc.wr_id, base_addr + (wc.wr_id % dop) * size, size, lkey);
+                posted++;
+            }
+        }
+        if (!batch.empty() && qp->post_recv_batch(batch)) {
+            throw std::runtime_error("Failed to post recv batch");
+        }
+    }
+}
+
+static void tccl_rate_lane(
+    rdma_util::Arc<rdma_util::TcclContext> context,
+    bool sender,
+    bool manual_polling,
+    uint64_t base_addr,
+    uint32_t key,
+    uint64_t size,
+    uint64_t dop,
+    uint64_t streams,
+    uint64_t iterations,
+    rdma_util::LatencyHistogram* latency
+) {
+    rdma_util::TcclContext* manual_context = manual_polling ? context.get() : nullptr;
+    std::vector<rdma_util::Handle> handles(dop);
+    std::vector<uint64_t> submit_ns(dop, 0);
+    wait_for_start();
+
+    // Both sides walk the streams in the same order, so the i-th send matches the i-th recv
+    for (uint64_t i = 0; i < iterations + dop; ++i) {
+        const uint64_t slot = i % dop;
+        if (i >= dop) {
+            wait_handle(handles[slot], manual_context);
+            if (sender) {
+                latency->record(rdma_util::stats_now_ns() - submit_ns[slot]);
+            }
+        }
+        if (i < iterations) {
+            const uint32_t stream_id = uint32_t(i % streams);
+            const uint64_t addr = base_addr + slot * size;
+            submit_ns[slot] = rdma_util::stats_now_ns();
+            handles[slot] =
+                sender ? context->send(stream_id, addr, size, key) : context->recv(stream_id, addr, size, key);
+        }
+    }
+}
+
+class Runner {
+  private:
+    const bench::Options& options_;
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd1_;
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd2_;
+    rdma_util::BringUpOptions bring_up_options_;
+    rdma_util::MemoryRegionOptions mr_options_;
+
+  public:
+    explicit Runner(const bench::Options& options) : options_(options) {
+        this->pd1_ = rdma_util::ProtectionDomain::create(rdma_util::Context::create(options.get("dev1").c_str()));
+        this->pd2_ = rdma_util::ProtectionDomain::create(rdma_util::Context::create(options.get("dev2").c_str()));
+        // Tune with the NANOGDR_IB_* environment variables, e.g. NANOGDR_IB_MTU=2048
+        this->bring_up_options_ = rdma_util::BringUpOptions::from_env();
+        this->mr_options_ = rdma_util::MemoryRegionOptions::from_env();
+    }
+
+    bench::Result run(const Point& point) {
+        const bool pingpong = point.mode == "pingpong";
+        const uint64_t iterations = this->options_.get_size(pingpong ? "pingpong-iters" : "rate-iters");
+        const uint64_t dop = pingpong ? 1 : point.dop;
+        const bool manual_polling = point.polling == "manual";
+        if (point.transport == "verbs" && manual_polling) {
+            throw std::runtime_error("--polling manual only applies to --transport tccl");
+        }
+
+        rdma_util::QueuePairConfig qp_config = rdma_util::TcclContext::get_queue_pair_config(dop);
+        qp_config.max_send_wr = std::max<uint32_t>(qp_config.max_send_wr, dop + 1);
+        qp_config.max_recv_wr = std::max<uint32_t>(qp_config.max_recv_wr, 2 * dop + 1);
+        qp_config.send_cq_depth = std::max<uint32_t>(qp_config.send_cq_depth, 2 * dop);
+        qp_config.recv_cq_depth = std::max<uint32_t>(qp_config.recv_cq_depth, 2 * dop + 1);
+        rdma_util::Box<rdma_util::RcQueuePair> qp1 = rdma_util::RcQueuePair::create(this->pd1_, qp_config);
+        rdma_util::Box<rdma_util::RcQueuePair> qp2 = rdma_util::RcQueuePair::create(this->pd2_, qp_config);
+        qp1->bring_up(qp2->get_handshake_data(this->bring_up_options_), this->bring_up_options_);
+        qp2->bring_up(qp1->get_handshake_data(this->bring_up_options_), this->bring_up_options_);
+        const bool inlined = point.size <= qp1->get_config().max_inline_data && point.transport == "verbs";
+
+        // [0, dop * size) is sent from, [dop * size, 2 * dop * size) is received into
+        const uint64_t half = dop * point.size;
+        rdma_util::Arc<rdma_util::MemoryRegion> mr1 = rdma_util::MemoryRegion::create(
+            this->pd1_,
+            bench::allocate_buffer(false, 0, 2 * half),
+            2 * half,
+            this->mr_options_
+        );
+        rdma_util::Arc<rdma_util::MemoryRegion> mr2 = rdma_util::MemoryRegion::create(
+            this->pd2_,
+            bench::allocate_buffer(false, 0, 2 * half),
+            2 * half,
+            this->mr_options_
+        );
+        const uint64_t addr1 = uint64_t(mr1->get_addr());
+        const uint64_t addr2 = uint64_t(mr2->get_addr());
+
+        rdma_util::Arc<rdma_util::TcclContext> context1;
+        rdma_util::Arc<rdma_util::TcclContext> context2;
+        if (point.transport == "tccl") {
+            rdma_util::TcclContextConfig config;
+            config.eager_threshold = uint32_t(this->options_.get_size("eager-threshold"));
+            context1 = rdma_util::TcclContext::create(std::move(qp1), !manual_polling, dop, config);
+            context2 = rdma_util::TcclContext::create(std::move(qp2), !manual_polling, dop, config);
+        }
+
+        rdma_util::LatencyHistogram latency;
+        std::vector<std::thread> threads;
+        g_started.store(false);
+        if (pingpong && point.transport == "verbs") {
+            threads.push_back(std::thread(
+                verbs_pingpong, qp1.get(), true, addr1, addr1 + half, mr1->get_lkey(), point.size, iterations, &latency
+            ));
+            threads.push_back(std::thread(
+                verbs_pingpong, qp2.get(), false, addr2, addr2 + half, mr2->get_lkey(), point.size, iterations, nullptr
+            ));
+        } else if (pingpong) {
+            threads.push_back(std::thread(
+                tccl_pingpong,
+                context1,
+                true,
+                manual_polling,
+                addr1,
+                addr1 + half,
+                mr1->get_lkey(),
+                mr1->get_rkey(),
+                point.size,
+                iterations,
+                &latency
+            ));
+            threads.push_back(std::thread(
+                tccl_pingpong,
+                context2,
+                false,
+                manual_polling,
+                addr2,
+                addr2 + half,
+                mr2->get_lkey(),
+                mr2->get_rkey(),
+                point.size,
+                iterations,
+                nullptr
+            ));
+        } else if (point.transport == "verbs") {
+            threads.push_back(std::thread(
+                verbs_rate_recver, qp2.get(), addr2 + half, mr2->get_lkey(), point.size, dop, iterations
+            ));
+            threads.push_back(std::thread(
+                verbs_rate_sender, qp1.get(), addr1, mr1->get_lkey(), point.size, dop, iterations, inlined, &latency
+            ));
+        } else {
+            threads.push_back(std::thread(
+                tccl_rate_lane,
+                context2,
+                false,
+                manual_polling,
+                addr2 + half,
+                mr2->get_rkey(),
+                point.size,
+                dop,
+                point.streams,
+                iterations,
+                nullptr
+            ));
+            threads.push_back(std::thread(
+                tccl_rate_lane,
+                context1,
+                true,
+                manual_polling,
+                addr1,
+                mr1->get_lkey(),
+                point.size,
+                dop,
+                point.streams,
+                iterations,
+                &latency
+            ));
+        }
+
+        // Give the recv sides a moment to pre-post their recvs
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        const auto start = std::chrono::steady_clock::now();
+        g_started.store(true, std::memory_order_release);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        const auto end = std::chrono::steady_clock::now();
+
+        bench::Result result;
+        result.parameters = {
+            {"mode", point.mode},
+            {"transport", point.transport},
+            {"polling", point.transport == "tccl" ? point.polling : "-"},
+            {"size", bench::format_size(point.size)},
+            {"dop", std::to_string(dop)},
+            {"streams", std::to_string(point.transport == "tccl" ? point.streams : 1)},
+        };
+        result.seconds = std::chrono::duration<double>(end - start).count();
+        result.messages = pingpong ? 2 * iterations : iterations;
+        result.bytes = result.messages * point.size;
+        result.latency = latency.snapshot();
+        return result;
+    }
+};
+
+int main(int argc, char** argv) {
+    bench::Options options(argv[0], "Measures ping-pong latency and small-message rate over one loopback QP pair.");
+    options.declare("mode", "pingpong,rate", "pingpong or rate");
+    options.declare("transport", "verbs,tccl", "verbs or tccl");
+    options.declare("polling", "thread", "thread (background polling thread) or manual (the caller polls), tccl only");
+    options.declare("dev1", "mlx5_0", "device of the first side");
+    options.declare("dev2", "mlx5_1", "device of the second side");
+    options.declare("size", "8,64,512,4K,64K", "message sizes");
+    options.declare("dop", "64", "messages in flight in rate mode");
+    options.declare("streams", "1", "streams the messages of rate mode are spread over, tccl only");
+    options.declare("pingpong-iters", "100000", "round trips per point");
+    options.declare("rate-iters", "1000000", "messages per point");
+    options.declare("eager-threshold", "0", "TcclContextConfig::eager_threshold");
+    options.declare("json", "", "write the results as JSON to this path, - for stdout");
+
+    try {
+        if (!options.parse(argc, argv)) {
+            return 0;
+        }
+
+        Runner runner(options);
+        std::vector<bench::Result> results;
+        bench::print_result_header({"mode", "transport", "polling", "size", "dop", "streams"});
+        for (const auto& mode : options.get_list("mode")) {
+            if (mode != "pingpong" && mode != "rate") {
+                throw std::runtime_error("Unknown mode: " + mode);
+            }
+            for (const auto& transport : options.get_list("transport")) {
+                if (transport != "verbs" && transport != "tccl") {
+                    throw std::runtime_error("Unknown transport: " + transport);
+                }
+                // Polling and streams only change tccl, verbs runs once per size and dop
+                const std::vector<std::string> pollings =
+                    transport == "tccl" ? options.get_list("polling") : std::vector<std::string> {"thread"};
+                const std::vector<uint64_t> streams_list = transport == "tccl" && mode == "rate"
+                    ? options.get_sizes("streams")
+                    : std::vector<uint64_t> {1};
+                const std::vector<uint64_t> dops =
+                    mode == "rate" ? options.get_sizes("dop") : std::vector<uint64_t> {1};
+                for (const auto& polling : pollings) {
+                    for (uint64_t streams : streams_list) {
+                        for (uint64_t dop : dops) {
+                            for (uint64_t size : options.get_sizes("size")) {
+                                results.push_back(runner.run(Point {mode, transport, polling, size, dop, streams}));
+                                bench::print_result(results.back());
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        if (!options.get("json").empty()) {
+            bench::write_json(options.get("json"), results);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
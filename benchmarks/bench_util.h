@@ -0,0 +1,257 @@
+#ifndef _BENCH_UTIL_H_
+#define _BENCH_UTIL_H_
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rdma_util.h"
+
+#ifdef USE_CUDA
+#include "gpu_mem_util.h"
+#endif
+
+namespace bench {
+
+/**
+ * @brief Parse a size with an optional K/M/G suffix (powers of 1024), e.g. "64K" or "1G".
+ */
+inline uint64_t parse_size(const std::string& text) {
+    if (text.empty()) {
+        throw std::runtime_error("Empty size");
+    }
+    char* end = nullptr;
+    uint64_t value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) {
+        throw std::runtime_error("Invalid size: " + text);
+    }
+    switch (*end) {
+        case 'G':
+        case 'g':
+            value *= 1024;
+            // fall through
+        case 'M':
+        case 'm':
+            value *= 1024;
+            // fall through
+        case 'K':
+        case 'k':
+            value *= 1024;
+            ++end;
+            break;
+        default:
+            break;
+    }
+    if (*end != '\0') {
+        throw std::runtime_error("Invalid size: " + text);
+    }
+    return value;
+}
+
+inline std::vector<std::string> split(const std::string& text, char delimiter = ',') {
+    std::vector<std::string> parts;
+    std::stringstream ss(text);
+    std::string part;
+    while (std::getline(ss, part, delimiter)) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+inline std::string format_size(uint64_t size) {
+    const char* suffixes[] = {"", "K", "M", "G"};
+    uint64_t index = 0;
+    while (index < 3 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        ++index;
+    }
+    return std::to_string(size) + suffixes[index];
+}
+
+/**
+ * @brief `--name value` options. Every option must be declared with a default and a description,
+ * so `--help` lists them and typos are rejected.
+ */
+class Options {
+  private:
+    struct Option {
+        std::string value;
+        std::string description;
+    };
+
+    std::string program_;
+    std::string summary_;
+    std::map<std::string, Option> options_;
+    std::vector<std::string> order_;
+
+  public:
+    Options(const std::string& program, const std::string& summary) : program_(program), summary_(summary) {}
+
+    inline void declare(const std::string& name, const std::string& default_value, const std::string& description) {
+        this->options_[name] = Option {default_value, description};
+        this->order_.push_back(name);
+    }
+
+    inline void print_help() const {
+        printf("Usage: %s [--option value]...\n%s\n\nOptions:\n", this->program_.c_str(), this->summary_.c_str());
+        for (const auto& name : this->order_) {
+            const Option& option = this->options_.at(name);
+            printf(
+                "  --%-18s %s (default: %s)\n",
+                name.c_str(),
+                option.description.c_str(),
+                option.value.empty() ? "none" : option.value.c_str()
+            );
+        }
+        printf("\nList options take comma-separated values and are swept over.\n");
+    }
+
+    /**
+     * @brief Parse the command line, return false if the help was requested.
+     */
+    inline bool parse(int argc, char** argv) {
+        for (int i = 1; i < argc; ++i) {
+            const std::string arg = argv[i];
+            if (arg == "-h" || arg == "--help") {
+                this->print_help();
+                return false;
+            }
+            if (arg.compare(0, 2, "--") != 0 || this->options_.count(arg.substr(2)) == 0) {
+                throw std::runtime_error("Unknown option: " + arg);
+            }
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value of option: " + arg);
+            }
+            this->options_[arg.substr(2)].value = argv[++i];
+        }
+        return true;
+    }
+
+    inline const std::string& get(const std::string& name) const {
+        return this->options_.at(name).value;
+    }
+
+    inline uint64_t get_size(const std::string& name) const {
+        return parse_size(this->get(name));
+    }
+
+    inline std::vector<std::string> get_list(const std::string& name) const {
+        return split(this->get(name));
+    }
+
+    inline std::vector<uint64_t> get_sizes(const std::string& name) const {
+        std::vector<uint64_t> sizes;
+        for (const auto& part : this->get_list(name)) {
+            sizes.push_back(parse_size(part));
+        }
+        return sizes;
+    }
+};
+
+/**
+ * @brief Allocate a benchmark buffer in host memory or on a GPU, which is freed with the last reference.
+ */
+inline rdma_util::Arc<void> allocate_buffer(bool on_gpu, uint32_t gpu, uint64_t size) {
+    if (on_gpu) {
+#ifdef USE_CUDA
+        void* buffer = gpu_mem_util::malloc_gpu_buffer(size, gpu);
+        if (buffer == nullptr) {
+            throw std::runtime_error("Failed to allocate GPU buffer");
+        }
+        return rdma_util::Arc<void>(buffer, [gpu](void* p) { gpu_mem_util::free_gpu_buffer(p, gpu); });
+#else
+        (void)gpu;
+        throw std::runtime_error("GPU memory needs a build with USE_CUDA");
+#endif
+    }
+    void* buffer = aligned_alloc(4096, (size + 4095) / 4096 * 4096);
+    if (buffer == nullptr) {
+        throw std::runtime_error("Failed to allocate host buffer");
+    }
+    return rdma_util::Arc<void>(buffer, free);
+}
+
+/**
+ * @brief The outcome of one point of a sweep. Parameters are kept as strings, so every
+ * benchmark can report its own set of them.
+ */
+struct Result {
+    std::vector<std::pair<std::string, std::string>> parameters;
+    double seconds = 0;
+    uint64_t bytes = 0;
+    uint64_t messages = 0;
+    rdma_util::HistogramSnapshot latency;
+
+    inline double get_bandwidth_gbps() const {
+        return this->seconds > 0 ? this->bytes / this->seconds / 1e9 : 0;
+    }
+
+    inline double get_message_rate_mops() const {
+        return this->seconds > 0 ? this->messages / this->seconds / 1e6 : 0;
+    }
+
+    inline std::string to_json() const {
+        std::stringstream ss;
+        ss << "{";
+        for (const auto& parameter : this->parameters) {
+            ss << "\"" << parameter.first << "\": \"" << parameter.second << "\", ";
+        }
+        ss << "\"seconds\": " << this->seconds << ", \"bytes\": " << this->bytes
+           << ", \"messages\": " << this->messages << ", \"bandwidth_gbps\": " << this->get_bandwidth_gbps()
+           << ", \"message_rate_mops\": " << this->get_message_rate_mops()
+           << ", \"latency_ns\": " << this->latency.to_json() << "}";
+        return ss.str();
+    }
+};
+
+inline void print_result_header(const std::vector<std::string>& parameter_names) {
+    for (const auto& name : parameter_names) {
+        printf("%10s ", name.c_str());
+    }
+    printf("%10s %10s %10s %10s %10s %10s\n", "GB/s", "Mmsg/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+}
+
+inline void print_result(const Result& result) {
+    for (const auto& parameter : result.parameters) {
+        printf("%10s ", parameter.second.c_str());
+    }
+    printf(
+        "%10.2f %10.3f %10.2f %10.2f %10.2f %10.2f\n",
+        result.get_bandwidth_gbps(),
+        result.get_message_rate_mops(),
+        result.latency.percentile(0.5) / 1e3,
+        result.latency.percentile(0.99) / 1e3,
+        result.latency.percentile(0.999) / 1e3,
+        result.latency.max / 1e3
+    );
+    fflush(stdout);
+}
+
+/**
+ * @brief Write the results as a JSON array to `path`, or to stdout if it is "-".
+ */
+inline void write_json(const std::string& path, const std::vector<Result>& results) {
+    FILE* file = path == "-" ? stdout : fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        throw std::runtime_error("Failed to open " + path);
+    }
+    fprintf(file, "[\n");
+    for (uint64_t i = 0; i < results.size(); ++i) {
+        fprintf(file, "  %s%s\n", results[i].to_json().c_str(), i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "]\n");
+    if (file != stdout) {
+        fclose(file);
+    }
+}
+
+}  // namespace bench
+
+#endif  // _BENCH_UTIL_H_
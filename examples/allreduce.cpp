@@ -0,0 +1,69 @@
+#include <cstdint>
+#include <cstdio>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "collective.h"
+#include "rdma_util.h"
+
+constexpr const char* kRNIC = "mlx5_0";
+constexpr uint32_t kWorldSize = 4;
+constexpr uint64_t kCount = 16 * 1024 * 1024 + 3;
+
+int main() {
+    // Every pair of ranks is connected by a loopback QP pair on the same RNIC
+    std::vector<std::vector<rdma_util::Arc<rdma_util::TcclContext>>> peers(
+        kWorldSize,
+        std::vector<rdma_util::Arc<rdma_util::TcclContext>>(kWorldSize)
+    );
+    for (uint32_t i = 0; i < kWorldSize; ++i) {
+        for (uint32_t j = i + 1; j < kWorldSize; ++j) {
+            auto qp1 = rdma_util::RcQueuePair::create(kRNIC);
+            auto qp2 = rdma_util::RcQueuePair::create(kRNIC);
+            qp1->bring_up(qp2->get_handshake_data());
+            qp2->bring_up(qp1->get_handshake_data());
+            peers[i][j] = rdma_util::TcclContext::create(std::move(qp1));
+            peers[j][i] = rdma_util::TcclContext::create(std::move(qp2));
+        }
+    }
+
+    printf("created tccl contexts\n");
+
+    std::vector<std::vector<float>> buffers(kWorldSize, std::vector<float>(kCount));
+    for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+        for (uint64_t i = 0; i < kCount; ++i) {
+            buffers[rank][i] = float(rank + 1);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+        threads.emplace_back([rank, &peers, &buffers]() {
+            auto communicator = rdma_util::Communicator::create(rank, peers[rank]);
+            communicator->allreduce(
+                buffers[rank].data(),
+                kCount,
+                rdma_util::DataType::FLOAT32,
+                rdma_util::ReduceOp::SUM
+            );
+            communicator->broadcast(buffers[rank].data(), kCount, rdma_util::DataType::FLOAT32, 0);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const float expected = float(kWorldSize * (kWorldSize + 1) / 2);
+    for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+        for (uint64_t i = 0; i < kCount; ++i) {
+            if (buffers[rank][i] != expected) {
+                printf("rank %u: buffer[%lu] = %f, expected %f\n", rank, i, buffers[rank][i], expected);
+                return 1;
+            }
+        }
+    }
+
+    printf("allreduce and broadcast are correct\n");
+    return 0;
+}
@@ -0,0 +1,69 @@
+#include <bootstrap.h>
+#include <rdma_util.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+constexpr const char* kRNIC = "mlx5_0";
+constexpr uint16_t kPort = 18515;
+constexpr uint64_t kNumQueuePairs = 4;
+constexpr uint64_t kDop = 16;
+constexpr uint64_t kBufferSize = 64 * 1024 * 1024;
+
+// Run `bootstrap server` on one host and `bootstrap client <server-host>` on the other
+int main(int argc, char** argv) {
+    if (argc < 2 || (strcmp(argv[1], "client") == 0 && argc < 3)) {
+        printf("usage: %s server | client <server-host>\n", argv[0]);
+        return 1;
+    }
+    const bool is_server = strcmp(argv[1], "server") == 0;
+
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd =
+        rdma_util::ProtectionDomain::create(rdma_util::Context::create(kRNIC));
+    const rdma_util::QueuePairConfig qp_config = rdma_util::TcclContext::get_queue_pair_config(kDop);
+
+    std::vector<rdma_util::Box<rdma_util::RcQueuePair>> qps;
+    std::vector<rdma_util::RcQueuePair*> raw_qps;
+    for (uint64_t i = 0; i < kNumQueuePairs; ++i) {
+        qps.push_back(rdma_util::RcQueuePair::create(pd, qp_config));
+        raw_qps.push_back(qps.back().get());
+    }
+
+    rdma_util::Box<rdma_util::BootstrapListener> listener;
+    rdma_util::Box<rdma_util::BootstrapConnection> connection;
+    if (is_server) {
+        listener = rdma_util::BootstrapListener::create(kPort);
+        connection = listener->accept();
+    } else {
+        connection = rdma_util::BootstrapConnection::connect(argv[2], kPort);
+    }
+
+    // All QPs are exchanged in one round trip and brought up in parallel
+    rdma_util::connect_queue_pairs(*connection, raw_qps, rdma_util::BringUpOptions::from_env(), kDop);
+    printf("brought up %lu QPs\n", kNumQueuePairs);
+
+    void* buffer = malloc(kBufferSize);
+    auto mr = rdma_util::MemoryRegion::create(pd, buffer, kBufferSize);
+
+    auto context = rdma_util::TcclContext::create(std::move(qps[0]), true, kDop);
+    if (is_server) {
+        context->send(0, uint64_t(buffer), kBufferSize, mr->get_lkey()).wait();
+        printf("sent\n");
+    } else {
+        context->recv(0, uint64_t(buffer), kBufferSize, mr->get_rkey()).wait();
+        printf("received\n");
+    }
+
+    // Keep the peer's QPs alive until both sides are done
+    char done = 1;
+    connection->send_all(&done, 1);
+    connection->recv_all(&done, 1);
+
+    mr.reset();
+    free(buffer);
+    return 0;
+}
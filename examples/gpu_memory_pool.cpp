@@ -0,0 +1,54 @@
+#include <cstdio>
+
+#ifdef USE_CUDA
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "gpu_mem_util.h"
+#include "rdma_util.h"
+
+constexpr uint32_t kGPU = 0;
+constexpr const char* kRNIC = "mlx5_0";
+constexpr uint64_t kBlockSize = 4 * 1024 * 1024;
+constexpr uint64_t kNumBlocks = 64;
+
+int main() {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kRNIC));
+    auto pool = gpu_mem_util::GpuMemoryPool::create(kGPU, std::move(pd));
+
+    std::vector<gpu_mem_util::GpuBlock> blocks;
+    for (int round = 0; round < 2; ++round) {
+        auto start = std::chrono::high_resolution_clock::now();
+        for (uint64_t i = 0; i < kNumBlocks; ++i) {
+            blocks.push_back(pool->allocate(kBlockSize));
+        }
+        auto end = std::chrono::high_resolution_clock::now();
+
+        // The second round is served from the cached blocks
+        printf(
+            "round %d: %lu blocks in %ld us, %lu bytes reserved\n",
+            round,
+            kNumBlocks,
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count(),
+            pool->get_reserved_bytes()
+        );
+
+        for (auto& block : blocks) {
+            pool->deallocate(block);
+        }
+        blocks.clear();
+    }
+
+    return 0;
+}
+
+#else
+
+int main() {
+    printf("CUDA is disabled\n");
+    return 0;
+}
+
+#endif
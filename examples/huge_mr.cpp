@@ -23,6 +23,12 @@ int main() {
         auto mr = rdma_util::MemoryRegion::create(std::move(pd), d_ptr, kSize);
     }
 
+    // The same buffer through dma-buf, which does not need the peer-memory module
+    {
+        auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kRNIC));
+        auto mr = gpu_mem_util::register_gpu_buffer_dmabuf(std::move(pd), d_ptr, kSize);
+    }
+
     gpu_mem_util::free_gpu_buffer(d_ptr, kGPU);
 
     return 0;
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstdio>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
@@ -9,6 +10,7 @@
 #ifdef USE_CUDA
 
 #include "gpu_mem_util.h"
+#include "topology.h"
 
 constexpr uint32_t kGPU1 = 4;
 constexpr uint32_t kGPU2 = 7;
@@ -18,24 +20,32 @@ constexpr uint64_t kDataBufferSize = 75ull * 1024 * 1024 * 1024;
 
 constexpr uint64_t kDataBufferSize = 1024 * 1024 * 1024;
 
-#endif
-
 constexpr const char* kRNIC1 = "mlx5_4";
 constexpr const char* kRNIC2 = "mlx5_5";
 
+#endif
+
 static bool stopped = false;
 
 int main() {
 #ifdef USE_CUDA
     auto data_buffer1 = gpu_mem_util::malloc_gpu_buffer(kDataBufferSize, kGPU1);
     auto data_buffer2 = gpu_mem_util::malloc_gpu_buffer(kDataBufferSize, kGPU2);
+
+    // Every GPU talks through the RNIC nearest to it
+    auto topology = rdma_util::Topology::create();
+    const std::string rnic1 = gpu_mem_util::get_nearest_rdma_device(*topology, data_buffer1);
+    const std::string rnic2 = gpu_mem_util::get_nearest_rdma_device(*topology, data_buffer2);
 #else
     auto data_buffer1 = malloc(kDataBufferSize);
     auto data_buffer2 = malloc(kDataBufferSize);
+    const std::string rnic1 = kRNIC1;
+    const std::string rnic2 = kRNIC2;
 #endif
+    printf("using %s and %s\n", rnic1.c_str(), rnic2.c_str());
 
-    auto qp1 = rdma_util::RcQueuePair::create(kRNIC1);
-    auto qp2 = rdma_util::RcQueuePair::create(kRNIC2);
+    auto qp1 = rdma_util::RcQueuePair::create(rnic1.c_str());
+    auto qp2 = rdma_util::RcQueuePair::create(rnic2.c_str());
 
     qp1->bring_up(qp2->get_handshake_data());
     qp2->bring_up(qp1->get_handshake_data());
@@ -45,8 +55,10 @@ int main() {
 
     printf("created data mr\n");
 
-    auto context1 = rdma_util::TcclContext::create(std::move(qp1), false);
-    auto context2 = rdma_util::TcclContext::create(std::move(qp2), false);
+    rdma_util::TcclContextConfig config;
+    config.bind_numa_node = true;
+    auto context1 = rdma_util::TcclContext::create(std::move(qp1), false, 16, config);
+    auto context2 = rdma_util::TcclContext::create(std::move(qp2), false, 16, config);
 
     printf("created tccl context\n");
 
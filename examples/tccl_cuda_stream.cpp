@@ -0,0 +1,84 @@
+#include <cstdio>
+
+#ifdef USE_CUDA
+
+#include <cuda_runtime.h>
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "gpu_mem_util.h"
+#include "rdma_util.h"
+#include "tccl_cuda.h"
+
+constexpr uint32_t kGPU1 = 0;
+constexpr uint32_t kGPU2 = 1;
+constexpr const char* kRNIC1 = "mlx5_0";
+constexpr const char* kRNIC2 = "mlx5_1";
+constexpr uint64_t kMessageSize = 4 * 1024 * 1024;
+constexpr uint64_t kNumMessages = 16;
+
+int main() {
+    void* send_buffer = gpu_mem_util::malloc_gpu_buffer(kMessageSize, kGPU1);
+    void* recv_buffer = gpu_mem_util::malloc_gpu_buffer(kMessageSize, kGPU2);
+    if (send_buffer == nullptr || recv_buffer == nullptr) {
+        printf("Failed to allocate buffer\n");
+        return 1;
+    }
+
+    {
+        auto qp1 = rdma_util::RcQueuePair::create(kRNIC1);
+        auto qp2 = rdma_util::RcQueuePair::create(kRNIC2);
+        qp1->bring_up(qp2->get_handshake_data());
+        qp2->bring_up(qp1->get_handshake_data());
+
+        auto mr1 = rdma_util::MemoryRegion::create(qp1->get_pd(), send_buffer, kMessageSize);
+        auto mr2 = rdma_util::MemoryRegion::create(qp2->get_pd(), recv_buffer, kMessageSize);
+
+        auto stream_tccl1 = rdma_util::CudaStreamTccl::create(rdma_util::TcclContext::create(std::move(qp1)), kGPU1);
+        auto stream_tccl2 = rdma_util::CudaStreamTccl::create(rdma_util::TcclContext::create(std::move(qp2)), kGPU2);
+
+        cudaStream_t stream1, stream2;
+        cudaSetDevice(kGPU1);
+        cudaStreamCreateWithFlags(&stream1, cudaStreamNonBlocking);
+        cudaSetDevice(kGPU2);
+        cudaStreamCreateWithFlags(&stream2, cudaStreamNonBlocking);
+
+        // The host only enqueues, the producer memset, the transfer and the consumer copy are ordered by the streams
+        std::vector<uint8_t> host_buffer(kMessageSize);
+        uint64_t num_errors = 0;
+        for (uint64_t i = 0; i < kNumMessages; ++i) {
+            cudaSetDevice(kGPU1);
+            cudaMemsetAsync(send_buffer, int(i), kMessageSize, stream1);
+            stream_tccl1->send_on_stream(stream1, 0, uint64_t(send_buffer), kMessageSize, mr1->get_lkey());
+
+            cudaSetDevice(kGPU2);
+            stream_tccl2->recv_on_stream(stream2, 0, uint64_t(recv_buffer), kMessageSize, mr2->get_rkey());
+            cudaMemcpyAsync(host_buffer.data(), recv_buffer, kMessageSize, cudaMemcpyDeviceToHost, stream2);
+            cudaStreamSynchronize(stream2);
+
+            for (uint64_t j = 0; j < kMessageSize; ++j) {
+                num_errors += host_buffer[j] != uint8_t(i);
+            }
+        }
+        cudaStreamSynchronize(stream1);
+        printf("%lu messages received, %lu bytes mismatched\n", kNumMessages, num_errors);
+
+        cudaStreamDestroy(stream1);
+        cudaStreamDestroy(stream2);
+    }
+
+    gpu_mem_util::free_gpu_buffer(send_buffer, kGPU1);
+    gpu_mem_util::free_gpu_buffer(recv_buffer, kGPU2);
+    return 0;
+}
+
+#else
+
+int main() {
+    printf("CUDA is disabled\n");
+    return 0;
+}
+
+#endif
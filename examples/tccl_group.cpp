@@ -0,0 +1,52 @@
+#include <rdma_util.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+constexpr const char* kRNIC = "mlx5_0";
+constexpr uint64_t kNumPeers = 8;
+constexpr uint64_t kMessageSize = 4 * 1024 * 1024;
+
+int main() {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kRNIC));
+    auto group = rdma_util::TcclContextGroup::create(std::move(pd));
+
+    // Every peer is a loopback QP pair, all of them share the SRQ and Ticket ring of the group
+    std::vector<rdma_util::Arc<rdma_util::TcclContext>> senders;
+    std::vector<rdma_util::Arc<rdma_util::TcclContext>> receivers;
+    for (uint64_t i = 0; i < kNumPeers; ++i) {
+        auto qp1 = group->create_queue_pair();
+        auto qp2 = group->create_queue_pair();
+        qp1->bring_up(qp2->get_handshake_data());
+        qp2->bring_up(qp1->get_handshake_data());
+        senders.push_back(group->add_context(std::move(qp1)));
+        receivers.push_back(group->add_context(std::move(qp2)));
+    }
+
+    printf("created %lu peers on one SRQ\n", kNumPeers);
+
+    std::vector<uint8_t> send_buffer(kMessageSize, 1);
+    std::vector<std::vector<uint8_t>> recv_buffers(kNumPeers, std::vector<uint8_t>(kMessageSize, 0));
+
+    std::vector<rdma_util::Handle> handles;
+    for (uint64_t i = 0; i < kNumPeers; ++i) {
+        handles.push_back(receivers[i]->recv(0, uint64_t(recv_buffers[i].data()), kMessageSize));
+        handles.push_back(senders[i]->send(0, uint64_t(send_buffer.data()), kMessageSize));
+    }
+    for (const auto& handle : handles) {
+        handle.wait();
+    }
+
+    for (uint64_t i = 0; i < kNumPeers; ++i) {
+        if (recv_buffers[i] != send_buffer) {
+            printf("peer %lu: data mismatch\n", i);
+            return 1;
+        }
+    }
+
+    printf("all peers received their data\n");
+    return 0;
+}
@@ -0,0 +1,54 @@
+#include <rdma_util.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+constexpr const char* kRNIC1 = "mlx5_0";
+constexpr const char* kRNIC2 = "mlx5_1";
+constexpr uint64_t kMessageSize = 64 * 1024 * 1024;
+constexpr uint32_t kNumStreams = 4;
+
+int main() {
+    auto qp1 = rdma_util::RcQueuePair::create(kRNIC1);
+    auto qp2 = rdma_util::RcQueuePair::create(kRNIC2);
+
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+
+    auto sender = rdma_util::TcclContext::create(std::move(qp1));
+    auto receiver = rdma_util::TcclContext::create(std::move(qp2));
+
+    std::vector<uint8_t> send_buffer(kNumStreams * kMessageSize);
+    std::vector<uint8_t> recv_buffer(kNumStreams * kMessageSize, 0);
+    for (uint32_t i = 0; i < kNumStreams; ++i) {
+        memset(send_buffer.data() + i * kMessageSize, int(i + 1), kMessageSize);
+    }
+
+    // The sender only advertises its buffers, nothing moves until the receiver pulls them
+    std::vector<rdma_util::Handle> send_handles;
+    for (uint32_t i = 0; i < kNumStreams; ++i) {
+        send_handles.push_back(sender->send_pull(i, uint64_t(send_buffer.data() + i * kMessageSize), kMessageSize));
+    }
+
+    // The receiver picks the order in which the buffers land
+    for (uint32_t i = kNumStreams; i-- > 0;) {
+        receiver->recv_pull(i, uint64_t(recv_buffer.data() + i * kMessageSize), kMessageSize).wait();
+        printf("pulled stream %u\n", i);
+    }
+
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+
+    if (memcmp(send_buffer.data(), recv_buffer.data(), send_buffer.size()) != 0) {
+        printf("data mismatch\n");
+        return 1;
+    }
+
+    printf("all pulls are done\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <rdma_util.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#ifdef USE_CUDA
+
+#include "gpu_mem_util.h"
+
+constexpr uint32_t kGPU1 = 0;
+constexpr uint32_t kGPU2 = 1;
+
+#endif
+
+constexpr uint64_t kDataBufferSize = 1024 * 1024 * 1024;
+constexpr uint32_t kMessageSize = 256 * 1024 * 1024;
+
+int main() {
+    std::vector<const char*> RNICs {"mlx5_0", "mlx5_1", "mlx5_4", "mlx5_5"};
+
+#ifdef USE_CUDA
+    auto data_buffer1 = gpu_mem_util::malloc_gpu_buffer(kDataBufferSize, kGPU1);
+    auto data_buffer2 = gpu_mem_util::malloc_gpu_buffer(kDataBufferSize, kGPU2);
+#else
+    auto data_buffer1 = malloc(kDataBufferSize);
+    auto data_buffer2 = malloc(kDataBufferSize);
+#endif
+
+    std::vector<rdma_util::Box<rdma_util::RcQueuePair>> qps1, qps2;
+    std::vector<rdma_util::Box<rdma_util::MemoryRegion>> data_mrs1, data_mrs2;
+    std::vector<uint32_t> lkeys, rkeys;
+
+    for (auto rnic : RNICs) {
+        auto qp1 = rdma_util::RcQueuePair::create(rnic);
+        auto qp2 = rdma_util::RcQueuePair::create(rnic);
+        qp1->bring_up(qp2->get_handshake_data());
+        qp2->bring_up(qp1->get_handshake_data());
+
+        // The same buffer is registered once in the PD of every stripe
+        data_mrs1.push_back(rdma_util::MemoryRegion::create(qp1->get_pd(), data_buffer1, kDataBufferSize));
+        data_mrs2.push_back(rdma_util::MemoryRegion::create(qp2->get_pd(), data_buffer2, kDataBufferSize));
+        lkeys.push_back(data_mrs1.back()->get_lkey());
+        rkeys.push_back(data_mrs2.back()->get_rkey());
+
+        qps1.push_back(std::move(qp1));
+        qps2.push_back(std::move(qp2));
+    }
+
+    printf("created %lu stripes\n", RNICs.size());
+
+    auto context1 = rdma_util::StripedTcclContext::create(std::move(qps1));
+    auto context2 = rdma_util::StripedTcclContext::create(std::move(qps2));
+
+    printf("created striped tccl context\n");
+
+    auto send_handle = context1->send(0, uint64_t(data_buffer1), kMessageSize, lkeys);
+    auto recv_handle = context2->recv(0, uint64_t(data_buffer2), kMessageSize, rkeys);
+
+    recv_handle.wait();
+    send_handle.wait();
+
+    printf("received\n");
+
+    data_mrs1.clear();
+    data_mrs2.clear();
+
+#ifdef USE_CUDA
+    gpu_mem_util::free_gpu_buffer(data_buffer1, kGPU1);
+    gpu_mem_util::free_gpu_buffer(data_buffer2, kGPU2);
+#else
+    free(data_buffer1);
+    free(data_buffer2);
+#endif
+
+    return 0;
+}
@@ -0,0 +1,166 @@
+#ifndef _BOOTSTRAP_H_
+#define _BOOTSTRAP_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rdma_util.h"
+
+namespace rdma_util {
+
+/**
+ * @brief Everything a peer needs to connect to one of our QPs.
+ * It is sent as raw bytes, so both hosts must share the byte order.
+ */
+struct QueuePairInfo {
+    HandshakeData handshake_data;
+
+    // Context parameters both peers must agree on, 0 if unused
+    uint64_t dop;
+    uint64_t chunk_size;
+
+    // TcclContextConfig::eager_threshold, which sizes the recv slots and picks the protocol of a message,
+    // so both peers must agree on it
+    uint32_t eager_threshold;
+
+    // Keeps the struct free of padding, which would go uninitialized on the wire
+    uint32_t reserved_;
+};
+
+static_assert(std::is_trivially_copyable<QueuePairInfo>::value, "QueuePairInfo must be trivially copyable");
+
+/**
+ * @brief A TCP or Unix domain socket connection used to exchange QueuePairInfo out of band.
+ */
+class BootstrapConnection {
+    friend class BootstrapListener;
+
+  private:
+    int fd_;
+
+    BootstrapConnection(int fd) : fd_(fd) {}
+
+  public:
+    static constexpr uint64_t kDefaultTimeoutMs = 30000;
+
+    BootstrapConnection() = delete;
+    BootstrapConnection(const BootstrapConnection&) = delete;
+    BootstrapConnection& operator=(const BootstrapConnection&) = delete;
+
+    ~BootstrapConnection();
+
+    /**
+     * @brief Connect to a BootstrapListener over TCP, retrying until the listener is up or the timeout expires.
+     */
+    static Box<BootstrapConnection>
+    connect(const char* host, uint16_t port, uint64_t timeout_ms = kDefaultTimeoutMs) noexcept(false);
+
+    /**
+     * @brief Connect to a BootstrapListener over a Unix domain socket, retrying like `connect`.
+     */
+    static Box<BootstrapConnection> connect_unix(const char* path, uint64_t timeout_ms = kDefaultTimeoutMs) noexcept(
+        false
+    );
+
+    inline int get_fd() const {
+        return this->fd_;
+    }
+
+    void send_all(const void* data, uint64_t length) noexcept(false);
+    void recv_all(void* data, uint64_t length) noexcept(false);
+
+    /**
+     * @brief Send the local QueuePairInfos and receive those of the peer in one round trip.
+     */
+    std::vector<QueuePairInfo> exchange(const std::vector<QueuePairInfo>& local) noexcept(false);
+};
+
+class BootstrapListener {
+  private:
+    int fd_;
+    uint16_t port_;
+    std::string unix_path_;
+
+    BootstrapListener() = default;
+
+  public:
+    BootstrapListener(const BootstrapListener&) = delete;
+    BootstrapListener& operator=(const BootstrapListener&) = delete;
+
+    ~BootstrapListener();
+
+    /**
+     * @brief Listen on a TCP port, port 0 picks a free one.
+     *
+     * @param port port to listen on
+     * @param bind_addr address to bind, nullptr for all interfaces
+     */
+    static Box<BootstrapListener> create(uint16_t port = 0, const char* bind_addr = nullptr) noexcept(false);
+
+    /**
+     * @brief Listen on a Unix domain socket, the path is unlinked when the listener is destroyed.
+     */
+    static Box<BootstrapListener> create_unix(const char* path) noexcept(false);
+
+    inline uint16_t get_port() const {
+        return this->port_;
+    }
+
+    Box<BootstrapConnection> accept() noexcept(false);
+
+    /**
+     * @brief Accept `num_peers` connections, in the order they arrive.
+     */
+    std::vector<Box<BootstrapConnection>> accept_all(uint64_t num_peers) noexcept(false);
+};
+
+/**
+ * @brief Exchange QueuePairInfos with a whole peer set at once.
+ *
+ * All connections are served concurrently and in full duplex, so the exchange costs a single
+ * round trip no matter how many peers and QPs there are.
+ *
+ * @param connections one connection per peer
+ * @param local QueuePairInfos to send to every peer, indexed like connections
+ * @return std::vector<std::vector<QueuePairInfo>> QueuePairInfos received from every peer
+ */
+std::vector<std::vector<QueuePairInfo>> exchange_all(
+    const std::vector<BootstrapConnection*>& connections,
+    const std::vector<std::vector<QueuePairInfo>>& local
+) noexcept(false);
+
+/**
+ * @brief Bring up QPs against their remote QueuePairInfos on several threads, see `RcQueuePair::bring_up_all`.
+ *
+ * @param qps QPs to bring up, the i-th one is connected to remote[i]
+ * @param remote QueuePairInfos of the peers
+ * @param options bring-up options, both peers must use the same
+ * @param num_threads number of threads, 0 picks RcQueuePair::kDefaultBringUpThreads
+ */
+void bring_up_all(
+    const std::vector<RcQueuePair*>& qps,
+    const std::vector<QueuePairInfo>& remote,
+    const BringUpOptions& options = BringUpOptions(),
+    uint64_t num_threads = 0
+) noexcept(false);
+
+/**
+ * @brief Exchange over one connection and bring up all QPs to the peer.
+ * It throws before bringing up any QP if the peer uses other context parameters.
+ *
+ * @param dop, chunk_size, eager_threshold parameters of the TcclContexts which will use the QPs
+ * @return std::vector<QueuePairInfo> QueuePairInfos of the peer, e.g. to check the context parameters
+ */
+std::vector<QueuePairInfo> connect_queue_pairs(
+    BootstrapConnection& connection,
+    const std::vector<RcQueuePair*>& qps,
+    const BringUpOptions& options = BringUpOptions(),
+    uint64_t dop = 0,
+    uint64_t chunk_size = 0,
+    uint32_t eager_threshold = 0
+) noexcept(false);
+
+}  // namespace rdma_util
+
+#endif  // _BOOTSTRAP_H_
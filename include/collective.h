@@ -0,0 +1,198 @@
+#ifndef _COLLECTIVE_H_
+#define _COLLECTIVE_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "rdma_util.h"
+
+namespace rdma_util {
+
+enum DataType {
+    INT32 = 0,
+    INT64 = 1,
+    FLOAT32 = 2,
+    FLOAT64 = 3,
+};
+
+enum ReduceOp {
+    SUM = 0,
+    MIN = 1,
+    MAX = 2,
+};
+
+enum CollectiveAlgorithm {
+    RING = 0,
+    TREE = 1,
+};
+
+uint64_t get_data_type_size(DataType data_type) noexcept(false);
+
+struct CommunicatorConfig {
+    static constexpr uint32_t kDefaultBaseStreamId = 1 << 15;
+    static constexpr uint32_t kDefaultNumLanes = 8;
+    static constexpr uint64_t kDefaultPipelineChunkSize = 1024 * 1024;
+
+    // Collectives use the stream ids [base_stream_id, base_stream_id + num_lanes) of every peer context.
+    // The stream table of a context is sparse, so a high base keeps clear of the streams of the
+    // application without costing memory.
+    uint32_t base_stream_id = kDefaultBaseStreamId;
+
+    // Pipeline chunks are spread over the lanes, so chunks of different lanes are matched independently
+    uint32_t num_lanes = kDefaultNumLanes;
+
+    // Segments are split into chunks of this size, reductions of a chunk overlap with the transfers of the others
+    uint64_t pipeline_chunk_size = kDefaultPipelineChunkSize;
+
+    // Buffers are GPU memory of `device`, so reductions run as CUDA kernels. Needs USE_CUDA.
+    bool device_memory = false;
+    uint32_t device = 0;
+};
+
+/**
+ * @brief Reduces pipeline chunks, `index` identifies the chunk of the current step.
+ */
+class Reducer {
+  public:
+    virtual ~Reducer() = default;
+
+    // Start dst[i] = op(dst[i], src[i]) for `count` elements
+    virtual void launch(uint64_t index, void* dst, const void* src, uint64_t count, DataType data_type, ReduceOp op)
+        noexcept(false) = 0;
+
+    // Wait until the reduction started by `launch` with the same index is done
+    virtual void synchronize(uint64_t index) noexcept(false) = 0;
+};
+
+/**
+ * @brief Reduces host memory on the calling thread, so `launch` is finished when it returns.
+ */
+class HostReducer: public Reducer {
+  public:
+    void launch(uint64_t index, void* dst, const void* src, uint64_t count, DataType data_type, ReduceOp op)
+        noexcept(false) override;
+
+    void synchronize(uint64_t) noexcept(false) override {}
+};
+
+/**
+ * @brief Collectives over a group of peers connected by TcclContexts.
+ *
+ * Peer contexts send and recv with the keyless overloads, so the buffers are registered by
+ * the memory region caches of the contexts. Every rank must call the same collectives in
+ * the same order, and a communicator must not be used by several threads at once.
+ *
+ * All collectives work in place, and segment i of a buffer belongs to rank i. With count
+ * elements, the first count % world_size segments hold one extra element.
+ */
+class Communicator {
+  private:
+    uint32_t rank_;
+    uint32_t world_size_;
+    std::vector<Arc<TcclContext>> peers_;
+    CommunicatorConfig config_;
+
+    Box<Reducer> reducer_;
+
+    // Reduce-scatter receives a segment here before reducing it into the buffer
+    void* scratch_;
+    uint64_t scratch_size_;
+
+    Communicator() = default;
+    Communicator(const Communicator&) = delete;
+    Communicator& operator=(const Communicator&) = delete;
+
+    void ensure_scratch(uint64_t size) noexcept(false);
+    void release_scratch() noexcept;
+    void ring_reduce_scatter(char* buffer, const std::vector<uint64_t>& offsets, DataType data_type, ReduceOp op)
+        noexcept(false);
+    void ring_allgather(char* buffer, const std::vector<uint64_t>& offsets) noexcept(false);
+    void ring_broadcast(char* buffer, uint64_t length, uint32_t root) noexcept(false);
+    void tree_broadcast(char* buffer, uint64_t length, uint32_t root) noexcept(false);
+
+    inline uint32_t lane_stream_id(uint64_t chunk) const {
+        return Communicator::get_lane_stream_id(this->config_, chunk);
+    }
+
+  public:
+    ~Communicator();
+
+    /**
+     * @brief Create a communicator.
+     *
+     * @param rank rank of this process
+     * @param peers context connected to every rank, indexed by rank, the own entry is ignored
+     * @param config config of the communicator, all ranks must use the same
+     */
+    static Box<Communicator> create(
+        uint32_t rank,
+        std::vector<Arc<TcclContext>> peers,
+        const CommunicatorConfig& config = CommunicatorConfig()
+    ) noexcept(false);
+
+    inline uint32_t get_rank() const {
+        return this->rank_;
+    }
+
+    inline uint32_t get_world_size() const {
+        return this->world_size_;
+    }
+
+    /**
+     * @brief Byte offsets of the segments of `count` elements, where segment i spans [offsets[i], offsets[i + 1]).
+     */
+    static std::vector<uint64_t> get_segment_offsets(uint64_t count, uint64_t world_size, uint64_t element_size);
+
+    /**
+     * @brief Pipeline chunks never split an element, and hold at least one.
+     */
+    static inline uint64_t get_pipeline_chunk_size(uint64_t chunk_size, uint64_t element_size) {
+        return std::max(element_size, chunk_size / element_size * element_size);
+    }
+
+    static inline uint64_t get_num_chunks(uint64_t length, uint64_t chunk_size) {
+        return (length + chunk_size - 1) / chunk_size;
+    }
+
+    static inline uint64_t get_chunk_length(uint64_t length, uint64_t chunk_size, uint64_t chunk) {
+        return std::min(chunk_size, length - chunk * chunk_size);
+    }
+
+    /**
+     * @brief Stream id of the lane which carries pipeline chunk `chunk`.
+     */
+    static inline uint32_t get_lane_stream_id(const CommunicatorConfig& config, uint64_t chunk) {
+        return config.base_stream_id + uint32_t(chunk % config.num_lanes);
+    }
+
+    /**
+     * @brief Ring allgather, every rank contributes `count_per_rank` elements at offset rank * count_per_rank.
+     */
+    void allgather(void* buffer, uint64_t count_per_rank, DataType data_type) noexcept(false);
+
+    /**
+     * @brief Ring reduce-scatter, segment rank of the buffer holds the reduced result afterwards.
+     */
+    void reduce_scatter(void* buffer, uint64_t count, DataType data_type, ReduceOp op) noexcept(false);
+
+    /**
+     * @brief Ring allreduce, a reduce-scatter followed by an allgather.
+     */
+    void allreduce(void* buffer, uint64_t count, DataType data_type, ReduceOp op) noexcept(false);
+
+    /**
+     * @brief Pipelined broadcast along a chain (RING) or a binary tree (TREE) rooted at `root`.
+     */
+    void broadcast(
+        void* buffer,
+        uint64_t count,
+        DataType data_type,
+        uint32_t root,
+        CollectiveAlgorithm algorithm = CollectiveAlgorithm::TREE
+    ) noexcept(false);
+};
+
+}  // namespace rdma_util
+
+#endif  // _COLLECTIVE_H_
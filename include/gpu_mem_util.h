@@ -2,13 +2,175 @@
 #define _GPU_MEM_UTIL_H_
 
 #include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "rdma_util.h"
+#include "topology.h"
 
 namespace gpu_mem_util {
 
+// Sizes of GPU allocations are rounded up to it, a large page of the GPU
+constexpr uint64_t kGpuPageSize = 2 * 1024 * 1024;
+
+inline uint64_t align_gpu_size(uint64_t size) {
+    return (size + kGpuPageSize - 1) & ~(kGpuPageSize - 1);
+}
+
+/**
+ * @brief Allocate GPU memory. The size is rounded up to a multiple of kGpuPageSize,
+ * the address is only as aligned as cudaMalloc makes it, which promises 256 bytes.
+ */
 void* malloc_gpu_buffer(uint64_t size, uint32_t device) noexcept;
+
+/**
+ * @brief Free GPU memory, dropping the allocation from the shared memory region caches first,
+ * see `rdma_util::DeviceRegistry::invalidate`.
+ */
 void free_gpu_buffer(void* d_ptr, uint32_t device) noexcept;
 void set_device(uint32_t device) noexcept;
 
+/**
+ * @brief PCI address of a GPU in the format of sysfs, e.g. 0000:3b:00.0.
+ */
+std::string get_gpu_pci_address(uint32_t device) noexcept(false);
+
+/**
+ * @brief CUDA device a buffer lives on, -1 if it is not device memory.
+ */
+int get_buffer_device(const void* ptr) noexcept;
+
+/**
+ * @brief Name of the RDMA device nearest to the GPU of a buffer, see `rdma_util::Topology`.
+ */
+std::string get_nearest_rdma_device(const rdma_util::Topology& topology, const void* d_ptr) noexcept(false);
+
+/**
+ * @brief The shared Context of the RDMA device nearest to the GPU of a buffer.
+ */
+rdma_util::Arc<rdma_util::Context>
+get_nearest_context(const rdma_util::Topology& topology, const void* d_ptr) noexcept(false);
+
+/**
+ * @brief Export a range of GPU memory as a dma-buf. The address and size must be aligned to the
+ * host page size, the base and size of a cudaMalloc allocation are.
+ *
+ * @return int the dma-buf fd which the caller must close, -1 on failure or if the driver lacks dma-buf support
+ */
+int export_dmabuf_fd(void* d_ptr, uint64_t size) noexcept;
+
+/**
+ * @brief Register GPU memory through a dma-buf instead of the peer-memory module.
+ * The buffer may start anywhere within its allocation, the whole allocation is exported from
+ * its base and the region is registered at the offset of the buffer in the dma-buf.
+ */
+rdma_util::Box<rdma_util::MemoryRegion> register_gpu_buffer_dmabuf(
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd,
+    void* d_ptr,
+    uint64_t size,
+    const rdma_util::MemoryRegionOptions& options = rdma_util::MemoryRegionOptions()
+) noexcept(false);
+
+/**
+ * @brief A block of GPU memory which is registered in the ProtectionDomain of its pool.
+ */
+struct GpuBlock {
+    void* addr;
+    // Size of the size class, which is at least the requested size
+    uint64_t size;
+    uint32_t lkey;
+    uint32_t rkey;
+};
+
+/**
+ * @brief A caching pool of GPU memory of one device.
+ *
+ * Blocks come in power-of-two size classes and are carved out of slabs of their class. A slab
+ * holds kBlocksPerSlab blocks, capped at the slab size of the pool, so touching a size class
+ * once reserves only a few blocks of it. Each slab is allocated and registered once, and is
+ * only released with the pool, so allocate and deallocate never call into CUDA or the RNIC
+ * after warming up. Blocks larger than the slab size get a dedicated slab, which is cached
+ * in its size class as well.
+ *
+ * It is thread-safe.
+ */
+class GpuMemoryPool {
+  private:
+    struct Slab {
+        void* addr;
+        uint64_t length;
+        rdma_util::Box<rdma_util::MemoryRegion> mr;
+    };
+
+    uint32_t device_;
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd_;
+    uint64_t slab_size_;
+    bool use_dmabuf_;
+
+    std::mutex mutex_;
+    std::vector<Slab> slabs_;
+    // Indexed by log2 of the size class
+    std::vector<std::vector<GpuBlock>> free_blocks_;
+    uint64_t reserved_bytes_;
+
+    GpuMemoryPool() = default;
+    GpuMemoryPool(const GpuMemoryPool&) = delete;
+    GpuMemoryPool& operator=(const GpuMemoryPool&) = delete;
+
+    void refill_inner(uint32_t size_class) noexcept(false);
+
+  public:
+    static constexpr uint64_t kMinBlockSize = 64 * 1024;
+    static constexpr uint64_t kDefaultSlabSize = 256 * 1024 * 1024;
+    static constexpr uint64_t kBlocksPerSlab = 16;
+
+    ~GpuMemoryPool();
+
+    /**
+     * @param device CUDA device of the memory
+     * @param pd ProtectionDomain the slabs are registered in
+     * @param slab_size upper bound of the slabs small blocks are carved out of, a power of two
+     * @param use_dmabuf register the slabs through dma-buf
+     */
+    static rdma_util::Box<GpuMemoryPool> create(
+        uint32_t device,
+        rdma_util::Arc<rdma_util::ProtectionDomain> pd,
+        uint64_t slab_size = kDefaultSlabSize,
+        bool use_dmabuf = false
+    ) noexcept(false);
+
+    /**
+     * @brief Get a block of at least `size` bytes.
+     */
+    GpuBlock allocate(uint64_t size) noexcept(false);
+
+    /**
+     * @brief Return a block to the pool. The memory stays registered and allocated.
+     */
+    void deallocate(const GpuBlock& block) noexcept(false);
+
+    inline uint32_t get_device() const {
+        return this->device_;
+    }
+
+    /**
+     * @brief Bytes of GPU memory held by the pool, whether they are handed out or not.
+     */
+    uint64_t get_reserved_bytes() noexcept;
+
+    /**
+     * @brief log2 of the smallest size class, in units of kMinBlockSize, which fits `size`.
+     */
+    static uint32_t get_size_class(uint64_t size) noexcept;
+
+    /**
+     * @brief Length of the slabs blocks of `block_size` are carved out of in a pool with `slab_size`,
+     * min(slab_size, block_size * kBlocksPerSlab) but never less than one block, in whole GPU pages.
+     */
+    static uint64_t get_slab_length(uint64_t block_size, uint64_t slab_size) noexcept;
+};
+
 }  // namespace gpu_mem_util
 
-#endif  // _GPU_MEM_UTIL_H_
\ No newline at end of file
+#endif  // _GPU_MEM_UTIL_H_
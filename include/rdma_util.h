@@ -3,19 +3,27 @@
 
 #include <infiniband/verbs.h>
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <ios>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include "concurrentqueue.h"
+#include "tccl_stats.h"
 
 namespace rdma_util {
 
@@ -31,6 +39,45 @@ struct HandshakeData {
     uint32_t qp_num;
 };
 
+/**
+ * @brief Options of MemoryRegion registration.
+ */
+struct MemoryRegionOptions {
+    int access_flags = ibv_access_flags::IBV_ACCESS_LOCAL_WRITE | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE
+        | ibv_access_flags::IBV_ACCESS_REMOTE_READ;
+
+    // Let the RNIC reorder PCIe writes, which often pays off for GPUDirect traffic through PCIe switches
+    bool relaxed_ordering = false;
+
+    int get_access_flags() const;
+
+    /**
+     * @brief Read the options from NANOGDR_IB_RELAXED_ORDERING, unset variables keep the defaults.
+     */
+    static MemoryRegionOptions from_env() noexcept(false);
+};
+
+/**
+ * @brief Options of RcQueuePair bring-up. Both peers must agree on them.
+ */
+struct BringUpOptions {
+    ibv_mtu path_mtu = ibv_mtu::IBV_MTU_4096;
+    uint8_t gid_index = 0;
+    uint8_t port_num = 1;
+
+    // Outstanding RDMA reads and atomics, as initiator and as responder
+    uint8_t max_rd_atomic = 16;
+
+    uint8_t traffic_class = 0;
+    ibv_rate rate = ibv_rate::IBV_RATE_MAX;
+
+    /**
+     * @brief Read the options from NANOGDR_IB_MTU, NANOGDR_IB_GID_INDEX, NANOGDR_IB_PORT,
+     * NANOGDR_IB_RD_ATOMIC and NANOGDR_IB_TC, unset variables keep the defaults.
+     */
+    static BringUpOptions from_env() noexcept(false);
+};
+
 enum QueuePairState {
     RESET = 0,
     INIT = 1,
@@ -51,6 +98,9 @@ struct WorkCompletion {
     uint32_t opcode;
     uint32_t imm_data;
 
+    // QP the work request belongs to, which tells apart the QPs sharing a CQ
+    uint32_t qp_num;
+
     inline std::string to_string() const {
         return "wr_id: " + std::to_string(wr_id) + ", status: " + std::to_string(status)
             + ", byte_len: " + std::to_string(byte_len) + ", opcode: " + std::to_string(opcode)
@@ -62,11 +112,177 @@ class Context;
 class ProtectionDomain;
 class RcQueuePair;
 class MemoryRegion;
+class MemoryRegionCache;
+struct MemoryRegionCacheConfig;
+
+/**
+ * @brief Accumulates send work requests which are chained and posted with a single doorbell
+ * by `RcQueuePair::post_send_batch`.
+ *
+ * The capacity is fixed at construction, the caller must flush the batch once it is full.
+ * Inlined work requests copy their payload when the batch is posted, so the local buffers
+ * must stay valid until then but need no lkey.
+ */
+class SendWorkRequestBatch {
+    friend class RcQueuePair;
+
+  private:
+    std::vector<ibv_send_wr> wrs_;
+    std::vector<ibv_sge> sges_;
+    uint64_t num_wrs_;
+    uint64_t num_sges_;
+
+    ibv_send_wr& next_wr(
+        uint64_t wr_id,
+        ibv_wr_opcode opcode,
+        const ibv_sge* sg_list,
+        uint32_t num_sge,
+        bool signaled,
+        bool inlined
+    );
+
+  public:
+    explicit SendWorkRequestBatch(uint64_t max_num_wrs = 0, uint64_t max_num_sges_per_wr = 1);
+
+    inline uint64_t size() const {
+        return this->num_wrs_;
+    }
+
+    inline bool empty() const {
+        return this->num_wrs_ == 0;
+    }
+
+    inline bool full() const {
+        return this->num_wrs_ == this->wrs_.size();
+    }
+
+    inline void clear() {
+        this->num_wrs_ = 0;
+        this->num_sges_ = 0;
+    }
+
+    /**
+     * @brief Request a completion for the last work request of the batch.
+     */
+    inline void signal_last() {
+        assert(!this->empty());
+        this->wrs_[this->num_wrs_ - 1].send_flags |= uint32_t(ibv_send_flags::IBV_SEND_SIGNALED);
+    }
+
+    void add_send(uint64_t wr_id, uint64_t laddr, uint32_t length, uint32_t lkey, bool signaled, bool inlined = false);
+
+    void add_send_with_imm(
+        uint64_t wr_id,
+        uint64_t laddr,
+        uint32_t length,
+        uint32_t lkey,
+        uint32_t imm,
+        bool signaled,
+        bool inlined = false
+    );
+
+    void add_read(
+        uint64_t wr_id,
+        uint64_t laddr,
+        uint64_t raddr,
+        uint32_t length,
+        uint32_t lkey,
+        uint32_t rkey,
+        bool signaled
+    );
+
+    void add_write(
+        uint64_t wr_id,
+        uint64_t laddr,
+        uint64_t raddr,
+        uint32_t length,
+        uint32_t lkey,
+        uint32_t rkey,
+        bool signaled,
+        bool inlined = false
+    );
+
+    void add_write_with_imm(
+        uint64_t wr_id,
+        uint64_t laddr,
+        uint64_t raddr,
+        uint32_t length,
+        uint32_t imm,
+        uint32_t lkey,
+        uint32_t rkey,
+        bool signaled,
+        bool inlined = false
+    );
+
+    /**
+     * @brief Add a work request gathering from several local buffers.
+     *
+     * @param opcode IBV_WR_SEND, IBV_WR_SEND_WITH_IMM, IBV_WR_RDMA_WRITE or IBV_WR_RDMA_WRITE_WITH_IMM
+     * @param sg_list local buffers, copied into the batch
+     * @param raddr remote address, ignored by sends
+     * @param rkey remote key, ignored by sends
+     * @param imm immediate data, ignored by opcodes without imm
+     */
+    void add_sg(
+        uint64_t wr_id,
+        ibv_wr_opcode opcode,
+        const ibv_sge* sg_list,
+        uint32_t num_sge,
+        uint64_t raddr,
+        uint32_t rkey,
+        uint32_t imm,
+        bool signaled,
+        bool inlined = false
+    );
+};
+
+/**
+ * @brief Accumulates recv work requests which are chained and posted with a single doorbell
+ * by `RcQueuePair::post_recv_batch`.
+ */
+class RecvWorkRequestBatch {
+    friend class RcQueuePair;
+    friend class SharedReceiveQueue;
+
+  private:
+    std::vector<ibv_recv_wr> wrs_;
+    std::vector<ibv_sge> sges_;
+    uint64_t num_wrs_;
+    uint64_t num_sges_;
+
+  public:
+    explicit RecvWorkRequestBatch(uint64_t max_num_wrs = 0, uint64_t max_num_sges_per_wr = 1);
+
+    inline uint64_t size() const {
+        return this->num_wrs_;
+    }
+
+    inline bool empty() const {
+        return this->num_wrs_ == 0;
+    }
+
+    inline bool full() const {
+        return this->num_wrs_ == this->wrs_.size();
+    }
+
+    inline void clear() {
+        this->num_wrs_ = 0;
+        this->num_sges_ = 0;
+    }
+
+    void add_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey);
+
+    /**
+     * @brief Add a work request scattering into several local buffers.
+     */
+    void add_sg(uint64_t wr_id, const ibv_sge* sg_list, uint32_t num_sge);
+};
 
 class Context {
     friend class ProtectionDomain;
     friend class MemoryRegion;
     friend class RcQueuePair;
+    friend class SharedReceiveQueue;
 
   private:
     ibv_context* inner;
@@ -81,12 +297,17 @@ class Context {
     ~Context();
 
     static Box<Context> create(const char* dev_name) noexcept(false);
+
+    inline const char* get_device_name() const {
+        return ibv_get_device_name(this->inner->device);
+    }
 };
 
 class ProtectionDomain {
     friend class Context;
     friend class MemoryRegion;
     friend class RcQueuePair;
+    friend class SharedReceiveQueue;
 
   private:
     ibv_pd* inner;
@@ -109,6 +330,183 @@ class ProtectionDomain {
     }
 };
 
+/**
+ * @brief A process-wide registry of opened devices, their default ProtectionDomains and the
+ * memory region caches of ProtectionDomains.
+ *
+ * Everything created from a device name goes through it, so QPs of the same device share one
+ * Context and one ProtectionDomain instead of opening the device for every QP. Entries are weak,
+ * a device is closed once the last object using it is gone. It is thread-safe.
+ */
+class DeviceRegistry {
+  private:
+    std::mutex mutex_;
+    std::map<std::string, std::weak_ptr<Context>> contexts_;
+    std::map<std::string, std::weak_ptr<ProtectionDomain>> pds_;
+
+    // A live cache holds its ProtectionDomain, so the address of a key is never reused while its entry is alive
+    std::map<const ProtectionDomain*, std::weak_ptr<MemoryRegionCache>> memory_region_caches_;
+
+    DeviceRegistry() = default;
+    DeviceRegistry(const DeviceRegistry&) = delete;
+    DeviceRegistry& operator=(const DeviceRegistry&) = delete;
+
+    Arc<Context> get_context_locked(const std::string& dev_name) noexcept(false);
+
+  public:
+    static DeviceRegistry& get_instance() noexcept;
+
+    /**
+     * @brief The shared Context of the device, opened on first use.
+     */
+    Arc<Context> get_context(const std::string& dev_name) noexcept(false);
+
+    /**
+     * @brief The default ProtectionDomain of the device, allocated on first use.
+     */
+    Arc<ProtectionDomain> get_pd(const std::string& dev_name) noexcept(false);
+
+    /**
+     * @brief The memory region cache shared by every user of the ProtectionDomain, created on first use.
+     * A buffer used by several QPs of the PD is then registered once, against a single budget.
+     */
+    Arc<MemoryRegionCache> get_memory_region_cache(Arc<ProtectionDomain> pd) noexcept(false);
+
+    /**
+     * @param config config of the cache if it is created by this call, ignored otherwise
+     */
+    Arc<MemoryRegionCache>
+    get_memory_region_cache(Arc<ProtectionDomain> pd, const MemoryRegionCacheConfig& config) noexcept(false);
+
+    /**
+     * @brief Drop [addr, addr + length) from every live cache of `get_memory_region_cache`.
+     *
+     * A cached region keeps the pages it pinned, so once the memory is freed and the range is
+     * reused by another allocation, keyless transfers would silently move the old pages. This is
+     * the hook to call before freeing memory which may have gone through a keyless transfer.
+     * `gpu_mem_util::free_gpu_buffer` calls it already, frameworks with allocators of their own
+     * must call it from their free path.
+     */
+    void invalidate(uint64_t addr, uint64_t length) noexcept;
+};
+
+/**
+ * @brief Sizes and layout of the queues of an RcQueuePair.
+ *
+ * The defaults match the sizes RcQueuePair used to hard-code. After creation,
+ * `RcQueuePair::get_config` reports the capabilities actually granted by the device.
+ */
+struct QueuePairConfig {
+    // Depth of the send CQ, or of the single CQ if shared_cq is set
+    uint32_t send_cq_depth = 128;
+    // Depth of the recv CQ, ignored if shared_cq is set
+    uint32_t recv_cq_depth = 128;
+
+    uint32_t max_send_wr = 128;
+    uint32_t max_recv_wr = 1024;
+    uint32_t max_send_sge = 1;
+    uint32_t max_recv_sge = 1;
+    uint32_t max_inline_data = 64;
+
+    // Use a single CQ for both send and recv completions
+    bool shared_cq = false;
+
+    // Attach the CQs to a completion channel, which is needed by event-driven polling.
+    // Every channel is a file descriptor, so it is off unless asked for.
+    bool use_completion_channel = false;
+};
+
+struct SharedReceiveQueueConfig {
+    uint32_t max_wr = 4096;
+    uint32_t max_sge = 1;
+
+    // Depth of the recv CQ shared by all the attached QPs
+    uint32_t cq_depth = 8192;
+};
+
+/**
+ * @brief A shared receive queue together with the recv CQ of all the RcQueuePairs attached to it.
+ *
+ * Recv work requests and their completions are pooled across the attached QPs, so receive
+ * side resources stay the same no matter how many peers there are. Completions are told
+ * apart by their qp_num.
+ */
+class SharedReceiveQueue {
+    friend class RcQueuePair;
+
+  private:
+    ibv_srq* inner;
+    ibv_cq* recv_cq_;
+
+    Arc<ProtectionDomain> pd_;
+    SharedReceiveQueueConfig config_;
+
+    SharedReceiveQueue(Arc<ProtectionDomain> pd, const SharedReceiveQueueConfig& config) noexcept(false);
+
+  public:
+    SharedReceiveQueue() = delete;
+    SharedReceiveQueue(const SharedReceiveQueue&) = delete;
+    SharedReceiveQueue& operator=(const SharedReceiveQueue&) = delete;
+
+    ~SharedReceiveQueue();
+
+    static Arc<SharedReceiveQueue> create(
+        Arc<ProtectionDomain> pd,
+        const SharedReceiveQueueConfig& config = SharedReceiveQueueConfig()
+    ) noexcept(false);
+
+    inline Arc<ProtectionDomain> get_pd() const {
+        return this->pd_;
+    }
+
+    /**
+     * @brief Queue sizes granted by the device
+     */
+    inline const SharedReceiveQueueConfig& get_config() const {
+        return this->config_;
+    }
+
+    int post_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey) noexcept;
+
+    /**
+     * @brief Chain the work requests of the batch and post them with a single ibv_post_srq_recv.
+     * The batch is cleared afterwards, no matter whether the post succeeds.
+     *
+     * @return int 0 on success, the errno of ibv_post_srq_recv otherwise
+     */
+    int post_recv_batch(RecvWorkRequestBatch& batch) noexcept;
+
+    /**
+     * UNSAFE: This function panics if the size of `wc_buffer` is less than the sizeof `ibv_wc[max_num_wcs]`
+     * @brief poll the shared recv_cq once and return the number of polled work completions on success
+     */
+    int poll_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs);
+
+    /**
+     * UNSAFE: This function panics if the size of `wc_buffer` is less than the sizeof `ibv_wc[max_num_wcs]`
+     * @brief poll the shared recv_cq once and call `visitor(const ibv_wc&)` on every polled work completion
+     * in place, see `RcQueuePair::visit_recv_cq_once`.
+     */
+    template<typename Visitor>
+    inline int visit_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, Visitor&& visitor) {
+        const int ret = ibv_poll_cq(this->recv_cq_, max_num_wcs, wc_buffer);
+        for (int i = 0; i < ret; ++i) {
+            visitor(static_cast<const ibv_wc&>(wc_buffer[i]));
+        }
+        return ret;
+    }
+};
+
+class RcQueuePair;
+
+/**
+ * @brief A QP and the handshake data of its remote peer, see `RcQueuePair::bring_up_all`.
+ */
+struct BringUpRequest {
+    RcQueuePair* qp;
+    HandshakeData remote;
+};
+
 class RcQueuePair {
     friend class Context;
     friend class MemoryRegion;
@@ -120,7 +518,16 @@ class RcQueuePair {
     Arc<ProtectionDomain> pd_;
     Arc<Context> context_;
 
-    RcQueuePair(Arc<ProtectionDomain> pd) noexcept(false);
+    // The shared receive queue the QP takes its recv work requests from, nullptr if there is none
+    Arc<SharedReceiveQueue> srq_;
+
+    QueuePairConfig config_;
+
+    // Shared by the send_cq and the recv_cq, nullptr if use_completion_channel is not set.
+    // With an SRQ, only the send_cq is attached to it.
+    ibv_comp_channel* completion_channel_;
+
+    RcQueuePair(Arc<ProtectionDomain> pd, const QueuePairConfig& config, Arc<SharedReceiveQueue> srq) noexcept(false);
 
   public:
     RcQueuePair() = delete;
@@ -132,21 +539,105 @@ class RcQueuePair {
     static Box<RcQueuePair> create(const char* dev_name) noexcept(false);
     static Box<RcQueuePair> create(Arc<Context> context) noexcept(false);
     static Box<RcQueuePair> create(Arc<ProtectionDomain> pd) noexcept(false);
+    static Box<RcQueuePair> create(const char* dev_name, const QueuePairConfig& config) noexcept(false);
+    static Box<RcQueuePair> create(Arc<Context> context, const QueuePairConfig& config) noexcept(false);
+    static Box<RcQueuePair> create(Arc<ProtectionDomain> pd, const QueuePairConfig& config) noexcept(false);
+
+    /**
+     * @brief Create a QP which takes its recv work requests from an SRQ and reports recv completions
+     * to the recv CQ of the SRQ. max_recv_wr, max_recv_sge, recv_cq_depth and shared_cq are ignored,
+     * and recvs must be posted on the SRQ.
+     */
+    static Box<RcQueuePair> create(Arc<SharedReceiveQueue> srq, const QueuePairConfig& config) noexcept(false);
 
     inline Arc<ProtectionDomain> get_pd() const {
         return this->pd_;
     }
 
+    inline Arc<SharedReceiveQueue> get_srq() const {
+        return this->srq_;
+    }
+
+    inline uint32_t get_qp_num() const {
+        return this->inner->qp_num;
+    }
+
     inline Arc<Context> get_context() const {
         return this->context_;
     }
 
+    /**
+     * @brief Maximum payload of an inlined work request, as granted by the device
+     */
+    inline uint32_t get_max_inline_data() const {
+        return this->config_.max_inline_data;
+    }
+
+    /**
+     * @brief Queue sizes granted by the device
+     */
+    inline const QueuePairConfig& get_config() const {
+        return this->config_;
+    }
+
+    /**
+     * @brief File descriptor of the completion channel shared by both CQs, -1 if there is none.
+     * It is non-blocking and becomes readable once an armed CQ gets a completion.
+     */
+    inline int get_completion_channel_fd() const {
+        return this->completion_channel_ ? this->completion_channel_->fd : -1;
+    }
+
+    /**
+     * @brief Request a completion event for the next completion of either CQ.
+     *
+     * @return int 0 on success, the errno of ibv_req_notify_cq otherwise
+     */
+    int arm_completion_notification() noexcept;
+
+    /**
+     * @brief Acknowledge all the completion events which are pending on the completion channel.
+     *
+     * @return int the number of acknowledged events
+     */
+    int ack_completion_events() noexcept;
+
     QueuePairState query_qp_state() noexcept(false);
 
     HandshakeData get_handshake_data() noexcept(false);
 
+    /**
+     * @brief Get the handshake data with the GID of the port and index in the options.
+     */
+    HandshakeData get_handshake_data(const BringUpOptions& options) noexcept(false);
+
     void bring_up(const HandshakeData& handshake_data, ibv_rate rate = ibv_rate::IBV_RATE_MAX) noexcept(false);
 
+    void bring_up(const HandshakeData& handshake_data, const BringUpOptions& options) noexcept(false);
+
+    static constexpr uint32_t kDefaultBringUpThreads = 8;
+
+    /**
+     * @brief Bring up many QPs at once on up to `num_threads` worker threads.
+     *
+     * Every state transition is a synchronous command to the device, so bringing up thousands of QPs
+     * one after the other is dominated by their round trips, which overlap across threads. The first
+     * error is rethrown once all the workers are done, the other QPs are brought up regardless.
+     */
+    static void bring_up_all(
+        const std::vector<BringUpRequest>& requests,
+        const BringUpOptions& options,
+        uint32_t num_threads = kDefaultBringUpThreads
+    ) noexcept(false);
+
+    /**
+     * @brief Move the QP back to RESET, so it can be brought up again with another peer.
+     *
+     * Posted work requests are dropped, and so are the completions left in the CQs of the QP.
+     * The recv CQ of an SRQ is shared, so it is left alone.
+     */
+    void reset() noexcept(false);
+
     int post_send_send(uint64_t wr_id, uint64_t laddr, uint32_t length, uint32_t lkey, bool signaled) noexcept;
 
     int post_send_send_with_imm(
@@ -191,6 +682,26 @@ class RcQueuePair {
 
     int post_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey) noexcept;
 
+    /**
+     * @brief Chain the work requests of the batch and post them with a single ibv_post_send.
+     * The batch is cleared afterwards, no matter whether the post succeeds.
+     *
+     * @return int 0 on success, the errno of ibv_post_send otherwise
+     */
+    int post_send_batch(SendWorkRequestBatch& batch) noexcept;
+
+    /**
+     * @brief Chain the work requests of the batch and post them with a single ibv_post_recv.
+     * The batch is cleared afterwards, no matter whether the post succeeds.
+     *
+     * @return int 0 on success, the errno of ibv_post_recv otherwise
+     */
+    int post_recv_batch(RecvWorkRequestBatch& batch) noexcept;
+
+    // The helpers without a wc_buffer poll through a stack buffer of this many work completions,
+    // so they allocate nothing as long as `polled_wcs` keeps its capacity between calls
+    static constexpr int kPollBatchSize = 32;
+
     /**
      * @brief poll the send_cq until at least `num_expected_completions` 
      * work completions are polled or an error occurs
@@ -248,6 +759,92 @@ class RcQueuePair {
      * @param polled_wcs return value to store the polled wr_ids and status
      */
     int poll_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs);
+
+    /**
+     * UNSAFE: This function panics if the size of `wc_buffer` is less than the sizeof `ibv_wc[max_num_wcs]`
+     * @brief poll the send_cq once and call `visitor(const ibv_wc&)` on every polled work completion in place.
+     * Nothing is copied or converted, so `imm_data` is still in network byte order.
+     *
+     * @return int the number of polled work completions on success, a negative value on error
+     */
+    template<typename Visitor>
+    inline int visit_send_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, Visitor&& visitor) {
+        const int ret = ibv_poll_cq(this->inner->send_cq, max_num_wcs, wc_buffer);
+        for (int i = 0; i < ret; ++i) {
+            visitor(static_cast<const ibv_wc&>(wc_buffer[i]));
+        }
+        return ret;
+    }
+
+    /**
+     * UNSAFE: This function panics if the size of `wc_buffer` is less than the sizeof `ibv_wc[max_num_wcs]`
+     * @brief poll the recv_cq once and call `visitor(const ibv_wc&)` on every polled work completion in place.
+     * Nothing is copied or converted, so `imm_data` is still in network byte order.
+     *
+     * @return int the number of polled work completions on success, a negative value on error
+     */
+    template<typename Visitor>
+    inline int visit_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, Visitor&& visitor) {
+        const int ret = ibv_poll_cq(this->inner->recv_cq, max_num_wcs, wc_buffer);
+        for (int i = 0; i < ret; ++i) {
+            visitor(static_cast<const ibv_wc&>(wc_buffer[i]));
+        }
+        return ret;
+    }
+};
+
+/**
+ * @brief A pool of idle QPs of one ProtectionDomain and QueuePairConfig.
+ *
+ * QPs can be created ahead of time with `reserve`, and released QPs are reset instead of
+ * destroyed, so a reconnect only pays for the bring-up and not for creating the QP and its CQs.
+ * It is thread-safe.
+ */
+class QueuePairPool {
+  private:
+    Arc<ProtectionDomain> pd_;
+    QueuePairConfig config_;
+
+    std::mutex mutex_;
+    std::vector<Box<RcQueuePair>> idle_qps_;
+
+    QueuePairPool() = default;
+    QueuePairPool(const QueuePairPool&) = delete;
+    QueuePairPool& operator=(const QueuePairPool&) = delete;
+
+  public:
+    /**
+     * @param pd ProtectionDomain of the QPs
+     * @param config config of the QPs
+     * @param num_reserved number of QPs created right away
+     */
+    static Arc<QueuePairPool> create(
+        Arc<ProtectionDomain> pd,
+        const QueuePairConfig& config = QueuePairConfig(),
+        uint64_t num_reserved = 0
+    ) noexcept(false);
+
+    /**
+     * @brief Create QPs until `count` of them are idle.
+     */
+    void reserve(uint64_t count) noexcept(false);
+
+    /**
+     * @brief Take an idle QP in RESET state, or create one if there is none.
+     */
+    Box<RcQueuePair> acquire() noexcept(false);
+
+    /**
+     * @brief Reset a QP acquired from this pool and keep it for the next `acquire`.
+     * Work requests which are still in flight are dropped.
+     */
+    void release(Box<RcQueuePair> qp) noexcept(false);
+
+    uint64_t get_num_idle() noexcept;
+
+    inline Arc<ProtectionDomain> get_pd() const {
+        return this->pd_;
+    }
 };
 
 class MemoryRegion {
@@ -264,9 +861,25 @@ class MemoryRegion {
     // This could be nullptr if the buffer is created with a raw pointer
     Arc<void> inner_buffer_with_deleter_;
 
-    MemoryRegion(Arc<ProtectionDomain> pd, Arc<void> buffer_with_deleter, uint64_t length) noexcept(false);
-
-    MemoryRegion(Arc<ProtectionDomain> pd, void* addr, uint64_t length) noexcept(false);
+    MemoryRegion(
+        Arc<ProtectionDomain> pd,
+        Arc<void> buffer_with_deleter,
+        uint64_t length,
+        const MemoryRegionOptions& options
+    ) noexcept(false);
+
+    MemoryRegion(Arc<ProtectionDomain> pd, void* addr, uint64_t length, const MemoryRegionOptions& options) noexcept(
+        false
+    );
+
+    MemoryRegion(
+        Arc<ProtectionDomain> pd,
+        int dmabuf_fd,
+        uint64_t offset,
+        uint64_t length,
+        uint64_t iova,
+        const MemoryRegionOptions& options
+    ) noexcept(false);
 
   public:
     MemoryRegion() = delete;
@@ -283,9 +896,14 @@ class MemoryRegion {
      * @param pd ProtectionDomain object
      * @param buffer_with_deleter buffer with a deleter
      * @param length length of the buffer
+     * @param options access flags of the registration
      */
-    static Box<MemoryRegion>
-    create(Arc<ProtectionDomain> pd, Arc<void> buffer_with_deleter, uint64_t length) noexcept(false);
+    static Box<MemoryRegion> create(
+        Arc<ProtectionDomain> pd,
+        Arc<void> buffer_with_deleter,
+        uint64_t length,
+        const MemoryRegionOptions& options = MemoryRegionOptions()
+    ) noexcept(false);
 
     /**
      * @brief Create a MemoryRegion object with a buffer that has a deleter
@@ -295,8 +913,37 @@ class MemoryRegion {
      * @param pd ProtectionDomain object
      * @param addr address of the raw buffer
      * @param length length of the buffer
+     * @param options access flags of the registration
+     */
+    static Box<MemoryRegion> create(
+        Arc<ProtectionDomain> pd,
+        void* addr,
+        uint64_t length,
+        const MemoryRegionOptions& options = MemoryRegionOptions()
+    ) noexcept(false);
+
+    /**
+     * @brief Create a MemoryRegion object from a dma-buf, e.g. exported from GPU memory. Unlike `create`
+     * it does not rely on a peer-memory kernel module.
+     *
+     * SAFETY: The caller must ensure that the exported memory has longer lifetime than the returned
+     * MemoryRegion object. The fd may be closed once this returns.
+     *
+     * @param pd ProtectionDomain object
+     * @param dmabuf_fd file descriptor of the dma-buf
+     * @param offset offset of the region in the dma-buf
+     * @param length length of the region
+     * @param iova address the region is accessed with in work requests, usually the virtual address of the buffer
+     * @param options access flags of the registration
      */
-    static Box<MemoryRegion> create(Arc<ProtectionDomain> pd, void* addr, uint64_t length) noexcept(false);
+    static Box<MemoryRegion> create_dmabuf(
+        Arc<ProtectionDomain> pd,
+        int dmabuf_fd,
+        uint64_t offset,
+        uint64_t length,
+        uint64_t iova,
+        const MemoryRegionOptions& options = MemoryRegionOptions()
+    ) noexcept(false);
 
     inline uint32_t get_lkey() const {
         return this->inner->lkey;
@@ -315,43 +962,614 @@ class MemoryRegion {
     }
 };
 
-template<typename T>
-using Queue = moodycamel::ConcurrentQueue<T>;
+struct MemoryRegionCacheConfig {
+    static constexpr uint64_t kDefaultMaxRegisteredBytes = 64ull * 1024 * 1024 * 1024;
+    static constexpr uint64_t kDefaultAlignment = 4096;
 
-struct Ticket {
-    uint32_t stream_id;
-    uint32_t length;
-    uint64_t addr;
-    uint32_t key;
+    // Unused regions are evicted in LRU order once more bytes than this are registered
+    uint64_t max_registered_bytes = kDefaultMaxRegisteredBytes;
+
+    // Registrations are widened to this alignment, so neighbouring lookups hit the same region.
+    // It must not exceed the page size of the memory, otherwise unmapped pages could be covered.
+    uint64_t alignment = kDefaultAlignment;
+
+    // Options of every registration made by the cache
+    MemoryRegionOptions registration_options;
+};
+
+/**
+ * @brief A registration cache of one ProtectionDomain.
+ *
+ * Registered regions do not overlap and are indexed by their start address, so any
+ * sub-range of a cached region is served without touching the device. A miss registers
+ * the aligned range, merged with the cached regions it overlaps.
+ *
+ * A region is pinned as long as someone other than the cache holds the returned Arc.
+ * Pinned regions are never evicted, and invalidated ones are deregistered when the last
+ * pin goes away. Owners must call `invalidate` before freeing or remapping cached memory,
+ * see `DeviceRegistry::invalidate` for the caches shared through the registry.
+ *
+ * It is thread-safe.
+ */
+class MemoryRegionCache {
+  private:
+    struct Entry {
+        Arc<MemoryRegion> mr;
+        uint64_t length;
+        std::list<uint64_t>::iterator lru_position;
+    };
+
+    Arc<ProtectionDomain> pd_;
+    MemoryRegionCacheConfig config_;
+
+    std::mutex mutex_;
+    // Keyed by the start address
+    std::map<uint64_t, Entry> entries_;
+    // Start addresses, the most recently used first
+    std::list<uint64_t> lru_;
+    uint64_t registered_bytes_;
+    uint64_t num_hits_;
+    uint64_t num_misses_;
+
+    MemoryRegionCache() = default;
+    MemoryRegionCache(const MemoryRegionCache&) = delete;
+    MemoryRegionCache& operator=(const MemoryRegionCache&) = delete;
+
+    void erase_inner(std::map<uint64_t, Entry>::iterator it);
+    void evict_inner();
+
+  public:
+    static Box<MemoryRegionCache>
+    create(Arc<ProtectionDomain> pd, const MemoryRegionCacheConfig& config = MemoryRegionCacheConfig()) noexcept(false);
+
+    /**
+     * @brief Get a region covering [addr, addr + length), registering it if it is not cached.
+     * The region stays pinned while the returned Arc is alive.
+     */
+    Arc<MemoryRegion> get(uint64_t addr, uint64_t length) noexcept(false);
+
+    /**
+     * @brief Drop every cached region overlapping [addr, addr + length). Call it before the memory is freed.
+     */
+    void invalidate(uint64_t addr, uint64_t length) noexcept;
+
+    /**
+     * @brief Drop every cached region.
+     */
+    void clear() noexcept;
+
+    inline Arc<ProtectionDomain> get_pd() const {
+        return this->pd_;
+    }
+
+    uint64_t get_registered_bytes() noexcept;
+    uint64_t get_num_hits() noexcept;
+    uint64_t get_num_misses() noexcept;
+};
+
+template<typename T>
+using Queue = moodycamel::ConcurrentQueue<T>;
+
+// A producer token pins a sub-queue to its producer, which skips the lookup of the implicit producer of the thread
+using ProducerToken = moodycamel::ProducerToken;
+using ConsumerToken = moodycamel::ConsumerToken;
+
+enum TicketKind {
+    // The receiver asks the sender to write into its buffer
+    RECV_REQUEST = 0,
+    // The sender asks the receiver to read from its buffer
+    PULL_REQUEST = 1,
+    // The receiver tells the sender that the pull of its slot is finished
+    PULL_DONE = 2,
+    // The payload of a small message follows the Ticket in the same send
+    EAGER_MESSAGE = 3,
+};
+
+struct Ticket {
+    uint32_t stream_id;
+    uint32_t key;
+    uint64_t addr;
+    uint64_t length;
     uint32_t padding_;
+    uint32_t kind;
+
+    // Completion slot of the request on the side which posts the Ticket.
+    // The sender of a PULL_REQUEST gets it back in the PULL_DONE.
+    uint32_t slot;
+
+    // Number of Tickets of the same scattered recv which follow this one, 0 for contiguous recvs.
+    // A scattered send carries the number of its segments minus one here as well.
+    uint32_t segments_left;
 
     inline std::string to_string() const {
         std::stringstream ss;
         ss << "stream_id: " << stream_id << std::hex << std::uppercase << ", length: " << length << ", addr: " << addr
-           << ", key: " << key << ", padding: " << padding_;
+           << ", key: " << key << ", padding: " << padding_ << ", kind: " << kind << ", slot: " << slot
+           << ", segments_left: " << segments_left;
         return ss.str();
     }
 };
 
-using Command = std::tuple<Ticket, Arc<std::atomic<bool>>>;
+enum SendQueueEntryKind {
+    TICKET_SEND = 0,
+    WRITE_CHUNK = 1,
+    LAST_WRITE_CHUNK = 2,
+    READ_CHUNK = 3,
+    LAST_READ_CHUNK = 4,
+    EAGER_SEND = 5,
+};
+
+/**
+ * @brief A work request in flight on the send queue, retired once a signaled
+ * work request posted at or after it completes.
+ */
+struct SendQueueEntry {
+    // Sequence number of the work request, used as its wr_id
+    uint64_t wr_id;
+    SendQueueEntryKind kind;
+
+    // Completion slot of a LAST_WRITE_CHUNK or LAST_READ_CHUNK, staging slot of an EAGER_SEND
+    uint32_t index;
+
+    // Stream and length of a write chunk, whose bytes count against the credits of the stream until it is retired
+    uint32_t stream_id;
+    uint32_t length;
+};
+
+struct PendingWrite {
+    uint32_t stream_id;
+    uint32_t slot;
+    uint32_t lkey;
+    uint32_t rkey;
+    uint64_t laddr;
+    uint64_t raddr;
+    uint64_t remaining;
+
+    // A vectored write walks the local and remote segments of its slot instead of laddr and raddr
+    bool vectored;
+    uint32_t local_index;
+    uint32_t remote_index;
+    uint64_t local_offset;
+    uint64_t remote_offset;
+};
+
+// A pull reads from raddr into laddr, which needs the same bookkeeping as a write
+using PendingRead = PendingWrite;
+
+// The second element is the index of the completion slot of the request
+using Command = std::tuple<Ticket, uint32_t>;
+
+/**
+ * @brief One member of a `send_batch`/`recv_batch`.
+ */
+struct BatchEntry {
+    uint32_t stream_id;
+    uint64_t addr;
+    uint64_t length;
+
+    // lkey of a send, rkey of a recv
+    uint32_t key;
+};
+
+/**
+ * @brief One contiguous piece of a `sendv`/`recvv` buffer.
+ */
+struct IoSegment {
+    uint64_t addr;
+    uint64_t length;
+
+    // lkey of a send, rkey of a recv
+    uint32_t key;
+};
+
+/**
+ * @brief A single-threaded FIFO ring buffer with a power-of-two capacity.
+ *
+ * The capacity only doubles when the ring overflows, so it stays fixed once the
+ * workload reaches its steady state. A ring constructed without a capacity does not
+ * allocate until its first push.
+ */
+template<typename T>
+class RingBuffer {
+  private:
+    std::vector<T> buffer_;
+    uint64_t head_;
+    uint64_t size_;
+
+    void grow() {
+        std::vector<T> buffer(this->buffer_.empty() ? kInitialCapacity : this->buffer_.size() * 2);
+        for (uint64_t i = 0; i < this->size_; ++i) {
+            buffer[i] = std::move(this->buffer_[(this->head_ + i) & (this->buffer_.size() - 1)]);
+        }
+        this->buffer_ = std::move(buffer);
+        this->head_ = 0;
+    }
+
+  public:
+    // Capacity of the first allocation of a ring constructed empty
+    static constexpr uint64_t kInitialCapacity = 16;
+
+    explicit RingBuffer(uint64_t capacity = 0) : head_(0), size_(0) {
+        if (capacity == 0) {
+            return;
+        }
+        uint64_t rounded_capacity = 1;
+        while (rounded_capacity < capacity) {
+            rounded_capacity <<= 1;
+        }
+        this->buffer_ = std::vector<T>(rounded_capacity);
+    }
+
+    inline bool empty() const {
+        return this->size_ == 0;
+    }
+
+    inline uint64_t size() const {
+        return this->size_;
+    }
+
+    inline uint64_t capacity() const {
+        return this->buffer_.size();
+    }
+
+    inline T& front() {
+        assert(this->size_ > 0);
+        return this->buffer_[this->head_];
+    }
+
+    inline const T& front() const {
+        assert(this->size_ > 0);
+        return this->buffer_[this->head_];
+    }
+
+    inline void pop() {
+        assert(this->size_ > 0);
+        this->head_ = (this->head_ + 1) & (this->buffer_.size() - 1);
+        this->size_--;
+    }
+
+    inline void push(const T& value) {
+        if (this->size_ == this->buffer_.size()) {
+            this->grow();
+        }
+        this->buffer_[(this->head_ + this->size_) & (this->buffer_.size() - 1)] = value;
+        this->size_++;
+    }
+};
 
 template<typename T>
-using MultiMap = std::map<uint32_t, std::queue<T>>;
+constexpr uint64_t RingBuffer<T>::kInitialCapacity;
+
+/**
+ * @brief How the writes of a stream share the send queue with the other streams of a context.
+ *
+ * Streams of a lower priority only write while no stream of a higher priority has a write
+ * it may post. Streams of the same priority share the send queue by deficit round robin, each
+ * visit lets a stream write up to `weight` times the scheduling quantum of the context.
+ */
+struct StreamQos {
+    // 0 is served first, must be smaller than StreamTable::kNumPriorities
+    uint32_t priority = StreamQos::kDefaultPriority;
+
+    // Share of the stream among the streams of its priority, must be positive
+    uint32_t weight = 1;
+
+    // The stream stops posting writes once this many of its bytes are posted and not yet completed,
+    // 0 means no limit. At least one chunk is always allowed, so a limit below the chunk size
+    // serializes the chunks of the stream.
+    uint64_t max_outstanding_bytes = 0;
+
+    static constexpr uint32_t kDefaultPriority = 1;
+};
+
+// An eager message which arrived before its recv, its payload stays in the recv slot `wr_id`
+struct HeldEagerMessage {
+    uint64_t wr_id;
+    uint64_t length;
+};
+
+struct StreamState {
+    // Tickets posted by the remote side to receive from this stream
+    RingBuffer<Ticket> remote_recv_requests;
+
+    // Local send requests waiting for a remote recv request
+    RingBuffer<Command> local_send_requests;
+
+    // Completion slots of local recv requests, completed in the order of the imm data
+    RingBuffer<uint32_t> local_recv_slots;
+
+    // Buffers advertised by the remote side to be pulled from this stream
+    RingBuffer<Ticket> remote_pull_requests;
+
+    // Local recv requests waiting for a remote pull request
+    RingBuffer<Command> local_pull_recvs;
+
+    // Local recv requests of eager messages, and eager messages which arrived before their recv
+    RingBuffer<Command> local_eager_recvs;
+    RingBuffer<HeldEagerMessage> unexpected_eager_messages;
+
+    // Whether the stream is linked in the ready list
+    bool ready = false;
+
+    // Matched writes, which must land in this order as the receiver completes its recvs in imm order
+    RingBuffer<PendingWrite> pending_writes;
+
+    StreamQos qos;
+
+    // Bytes the stream may still write in its current turn of deficit round robin
+    uint64_t deficit = 0;
+
+    // Whether the quantum of the current turn has been granted
+    bool in_turn = false;
+
+    // Bytes of write chunks which are posted and not yet retired
+    uint64_t outstanding_bytes = 0;
+
+    // Whether the stream is linked in the active list of its priority
+    bool active = false;
+};
+
+/**
+ * @brief A table of per-stream queues for sparse stream ids.
+ *
+ * Every stream id seen is given a dense index into the stream states by an open-addressing
+ * hash with linear probing, so the memory grows with the number of streams in use rather than
+ * with the largest stream id. Streams which have both a remote recv request and a local send
+ * request, or both a remote pull request and a local pull recv, are linked in a FIFO ready list,
+ * so matching only visits the streams which can make progress.
+ *
+ * SAFETY: a reference returned by `get` is invalidated by the first use of a new stream id.
+ */
+class StreamTable {
+  public:
+    static constexpr uint32_t kNumPriorities = 4;
+
+  private:
+    static constexpr uint32_t kEmptySlot = UINT32_MAX;
+    static constexpr uint64_t kInitialSlots = 16;
+
+    std::vector<StreamState> streams_;
+
+    // Hash slots, an index of streams_ or kEmptySlot, and the stream id held by each slot
+    std::vector<uint32_t> slot_indices_;
+    std::vector<uint32_t> slot_stream_ids_;
+
+    RingBuffer<uint32_t> ready_streams_;
+
+    // Streams with a matched write they may post, one FIFO list per priority
+    std::array<RingBuffer<uint32_t>, kNumPriorities> active_streams_;
+
+    inline uint64_t probe_inner(uint32_t stream_id) const {
+        const uint64_t mask = this->slot_indices_.size() - 1;
+        uint64_t slot = ((uint64_t(stream_id) * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+        while (this->slot_indices_[slot] != kEmptySlot && this->slot_stream_ids_[slot] != stream_id) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    void rehash_inner(uint64_t num_slots) {
+        std::vector<uint32_t> slot_indices(num_slots, kEmptySlot);
+        std::vector<uint32_t> slot_stream_ids(num_slots, 0);
+        this->slot_indices_.swap(slot_indices);
+        this->slot_stream_ids_.swap(slot_stream_ids);
+        for (uint64_t i = 0; i < slot_indices.size(); ++i) {
+            if (slot_indices[i] != kEmptySlot) {
+                const uint64_t slot = this->probe_inner(slot_stream_ids[i]);
+                this->slot_indices_[slot] = slot_indices[i];
+                this->slot_stream_ids_[slot] = slot_stream_ids[i];
+            }
+        }
+    }
+
+    inline void link_if_ready(uint32_t stream_id, StreamState& stream) {
+        if (!stream.ready && (StreamTable::has_push(stream) || StreamTable::has_pull(stream))) {
+            stream.ready = true;
+            this->ready_streams_.push(stream_id);
+        }
+    }
+
+    inline void activate_if_writable(uint32_t stream_id, StreamState& stream) {
+        if (!stream.active && StreamTable::has_write(stream)) {
+            stream.active = true;
+            this->active_streams_[stream.qos.priority].push(stream_id);
+        }
+    }
+
+  public:
+    // A scattered remote recv is only matchable once all of its Tickets have arrived
+    static inline bool has_push(const StreamState& stream) {
+        return !stream.remote_recv_requests.empty()
+            && stream.remote_recv_requests.size() > stream.remote_recv_requests.front().segments_left
+            && !stream.local_send_requests.empty();
+    }
+
+    static inline bool has_pull(const StreamState& stream) {
+        return !stream.remote_pull_requests.empty() && !stream.local_pull_recvs.empty();
+    }
+
+    static inline bool has_credit(const StreamState& stream) {
+        return stream.qos.max_outstanding_bytes == 0 || stream.outstanding_bytes < stream.qos.max_outstanding_bytes;
+    }
+
+    static inline bool has_write(const StreamState& stream) {
+        return !stream.pending_writes.empty() && StreamTable::has_credit(stream);
+    }
+
+    /**
+     * @brief The state of a stream, created on first use.
+     */
+    inline StreamState& get(uint32_t stream_id) {
+        if (!this->slot_indices_.empty()) {
+            const uint32_t index = this->slot_indices_[this->probe_inner(stream_id)];
+            if (index != kEmptySlot) {
+                return this->streams_[index];
+            }
+        }
+
+        // Keep the load factor at most 1/2, so probe sequences stay short
+        if (2 * (this->streams_.size() + 1) > this->slot_indices_.size()) {
+            this->rehash_inner(std::max(kInitialSlots, 2 * this->slot_indices_.size()));
+        }
+        const uint64_t slot = this->probe_inner(stream_id);
+        this->slot_indices_[slot] = uint32_t(this->streams_.size());
+        this->slot_stream_ids_[slot] = stream_id;
+        this->streams_.emplace_back();
+        return this->streams_.back();
+    }
+
+    inline uint64_t get_num_streams() const {
+        return this->streams_.size();
+    }
+
+    inline void push_remote_recv_request(const Ticket& ticket) {
+        StreamState& stream = this->get(ticket.stream_id);
+        stream.remote_recv_requests.push(ticket);
+        this->link_if_ready(ticket.stream_id, stream);
+    }
+
+    inline void push_local_send_request(const Command& command) {
+        const uint32_t stream_id = std::get<0>(command).stream_id;
+        StreamState& stream = this->get(stream_id);
+        stream.local_send_requests.push(command);
+        this->link_if_ready(stream_id, stream);
+    }
+
+    inline void push_remote_pull_request(const Ticket& ticket) {
+        StreamState& stream = this->get(ticket.stream_id);
+        stream.remote_pull_requests.push(ticket);
+        this->link_if_ready(ticket.stream_id, stream);
+    }
+
+    inline void push_local_pull_recv(const Command& command) {
+        const uint32_t stream_id = std::get<0>(command).stream_id;
+        StreamState& stream = this->get(stream_id);
+        stream.local_pull_recvs.push(command);
+        this->link_if_ready(stream_id, stream);
+    }
+
+    /**
+     * @brief Pop the first ready stream. The caller must hand it back with `unlink_or_requeue`
+     * after consuming its requests.
+     */
+    inline bool pop_ready(uint32_t& stream_id) {
+        if (this->ready_streams_.empty()) {
+            return false;
+        }
+        stream_id = this->ready_streams_.front();
+        this->ready_streams_.pop();
+        return true;
+    }
+
+    inline void unlink_or_requeue(uint32_t stream_id) {
+        StreamState& stream = this->get(stream_id);
+        stream.ready = false;
+        this->link_if_ready(stream_id, stream);
+    }
+
+    inline void push_pending_write(const PendingWrite& pending_write) {
+        StreamState& stream = this->get(pending_write.stream_id);
+        stream.pending_writes.push(pending_write);
+        this->activate_if_writable(pending_write.stream_id, stream);
+    }
+
+    /**
+     * @brief Charge the bytes of a posted write chunk against the credits of its stream.
+     */
+    inline void acquire_credit(uint32_t stream_id, uint64_t length) {
+        this->get(stream_id).outstanding_bytes += length;
+    }
+
+    /**
+     * @brief Give back the credits of a retired write chunk, which may reactivate its stream.
+     */
+    inline void release_credit(uint32_t stream_id, uint64_t length) {
+        StreamState& stream = this->get(stream_id);
+        assert(stream.outstanding_bytes >= length);
+        stream.outstanding_bytes -= length;
+        this->activate_if_writable(stream_id, stream);
+    }
+
+    /**
+     * @brief A new priority takes effect the next time the stream is activated, a new weight on its next turn.
+     */
+    inline void set_qos(uint32_t stream_id, const StreamQos& qos) {
+        assert(qos.priority < kNumPriorities && qos.weight > 0);
+        StreamState& stream = this->get(stream_id);
+        stream.qos = qos;
+        this->activate_if_writable(stream_id, stream);
+    }
+
+    /**
+     * @brief Pop the first active stream of the highest priority. The caller must hand it back
+     * with `deactivate_or_requeue` after posting its writes.
+     */
+    inline bool pop_active(uint32_t& stream_id) {
+        for (auto& active_streams : this->active_streams_) {
+            if (!active_streams.empty()) {
+                stream_id = active_streams.front();
+                active_streams.pop();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    inline void deactivate_or_requeue(uint32_t stream_id) {
+        StreamState& stream = this->get(stream_id);
+        stream.active = false;
+        if (stream.pending_writes.empty()) {
+            // An idle stream does not keep its deficit, as in deficit round robin
+            stream.deficit = 0;
+            stream.in_turn = false;
+        }
+        this->activate_if_writable(stream_id, stream);
+    }
+};
+
+/**
+ * @brief A trivially copyable reference to a completion slot.
+ *
+ * The operation is finished once the generation of the slot moves past the one
+ * recorded when the slot was acquired. A Handle must not outlive the TcclContext
+ * which issued it.
+ */
+struct alignas(64) CompletionSlot {
+    // Doubles as the futex word of blocking waiters
+    std::atomic<uint32_t> generation;
+    std::atomic<uint32_t> waiters;
+    std::atomic<uint32_t> next_free;
+};
+
+/**
+ * @brief A store of `value` into `*flag` issued when a request finishes, right before its handle finishes.
+ * The flag may live in host memory mapped into a GPU, so GPU work can wait for the request.
+ */
+struct CompletionSignal {
+    uint32_t* flag;
+    uint32_t value;
+};
 
 class Handle {
   private:
-    Arc<std::atomic<bool>> finished_;
+    CompletionSlot* slot_;
+    uint32_t expected_generation_;
 
   public:
-    Handle() : finished_(std::make_shared<std::atomic<bool>>(true)) {}
+    static constexpr uint64_t kDefaultSpinCount = 4096;
 
-    Handle(const Arc<std::atomic<bool>>& finished) : finished_(finished) {}
+    Handle() : slot_(nullptr), expected_generation_(0) {}
+
+    Handle(CompletionSlot* slot, uint32_t expected_generation) :
+        slot_(slot),
+        expected_generation_(expected_generation) {}
 
     /**
      * @brief Check if the send/recv is finished.
      */
     inline bool is_finished() const {
-        return this->finished_->load(std::memory_order_relaxed);
+        return this->slot_ == nullptr
+            || this->slot_->generation.load(std::memory_order_acquire) != this->expected_generation_;
     }
 
     /**
@@ -362,60 +1580,371 @@ class Handle {
             std::this_thread::yield();
         }
     }
+
+    /**
+     * @brief Spin for a while, then sleep on a futex until the operation is finished.
+     *
+     * @param spin_count number of checks before going to sleep
+     */
+    void wait_blocking(uint64_t spin_count = kDefaultSpinCount) const;
+};
+
+static_assert(std::is_trivially_copyable<Handle>::value, "Handle must be trivially copyable");
+
+enum PollingMode {
+    // Spin on the CQs forever
+    BUSY_POLLING = 0,
+
+    // Spin on the CQs for `spin_window_us` after the last progress, then block on the
+    // completion channel until a completion arrives or a request is submitted
+    ADAPTIVE_POLLING = 1,
+};
+
+struct TcclContextConfig {
+    static constexpr uint64_t kDefaultChunkSize = 256 * 1024;
+    static constexpr uint64_t kMaxChunkSize = 1ull << 30;
+
+    static constexpr uint32_t kDefaultMaxInflightRequests = 16384;
+
+    static constexpr uint32_t kMaxEagerThreshold = 64 * 1024;
+
+    // Large sends are fragmented into chunks of this size which are written in a pipelined way.
+    // Only the last chunk carries the immediate data, so the receiver is signalled exactly once.
+    uint64_t chunk_size = kDefaultChunkSize;
+
+    // Capacity of the completion slab shared by sends and recvs. Submitting more requests
+    // than this blocks the caller until earlier ones complete. The contexts of a TcclContextGroup
+    // share the slab of the group, so the limit applies to the whole group.
+    uint32_t max_inflight_requests = kDefaultMaxInflightRequests;
+
+    // Only every signal_interval-th work request on the send queue is signaled, the last one
+    // of every posted batch is signaled as well. A completion retires all the work requests
+    // posted before it, so 1 means a completion for every work request.
+    uint64_t signal_interval = 1;
+
+    // Data chunks up to this size are written with IBV_SEND_INLINE, which saves the NIC a DMA
+    // read of the payload. The CPU reads the payload, so only enable this for host memory.
+    // It must not exceed the max_inline_data of the QP, 0 disables it.
+    uint32_t inline_threshold = 0;
+
+    // Messages up to this size skip the rendezvous, the sender copies them right behind a Ticket
+    // into the recv ring of the remote side, and the receiver copies them out. The CPU touches
+    // both buffers, so they must be host memory. Both sides must agree on it, `connect_queue_pairs`
+    // checks that they do. 0 disables it.
+    // A message which arrives before its recv keeps its recv slot until the recv is posted, so a
+    // sender running ahead is held back by RNR once the recv ring is full of such messages.
+    uint32_t eager_threshold = 0;
+
+    // Polling mode of the background polling thread
+    PollingMode polling_mode = PollingMode::BUSY_POLLING;
+
+    // How long the background polling thread keeps spinning without progress in ADAPTIVE_POLLING
+    uint64_t spin_window_us = 1000;
+
+    // Bytes a stream of weight 1 may write per turn when streams of one priority share the send queue
+    // by deficit round robin, see StreamQos. A turn ends early once the stream runs out of writes.
+    uint64_t scheduling_quantum = kDefaultChunkSize;
+
+    // Restrict the background polling thread to the CPUs of the NUMA node of the RNIC, and place
+    // the host recv ring and staging buffers on that node, so polling never crosses the CPU
+    // interconnect. Nothing is bound if the node of the RNIC is unknown.
+    bool bind_numa_node = false;
+};
+
+/**
+ * @brief A fixed-capacity slab of cache-line-padded completion slots.
+ *
+ * Free slots form a lock-free stack whose head is tagged to avoid ABA. Slots are
+ * acquired by the submitting threads and completed by the polling thread, so nothing
+ * touches the allocator after construction.
+ */
+class CompletionSlab {
+  private:
+    static constexpr uint32_t kNil = UINT32_MAX;
+
+    CompletionSlot* slots_;
+    uint32_t capacity_;
+
+    // Lower 32 bits: index of the first free slot, upper 32 bits: ABA tag
+    std::atomic<uint64_t> free_head_;
+
+    void release(uint32_t index) noexcept;
+
+  public:
+    CompletionSlab() = delete;
+    CompletionSlab(const CompletionSlab&) = delete;
+    CompletionSlab& operator=(const CompletionSlab&) = delete;
+
+    explicit CompletionSlab(uint32_t capacity) noexcept(false);
+    ~CompletionSlab();
+
+    inline uint32_t get_capacity() const {
+        return this->capacity_;
+    }
+
+    /**
+     * @brief Acquire a free slot, yield until one is completed if the slab is exhausted.
+     */
+    uint32_t acquire() noexcept;
+
+    /**
+     * @brief Try to acquire a free slot, return UINT32_MAX if the slab is exhausted.
+     */
+    uint32_t try_acquire() noexcept;
+
+    /**
+     * @brief Finish the operation of the slot and return the slot to the free list.
+     */
+    void complete(uint32_t index) noexcept;
+
+    inline Handle get_handle(uint32_t index) const {
+        CompletionSlot* slot = &this->slots_[index];
+        return Handle(slot, slot->generation.load(std::memory_order_relaxed));
+    }
+};
+
+#ifdef ENABLE_STATS
+struct SlotStats {
+    uint64_t submit_ns;
+    uint64_t match_ns;
+    uint64_t length;
+    uint32_t stream_id;
+    bool is_send;
+};
+#endif
+
+/**
+ * @brief A CompletionSlab together with the side state of the request in every slot.
+ *
+ * A standalone TcclContext owns one. The contexts of a TcclContextGroup share the one of the
+ * group, so the slots of a group do not grow with the number of peers. Slot indices are only
+ * meaningful on the side which acquired them, so sharing them needs no coordination with peers.
+ */
+struct RequestSlots {
+    static constexpr uint32_t kNoGroup = UINT32_MAX;
+
+    struct State {
+        // Region pinned by the in-flight request
+        Arc<MemoryRegion> pin;
+
+        // Stored by the completion of the slot, a null flag for requests without a signal
+        CompletionSignal signal {nullptr, 0};
+
+        // Group slot of the batch the request belongs to, kNoGroup for single requests
+        uint32_t group = kNoGroup;
+
+        // Number of unfinished members if this is the group slot of a batch
+        uint32_t group_remaining = 0;
+
+        // Completion slot of the remote sender if this is a local pull recv
+        uint32_t pull_peer_slot = 0;
+
+        // Local segments of a vectored request, written by the submitter and published by the enqueue.
+        // The remote segments a vectored send writes into are collected by the polling thread.
+        std::vector<IoSegment> segments;
+        std::vector<IoSegment> remote_segments;
+
+#ifdef ENABLE_STATS
+        // Written by the submitter and published by the enqueue like the pin
+        SlotStats stats;
+#endif
+    };
+
+    CompletionSlab slab;
+    std::vector<State> states;
+
+    explicit RequestSlots(uint32_t capacity) noexcept(false) : slab(capacity), states(capacity) {}
 };
 
+class PollingEngine;
+
+class TcclContextGroup;
+
+class TcclSubmitter;
+
 class TcclContext {
+    friend class PollingEngine;
+    friend class TcclContextGroup;
+    friend class TcclSubmitter;
+
   private:
     uint64_t dop_;
+    TcclContextConfig config_;
 
     Arc<RcQueuePair> qp_;
 
     std::vector<ibv_wc> send_ibv_wc_buffer_;
-    std::vector<WorkCompletion> polled_send_wcs_;
 
     std::vector<ibv_wc> recv_ibv_wc_buffer_;
     std::vector<WorkCompletion> polled_recv_wcs_;
 
+    // Scratch of the poll rounds, sized to dop once so that polling never allocates
+    std::vector<Command> send_round_commands_;
+    std::vector<Ticket> send_round_tickets_;
+    std::vector<Command> recv_round_commands_;
+    std::vector<Ticket> recv_round_tickets_;
+
+    // Completion slots of the requests, shared with the other contexts of a TcclContextGroup
+    Arc<RequestSlots> slots_;
+
+    // Keyless requests pin their regions of this cache in their slots
+    Arc<MemoryRegionCache> memory_region_cache_;
+
     Queue<Command> send_request_command_queue_;
     Queue<Command> recv_request_command_queue_;
 
-    Box<MemoryRegion> host_send_buffer_;
-    uint64_t send_buffer_addr_;
-    uint32_t send_buffer_lkey_;
+    // Pull recvs are matched locally against the pull requests of the remote side
+    Queue<Command> pull_recv_command_queue_;
+
+    // Only the polling thread dequeues, so it keeps a consumer token for every queue
+    Box<ConsumerToken> send_request_consumer_token_;
+    Box<ConsumerToken> recv_request_consumer_token_;
+    Box<ConsumerToken> pull_recv_consumer_token_;
+
+    // QoS of the streams, applied by the polling thread which owns the stream table
+    Queue<std::tuple<uint32_t, StreamQos>> stream_qos_queue_;
 
+    // Tickets of the send batch, they are inlined so they only need to live until the batch is posted
+    std::vector<Ticket> inline_tickets_;
+    uint64_t num_inline_tickets_;
+
+    // Every recv slot holds a Ticket and the payload of an eager message. In a TcclContextGroup
+    // the address and lkey are the ones of the shared ring.
     Box<MemoryRegion> host_recv_buffer_;
     uint64_t recv_buffer_addr_;
     uint32_t recv_buffer_lkey_;
+    uint64_t recv_slot_size_;
+
+    // Where recv slots held by unexpected eager messages are reposted, recv_batch_ or the one of the group
+    RecvWorkRequestBatch* recv_repost_batch_;
 
+    // Eager messages are staged here until their send completes
+    Box<MemoryRegion> eager_send_buffer_;
+    RingBuffer<uint32_t> free_eager_send_slots_;
+    std::queue<Command> pending_eager_send_queue_;
+
+    // Filled and drained by the polling thread alone
     Queue<Ticket> local_recv_request_queue_;
     Queue<Ticket> remote_recv_request_queue_;
+    Box<ProducerToken> local_recv_request_producer_token_;
+    Box<ProducerToken> remote_recv_request_producer_token_;
+    Box<ConsumerToken> local_recv_request_consumer_token_;
+    Box<ConsumerToken> remote_recv_request_consumer_token_;
 
     // Used in send_one_round
     std::queue<Ticket> pending_local_recv_request_queue_;
-    MultiMap<Ticket> pending_remote_recv_request_map_;
-    MultiMap<Ticket> pending_local_send_request_map_;
-    MultiMap<rdma_util::Arc<std::atomic<bool>>> pending_local_send_flag_map_;
-    std::queue<uint64_t> free_post_send_send_slots_;
+    StreamTable stream_table_;
+    std::queue<PendingRead> pending_read_queue_;
+
+    SendWorkRequestBatch send_batch_;
+    uint32_t max_gather_sges_;
+    std::vector<ibv_sge> gather_sges_;
+    RingBuffer<SendQueueEntry> inflight_send_queue_;
+    uint64_t next_send_wr_id_;
+    uint64_t unsignaled_count_;
     uint64_t post_send_write_slot_available_;
     uint64_t post_send_send_slot_available_;
 
     // Used in recv_one_round
     uint64_t pending_recv_request_count_;
-    MultiMap<rdma_util::Arc<std::atomic<bool>>> pending_local_recv_request_map_;
+    RecvWorkRequestBatch recv_batch_;
+
+    // The QP takes its recvs from a shared receive queue, whose CQ is polled by a TcclContextGroup
+    bool shared_recv_;
+
+    // NUMA node the host buffers and the polling thread are bound to, -1 if they are not bound
+    int numa_node_;
+
+#ifdef ENABLE_STATS
+    TcclContextStats stats_;
+
+    inline void record_submit_inner(uint32_t slot, uint32_t stream_id, uint64_t length, bool is_send) {
+        this->slots_->states[slot].stats = {stats_now_ns(), 0, length, stream_id, is_send};
+    }
+
+    inline void record_transfer_inner(uint32_t slot) {
+        this->stats_.transfer_latency.record(stats_now_ns() - this->slots_->states[slot].stats.match_ns);
+    }
+#endif
 
     // Background polling
     bool background_polling_;
     std::thread polling_thread_;
     std::atomic<bool> polling_stopped_;
 
+    // Used by ADAPTIVE_POLLING to wake up the sleeping polling thread on submissions
+    std::atomic<bool> polling_sleeping_;
+    int wakeup_fd_ = -1;
+
+    // Used by PollingEngine
+    std::atomic<bool> engine_registered_ {false};
+    std::atomic<bool> engine_claimed_ {false};
+    std::atomic<bool> engine_busy_ {false};
+
     TcclContext(const TcclContext&) = delete;
     TcclContext& operator=(const TcclContext&) = delete;
 
-    void poll_both_inner() noexcept(false);
-    void poll_send_one_round_inner() noexcept(false);
-    void poll_recv_one_round_inner() noexcept(false);
+    bool poll_both_inner() noexcept(false);
+    bool poll_send_one_round_inner() noexcept(false);
+    bool poll_recv_one_round_inner() noexcept(false);
+    void polling_loop_inner() noexcept(false);
+    void sleep_until_event_inner() noexcept(false);
+    void wake_up_polling_thread() noexcept;
+    bool try_poll_both_inner() noexcept(false);
+    void post_pending_writes_inner() noexcept(false);
+    uint64_t post_write_chunk_inner(PendingWrite& pending_write) noexcept(false);
+    uint64_t post_vectored_write_inner(PendingWrite& pending_write) noexcept(false);
+    void post_pending_reads_inner() noexcept(false);
+    void post_eager_sends_inner() noexcept(false);
+    void post_eager_recv_inner(const Command& command) noexcept(false);
+    bool deliver_eager_inner(const Ticket& header, const char* payload, uint64_t wr_id) noexcept(false);
+    // Returns whether the recv slot can be reposted, an unexpected eager message holds on to it
+    bool handle_recv_completion_inner(const WorkCompletion& wc, const char* recv_slot) noexcept(false);
+    void flush_send_batch_inner() noexcept(false);
+    uint64_t track_send_inner(
+        SendQueueEntryKind kind,
+        uint32_t index,
+        bool& signaled,
+        uint32_t stream_id = 0,
+        uint32_t length = 0
+    );
+    void complete_slot_inner(uint32_t slot);
+    Handle submit_inner(
+        Queue<Command>& queue,
+        ProducerToken* token,
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t key,
+        uint32_t padding,
+        TicketKind kind,
+        Arc<MemoryRegion> pin,
+        const CompletionSignal& signal = CompletionSignal {nullptr, 0}
+    ) noexcept(false);
+    Handle submit_batch_inner(
+        Queue<Command>& queue,
+        ProducerToken* token,
+        const BatchEntry* entries,
+        uint64_t count
+    ) noexcept(false);
+    Handle submit_vectored_inner(
+        Queue<Command>& queue,
+        ProducerToken* token,
+        uint32_t stream_id,
+        const IoSegment* segments,
+        uint64_t count
+    ) noexcept(false);
+    void retire_sends_inner(uint64_t wr_id);
 
   public:
+    static constexpr uint32_t kNoGroup = RequestSlots::kNoGroup;
+
+    // Members of a batch are enqueued in chunks of this size
+    static constexpr uint64_t kBatchChunkSize = 64;
+
+    // SGEs per send work request requested by get_queue_pair_config, a vectored write gathers
+    // from up to max_send_sge local segments of the QP
+    static constexpr uint32_t kGatherSges = 4;
     ~TcclContext();
 
     inline uint64_t get_dop() const {
@@ -428,6 +1957,7 @@ class TcclContext {
      */
     inline void poll_both() noexcept(false) {
         assert(this->background_polling_ == false);
+        assert(this->engine_registered_.load(std::memory_order_relaxed) == false);
         this->poll_recv_one_round_inner();
         this->poll_send_one_round_inner();
     }
@@ -438,6 +1968,7 @@ class TcclContext {
      */
     inline void poll_send_one_round() noexcept(false) {
         assert(this->background_polling_ == false);
+        assert(this->engine_registered_.load(std::memory_order_relaxed) == false);
         this->poll_send_one_round_inner();
     }
 
@@ -447,17 +1978,556 @@ class TcclContext {
      */
     inline void poll_recv_one_round() noexcept(false) {
         assert(this->background_polling_ == false);
+        assert(this->engine_registered_.load(std::memory_order_relaxed) == false);
         this->poll_recv_one_round_inner();
     }
 
-    static Arc<TcclContext>
-    create(Box<RcQueuePair> qp, bool spawn_polling_thread = true, uint64_t dop = 16) noexcept(false);
-    [[nodiscard]] Handle send(uint32_t stream_id, uint64_t addr, uint32_t length, uint32_t lkey, uint32_t padding = 0);
-    [[nodiscard]] Handle recv(uint32_t stream_id, uint64_t addr, uint32_t length, uint32_t rkey, uint32_t padding = 0);
+    inline const TcclContextConfig& get_config() const {
+        return this->config_;
+    }
+
+    /**
+     * @brief NUMA node of the RNIC if `bind_numa_node` is set and the node is known, -1 otherwise.
+     */
+    inline int get_numa_node() const {
+        return this->numa_node_;
+    }
+
+    /**
+     * @brief A snapshot of the counters and latency histograms of the context.
+     * Everything is zero and `enabled` is false unless the library is built with ENABLE_STATS.
+     */
+    TcclContextStatsSnapshot get_stats() noexcept(false);
+
+    inline bool is_eager(uint64_t length) const {
+        return length <= this->config_.eager_threshold && this->config_.eager_threshold > 0;
+    }
+
+    /**
+     * @brief Set the priority, weight and credit limit of the writes of a stream on this side.
+     * It is applied by the polling thread, requests of the stream which are already matched
+     * may still be written with the previous QoS. Thread-safe.
+     */
+    void set_stream_qos(uint32_t stream_id, const StreamQos& qos) noexcept(false);
+
+    /**
+     * @brief Queue sizes an RcQueuePair needs to back a TcclContext with the given dop.
+     * Up to dop writes and dop Ticket sends are in flight, and 2 * dop Ticket recvs are posted.
+     */
+    static QueuePairConfig get_queue_pair_config(uint64_t dop) noexcept;
+
+    /**
+     * @brief Like the one above, plus a completion channel if the polling mode of `config` blocks on one.
+     */
+    static QueuePairConfig get_queue_pair_config(uint64_t dop, const TcclContextConfig& config) noexcept;
+
+    static Arc<TcclContext> create(
+        Box<RcQueuePair> qp,
+        bool spawn_polling_thread = true,
+        uint64_t dop = 16,
+        const TcclContextConfig& config = TcclContextConfig()
+    ) noexcept(false);
+    [[nodiscard]] Handle send(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey, uint32_t padding = 0);
+    [[nodiscard]] Handle recv(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey, uint32_t padding = 0);
+
+    /**
+     * @brief Send a buffer which is registered on demand by the memory region cache of the context.
+     * The region stays pinned until the send is finished.
+     */
+    [[nodiscard]] Handle send(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false);
+
+    /**
+     * @brief Recv into a buffer which is registered on demand by the memory region cache of the context.
+     * The region stays pinned until the recv is finished.
+     */
+    [[nodiscard]] Handle recv(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false);
+
+    /**
+     * @brief `send` which also stores `value` into `*flag` once the send is finished.
+     *
+     * The store is issued by the polling thread with release semantics before the handle
+     * finishes, so a CUDA stream can wait for the send on a flag in mapped host memory.
+     * It is safe to call from a CUDA host function, as it never calls into CUDA.
+     */
+    [[nodiscard]] Handle send_signaled(
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t lkey,
+        uint32_t* flag,
+        uint32_t value
+    ) noexcept(false);
+
+    /**
+     * @brief `recv` which also stores `value` into `*flag` once the message has landed, see `send_signaled`.
+     */
+    [[nodiscard]] Handle recv_signaled(
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t rkey,
+        uint32_t* flag,
+        uint32_t value
+    ) noexcept(false);
+
+    /**
+     * @brief Submit a group of sends with a single bulk enqueue per chunk of the batch.
+     *
+     * Every member is matched on its own stream like a plain `send`, the returned handle
+     * finishes once all of them are finished, in whichever order that happens. Besides one
+     * slot per member the batch holds one group slot, so `count` must be smaller than
+     * `max_inflight_requests`.
+     */
+    [[nodiscard]] Handle send_batch(const BatchEntry* entries, uint64_t count) noexcept(false);
+
+    /**
+     * @brief Submit a group of recvs, see `send_batch`.
+     */
+    [[nodiscard]] Handle recv_batch(const BatchEntry* entries, uint64_t count) noexcept(false);
+
+    inline Handle send_batch(const std::vector<BatchEntry>& entries) noexcept(false) {
+        return this->send_batch(entries.data(), entries.size());
+    }
+
+    inline Handle recv_batch(const std::vector<BatchEntry>& entries) noexcept(false) {
+        return this->recv_batch(entries.data(), entries.size());
+    }
+
+    /**
+     * @brief Send a message gathered from several local buffers, without packing it first.
+     *
+     * The message is matched like a plain `send` of the total length, so the remote side may
+     * recv it with a `recv` or a `recvv` with any split of the same total. A write gathers up to
+     * max_send_sge local segments into one remote segment at a time. Scattered messages are never
+     * eager, so the total must exceed the eager threshold.
+     */
+    [[nodiscard]] Handle sendv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false);
+
+    /**
+     * @brief Recv a message into several local buffers, which are advertised as one Ticket each.
+     * See `sendv`.
+     */
+    [[nodiscard]] Handle recvv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false);
+
+    inline Handle sendv(uint32_t stream_id, const std::vector<IoSegment>& segments) noexcept(false) {
+        return this->sendv(stream_id, segments.data(), segments.size());
+    }
+
+    inline Handle recvv(uint32_t stream_id, const std::vector<IoSegment>& segments) noexcept(false) {
+        return this->recvv(stream_id, segments.data(), segments.size());
+    }
+
+    /**
+     * @brief Advertise a buffer which the remote side pulls with RDMA reads into its `recv_pull` buffer.
+     *
+     * Nothing is written by this side, so the receiver decides when and in which order the
+     * buffers of its senders land. The handle finishes once the receiver has read the whole
+     * buffer. Both sides of a stream must use the pull variants for the same message.
+     *
+     * @param rkey remote key of the buffer, the region needs IBV_ACCESS_REMOTE_READ
+     */
+    [[nodiscard]] Handle send_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey) noexcept(false);
+
+    /**
+     * @brief Pull the buffer of the next `send_pull` of the remote side on this stream into a local buffer.
+     */
+    [[nodiscard]] Handle recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey) noexcept(false);
+
+    /**
+     * @brief `send_pull` with a buffer registered on demand by the memory region cache of the context.
+     */
+    [[nodiscard]] Handle send_pull(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false);
+
+    /**
+     * @brief `recv_pull` with a buffer registered on demand by the memory region cache of the context.
+     */
+    [[nodiscard]] Handle recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false);
+
+    /**
+     * @brief The memory region cache used by the send/recv overloads without keys, shared by every
+     * context whose QP is in the same ProtectionDomain. Call its `invalidate` before freeing a buffer
+     * which was passed to them.
+     */
+    inline Arc<MemoryRegionCache> get_memory_region_cache() const {
+        return this->memory_region_cache_;
+    }
 
   private:
     TcclContext() = default;
-    void initialize(Box<RcQueuePair> qp, uint64_t dop) noexcept(false);
+    static Arc<TcclContext> create_inner(
+        Box<RcQueuePair> qp,
+        bool spawn_polling_thread,
+        uint64_t dop,
+        const TcclContextConfig& config,
+        Arc<RequestSlots> slots
+    ) noexcept(false);
+
+    // `slots` is the slab of the group the context joins, a null one makes the context allocate its own
+    void initialize(
+        Box<RcQueuePair> qp,
+        uint64_t dop,
+        const TcclContextConfig& config,
+        Arc<RequestSlots> slots
+    ) noexcept(false);
+};
+
+/**
+ * @brief Submits to a TcclContext through producer tokens of its own, so an enqueue goes straight
+ * to the sub-queue of the submitter instead of looking up the implicit producer of the thread.
+ *
+ * The requests of one submitter reach the polling thread in submission order, so a stream
+ * stays FIFO as long as it is fed by a single submitter, while several threads with their own
+ * submitters feed their own streams. Requests to the same stream from different submitters, or
+ * from a submitter and the plain TcclContext calls, are matched in an unspecified order.
+ *
+ * SAFETY: A submitter must not be used by several threads at once. It keeps the context alive.
+ */
+class TcclSubmitter {
+  private:
+    Arc<TcclContext> context_;
+    ProducerToken send_token_;
+    ProducerToken recv_token_;
+    ProducerToken pull_recv_token_;
+
+    explicit TcclSubmitter(Arc<TcclContext> context);
+    TcclSubmitter(const TcclSubmitter&) = delete;
+    TcclSubmitter& operator=(const TcclSubmitter&) = delete;
+
+  public:
+    static Box<TcclSubmitter> create(Arc<TcclContext> context) noexcept(false);
+
+    [[nodiscard]] Handle send(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey, uint32_t padding = 0);
+    [[nodiscard]] Handle recv(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey, uint32_t padding = 0);
+
+    /**
+     * @brief See `TcclContext::send_pull`.
+     */
+    [[nodiscard]] Handle send_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey) noexcept(false);
+
+    /**
+     * @brief See `TcclContext::recv_pull`.
+     */
+    [[nodiscard]] Handle recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey) noexcept(false);
+
+    /**
+     * @brief See `TcclContext::send_batch`, the members of the batch are enqueued with one bulk
+     * enqueue per chunk on the sub-queue of the submitter.
+     */
+    [[nodiscard]] Handle send_batch(const BatchEntry* entries, uint64_t count) noexcept(false);
+
+    /**
+     * @brief See `TcclContext::recv_batch`.
+     */
+    [[nodiscard]] Handle recv_batch(const BatchEntry* entries, uint64_t count) noexcept(false);
+
+    inline Handle send_batch(const std::vector<BatchEntry>& entries) noexcept(false) {
+        return this->send_batch(entries.data(), entries.size());
+    }
+
+    inline Handle recv_batch(const std::vector<BatchEntry>& entries) noexcept(false) {
+        return this->recv_batch(entries.data(), entries.size());
+    }
+
+    /**
+     * @brief See `TcclContext::sendv`.
+     */
+    [[nodiscard]] Handle sendv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false);
+
+    /**
+     * @brief See `TcclContext::recvv`.
+     */
+    [[nodiscard]] Handle recvv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false);
+
+    inline Arc<TcclContext> get_context() const {
+        return this->context_;
+    }
+};
+
+class StripedHandle {
+  public:
+    static constexpr uint64_t kMaxStripes = 16;
+
+  private:
+    std::array<Handle, kMaxStripes> handles_;
+    uint64_t num_handles_;
+
+  public:
+    StripedHandle() : num_handles_(0) {}
+
+    inline void push(const Handle& handle) {
+        assert(this->num_handles_ < kMaxStripes);
+        this->handles_[this->num_handles_++] = handle;
+    }
+
+    /**
+     * @brief Check if every stripe of the send/recv is finished.
+     */
+    inline bool is_finished() const {
+        for (uint64_t i = 0; i < this->num_handles_; ++i) {
+            if (!this->handles_[i].is_finished()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Wait until every stripe is finished in a busy looping way.
+     */
+    inline void wait() const {
+        for (uint64_t i = 0; i < this->num_handles_; ++i) {
+            this->handles_[i].wait();
+        }
+    }
+};
+
+/**
+ * @brief A logical channel striped over several TcclContexts, one per RcQueuePair.
+ *
+ * Each send/recv is split into contiguous stripes which are posted on the underlying
+ * contexts with the same stream_id. Both peers split a request in the same way, so the
+ * stripes are matched independently by every underlying context. The QPs may live on
+ * different devices, thus the caller passes one key per stripe.
+ */
+class StripedTcclContext {
+  private:
+    std::vector<Arc<TcclContext>> contexts_;
+    uint64_t min_stripe_size_;
+
+    StripedTcclContext() = default;
+    StripedTcclContext(const StripedTcclContext&) = delete;
+    StripedTcclContext& operator=(const StripedTcclContext&) = delete;
+
+    uint64_t get_stripe_size(uint64_t length) const;
+
+  public:
+    static constexpr uint64_t kStripeAlignment = 4096;
+    static constexpr uint64_t kDefaultMinStripeSize = 64 * 1024;
+
+    inline uint64_t get_num_stripes() const {
+        return this->contexts_.size();
+    }
+
+    inline Arc<TcclContext> get_context(uint64_t index) const {
+        return this->contexts_[index];
+    }
+
+    /**
+     * @brief Poll both send and recv tasks of every underlying context
+     * SAFETY: !! This function is not thread-safe !!
+     */
+    void poll_both() noexcept(false);
+
+    /**
+     * @brief Create a StripedTcclContext over a set of QPs which are already brought up.
+     * The i-th QP of both peers must be connected to each other.
+     *
+     * @param qps QPs to stripe over
+     * @param spawn_polling_thread spawn a polling thread for every underlying context
+     * @param dop degree of parallelism of every underlying context
+     * @param min_stripe_size requests smaller than this are not split further
+     * @param config config of every underlying context
+     */
+    static Arc<StripedTcclContext> create(
+        std::vector<Box<RcQueuePair>> qps,
+        bool spawn_polling_thread = true,
+        uint64_t dop = 16,
+        uint64_t min_stripe_size = kDefaultMinStripeSize,
+        const TcclContextConfig& config = TcclContextConfig()
+    ) noexcept(false);
+
+    /**
+     * @param lkeys lkey of the buffer in the PD of every stripe, or a single lkey if all QPs share a PD
+     */
+    [[nodiscard]] StripedHandle
+    send(uint32_t stream_id, uint64_t addr, uint64_t length, const std::vector<uint32_t>& lkeys) noexcept(false);
+
+    /**
+     * @param rkeys rkey of the buffer in the PD of every stripe, or a single rkey if all QPs share a PD
+     */
+    [[nodiscard]] StripedHandle
+    recv(uint32_t stream_id, uint64_t addr, uint64_t length, const std::vector<uint32_t>& rkeys) noexcept(false);
+
+    /**
+     * @brief Set the QoS of a stream on every stripe.
+     */
+    void set_stream_qos(uint32_t stream_id, const StreamQos& qos) noexcept(false);
+};
+
+struct TcclContextGroupConfig {
+    // Recv slots shared by all the contexts of the group, each one holds a Ticket or an eager message.
+    // Writes with imm consume recv work requests as well.
+    uint32_t num_recv_slots = 4096;
+};
+
+/**
+ * @brief TcclContexts of one device whose QPs share a single SRQ, recv CQ and Ticket ring.
+ *
+ * A standalone TcclContext posts 2 * dop Ticket recvs into a ring of its own, so receive
+ * resources grow with the number of peers. The contexts of a group take their recvs from
+ * the shared ring instead, and the group dispatches the completions of the shared recv CQ
+ * to them by qp_num. They also share the completion slots of the group, so apart from the
+ * send side sized by dop, adding a peer costs no memory linear in max_inflight_requests.
+ * All the contexts of a group are polled by the group, so they must not be polled by
+ * themselves or registered with a PollingEngine. Their polling_mode is ignored.
+ */
+class TcclContextGroup {
+  private:
+    uint64_t dop_;
+    TcclContextConfig config_;
+
+    Arc<SharedReceiveQueue> srq_;
+    Box<MemoryRegion> recv_ring_;
+
+    // Completion slots shared by all the contexts of the group, sized by max_inflight_requests once
+    Arc<RequestSlots> slots_;
+    uint64_t recv_slot_size_;
+    RecvWorkRequestBatch recv_batch_;
+    std::vector<ibv_wc> recv_ibv_wc_buffer_;
+    std::vector<WorkCompletion> polled_recv_wcs_;
+
+    // Completions of QPs which are not added yet, as the peer may start sending right after bring-up.
+    // Their recv slots are reposted once they are delivered.
+    std::vector<WorkCompletion> undelivered_wcs_;
+
+    // Protects contexts_
+    std::mutex mutex_;
+    std::vector<Arc<TcclContext>> contexts_;
+    std::atomic<uint64_t> version_;
+
+    // Private snapshot of the polling side, refreshed when the version moves
+    std::vector<Arc<TcclContext>> polled_contexts_;
+    std::unordered_map<uint32_t, TcclContext*> contexts_by_qp_num_;
+    uint64_t seen_version_;
+
+    bool background_polling_;
+    std::thread polling_thread_;
+    std::atomic<bool> polling_stopped_;
+
+    TcclContextGroup() = default;
+    TcclContextGroup(const TcclContextGroup&) = delete;
+    TcclContextGroup& operator=(const TcclContextGroup&) = delete;
+
+    bool poll_once_inner() noexcept(false);
+    bool deliver_inner(const WorkCompletion& wc) noexcept(false);
+
+  public:
+    ~TcclContextGroup();
+
+    /**
+     * @brief Create a group with an SRQ in the given PD.
+     *
+     * @param spawn_polling_thread spawn a thread which polls the group, otherwise call `poll_once`
+     * @param dop degree of parallelism of every context in the group
+     * @param config config of every context in the group
+     */
+    static Arc<TcclContextGroup> create(
+        Arc<ProtectionDomain> pd,
+        bool spawn_polling_thread = true,
+        uint64_t dop = 16,
+        const TcclContextConfig& config = TcclContextConfig(),
+        const TcclContextGroupConfig& group_config = TcclContextGroupConfig()
+    ) noexcept(false);
+
+    /**
+     * @brief Create a QP attached to the SRQ of the group, to be brought up and passed to `add_context`.
+     */
+    Box<RcQueuePair> create_queue_pair() noexcept(false);
+
+    /**
+     * @brief Wrap a QP of `create_queue_pair` which is already brought up in a TcclContext of the group.
+     * Contexts stay in the group until it is destroyed.
+     */
+    Arc<TcclContext> add_context(Box<RcQueuePair> qp) noexcept(false);
+
+    /**
+     * @brief Poll the shared recv CQ and every context of the group once, return whether anything progressed.
+     * SAFETY: !! This function is not thread-safe !!
+     */
+    inline bool poll_once() noexcept(false) {
+        assert(this->background_polling_ == false);
+        return this->poll_once_inner();
+    }
+
+    inline Arc<SharedReceiveQueue> get_srq() const {
+        return this->srq_;
+    }
+};
+
+struct PollingEngineConfig {
+    // Number of poller threads
+    uint64_t num_threads = 1;
+
+    // CPUs the pollers are pinned to in a round-robin way, pollers are not pinned if it is empty.
+    // Use PollingEngine::get_numa_node_cpus to pin them to the NUMA node of the RNICs.
+    std::vector<uint32_t> cpus;
+};
+
+/**
+ * @brief A small pool of poller threads which drives many TcclContexts.
+ *
+ * Every registered context has a home poller, which is the least loaded one at registration
+ * time. A poller whose own contexts are idle steals rounds from the busy contexts of the
+ * other pollers, so a single hot context does not leave the other threads spinning for
+ * nothing. A context is claimed before it is polled, thus it is never polled concurrently.
+ *
+ * The contexts must be created without their own polling thread, and their polling_mode
+ * is ignored.
+ */
+class PollingEngine {
+  private:
+    struct Poller {
+        std::vector<Arc<TcclContext>> contexts;
+        std::thread thread;
+
+        // The registration version this poller works on
+        std::atomic<uint64_t> seen_version;
+    };
+
+    PollingEngineConfig config_;
+
+    // Protects the context lists of the pollers
+    std::mutex mutex_;
+    std::vector<Box<Poller>> pollers_;
+    std::atomic<uint64_t> version_;
+    std::atomic<bool> stopped_;
+
+    PollingEngine() = default;
+    PollingEngine(const PollingEngine&) = delete;
+    PollingEngine& operator=(const PollingEngine&) = delete;
+
+    void poller_loop(uint64_t index) noexcept(false);
+    void wait_for_pollers(uint64_t version) const;
+
+  public:
+    ~PollingEngine();
+
+    static Arc<PollingEngine> create(const PollingEngineConfig& config = PollingEngineConfig()) noexcept(false);
+
+    inline uint64_t get_num_threads() const {
+        return this->pollers_.size();
+    }
+
+    /**
+     * @brief Start polling a context on the least loaded poller.
+     */
+    void register_context(Arc<TcclContext> context) noexcept(false);
+
+    /**
+     * @brief Stop polling a context. No poller touches the context once it returns.
+     * It must not be called from a poller thread.
+     */
+    void deregister_context(const Arc<TcclContext>& context) noexcept(false);
+
+    /**
+     * @brief CPUs of a NUMA node, read from sysfs. See `Topology` for the placement of devices.
+     */
+    static std::vector<uint32_t> get_numa_node_cpus(int numa_node) noexcept(false);
+
+    /**
+     * @brief NUMA node of an RDMA device, -1 if it is unknown.
+     */
+    static int get_device_numa_node(const char* dev_name) noexcept;
 };
 
 }  // namespace rdma_util
@@ -0,0 +1,27 @@
+#ifndef _REDUCE_KERNELS_H_
+#define _REDUCE_KERNELS_H_
+
+#include <cuda_runtime.h>
+
+#include <cstdint>
+
+namespace reduce_kernels {
+
+/**
+ * @brief Launch `dst[i] = op(dst[i], src[i])` for `count` elements on a stream.
+ *
+ * @param data_type a rdma_util::DataType
+ * @param op a rdma_util::ReduceOp
+ */
+cudaError_t launch_reduce(
+    void* dst,
+    const void* src,
+    uint64_t count,
+    int data_type,
+    int op,
+    cudaStream_t stream
+) noexcept;
+
+}  // namespace reduce_kernels
+
+#endif  // _REDUCE_KERNELS_H_
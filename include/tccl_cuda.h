@@ -0,0 +1,121 @@
+#ifndef _TCCL_CUDA_H_
+#define _TCCL_CUDA_H_
+
+#include <cuda_runtime.h>
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "rdma_util.h"
+
+namespace rdma_util {
+
+/**
+ * @brief Stream-ordered send/recv of a TcclContext, so GPU work triggers and awaits transfers
+ * without a host round trip.
+ *
+ * A transfer enqueued on a CUDA stream is submitted by a host function once the prior work of
+ * the stream is done, and the work enqueued after it waits with `cuStreamWaitValue32` on a flag
+ * in mapped host memory, which the polling thread of the context stores when the transfer is
+ * finished. No host thread blocks on a transfer. Sends gate the later work of the stream as well,
+ * so a kernel may overwrite the send buffer right after `send_on_stream`.
+ *
+ * Every transfer owns a flag of a ring until it is finished, at most `num_flags` transfers can be
+ * unfinished at once and further calls wait for the oldest one. It is thread-safe.
+ */
+class CudaStreamTccl {
+  private:
+    struct Operation {
+        CudaStreamTccl* owner;
+        uint32_t index;
+        uint32_t value;
+        uint32_t stream_id;
+        uint64_t addr;
+        uint64_t length;
+        uint32_t key;
+        bool is_send;
+    };
+
+    Arc<TcclContext> context_;
+    uint32_t device_;
+
+    // Mapped host memory, written by the polling thread and polled by the GPU
+    uint32_t* host_flags_;
+    uint64_t device_flags_;
+    uint32_t num_flags_;
+
+    // Lets the GPU see the RDMA writes of the NIC which precede the flag, if the device supports it
+    uint32_t wait_flags_;
+
+    std::mutex mutex_;
+    std::vector<Operation> operations_;
+    uint64_t next_operation_;
+
+    // Set by a host function which failed to submit, the failed transfer still releases its stream
+    std::atomic<bool> failed_;
+
+    CudaStreamTccl() = default;
+    CudaStreamTccl(const CudaStreamTccl&) = delete;
+    CudaStreamTccl& operator=(const CudaStreamTccl&) = delete;
+
+    static void launch_inner(void* arg) noexcept;
+    void enqueue_inner(
+        cudaStream_t stream,
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t key,
+        bool is_send
+    ) noexcept(false);
+
+  public:
+    static constexpr uint32_t kDefaultNumFlags = 1024;
+
+    /**
+     * @brief SAFETY: All streams used with it must be synchronized before it is destroyed.
+     */
+    ~CudaStreamTccl();
+
+    /**
+     * @param context context the transfers are submitted to, its polling thread or engine must be running
+     * @param device CUDA device of the streams
+     * @param num_flags maximum number of unfinished transfers
+     */
+    static Box<CudaStreamTccl> create(
+        Arc<TcclContext> context,
+        uint32_t device,
+        uint32_t num_flags = kDefaultNumFlags
+    ) noexcept(false);
+
+    /**
+     * @brief Send the buffer once the prior work of `stream` is done, the later work waits for the send.
+     */
+    void send_on_stream(
+        cudaStream_t stream,
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t lkey
+    ) noexcept(false);
+
+    /**
+     * @brief Recv into the buffer once the prior work of `stream` is done, the later work waits for the data.
+     */
+    void recv_on_stream(
+        cudaStream_t stream,
+        uint32_t stream_id,
+        uint64_t addr,
+        uint64_t length,
+        uint32_t rkey
+    ) noexcept(false);
+
+    inline Arc<TcclContext> get_context() const {
+        return this->context_;
+    }
+};
+
+}  // namespace rdma_util
+
+#endif  // _TCCL_CUDA_H_
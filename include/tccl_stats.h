@@ -0,0 +1,256 @@
+#ifndef _TCCL_STATS_H_
+#define _TCCL_STATS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Statements wrapped in TCCL_STATS are compiled out unless the build enables ENABLE_STATS
+#ifdef ENABLE_STATS
+#define TCCL_STATS(...) __VA_ARGS__
+#else
+#define TCCL_STATS(...)
+#endif
+
+namespace rdma_util {
+
+#ifdef ENABLE_STATS
+constexpr bool kStatsEnabled = true;
+#else
+constexpr bool kStatsEnabled = false;
+#endif
+
+inline uint64_t stats_now_ns() {
+    return uint64_t(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+            .count()
+    );
+}
+
+// Every counter has a single writer, so a relaxed load and store is enough and avoids a locked add
+inline void stats_bump(std::atomic<uint64_t>& counter, uint64_t delta = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+/**
+ * @brief A point-in-time copy of a LatencyHistogram, values are in nanoseconds.
+ */
+struct HistogramSnapshot {
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // Number of recorded values per bucket, see LatencyHistogram::get_bucket
+    std::vector<uint64_t> buckets;
+
+    double mean() const;
+
+    /**
+     * @brief The smallest bucket bound which at least `quantile` of the recorded values do not exceed.
+     *
+     * @param quantile in [0, 1]
+     */
+    uint64_t percentile(double quantile) const;
+
+    void merge(const HistogramSnapshot& other);
+
+    std::string to_json() const;
+};
+
+/**
+ * @brief A log-linear histogram in the spirit of HdrHistogram.
+ *
+ * Values below kSubBuckets get a bucket of their own, every larger power of two is split
+ * into kSubBuckets linear buckets, so the relative error stays below 1 / kSubBuckets over
+ * the whole uint64_t range. Only one thread records, any thread may take snapshots.
+ */
+class LatencyHistogram {
+  public:
+    static constexpr uint32_t kSubBucketBits = 4;
+    static constexpr uint32_t kSubBuckets = 1 << kSubBucketBits;
+    static constexpr uint32_t kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+  private:
+    std::array<std::atomic<uint64_t>, kNumBuckets> buckets_;
+    std::atomic<uint64_t> count_;
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+
+  public:
+    LatencyHistogram();
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    static inline uint32_t get_bucket(uint64_t value) {
+        if (value < kSubBuckets) {
+            return uint32_t(value);
+        }
+        const uint32_t shift = uint32_t(63 - __builtin_clzll(value)) - kSubBucketBits;
+        return (shift + 1) * kSubBuckets + uint32_t((value >> shift) & (kSubBuckets - 1));
+    }
+
+    /**
+     * @brief The smallest value which falls into the bucket.
+     */
+    static inline uint64_t get_bucket_lower_bound(uint32_t bucket) {
+        if (bucket < kSubBuckets) {
+            return bucket;
+        }
+        const uint32_t shift = bucket / kSubBuckets - 1;
+        return uint64_t(kSubBuckets + bucket % kSubBuckets) << shift;
+    }
+
+    inline void record(uint64_t value) {
+        stats_bump(this->buckets_[get_bucket(value)]);
+        stats_bump(this->count_);
+        stats_bump(this->sum_, value);
+        if (value > this->max_.load(std::memory_order_relaxed)) {
+            this->max_.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    HistogramSnapshot snapshot() const;
+};
+
+/**
+ * @brief Counters of one stream of a TcclContext.
+ * Latencies span from the submission of a request to the completion of its handle.
+ */
+struct StreamStats {
+    std::atomic<uint64_t> num_sends {0};
+    std::atomic<uint64_t> num_recvs {0};
+    std::atomic<uint64_t> bytes_sent {0};
+    std::atomic<uint64_t> bytes_received {0};
+    LatencyHistogram send_latency;
+    LatencyHistogram recv_latency;
+};
+
+struct StreamStatsSnapshot {
+    uint64_t num_sends = 0;
+    uint64_t num_recvs = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t bytes_received = 0;
+    HistogramSnapshot send_latency;
+    HistogramSnapshot recv_latency;
+
+    std::string to_json() const;
+};
+
+/**
+ * @brief A consistent-enough copy of the statistics of a TcclContext.
+ *
+ * Every counter is read atomically, but the counters are not read at the same instant.
+ */
+struct TcclContextStatsSnapshot {
+    // False if the library was built without ENABLE_STATS, everything else is zero then
+    bool enabled = false;
+
+    // From the submission of a recv or a send_pull until its Ticket is posted
+    HistogramSnapshot ticket_wait;
+
+    // From the submission of a send until it is matched with the Ticket of the remote side
+    HistogramSnapshot match_wait;
+
+    // From the match until the last write or read of the message completes
+    HistogramSnapshot transfer_latency;
+
+    // Polls of the CQs of the context, an empty poll found no completion
+    uint64_t send_cq_polls = 0;
+    uint64_t send_cq_empty_polls = 0;
+    uint64_t send_wcs = 0;
+    uint64_t recv_cq_polls = 0;
+    uint64_t recv_cq_empty_polls = 0;
+    uint64_t recv_wcs = 0;
+
+    std::map<uint32_t, StreamStatsSnapshot> streams;
+
+    std::string to_json() const;
+
+    /**
+     * @brief A short human-readable summary with the p50/p99/max of every histogram.
+     */
+    std::string to_string() const;
+};
+
+/**
+ * @brief The live statistics of a TcclContext, updated by its polling thread only.
+ */
+class TcclContextStats {
+  private:
+    // Stream stats are created on first use and never freed, so the polling thread caches raw pointers
+    std::mutex mutex_;
+    std::map<uint32_t, std::unique_ptr<StreamStats>> streams_;
+
+    // Small stream ids are looked up by index, the others by hash, as stream ids may be sparse
+    std::vector<StreamStats*> stream_cache_;
+    std::unordered_map<uint32_t, StreamStats*> sparse_stream_cache_;
+
+  public:
+    static constexpr uint32_t kMaxIndexedStreamId = 4096;
+
+    LatencyHistogram ticket_wait;
+    LatencyHistogram match_wait;
+    LatencyHistogram transfer_latency;
+
+    std::atomic<uint64_t> send_cq_polls {0};
+    std::atomic<uint64_t> send_cq_empty_polls {0};
+    std::atomic<uint64_t> send_wcs {0};
+    std::atomic<uint64_t> recv_cq_polls {0};
+    std::atomic<uint64_t> recv_cq_empty_polls {0};
+    std::atomic<uint64_t> recv_wcs {0};
+
+    TcclContextStats() = default;
+    TcclContextStats(const TcclContextStats&) = delete;
+    TcclContextStats& operator=(const TcclContextStats&) = delete;
+
+    inline void record_send_poll(int ret) {
+        stats_bump(this->send_cq_polls);
+        if (ret <= 0) {
+            stats_bump(this->send_cq_empty_polls);
+        } else {
+            stats_bump(this->send_wcs, uint64_t(ret));
+        }
+    }
+
+    inline void record_recv_poll(int ret) {
+        stats_bump(this->recv_cq_polls);
+        if (ret <= 0) {
+            stats_bump(this->recv_cq_empty_polls);
+        } else {
+            stats_bump(this->recv_wcs, uint64_t(ret));
+        }
+    }
+
+    /**
+     * @brief Stats of the stream, created on first use.
+     * SAFETY: Only the polling thread may call this.
+     */
+    inline StreamStats& get_stream(uint32_t stream_id) {
+        if (stream_id < kMaxIndexedStreamId) {
+            if (stream_id < this->stream_cache_.size() && this->stream_cache_[stream_id] != nullptr) {
+                return *this->stream_cache_[stream_id];
+            }
+        } else {
+            auto iter = this->sparse_stream_cache_.find(stream_id);
+            if (iter != this->sparse_stream_cache_.end()) {
+                return *iter->second;
+            }
+        }
+        return this->create_stream(stream_id);
+    }
+
+    StreamStats& create_stream(uint32_t stream_id);
+
+    TcclContextStatsSnapshot snapshot();
+};
+
+}  // namespace rdma_util
+
+#endif  // _TCCL_STATS_H_
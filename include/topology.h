@@ -0,0 +1,133 @@
+#ifndef _TOPOLOGY_H_
+#define _TOPOLOGY_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "rdma_util.h"
+
+namespace rdma_util {
+
+/**
+ * @brief How far apart two PCI devices are, from the nearest to the farthest.
+ * The levels follow the ones of `nvidia-smi topo -m`.
+ */
+enum class PciDistance {
+    // Behind a common PCIe switch, peer traffic never reaches the root complex (PIX/PXB)
+    PCIE_SWITCH = 0,
+    // Below the same host bridge, peer traffic crosses the root complex (PHB)
+    HOST_BRIDGE = 1,
+    // Below different host bridges of the same NUMA node (NODE)
+    NUMA_NODE = 2,
+    // On different or unknown NUMA nodes, peer traffic crosses the CPU interconnect (SYS)
+    SYSTEM = 3,
+};
+
+const char* to_string(PciDistance distance) noexcept;
+
+struct PciDevice {
+    // Name of the RDMA device, empty for other PCI devices
+    std::string name;
+
+    // domain:bus:device.function in lower case, e.g. 0000:3b:00.0
+    std::string pci_address;
+
+    // -1 if the platform does not report it
+    int numa_node;
+
+    // Host bridge and bridges down to the device itself, e.g. pci0000:3a, 0000:3a:00.0, 0000:3b:00.0.
+    // It is empty for devices which are not on a PCI bus, like soft RoCE.
+    std::vector<std::string> pci_path;
+};
+
+/**
+ * @brief PCIe and NUMA placement of the RDMA devices of the host, read from sysfs.
+ *
+ * GPUs are paired with the RDMA device nearest to them instead of a hard-coded one, as a pair
+ * whose peer traffic crosses the root complex or the CPU interconnect only gets a fraction of
+ * the GPUDirect bandwidth. Look up the PCI address of a GPU with `gpu_mem_util::get_gpu_pci_address`.
+ */
+class Topology {
+  private:
+    std::string sysfs_root_;
+    std::vector<PciDevice> rdma_devices_;
+
+    Topology() = default;
+    Topology(const Topology&) = delete;
+    Topology& operator=(const Topology&) = delete;
+
+    PciDevice read_device_inner(const std::string& device_link) const noexcept(false);
+
+  public:
+    /**
+     * @param sysfs_root mount point of sysfs, only tests need another one
+     */
+    static Box<Topology> create(const std::string& sysfs_root = "/sys") noexcept(false);
+
+    /**
+     * @brief RDMA devices sorted by name.
+     */
+    inline const std::vector<PciDevice>& get_rdma_devices() const {
+        return this->rdma_devices_;
+    }
+
+    /**
+     * @brief The RDMA device called `name`.
+     */
+    const PciDevice& get_rdma_device(const std::string& name) const noexcept(false);
+
+    /**
+     * @brief Any PCI device of the host, e.g. a GPU.
+     */
+    PciDevice get_pci_device(const std::string& pci_address) const noexcept(false);
+
+    /**
+     * @brief The RDMA device nearest to a PCI device. Ties go to the one with fewer PCI links
+     * in between, and then to the first name.
+     */
+    const PciDevice& get_nearest_rdma_device(const std::string& pci_address) const noexcept(false);
+
+    /**
+     * @brief CPUs of a NUMA node.
+     */
+    std::vector<uint32_t> get_numa_node_cpus(int numa_node) const noexcept(false);
+
+    static PciDistance get_distance(const PciDevice& a, const PciDevice& b) noexcept;
+
+    /**
+     * @brief Number of PCI links between two devices below the same host bridge, UINT32_MAX otherwise.
+     */
+    static uint32_t get_num_hops(const PciDevice& a, const PciDevice& b) noexcept;
+
+    /**
+     * @brief Lower case a PCI address and cut its domain to 4 digits, as CUDA reports it in upper case
+     * and NVML with 8 digits.
+     */
+    static std::string normalize_pci_address(const std::string& pci_address) noexcept;
+
+    /**
+     * @brief Parse a cpulist of sysfs, e.g. 0-15,32-47.
+     */
+    static std::vector<uint32_t> parse_cpu_list(const std::string& cpu_list) noexcept;
+
+    /**
+     * @brief NUMA node of an RDMA device, -1 if it is unknown.
+     */
+    static int get_rdma_device_numa_node(const char* dev_name) noexcept;
+
+    /**
+     * @brief Restrict the calling thread to a set of CPUs, return false if it fails.
+     */
+    static bool pin_current_thread(const std::vector<uint32_t>& cpus) noexcept;
+
+    /**
+     * @brief Allocate page-aligned host memory whose pages are preferably placed on a NUMA node.
+     * The placement is best effort, the memory falls back to other nodes if the node is full.
+     */
+    static Arc<void> allocate_on_numa_node(uint64_t size, int numa_node) noexcept(false);
+};
+
+}  // namespace rdma_util
+
+#endif  // _TOPOLOGY_H_
@@ -0,0 +1,419 @@
+#include "bootstrap.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rdma_assert.h"
+
+namespace rdma_util {
+
+// "NGDR"
+static constexpr uint32_t kBootstrapMagic = 0x5244474e;
+static constexpr uint32_t kBootstrapVersion = 1;
+
+// Upper bound of QPs per peer, which guards against garbage on the wire
+static constexpr uint64_t kMaxQueuePairsPerPeer = 1 << 20;
+
+struct BootstrapHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_entries;
+};
+
+constexpr uint64_t BootstrapConnection::kDefaultTimeoutMs;
+
+static const int kRetryIntervalMs = 100;
+
+static int connect_with_retry(int family, const sockaddr* addr, socklen_t addr_len, uint64_t timeout_ms) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (true) {
+        int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to create socket");
+        }
+        if (::connect(fd, addr, addr_len) == 0) {
+            return fd;
+        }
+        close(fd);
+        if (std::chrono::steady_clock::now() >= deadline) {
+            return -1;
+        }
+        // The listener may not be up yet
+        std::this_thread::sleep_for(std::chrono::milliseconds(kRetryIntervalMs));
+    }
+}
+
+static void set_no_delay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+BootstrapConnection::~BootstrapConnection() {
+    if (this->fd_ >= 0) {
+        close(this->fd_);
+    }
+}
+
+Box<BootstrapConnection> BootstrapConnection::connect(const char* host, uint16_t port, uint64_t timeout_ms) noexcept(
+    false
+) {
+    addrinfo hints {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    const std::string service = std::to_string(port);
+    if (getaddrinfo(host, service.c_str(), &hints, &result) != 0 || result == nullptr) {
+        throw std::runtime_error(std::string("Failed to resolve ") + host);
+    }
+
+    int fd = -1;
+    try {
+        fd = connect_with_retry(result->ai_family, result->ai_addr, result->ai_addrlen, timeout_ms);
+    } catch (...) {
+        freeaddrinfo(result);
+        throw;
+    }
+    freeaddrinfo(result);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Failed to connect to ") + host + ":" + service);
+    }
+
+    set_no_delay(fd);
+    return Box<BootstrapConnection>(new BootstrapConnection(fd));
+}
+
+Box<BootstrapConnection> BootstrapConnection::connect_unix(const char* path, uint64_t timeout_ms) noexcept(false) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    ASSERT(strlen(path) < sizeof(addr.sun_path), "Unix socket path is too long");
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = connect_with_retry(AF_UNIX, reinterpret_cast<sockaddr*>(&addr), sizeof(addr), timeout_ms);
+    if (fd < 0) {
+        throw std::runtime_error(std::string("Failed to connect to ") + path);
+    }
+    return Box<BootstrapConnection>(new BootstrapConnection(fd));
+}
+
+void BootstrapConnection::send_all(const void* data, uint64_t length) noexcept(false) {
+    const char* ptr = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t ret = send(this->fd_, ptr, length, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            throw std::runtime_error("Failed to send bootstrap data");
+        }
+        ptr += ret;
+        length -= ret;
+    }
+}
+
+void BootstrapConnection::recv_all(void* data, uint64_t length) noexcept(false) {
+    char* ptr = static_cast<char*>(data);
+    while (length > 0) {
+        ssize_t ret = recv(this->fd_, ptr, length, 0);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            throw std::runtime_error("Failed to recv bootstrap data");
+        }
+        ptr += ret;
+        length -= ret;
+    }
+}
+
+std::vector<QueuePairInfo> BootstrapConnection::exchange(const std::vector<QueuePairInfo>& local) noexcept(false) {
+    return exchange_all({this}, {local})[0];
+}
+
+BootstrapListener::~BootstrapListener() {
+    if (this->fd_ >= 0) {
+        close(this->fd_);
+    }
+    if (!this->unix_path_.empty()) {
+        unlink(this->unix_path_.c_str());
+    }
+}
+
+Box<BootstrapListener> BootstrapListener::create(uint16_t port, const char* bind_addr) noexcept(false) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+
+    Box<BootstrapListener> listener = Box<BootstrapListener>(new BootstrapListener());
+    listener->fd_ = fd;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind_addr != nullptr) {
+        ASSERT(inet_pton(AF_INET, bind_addr, &addr.sin_addr) == 1, "Invalid bind address");
+    }
+
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw std::runtime_error("Failed to bind bootstrap listener");
+    }
+    // Backlog is large enough for a whole peer set connecting at once
+    if (listen(fd, SOMAXCONN) != 0) {
+        throw std::runtime_error("Failed to listen");
+    }
+
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addr_len) != 0) {
+        throw std::runtime_error("Failed to get the listening port");
+    }
+    listener->port_ = ntohs(addr.sin_port);
+    return listener;
+}
+
+Box<BootstrapListener> BootstrapListener::create_unix(const char* path) noexcept(false) {
+    sockaddr_un addr {};
+    addr.sun_family = AF_UNIX;
+    ASSERT(strlen(path) < sizeof(addr.sun_path), "Unix socket path is too long");
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create socket");
+    }
+
+    Box<BootstrapListener> listener = Box<BootstrapListener>(new BootstrapListener());
+    listener->fd_ = fd;
+    listener->port_ = 0;
+
+    unlink(path);
+    if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        throw std::runtime_error("Failed to bind bootstrap listener");
+    }
+    listener->unix_path_ = path;
+    if (listen(fd, SOMAXCONN) != 0) {
+        throw std::runtime_error("Failed to listen");
+    }
+    return listener;
+}
+
+Box<BootstrapConnection> BootstrapListener::accept() noexcept(false) {
+    while (true) {
+        int fd = accept4(this->fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) {
+            if (this->unix_path_.empty()) {
+                set_no_delay(fd);
+            }
+            return Box<BootstrapConnection>(new BootstrapConnection(fd));
+        } else if (errno != EINTR) {
+            throw std::runtime_error("Failed to accept bootstrap connection");
+        }
+    }
+}
+
+std::vector<Box<BootstrapConnection>> BootstrapListener::accept_all(uint64_t num_peers) noexcept(false) {
+    std::vector<Box<BootstrapConnection>> connections;
+    connections.reserve(num_peers);
+    for (uint64_t i = 0; i < num_peers; ++i) {
+        connections.push_back(this->accept());
+    }
+    return connections;
+}
+
+namespace {
+
+// Progress of the exchange with one peer
+struct ExchangeState {
+    std::vector<char> out;
+    uint64_t sent = 0;
+
+    BootstrapHeader header {};
+    uint64_t header_received = 0;
+    std::vector<QueuePairInfo> in;
+    uint64_t payload_received = 0;
+
+    inline bool send_done() const {
+        return this->sent == this->out.size();
+    }
+
+    inline bool recv_done() const {
+        return this->header_received == sizeof(BootstrapHeader)
+            && this->payload_received == this->in.size() * sizeof(QueuePairInfo);
+    }
+};
+
+}  // namespace
+
+std::vector<std::vector<QueuePairInfo>> exchange_all(
+    const std::vector<BootstrapConnection*>& connections,
+    const std::vector<std::vector<QueuePairInfo>>& local
+) noexcept(false) {
+    ASSERT(connections.size() == local.size(), "Number of connections and local infos mismatch");
+
+    std::vector<ExchangeState> states(connections.size());
+    for (uint64_t i = 0; i < connections.size(); ++i) {
+        BootstrapHeader header {kBootstrapMagic, kBootstrapVersion, local[i].size()};
+        states[i].out.resize(sizeof(header) + local[i].size() * sizeof(QueuePairInfo));
+        memcpy(states[i].out.data(), &header, sizeof(header));
+        if (!local[i].empty()) {
+            memcpy(states[i].out.data() + sizeof(header), local[i].data(), local[i].size() * sizeof(QueuePairInfo));
+        }
+    }
+
+    // Send and recv of all peers are interleaved, blocking on either could deadlock once the
+    // payload outgrows the socket buffers
+    std::vector<pollfd> fds(connections.size());
+    uint64_t num_pending = connections.size();
+    while (num_pending > 0) {
+        for (uint64_t i = 0; i < connections.size(); ++i) {
+            fds[i].fd = connections[i]->get_fd();
+            fds[i].events = 0;
+            fds[i].revents = 0;
+            if (!states[i].send_done()) {
+                fds[i].events |= POLLOUT;
+            }
+            if (!states[i].recv_done()) {
+                fds[i].events |= POLLIN;
+            }
+            if (fds[i].events == 0) {
+                // poll ignores negative fds
+                fds[i].fd = -1;
+            }
+        }
+
+        int ret = poll(fds.data(), fds.size(), -1);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0) {
+            throw std::runtime_error("Failed to poll bootstrap connections");
+        }
+
+        for (uint64_t i = 0; i < connections.size(); ++i) {
+            ExchangeState& state = states[i];
+            const bool was_done = state.send_done() && state.recv_done();
+
+            if (fds[i].revents & (POLLERR | POLLNVAL)) {
+                throw std::runtime_error("Bootstrap connection failed");
+            }
+
+            if ((fds[i].revents & POLLOUT) && !state.send_done()) {
+                ssize_t n = send(
+                    fds[i].fd,
+                    state.out.data() + state.sent,
+                    state.out.size() - state.sent,
+                    MSG_DONTWAIT | MSG_NOSIGNAL
+                );
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    throw std::runtime_error("Failed to send bootstrap data");
+                } else if (n > 0) {
+                    state.sent += n;
+                }
+            }
+
+            if ((fds[i].revents & (POLLIN | POLLHUP)) && !state.recv_done()) {
+                char* dst = nullptr;
+                uint64_t remaining = 0;
+                if (state.header_received < sizeof(BootstrapHeader)) {
+                    dst = reinterpret_cast<char*>(&state.header) + state.header_received;
+                    remaining = sizeof(BootstrapHeader) - state.header_received;
+                } else {
+                    dst = reinterpret_cast<char*>(state.in.data()) + state.payload_received;
+                    remaining = state.in.size() * sizeof(QueuePairInfo) - state.payload_received;
+                }
+
+                ssize_t n = recv(fds[i].fd, dst, remaining, MSG_DONTWAIT);
+                if (n == 0) {
+                    throw std::runtime_error("Bootstrap peer closed the connection");
+                } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    throw std::runtime_error("Failed to recv bootstrap data");
+                } else if (n > 0 && state.header_received < sizeof(BootstrapHeader)) {
+                    state.header_received += n;
+                    if (state.header_received == sizeof(BootstrapHeader)) {
+                        ASSERT(state.header.magic == kBootstrapMagic, "Bad bootstrap magic");
+                        ASSERT(state.header.version == kBootstrapVersion, "Bootstrap version mismatch");
+                        ASSERT(state.header.num_entries <= kMaxQueuePairsPerPeer, "Too many bootstrap entries");
+                        state.in.resize(state.header.num_entries);
+                    }
+                } else if (n > 0) {
+                    state.payload_received += n;
+                }
+            }
+
+            if (!was_done && state.send_done() && state.recv_done()) {
+                num_pending--;
+            }
+        }
+    }
+
+    std::vector<std::vector<QueuePairInfo>> remote(connections.size());
+    for (uint64_t i = 0; i < connections.size(); ++i) {
+        remote[i] = std::move(states[i].in);
+    }
+    return remote;
+}
+
+void bring_up_all(
+    const std::vector<RcQueuePair*>& qps,
+    const std::vector<QueuePairInfo>& remote,
+    const BringUpOptions& options,
+    uint64_t num_threads
+) noexcept(false) {
+    ASSERT(qps.size() == remote.size(), "Number of QPs and remote infos mismatch");
+    std::vector<BringUpRequest> requests(qps.size());
+    for (uint64_t i = 0; i < qps.size(); ++i) {
+        requests[i] = BringUpRequest {qps[i], remote[i].handshake_data};
+    }
+    RcQueuePair::bring_up_all(
+        requests,
+        options,
+        num_threads == 0 ? RcQueuePair::kDefaultBringUpThreads : uint32_t(num_threads)
+    );
+}
+
+std::vector<QueuePairInfo> connect_queue_pairs(
+    BootstrapConnection& connection,
+    const std::vector<RcQueuePair*>& qps,
+    const BringUpOptions& options,
+    uint64_t dop,
+    uint64_t chunk_size,
+    uint32_t eager_threshold
+) noexcept(false) {
+    std::vector<QueuePairInfo> local(qps.size());
+    for (uint64_t i = 0; i < qps.size(); ++i) {
+        local[i] = QueuePairInfo {};
+        local[i].handshake_data = qps[i]->get_handshake_data(options);
+        local[i].dop = dop;
+        local[i].chunk_size = chunk_size;
+        local[i].eager_threshold = eager_threshold;
+    }
+
+    std::vector<QueuePairInfo> remote = connection.exchange(local);
+    ASSERT(remote.size() == qps.size(), "Number of QPs mismatch between peers");
+    for (const auto& info : remote) {
+        ASSERT(info.dop == dop && info.chunk_size == chunk_size, "Context parameters mismatch between peers");
+        ASSERT(info.eager_threshold == eager_threshold, "Eager threshold mismatch between peers");
+    }
+
+    bring_up_all(qps, remote, options);
+    return remote;
+}
+
+}  // namespace rdma_util
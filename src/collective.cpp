@@ -0,0 +1,511 @@
+#include "collective.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef USE_CUDA
+#include <cuda_runtime.h>
+
+#include "gpu_mem_util.h"
+#include "reduce_kernels.h"
+#endif
+
+#include "rdma_assert.h"
+
+namespace rdma_util {
+
+constexpr uint32_t CommunicatorConfig::kDefaultBaseStreamId;
+constexpr uint32_t CommunicatorConfig::kDefaultNumLanes;
+constexpr uint64_t CommunicatorConfig::kDefaultPipelineChunkSize;
+
+uint64_t get_data_type_size(DataType data_type) noexcept(false) {
+    switch (data_type) {
+        case DataType::INT32:
+        case DataType::FLOAT32:
+            return 4;
+        case DataType::INT64:
+        case DataType::FLOAT64:
+            return 8;
+        default:
+            throw std::runtime_error("Unknown data type");
+    }
+}
+
+template<typename T>
+static void host_reduce_typed(T* dst, const T* src, uint64_t count, ReduceOp op) noexcept(false) {
+    switch (op) {
+        case ReduceOp::SUM:
+            for (uint64_t i = 0; i < count; ++i) {
+                dst[i] = dst[i] + src[i];
+            }
+            break;
+        case ReduceOp::MIN:
+            for (uint64_t i = 0; i < count; ++i) {
+                dst[i] = std::min(dst[i], src[i]);
+            }
+            break;
+        case ReduceOp::MAX:
+            for (uint64_t i = 0; i < count; ++i) {
+                dst[i] = std::max(dst[i], src[i]);
+            }
+            break;
+        default:
+            throw std::runtime_error("Unknown reduce op");
+    }
+}
+
+void HostReducer::launch(uint64_t, void* dst, const void* src, uint64_t count, DataType data_type, ReduceOp op)
+    noexcept(false) {
+    switch (data_type) {
+        case DataType::INT32:
+            host_reduce_typed(static_cast<int32_t*>(dst), static_cast<const int32_t*>(src), count, op);
+            break;
+        case DataType::INT64:
+            host_reduce_typed(static_cast<int64_t*>(dst), static_cast<const int64_t*>(src), count, op);
+            break;
+        case DataType::FLOAT32:
+            host_reduce_typed(static_cast<float*>(dst), static_cast<const float*>(src), count, op);
+            break;
+        case DataType::FLOAT64:
+            host_reduce_typed(static_cast<double*>(dst), static_cast<const double*>(src), count, op);
+            break;
+        default:
+            throw std::runtime_error("Unknown data type");
+    }
+}
+
+#ifdef USE_CUDA
+
+/**
+ * @brief Runs reductions as kernels on a private stream, one event per pipeline chunk
+ * lets the communicator forward a chunk as soon as its own kernel is done.
+ */
+class CudaReducer: public Reducer {
+  private:
+    uint32_t device_;
+    cudaStream_t stream_;
+    std::vector<cudaEvent_t> events_;
+
+  public:
+    explicit CudaReducer(uint32_t device) noexcept(false) : device_(device), stream_(nullptr) {
+        ASSERT(cudaSetDevice(device) == cudaSuccess, "Failed to set device");
+        ASSERT(
+            cudaStreamCreateWithFlags(&this->stream_, cudaStreamNonBlocking) == cudaSuccess,
+            "Failed to create stream"
+        );
+    }
+
+    ~CudaReducer() override {
+        cudaSetDevice(this->device_);
+        for (auto event : this->events_) {
+            cudaEventDestroy(event);
+        }
+        cudaStreamDestroy(this->stream_);
+    }
+
+    void launch(uint64_t index, void* dst, const void* src, uint64_t count, DataType data_type, ReduceOp op)
+        noexcept(false) override {
+        cudaSetDevice(this->device_);
+        while (this->events_.size() <= index) {
+            cudaEvent_t event;
+            ASSERT(cudaEventCreateWithFlags(&event, cudaEventDisableTiming) == cudaSuccess, "Failed to create event");
+            this->events_.push_back(event);
+        }
+        ASSERT(
+            reduce_kernels::launch_reduce(dst, src, count, int(data_type), int(op), this->stream_) == cudaSuccess,
+            "Failed to launch reduce kernel"
+        );
+        ASSERT(cudaEventRecord(this->events_[index], this->stream_) == cudaSuccess, "Failed to record event");
+    }
+
+    void synchronize(uint64_t index) noexcept(false) override {
+        ASSERT(cudaEventSynchronize(this->events_[index]) == cudaSuccess, "Failed to synchronize event");
+    }
+};
+
+#endif
+
+std::vector<uint64_t> Communicator::get_segment_offsets(uint64_t count, uint64_t world_size, uint64_t element_size) {
+    std::vector<uint64_t> offsets(world_size + 1, 0);
+    const uint64_t base = count / world_size;
+    const uint64_t remainder = count % world_size;
+    for (uint64_t i = 0; i < world_size; ++i) {
+        offsets[i + 1] = offsets[i] + (base + (i < remainder ? 1 : 0)) * element_size;
+    }
+    return offsets;
+}
+
+Box<Communicator> Communicator::create(
+    uint32_t rank,
+    std::vector<Arc<TcclContext>> peers,
+    const CommunicatorConfig& config
+) noexcept(false) {
+    ASSERT(rank < peers.size(), "Rank is out of range");
+    ASSERT(config.num_lanes > 0, "num_lanes must be positive");
+    ASSERT(config.pipeline_chunk_size > 0, "pipeline_chunk_size must be positive");
+    ASSERT(uint64_t(config.base_stream_id) + config.num_lanes <= (1ull << 32), "Lane stream ids overflow");
+    for (uint32_t i = 0; i < peers.size(); ++i) {
+        ASSERT(i == rank || peers[i] != nullptr, "Missing context of a peer");
+    }
+
+    auto communicator = Box<Communicator>(new Communicator());
+    communicator->rank_ = rank;
+    communicator->world_size_ = uint32_t(peers.size());
+    communicator->peers_ = std::move(peers);
+    communicator->peers_[rank] = nullptr;
+    communicator->config_ = config;
+    communicator->scratch_ = nullptr;
+    communicator->scratch_size_ = 0;
+
+    if (config.device_memory) {
+#ifdef USE_CUDA
+        communicator->reducer_ = Box<Reducer>(new CudaReducer(config.device));
+#else
+        throw std::runtime_error("device_memory needs USE_CUDA");
+#endif
+    } else {
+        communicator->reducer_ = Box<Reducer>(new HostReducer());
+    }
+
+    return communicator;
+}
+
+Communicator::~Communicator() {
+    this->release_scratch();
+}
+
+void Communicator::release_scratch() noexcept {
+    if (this->scratch_ == nullptr) {
+        return;
+    }
+
+    // Cached registrations must not outlive the memory, the caches of the peers live in the registry
+    DeviceRegistry::get_instance().invalidate(uint64_t(this->scratch_), this->scratch_size_);
+
+#ifdef USE_CUDA
+    if (this->config_.device_memory) {
+        gpu_mem_util::free_gpu_buffer(this->scratch_, this->config_.device);
+    } else {
+        free(this->scratch_);
+    }
+#else
+    free(this->scratch_);
+#endif
+    this->scratch_ = nullptr;
+    this->scratch_size_ = 0;
+}
+
+void Communicator::ensure_scratch(uint64_t size) noexcept(false) {
+    if (size <= this->scratch_size_) {
+        return;
+    }
+    this->release_scratch();
+
+#ifdef USE_CUDA
+    if (this->config_.device_memory) {
+        this->scratch_ = gpu_mem_util::malloc_gpu_buffer(size, this->config_.device);
+    } else {
+        this->scratch_ = malloc(size);
+    }
+#else
+    this->scratch_ = malloc(size);
+#endif
+    ASSERT(this->scratch_ != nullptr, "Failed to allocate scratch buffer");
+    this->scratch_size_ = size;
+}
+
+void Communicator::ring_reduce_scatter(
+    char* buffer,
+    const std::vector<uint64_t>& offsets,
+    DataType data_type,
+    ReduceOp op
+) noexcept(false) {
+    const uint32_t n = this->world_size_;
+    const uint32_t r = this->rank_;
+    const uint64_t element_size = get_data_type_size(data_type);
+    const uint64_t chunk_size = get_pipeline_chunk_size(this->config_.pipeline_chunk_size, element_size);
+    const auto& next = this->peers_[(r + 1) % n];
+    const auto& prev = this->peers_[(r + n - 1) % n];
+
+    uint64_t max_segment_length = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+        max_segment_length = std::max(max_segment_length, offsets[i + 1] - offsets[i]);
+    }
+    if (max_segment_length == 0) {
+        return;
+    }
+    this->ensure_scratch(max_segment_length);
+    char* scratch = static_cast<char*>(this->scratch_);
+
+    // Step s sends segment (r - s - 1) and reduces segment (r - s - 2) with the one received from prev
+    auto send_segment = [&](uint32_t step) { return (r + 2 * n - step - 1) % n; };
+    auto recv_segment = [&](uint32_t step) { return (r + 2 * n - step - 2) % n; };
+
+    std::vector<Handle> send_handles;
+    std::vector<Handle> recv_handles;
+
+    auto post_send = [&](uint32_t segment, uint64_t chunk) {
+        const uint64_t length = offsets[segment + 1] - offsets[segment];
+        const uint64_t addr = uint64_t(buffer + offsets[segment] + chunk * chunk_size);
+        send_handles.push_back(
+            next->send(this->lane_stream_id(chunk), addr, get_chunk_length(length, chunk_size, chunk))
+        );
+    };
+    auto post_recv = [&](uint32_t segment, uint64_t chunk) {
+        const uint64_t length = offsets[segment + 1] - offsets[segment];
+        const uint64_t addr = uint64_t(scratch + chunk * chunk_size);
+        recv_handles[chunk] =
+            prev->recv(this->lane_stream_id(chunk), addr, get_chunk_length(length, chunk_size, chunk));
+    };
+
+    recv_handles.resize(get_num_chunks(max_segment_length, chunk_size));
+    for (uint64_t k = 0; k < get_num_chunks(offsets[send_segment(0) + 1] - offsets[send_segment(0)], chunk_size); ++k) {
+        post_send(send_segment(0), k);
+    }
+    for (uint64_t k = 0; k < get_num_chunks(offsets[recv_segment(0) + 1] - offsets[recv_segment(0)], chunk_size); ++k) {
+        post_recv(recv_segment(0), k);
+    }
+
+    for (uint32_t step = 0; step + 1 < n; ++step) {
+        const uint32_t segment = recv_segment(step);
+        const uint64_t length = offsets[segment + 1] - offsets[segment];
+        const uint64_t num_chunks = get_num_chunks(length, chunk_size);
+        const bool has_next_step = step + 2 < n;
+        const uint64_t next_num_chunks = has_next_step
+            ? get_num_chunks(offsets[recv_segment(step + 1) + 1] - offsets[recv_segment(step + 1)], chunk_size)
+            : 0;
+
+        // Once chunk k is reduced it is forwarded, and its scratch space takes the chunk of the next step
+        auto finish_chunk = [&](uint64_t k) {
+            this->reducer_->synchronize(k);
+            if (has_next_step) {
+                post_send(segment, k);
+                if (k < next_num_chunks) {
+                    post_recv(recv_segment(step + 1), k);
+                }
+            }
+        };
+
+        for (uint64_t k = 0; k < num_chunks; ++k) {
+            recv_handles[k].wait();
+            const uint64_t offset = offsets[segment] + k * chunk_size;
+            const uint64_t chunk_length = get_chunk_length(length, chunk_size, k);
+            this->reducer_->launch(
+                k,
+                buffer + offset,
+                scratch + k * chunk_size,
+                chunk_length / element_size,
+                data_type,
+                op
+            );
+            // Lag one chunk behind, so the reduction of chunk k overlaps with finishing chunk k - 1
+            if (k > 0) {
+                finish_chunk(k - 1);
+            }
+        }
+        if (num_chunks > 0) {
+            finish_chunk(num_chunks - 1);
+        }
+        for (uint64_t k = num_chunks; k < next_num_chunks; ++k) {
+            post_recv(recv_segment(step + 1), k);
+        }
+    }
+
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+}
+
+void Communicator::ring_allgather(char* buffer, const std::vector<uint64_t>& offsets) noexcept(false) {
+    const uint32_t n = this->world_size_;
+    const uint32_t r = this->rank_;
+    const uint64_t chunk_size = this->config_.pipeline_chunk_size;
+    const auto& next = this->peers_[(r + 1) % n];
+    const auto& prev = this->peers_[(r + n - 1) % n];
+
+    // Step s sends segment (r - s) and receives segment (r - s - 1), which is sent in step s + 1
+    auto send_segment = [&](uint32_t step) { return (r + 2 * n - step) % n; };
+    auto recv_segment = [&](uint32_t step) { return (r + 2 * n - step - 1) % n; };
+    auto segment_length = [&](uint32_t segment) { return offsets[segment + 1] - offsets[segment]; };
+
+    // Received segments never overlap, so every recv is posted up front
+    std::vector<std::vector<Handle>> recv_handles(n);
+    for (uint32_t step = 0; step + 1 < n; ++step) {
+        const uint32_t segment = recv_segment(step);
+        const uint64_t length = segment_length(segment);
+        for (uint64_t k = 0; k < get_num_chunks(length, chunk_size); ++k) {
+            recv_handles[step].push_back(prev->recv(
+                this->lane_stream_id(k),
+                uint64_t(buffer + offsets[segment] + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    std::vector<Handle> send_handles;
+    for (uint32_t step = 0; step + 1 < n; ++step) {
+        const uint32_t segment = send_segment(step);
+        const uint64_t length = segment_length(segment);
+        for (uint64_t k = 0; k < get_num_chunks(length, chunk_size); ++k) {
+            if (step > 0) {
+                recv_handles[step - 1][k].wait();
+            }
+            send_handles.push_back(next->send(
+                this->lane_stream_id(k),
+                uint64_t(buffer + offsets[segment] + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    if (n > 1) {
+        for (const auto& handle : recv_handles[n - 2]) {
+            handle.wait();
+        }
+    }
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+}
+
+void Communicator::ring_broadcast(char* buffer, uint64_t length, uint32_t root) noexcept(false) {
+    const uint32_t n = this->world_size_;
+    const uint32_t position = (this->rank_ + n - root) % n;
+    const uint64_t chunk_size = this->config_.pipeline_chunk_size;
+    const uint64_t num_chunks = get_num_chunks(length, chunk_size);
+
+    std::vector<Handle> recv_handles;
+    if (position > 0) {
+        const auto& prev = this->peers_[(this->rank_ + n - 1) % n];
+        for (uint64_t k = 0; k < num_chunks; ++k) {
+            recv_handles.push_back(prev->recv(
+                this->lane_stream_id(k),
+                uint64_t(buffer + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    std::vector<Handle> send_handles;
+    for (uint64_t k = 0; k < num_chunks; ++k) {
+        if (position > 0) {
+            recv_handles[k].wait();
+        }
+        if (position + 1 < n) {
+            send_handles.push_back(this->peers_[(this->rank_ + 1) % n]->send(
+                this->lane_stream_id(k),
+                uint64_t(buffer + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+}
+
+void Communicator::tree_broadcast(char* buffer, uint64_t length, uint32_t root) noexcept(false) {
+    const uint32_t n = this->world_size_;
+    const uint32_t position = (this->rank_ + n - root) % n;
+    const uint64_t chunk_size = this->config_.pipeline_chunk_size;
+    const uint64_t num_chunks = get_num_chunks(length, chunk_size);
+
+    // Binary tree over the positions relative to root
+    auto rank_of = [&](uint32_t pos) { return (pos + root) % n; };
+    std::vector<uint32_t> children;
+    for (uint32_t child = 2 * position + 1; child <= 2 * position + 2 && child < n; ++child) {
+        children.push_back(rank_of(child));
+    }
+
+    std::vector<Handle> recv_handles;
+    if (position > 0) {
+        const auto& parent = this->peers_[rank_of((position - 1) / 2)];
+        for (uint64_t k = 0; k < num_chunks; ++k) {
+            recv_handles.push_back(parent->recv(
+                this->lane_stream_id(k),
+                uint64_t(buffer + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    std::vector<Handle> send_handles;
+    for (uint64_t k = 0; k < num_chunks; ++k) {
+        if (position > 0) {
+            recv_handles[k].wait();
+        }
+        for (uint32_t child : children) {
+            send_handles.push_back(this->peers_[child]->send(
+                this->lane_stream_id(k),
+                uint64_t(buffer + k * chunk_size),
+                get_chunk_length(length, chunk_size, k)
+            ));
+        }
+    }
+
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+}
+
+void Communicator::allgather(void* buffer, uint64_t count_per_rank, DataType data_type) noexcept(false) {
+    if (this->world_size_ == 1) {
+        return;
+    }
+    const uint64_t segment_length = count_per_rank * get_data_type_size(data_type);
+    std::vector<uint64_t> offsets(this->world_size_ + 1);
+    for (uint32_t i = 0; i <= this->world_size_; ++i) {
+        offsets[i] = i * segment_length;
+    }
+    this->ring_allgather(static_cast<char*>(buffer), offsets);
+}
+
+void Communicator::reduce_scatter(void* buffer, uint64_t count, DataType data_type, ReduceOp op) noexcept(false) {
+    if (this->world_size_ == 1) {
+        return;
+    }
+    auto offsets = get_segment_offsets(count, this->world_size_, get_data_type_size(data_type));
+    this->ring_reduce_scatter(static_cast<char*>(buffer), offsets, data_type, op);
+}
+
+void Communicator::allreduce(void* buffer, uint64_t count, DataType data_type, ReduceOp op) noexcept(false) {
+    if (this->world_size_ == 1) {
+        return;
+    }
+    auto offsets = get_segment_offsets(count, this->world_size_, get_data_type_size(data_type));
+    this->ring_reduce_scatter(static_cast<char*>(buffer), offsets, data_type, op);
+    this->ring_allgather(static_cast<char*>(buffer), offsets);
+}
+
+void Communicator::broadcast(
+    void* buffer,
+    uint64_t count,
+    DataType data_type,
+    uint32_t root,
+    CollectiveAlgorithm algorithm
+) noexcept(false) {
+    ASSERT(root < this->world_size_, "Root is out of range");
+    if (this->world_size_ == 1) {
+        return;
+    }
+    const uint64_t length = count * get_data_type_size(data_type);
+    switch (algorithm) {
+        case CollectiveAlgorithm::RING:
+            this->ring_broadcast(static_cast<char*>(buffer), length, root);
+            break;
+        case CollectiveAlgorithm::TREE:
+            this->tree_broadcast(static_cast<char*>(buffer), length, root);
+            break;
+        default:
+            throw std::runtime_error("Unknown collective algorithm");
+    }
+}
+
+}  // namespace rdma_util
@@ -1,7 +1,16 @@
+#include "gpu_mem_util.h"
+
+#include <cuda.h>
 #include <cuda_runtime.h>
+#include <unistd.h>
 
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace gpu_mem_util {
 
@@ -9,7 +18,7 @@ void* malloc_gpu_buffer(uint64_t size, uint32_t device) noexcept {
     void* d_ptr;
     if (cudaSetDevice(device) != cudaSuccess) {
         return nullptr;
-    } else if (cudaMalloc(&d_ptr, size) != cudaSuccess) {
+    } else if (cudaMalloc(&d_ptr, align_gpu_size(size)) != cudaSuccess) {
         return nullptr;
     } else {
         return d_ptr;
@@ -18,6 +27,12 @@ void* malloc_gpu_buffer(uint64_t size, uint32_t device) noexcept {
 
 void free_gpu_buffer(void* d_ptr, uint32_t device) noexcept {
     cudaSetDevice(device);
+    // The whole allocation goes away, so no cached region of it may outlive the free
+    CUdeviceptr base = 0;
+    size_t size = 0;
+    if (cuMemGetAddressRange(&base, &size, CUdeviceptr(d_ptr)) == CUDA_SUCCESS) {
+        rdma_util::DeviceRegistry::get_instance().invalidate(uint64_t(base), size);
+    }
     cudaFree(d_ptr);
 }
 
@@ -25,4 +40,194 @@ void set_device(uint32_t device) noexcept {
     cudaSetDevice(device);
 }
 
+std::string get_gpu_pci_address(uint32_t device) noexcept(false) {
+    // Room for domain:bus:device.function with a domain of 8 digits
+    char pci_bus_id[32] = {};
+    if (cudaDeviceGetPCIBusId(pci_bus_id, sizeof(pci_bus_id), int(device)) != cudaSuccess) {
+        throw std::runtime_error("Failed to get PCI bus id of the GPU");
+    }
+    return rdma_util::Topology::normalize_pci_address(pci_bus_id);
+}
+
+int get_buffer_device(const void* ptr) noexcept {
+    cudaPointerAttributes attributes {};
+    if (cudaPointerGetAttributes(&attributes, ptr) != cudaSuccess) {
+        cudaGetLastError();
+        return -1;
+    }
+    return attributes.type == cudaMemoryTypeDevice ? attributes.device : -1;
+}
+
+std::string get_nearest_rdma_device(const rdma_util::Topology& topology, const void* d_ptr) noexcept(false) {
+    const int device = get_buffer_device(d_ptr);
+    if (device < 0) {
+        throw std::runtime_error("Buffer is not GPU memory");
+    }
+    return topology.get_nearest_rdma_device(get_gpu_pci_address(uint32_t(device))).name;
+}
+
+rdma_util::Arc<rdma_util::Context>
+get_nearest_context(const rdma_util::Topology& topology, const void* d_ptr) noexcept(false) {
+    return rdma_util::DeviceRegistry::get_instance().get_context(get_nearest_rdma_device(topology, d_ptr));
+}
+
+int export_dmabuf_fd(void* d_ptr, uint64_t size) noexcept {
+    int fd = -1;
+    CUresult ret =
+        cuMemGetHandleForAddressRange(&fd, CUdeviceptr(d_ptr), size, CU_MEM_RANGE_HANDLE_TYPE_DMA_BUF_FD, 0);
+    return ret == CUDA_SUCCESS ? fd : -1;
+}
+
+rdma_util::Box<rdma_util::MemoryRegion> register_gpu_buffer_dmabuf(
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd,
+    void* d_ptr,
+    uint64_t size,
+    const rdma_util::MemoryRegionOptions& options
+) noexcept(false) {
+    // cudaMalloc only aligns addresses to 256 bytes, so the whole allocation is exported from its base,
+    // which the driver maps in whole host pages, and the buffer is registered at its offset in it
+    CUdeviceptr base = 0;
+    size_t allocation_size = 0;
+    if (cuMemGetAddressRange(&base, &allocation_size, CUdeviceptr(d_ptr)) != CUDA_SUCCESS) {
+        throw std::runtime_error("Buffer is not GPU memory");
+    }
+    const uint64_t offset = uint64_t(d_ptr) - uint64_t(base);
+    if (offset + size > allocation_size) {
+        throw std::runtime_error("GPU buffer exceeds its allocation");
+    }
+    const uint64_t page_size = uint64_t(sysconf(_SC_PAGESIZE));
+    if (uint64_t(base) % page_size != 0) {
+        throw std::runtime_error("GPU allocation is not aligned to the host page size");
+    }
+
+    int fd = export_dmabuf_fd(reinterpret_cast<void*>(base), (allocation_size + page_size - 1) / page_size * page_size);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to export GPU buffer as dma-buf");
+    }
+
+    // The MR holds its own reference of the dma-buf, so the fd is closed either way
+    try {
+        auto mr = rdma_util::MemoryRegion::create_dmabuf(pd, fd, offset, size, uint64_t(d_ptr), options);
+        close(fd);
+        return mr;
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+}
+
+constexpr uint64_t GpuMemoryPool::kMinBlockSize;
+constexpr uint64_t GpuMemoryPool::kDefaultSlabSize;
+constexpr uint64_t GpuMemoryPool::kBlocksPerSlab;
+
+uint32_t GpuMemoryPool::get_size_class(uint64_t size) noexcept {
+    uint32_t size_class = 0;
+    while ((kMinBlockSize << size_class) < size) {
+        size_class++;
+    }
+    return size_class;
+}
+
+uint64_t GpuMemoryPool::get_slab_length(uint64_t block_size, uint64_t slab_size) noexcept {
+    uint64_t length = block_size * kBlocksPerSlab;
+    if (length > slab_size) {
+        length = slab_size;
+    }
+    if (length < block_size) {
+        length = block_size;
+    }
+    return align_gpu_size(length);
+}
+
+rdma_util::Box<GpuMemoryPool> GpuMemoryPool::create(
+    uint32_t device,
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd,
+    uint64_t slab_size,
+    bool use_dmabuf
+) noexcept(false) {
+    if (slab_size < kMinBlockSize || (slab_size & (slab_size - 1)) != 0) {
+        throw std::runtime_error("Slab size must be a power of two not smaller than the minimum block size");
+    }
+
+    rdma_util::Box<GpuMemoryPool> pool = rdma_util::Box<GpuMemoryPool>(new GpuMemoryPool());
+    pool->device_ = device;
+    pool->pd_ = pd;
+    pool->slab_size_ = slab_size;
+    pool->use_dmabuf_ = use_dmabuf;
+    pool->reserved_bytes_ = 0;
+    // Enough classes for any 64-bit size
+    pool->free_blocks_ = std::vector<std::vector<GpuBlock>>(64);
+    return pool;
+}
+
+GpuMemoryPool::~GpuMemoryPool() {
+    for (auto& slab : this->slabs_) {
+        // Deregister before the memory goes away, free_gpu_buffer drops the cached regions of the slab
+        slab.mr.reset();
+        free_gpu_buffer(slab.addr, this->device_);
+    }
+}
+
+void GpuMemoryPool::refill_inner(uint32_t size_class) noexcept(false) {
+    const uint64_t block_size = kMinBlockSize << size_class;
+    const uint64_t length = get_slab_length(block_size, this->slab_size_);
+
+    void* addr = malloc_gpu_buffer(length, this->device_);
+    if (addr == nullptr) {
+        throw std::runtime_error("Failed to allocate GPU slab");
+    }
+
+    Slab slab;
+    slab.addr = addr;
+    slab.length = length;
+    try {
+        if (this->use_dmabuf_) {
+            slab.mr = register_gpu_buffer_dmabuf(this->pd_, addr, length);
+        } else {
+            slab.mr = rdma_util::MemoryRegion::create(this->pd_, addr, length);
+        }
+    } catch (...) {
+        free_gpu_buffer(addr, this->device_);
+        throw;
+    }
+
+    const uint32_t lkey = slab.mr->get_lkey();
+    const uint32_t rkey = slab.mr->get_rkey();
+    for (uint64_t offset = 0; offset + block_size <= length; offset += block_size) {
+        this->free_blocks_[size_class].push_back(GpuBlock {static_cast<char*>(addr) + offset, block_size, lkey, rkey});
+    }
+    this->slabs_.push_back(std::move(slab));
+    this->reserved_bytes_ += length;
+}
+
+GpuBlock GpuMemoryPool::allocate(uint64_t size) noexcept(false) {
+    if (size == 0) {
+        throw std::runtime_error("Size must be positive");
+    }
+
+    const uint32_t size_class = get_size_class(size);
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    std::vector<GpuBlock>& free_blocks = this->free_blocks_[size_class];
+    if (free_blocks.empty()) {
+        this->refill_inner(size_class);
+    }
+    GpuBlock block = free_blocks.back();
+    free_blocks.pop_back();
+    return block;
+}
+
+void GpuMemoryPool::deallocate(const GpuBlock& block) noexcept(false) {
+    const uint32_t size_class = get_size_class(block.size);
+    if ((kMinBlockSize << size_class) != block.size) {
+        throw std::runtime_error("Block does not belong to a size class");
+    }
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->free_blocks_[size_class].push_back(block);
+}
+
+uint64_t GpuMemoryPool::get_reserved_bytes() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->reserved_bytes_;
+}
+
 }  // namespace gpu_mem_util
@@ -0,0 +1,17 @@
+#ifndef _RDMA_ASSERT_H_
+#define _RDMA_ASSERT_H_
+
+// Private to the sources of this library, it is not installed with the public headers
+
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+
+// Reports the failed check with its location, then throws, so callers see a std::runtime_error
+#define ASSERT(expr, msg) \
+    if (!(expr)) { \
+        printf("Assertion failed: %s:%d %s\n", __FILE__, __LINE__, msg); \
+        throw std::runtime_error(std::string("Assertion failed: ") + msg); \
+    }
+
+#endif  // _RDMA_ASSERT_H_
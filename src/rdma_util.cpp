@@ -1,27 +1,43 @@
 #include "rdma_util.h"
+#include "topology.h"
 
+#include <fcntl.h>
 #include <infiniband/verbs.h>
+#include <linux/futex.h>
 #include <netinet/in.h>
-
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <fstream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <queue>
 #include <stdexcept>
+#include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
 
-namespace rdma_util {
+#include "rdma_assert.h"
 
-#define ASSERT(expr, msg) \
-    if (!(expr)) { \
-        printf("Assertion failed: %s:%d %s\n", __FILE__, __LINE__, msg); \
-        throw std::runtime_error(std::string("Assertion failed: ") + msg); \
-    }
+namespace rdma_util {
 
 Context::Context(const char* dev_name) noexcept(false) {
     auto dev_list = ibv_get_device_list(nullptr);
@@ -79,59 +95,245 @@ ProtectionDomain::~ProtectionDomain() {
     }
 }
 
-RcQueuePair::RcQueuePair(rdma_util::Arc<ProtectionDomain> pd) noexcept(false) {
+DeviceRegistry& DeviceRegistry::get_instance() noexcept {
+    // Leaked on purpose, so it outlives every static object which may still release a device
+    static DeviceRegistry* registry = new DeviceRegistry();
+    return *registry;
+}
+
+Arc<Context> DeviceRegistry::get_context_locked(const std::string& dev_name) noexcept(false) {
+    Arc<Context> context = this->contexts_[dev_name].lock();
+    if (context == nullptr) {
+        context = Context::create(dev_name.c_str());
+        this->contexts_[dev_name] = context;
+    }
+    return context;
+}
+
+Arc<Context> DeviceRegistry::get_context(const std::string& dev_name) noexcept(false) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->get_context_locked(dev_name);
+}
+
+Arc<ProtectionDomain> DeviceRegistry::get_pd(const std::string& dev_name) noexcept(false) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    Arc<ProtectionDomain> pd = this->pds_[dev_name].lock();
+    if (pd == nullptr) {
+        pd = ProtectionDomain::create(this->get_context_locked(dev_name));
+        this->pds_[dev_name] = pd;
+    }
+    return pd;
+}
+
+Arc<MemoryRegionCache> DeviceRegistry::get_memory_region_cache(Arc<ProtectionDomain> pd) noexcept(false) {
+    return this->get_memory_region_cache(std::move(pd), MemoryRegionCacheConfig());
+}
+
+Arc<MemoryRegionCache> DeviceRegistry::get_memory_region_cache(
+    Arc<ProtectionDomain> pd,
+    const MemoryRegionCacheConfig& config
+) noexcept(false) {
+    ASSERT(pd != nullptr, "ProtectionDomain is null");
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    for (auto it = this->memory_region_caches_.begin(); it != this->memory_region_caches_.end();) {
+        it = it->second.expired() ? this->memory_region_caches_.erase(it) : std::next(it);
+    }
+
+    std::weak_ptr<MemoryRegionCache>& entry = this->memory_region_caches_[pd.get()];
+    Arc<MemoryRegionCache> cache = entry.lock();
+    if (cache == nullptr) {
+        cache = MemoryRegionCache::create(std::move(pd), config);
+        entry = cache;
+    }
+    return cache;
+}
+
+void DeviceRegistry::invalidate(uint64_t addr, uint64_t length) noexcept {
+    // Collected first, so the caches are not locked under the registry lock
+    std::vector<Arc<MemoryRegionCache>> caches;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        for (auto& entry : this->memory_region_caches_) {
+            Arc<MemoryRegionCache> cache = entry.second.lock();
+            if (cache != nullptr) {
+                caches.push_back(std::move(cache));
+            }
+        }
+    }
+    for (auto& cache : caches) {
+        cache->invalidate(addr, length);
+    }
+}
+
+RcQueuePair::RcQueuePair(
+    rdma_util::Arc<ProtectionDomain> pd,
+    const QueuePairConfig& config,
+    rdma_util::Arc<SharedReceiveQueue> srq
+) noexcept(false) {
+    const bool own_recv_cq = srq == nullptr;
+    ASSERT(
+        config.send_cq_depth > 0 && (config.shared_cq || !own_recv_cq || config.recv_cq_depth > 0),
+        "CQ depth must be positive"
+    );
+    ASSERT(config.max_send_wr > 0 && (!own_recv_cq || config.max_recv_wr > 0), "Max WRs must be positive");
+    ASSERT(config.max_send_sge > 0 && (!own_recv_cq || config.max_recv_sge > 0), "Max SGEs must be positive");
+
     this->pd_ = pd;
     this->context_ = pd->context_;
-    auto send_cq = ibv_create_cq(context_->inner, 128, nullptr, nullptr, 0);
-    auto recv_cq = ibv_create_cq(context_->inner, 128, nullptr, nullptr, 0);
+    this->srq_ = srq;
+    this->config_ = config;
+
+    ibv_comp_channel* completion_channel = nullptr;
+    if (config.use_completion_channel) {
+        completion_channel = ibv_create_comp_channel(context_->inner);
+        if (completion_channel == nullptr) {
+            throw std::runtime_error("Failed to create completion channel");
+        }
+        int flags = fcntl(completion_channel->fd, F_GETFL);
+        if (flags < 0 || fcntl(completion_channel->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+            ibv_destroy_comp_channel(completion_channel);
+            throw std::runtime_error("Failed to set completion channel non-blocking");
+        }
+    }
+
+    ibv_cq* send_cq = nullptr;
+    ibv_cq* recv_cq = nullptr;
+    if (!own_recv_cq) {
+        this->config_.shared_cq = false;
+        send_cq = ibv_create_cq(context_->inner, config.send_cq_depth, nullptr, completion_channel, 0);
+        recv_cq = srq->recv_cq_;
+    } else if (config.shared_cq) {
+        send_cq = ibv_create_cq(context_->inner, config.send_cq_depth, nullptr, completion_channel, 0);
+        recv_cq = send_cq;
+    } else {
+        send_cq = ibv_create_cq(context_->inner, config.send_cq_depth, nullptr, completion_channel, 0);
+        recv_cq = ibv_create_cq(context_->inner, config.recv_cq_depth, nullptr, completion_channel, 0);
+    }
 
     if (send_cq == nullptr || recv_cq == nullptr) {
         if (send_cq) {
             ibv_destroy_cq(send_cq);
         }
-        if (recv_cq) {
+        if (own_recv_cq && recv_cq && recv_cq != send_cq) {
             ibv_destroy_cq(recv_cq);
         }
+        if (completion_channel) {
+            ibv_destroy_comp_channel(completion_channel);
+        }
         throw std::runtime_error("Failed to create completion queue");
     }
 
     ibv_qp_init_attr init_attr {};
     init_attr.send_cq = send_cq;
     init_attr.recv_cq = recv_cq;
-    init_attr.cap.max_send_wr = 128;
-    init_attr.cap.max_recv_wr = 1024;
-    init_attr.cap.max_send_sge = 1;
-    init_attr.cap.max_recv_sge = 1;
-    init_attr.cap.max_inline_data = 64;
+    init_attr.cap.max_send_wr = config.max_send_wr;
+    init_attr.cap.max_recv_wr = config.max_recv_wr;
+    init_attr.cap.max_send_sge = config.max_send_sge;
+    init_attr.cap.max_recv_sge = config.max_recv_sge;
+    init_attr.cap.max_inline_data = config.max_inline_data;
     init_attr.qp_type = IBV_QPT_RC;
     init_attr.sq_sig_all = 0;
+    if (!own_recv_cq) {
+        init_attr.srq = srq->inner;
+        init_attr.cap.max_recv_wr = 0;
+        init_attr.cap.max_recv_sge = 0;
+    }
 
     this->inner = ibv_create_qp(pd->inner, &init_attr);
     if (this->inner == nullptr) {
         ibv_destroy_cq(send_cq);
-        ibv_destroy_cq(recv_cq);
+        if (own_recv_cq && recv_cq != send_cq) {
+            ibv_destroy_cq(recv_cq);
+        }
+        if (completion_channel) {
+            ibv_destroy_comp_channel(completion_channel);
+        }
         throw std::runtime_error("Failed to create queue pair");
     }
+
+    this->completion_channel_ = completion_channel;
+
+    // ibv_create_qp and ibv_create_cq update the capabilities to the actual ones
+    this->config_.max_send_wr = init_attr.cap.max_send_wr;
+    this->config_.max_recv_wr = init_attr.cap.max_recv_wr;
+    this->config_.max_send_sge = init_attr.cap.max_send_sge;
+    this->config_.max_recv_sge = init_attr.cap.max_recv_sge;
+    this->config_.max_inline_data = init_attr.cap.max_inline_data;
+    this->config_.send_cq_depth = send_cq->cqe;
+    this->config_.recv_cq_depth = recv_cq->cqe;
 }
 
 Box<RcQueuePair> RcQueuePair::create(const char* dev_name) noexcept(false) {
-    return Box<RcQueuePair>(new RcQueuePair(ProtectionDomain::create(Context::create(dev_name))));
+    return RcQueuePair::create(dev_name, QueuePairConfig());
 }
 
 Box<RcQueuePair> RcQueuePair::create(rdma_util::Arc<Context> context) noexcept(false) {
-    return Box<RcQueuePair>(new RcQueuePair(ProtectionDomain::create(context)));
+    return RcQueuePair::create(context, QueuePairConfig());
 }
 
 Box<RcQueuePair> RcQueuePair::create(rdma_util::Arc<ProtectionDomain> pd) noexcept(false) {
-    return Box<RcQueuePair>(new RcQueuePair(pd));
+    return RcQueuePair::create(pd, QueuePairConfig());
+}
+
+Box<RcQueuePair> RcQueuePair::create(const char* dev_name, const QueuePairConfig& config) noexcept(false) {
+    return Box<RcQueuePair>(new RcQueuePair(DeviceRegistry::get_instance().get_pd(dev_name), config, nullptr));
+}
+
+Box<RcQueuePair> RcQueuePair::create(rdma_util::Arc<Context> context, const QueuePairConfig& config) noexcept(false) {
+    return Box<RcQueuePair>(new RcQueuePair(ProtectionDomain::create(context), config, nullptr));
+}
+
+Box<RcQueuePair>
+RcQueuePair::create(rdma_util::Arc<ProtectionDomain> pd, const QueuePairConfig& config) noexcept(false) {
+    return Box<RcQueuePair>(new RcQueuePair(pd, config, nullptr));
+}
+
+Box<RcQueuePair>
+RcQueuePair::create(rdma_util::Arc<SharedReceiveQueue> srq, const QueuePairConfig& config) noexcept(false) {
+    ASSERT(srq != nullptr, "SRQ is null");
+    return Box<RcQueuePair>(new RcQueuePair(srq->get_pd(), config, srq));
 }
 
 RcQueuePair::~RcQueuePair() {
     if (this->inner) {
-        ibv_destroy_cq(this->inner->send_cq);
-        ibv_destroy_cq(this->inner->recv_cq);
+        // The QP must go first, CQs which are still attached can not be destroyed.
+        // The recv CQ of an SRQ belongs to the SRQ.
+        auto send_cq = this->inner->send_cq;
+        auto recv_cq = this->inner->recv_cq;
         ibv_destroy_qp(this->inner);
+        ibv_destroy_cq(send_cq);
+        if (recv_cq != send_cq && this->srq_ == nullptr) {
+            ibv_destroy_cq(recv_cq);
+        }
+        if (this->completion_channel_) {
+            ibv_destroy_comp_channel(this->completion_channel_);
+        }
+    }
+}
+
+int RcQueuePair::arm_completion_notification() noexcept {
+    if (this->completion_channel_ == nullptr) {
+        return EINVAL;
+    }
+    int ret = ibv_req_notify_cq(this->inner->send_cq, 0);
+    if (ret || this->inner->recv_cq == this->inner->send_cq || this->srq_ != nullptr) {
+        return ret;
+    }
+    return ibv_req_notify_cq(this->inner->recv_cq, 0);
+}
+
+int RcQueuePair::ack_completion_events() noexcept {
+    if (this->completion_channel_ == nullptr) {
+        return 0;
     }
+    int num_events = 0;
+    ibv_cq* cq = nullptr;
+    void* cq_context = nullptr;
+    while (ibv_get_cq_event(this->completion_channel_, &cq, &cq_context) == 0) {
+        ibv_ack_cq_events(cq, 1);
+        num_events++;
+    }
+    return num_events;
 }
 
 QueuePairState RcQueuePair::query_qp_state() noexcept(false) {
@@ -155,17 +357,21 @@ QueuePairState RcQueuePair::query_qp_state() noexcept(false) {
 }
 
 HandshakeData RcQueuePair::get_handshake_data() noexcept(false) {
+    return this->get_handshake_data(BringUpOptions());
+}
+
+HandshakeData RcQueuePair::get_handshake_data(const BringUpOptions& options) noexcept(false) {
     ibv_qp_attr attr_ {};
 
     attr_.ah_attr.static_rate = ibv_rate::IBV_RATE_100_GBPS;
     ibv_modify_qp(this->inner, &attr_, ibv_qp_attr_mask::IBV_QP_RATE_LIMIT);
 
     ibv_gid gid;
-    if (ibv_query_gid(this->context_->inner, 1, 0, &gid)) {
+    if (ibv_query_gid(this->context_->inner, options.port_num, options.gid_index, &gid)) {
         throw std::runtime_error("Failed to query gid");
     }
     ibv_port_attr attr;
-    if (ibv_query_port(this->context_->inner, 1, &attr)) {
+    if (ibv_query_port(this->context_->inner, options.port_num, &attr)) {
         throw std::runtime_error("Failed to query port");
     }
 
@@ -177,6 +383,12 @@ HandshakeData RcQueuePair::get_handshake_data() noexcept(false) {
 }
 
 void RcQueuePair::bring_up(const HandshakeData& handshake_data, ibv_rate rate) noexcept(false) {
+    BringUpOptions options;
+    options.rate = rate;
+    this->bring_up(handshake_data, options);
+}
+
+void RcQueuePair::bring_up(const HandshakeData& handshake_data, const BringUpOptions& options) noexcept(false) {
     ibv_gid gid = handshake_data.gid;
     uint16_t lid = handshake_data.lid;
     uint32_t remote_qp_num = handshake_data.qp_num;
@@ -206,7 +418,7 @@ void RcQueuePair::bring_up(const HandshakeData& handshake_data, ibv_rate rate) n
         attr.qp_state = ibv_qp_state::IBV_QPS_INIT;
         attr.qp_access_flags = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
         attr.pkey_index = 0;
-        attr.port_num = 1;
+        attr.port_num = options.port_num;
 
         if (ibv_modify_qp(this->inner, &attr, mask)) {
             throw std::runtime_error("Failed to modify to INIT");
@@ -220,18 +432,19 @@ void RcQueuePair::bring_up(const HandshakeData& handshake_data, ibv_rate rate) n
             | ibv_qp_attr_mask::IBV_QP_MAX_DEST_RD_ATOMIC | ibv_qp_attr_mask::IBV_QP_MIN_RNR_TIMER;
         ibv_qp_attr attr {};
         attr.qp_state = ibv_qp_state::IBV_QPS_RTR;
-        attr.path_mtu = ibv_mtu::IBV_MTU_4096;
+        attr.path_mtu = options.path_mtu;
         attr.rq_psn = remote_qp_num;
         attr.dest_qp_num = remote_qp_num;
         attr.ah_attr.grh.dgid = gid;
         attr.ah_attr.grh.flow_label = 0;
-        attr.ah_attr.grh.sgid_index = 0;
+        attr.ah_attr.grh.sgid_index = options.gid_index;
         attr.ah_attr.grh.hop_limit = 255;
+        attr.ah_attr.grh.traffic_class = options.traffic_class;
         attr.ah_attr.dlid = lid;
         attr.ah_attr.is_global = 1;
-        attr.ah_attr.port_num = 1;
-        attr.ah_attr.static_rate = rate;
-        attr.max_dest_rd_atomic = 16;
+        attr.ah_attr.port_num = options.port_num;
+        attr.ah_attr.static_rate = options.rate;
+        attr.max_dest_rd_atomic = options.max_rd_atomic;
         attr.min_rnr_timer = 0;
 
         if (ibv_modify_qp(this->inner, &attr, mask)) {
@@ -248,7 +461,7 @@ void RcQueuePair::bring_up(const HandshakeData& handshake_data, ibv_rate rate) n
         ibv_qp_attr attr {};
         attr.qp_state = ibv_qp_state::IBV_QPS_RTS;
         attr.sq_psn = this->inner->qp_num;
-        attr.max_rd_atomic = 16;
+        attr.max_rd_atomic = options.max_rd_atomic;
         attr.timeout = 14;
         attr.retry_cnt = 7;
         attr.rnr_retry = 7;
@@ -259,6 +472,118 @@ void RcQueuePair::bring_up(const HandshakeData& handshake_data, ibv_rate rate) n
     }
 }
 
+constexpr uint32_t RcQueuePair::kDefaultBringUpThreads;
+
+void RcQueuePair::bring_up_all(
+    const std::vector<BringUpRequest>& requests,
+    const BringUpOptions& options,
+    uint32_t num_threads
+) noexcept(false) {
+    ASSERT(num_threads > 0, "num_threads must be positive");
+    const uint64_t num_workers = std::min<uint64_t>(num_threads, requests.size());
+    if (num_workers <= 1) {
+        for (const auto& request : requests) {
+            request.qp->bring_up(request.remote, options);
+        }
+        return;
+    }
+
+    std::atomic<uint64_t> next(0);
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto worker = [&]() {
+        for (uint64_t i = next.fetch_add(1); i < requests.size(); i = next.fetch_add(1)) {
+            try {
+                requests[i].qp->bring_up(requests[i].remote, options);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    };
+
+    // The calling thread is one of the workers
+    std::vector<std::thread> workers;
+    for (uint64_t i = 1; i < num_workers; ++i) {
+        workers.push_back(std::thread(worker));
+    }
+    worker();
+    for (auto& thread : workers) {
+        thread.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+void RcQueuePair::reset() noexcept(false) {
+    ibv_qp_attr attr {};
+    attr.qp_state = ibv_qp_state::IBV_QPS_RESET;
+    if (ibv_modify_qp(this->inner, &attr, ibv_qp_attr_mask::IBV_QP_STATE)) {
+        throw std::runtime_error("Failed to modify to RESET");
+    }
+
+    // Completions of the previous connection must not show up on the next one
+    ibv_wc wcs[kPollBatchSize];
+    while (ibv_poll_cq(this->inner->send_cq, kPollBatchSize, wcs) > 0) {
+    }
+    if (this->srq_ == nullptr && this->inner->recv_cq != this->inner->send_cq) {
+        while (ibv_poll_cq(this->inner->recv_cq, kPollBatchSize, wcs) > 0) {
+        }
+    }
+}
+
+Arc<QueuePairPool> QueuePairPool::create(
+    Arc<ProtectionDomain> pd,
+    const QueuePairConfig& config,
+    uint64_t num_reserved
+) noexcept(false) {
+    ASSERT(pd != nullptr, "ProtectionDomain is null");
+    auto pool = Arc<QueuePairPool>(new QueuePairPool());
+    pool->pd_ = pd;
+    pool->config_ = config;
+    pool->reserve(num_reserved);
+    return pool;
+}
+
+void QueuePairPool::reserve(uint64_t count) noexcept(false) {
+    uint64_t num_idle = this->get_num_idle();
+    // QPs are created outside the lock, creating one is a round trip to the device
+    while (num_idle < count) {
+        Box<RcQueuePair> qp = RcQueuePair::create(this->pd_, this->config_);
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->idle_qps_.push_back(std::move(qp));
+        num_idle = this->idle_qps_.size();
+    }
+}
+
+Box<RcQueuePair> QueuePairPool::acquire() noexcept(false) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        if (!this->idle_qps_.empty()) {
+            Box<RcQueuePair> qp = std::move(this->idle_qps_.back());
+            this->idle_qps_.pop_back();
+            return qp;
+        }
+    }
+    return RcQueuePair::create(this->pd_, this->config_);
+}
+
+void QueuePairPool::release(Box<RcQueuePair> qp) noexcept(false) {
+    ASSERT(qp != nullptr, "QP is null");
+    ASSERT(qp->get_pd() == this->pd_, "QP does not belong to the ProtectionDomain of the pool");
+    qp->reset();
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->idle_qps_.push_back(std::move(qp));
+}
+
+uint64_t QueuePairPool::get_num_idle() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->idle_qps_.size();
+}
+
 int RcQueuePair::post_send_send(
     uint64_t wr_id,
     uint64_t laddr,
@@ -417,462 +742,2153 @@ int RcQueuePair::post_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint3
     return ibv_post_recv(this->inner, &wr, &bad_wr);
 }
 
-int RcQueuePair::wait_until_send_completion(
-    const int expected_num_wcs,
-    std::vector<WorkCompletion>& polled_wcs
-) noexcept {
-    ibv_wc* work_completions = new ibv_wc[expected_num_wcs];
-    int ret = 0;
-    int num_polled_completions = 0;
-
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
-    }
-
-    while (num_polled_completions < expected_num_wcs) {
-        ret = ibv_poll_cq(this->inner->send_cq, expected_num_wcs, work_completions);
-        if (ret > 0) {
-            for (int i = 0; i < ret; ++i) {
-                WorkCompletion work_completion {};
-                work_completion.wr_id = work_completions[i].wr_id;
-                work_completion.status = work_completions[i].status;
-                work_completion.byte_len = work_completions[i].byte_len;
-                work_completion.opcode = work_completions[i].opcode;
-                work_completion.imm_data = ntohl(work_completions[i].imm_data);
-                polled_wcs.push_back(work_completion);
-            }
-            num_polled_completions += ret;
-        } else if (ret < 0) {
-            delete[] work_completions;
-            return ret;
-        }
+int RcQueuePair::post_send_batch(SendWorkRequestBatch& batch) noexcept {
+    if (batch.empty()) {
+        return 0;
     }
-    delete[] work_completions;
-    return 0;
-}
 
-int RcQueuePair::wait_until_recv_completion(
-    const int expected_num_wcs,
-    std::vector<WorkCompletion>& polled_wcs
-) noexcept {
-    ibv_wc* work_completions = new ibv_wc[expected_num_wcs];
-    int ret = 0;
-    int num_polled_completions = 0;
-
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
-    }
-
-    while (num_polled_completions < expected_num_wcs) {
-        ret = ibv_poll_cq(this->inner->recv_cq, expected_num_wcs, work_completions);
-        if (ret > 0) {
-            for (int i = 0; i < ret; ++i) {
-                WorkCompletion work_completion {};
-                work_completion.wr_id = work_completions[i].wr_id;
-                work_completion.status = work_completions[i].status;
-                work_completion.byte_len = work_completions[i].byte_len;
-                work_completion.opcode = work_completions[i].opcode;
-                work_completion.imm_data = ntohl(work_completions[i].imm_data);
-                polled_wcs.push_back(work_completion);
-            }
-            num_polled_completions += ret;
-        } else if (ret < 0) {
-            delete[] work_completions;
-            return ret;
-        }
+    for (uint64_t i = 0; i + 1 < batch.num_wrs_; ++i) {
+        batch.wrs_[i].next = &batch.wrs_[i + 1];
     }
-    delete[] work_completions;
-    return 0;
+    batch.wrs_[batch.num_wrs_ - 1].next = nullptr;
+
+    ibv_send_wr* bad_wr = nullptr;
+    int ret = ibv_post_send(this->inner, batch.wrs_.data(), &bad_wr);
+    batch.clear();
+    return ret;
 }
 
-int RcQueuePair::poll_send_cq_once(const int max_num_wcs, std::vector<WorkCompletion>& polled_wcs) noexcept {
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
+int RcQueuePair::post_recv_batch(RecvWorkRequestBatch& batch) noexcept {
+    if (batch.empty()) {
+        return 0;
     }
 
-    ibv_wc* work_completions = new ibv_wc[max_num_wcs];
-
-    int ret = ibv_poll_cq(this->inner->send_cq, max_num_wcs, work_completions);
-
-    if (ret > 0) {
-        for (int i = 0; i < ret; ++i) {
-            WorkCompletion work_completion {};
-            work_completion.wr_id = work_completions[i].wr_id;
-            work_completion.status = work_completions[i].status;
-            work_completion.byte_len = work_completions[i].byte_len;
-            work_completion.opcode = work_completions[i].opcode;
-            work_completion.imm_data = ntohl(work_completions[i].imm_data);
-            polled_wcs.push_back(work_completion);
-        }
+    for (uint64_t i = 0; i + 1 < batch.num_wrs_; ++i) {
+        batch.wrs_[i].next = &batch.wrs_[i + 1];
     }
+    batch.wrs_[batch.num_wrs_ - 1].next = nullptr;
 
-    delete[] work_completions;
+    ibv_recv_wr* bad_wr = nullptr;
+    int ret = ibv_post_recv(this->inner, batch.wrs_.data(), &bad_wr);
+    batch.clear();
     return ret;
 }
 
-int RcQueuePair::poll_recv_cq_once(const int max_num_wcs, std::vector<WorkCompletion>& polled_wcs) noexcept {
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
-    }
-
-    ibv_wc* work_completions = new ibv_wc[max_num_wcs];
-
-    int ret = ibv_poll_cq(this->inner->recv_cq, max_num_wcs, work_completions);
+static inline WorkCompletion to_work_completion(const ibv_wc& wc) {
+    WorkCompletion work_completion {};
+    work_completion.wr_id = wc.wr_id;
+    work_completion.status = wc.status;
+    work_completion.byte_len = wc.byte_len;
+    work_completion.opcode = wc.opcode;
+    work_completion.imm_data = ntohl(wc.imm_data);
+    work_completion.qp_num = wc.qp_num;
+    return work_completion;
+}
 
-    if (ret > 0) {
-        for (int i = 0; i < ret; ++i) {
-            WorkCompletion work_completion {};
-            work_completion.wr_id = work_completions[i].wr_id;
-            work_completion.status = work_completions[i].status;
-            work_completion.byte_len = work_completions[i].byte_len;
-            work_completion.opcode = work_completions[i].opcode;
-            work_completion.imm_data = ntohl(work_completions[i].imm_data);
-            polled_wcs.push_back(work_completion);
-        }
+/**
+ * @brief Poll up to `max_num_wcs` work completions through `wc_buffer` and append them to `polled_wcs`.
+ * Nothing is allocated as long as `polled_wcs` has enough capacity.
+ */
+static int poll_cq_into(ibv_cq* cq, const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs) {
+    int ret = ibv_poll_cq(cq, max_num_wcs, wc_buffer);
+    for (int i = 0; i < ret; ++i) {
+        polled_wcs.push_back(to_work_completion(wc_buffer[i]));
     }
-
-    delete[] work_completions;
     return ret;
 }
 
-int RcQueuePair::poll_send_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs) {
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
+/**
+ * @brief Poll up to `max_num_wcs` work completions in rounds of kPollBatchSize through a stack buffer.
+ */
+static int poll_cq_chunked(ibv_cq* cq, const int max_num_wcs, std::vector<WorkCompletion>& polled_wcs) {
+    ibv_wc wc_buffer[RcQueuePair::kPollBatchSize];
+    int num_polled = 0;
+    while (num_polled < max_num_wcs) {
+        const int num_wanted = std::min(max_num_wcs - num_polled, RcQueuePair::kPollBatchSize);
+        const int ret = poll_cq_into(cq, num_wanted, wc_buffer, polled_wcs);
+        if (ret < 0) {
+            return ret;
+        }
+        num_polled += ret;
+        if (ret < num_wanted) {
+            break;
+        }
     }
+    return num_polled;
+}
 
-    ibv_wc* work_completions = wc_buffer;
-
-    int ret = ibv_poll_cq(this->inner->send_cq, max_num_wcs, work_completions);
-
-    if (ret > 0) {
-        for (int i = 0; i < ret; ++i) {
-            WorkCompletion work_completion {};
-            work_completion.wr_id = work_completions[i].wr_id;
-            work_completion.status = work_completions[i].status;
-            work_completion.byte_len = work_completions[i].byte_len;
-            work_completion.opcode = work_completions[i].opcode;
-            work_completion.imm_data = ntohl(work_completions[i].imm_data);
-            polled_wcs.push_back(work_completion);
+static int wait_until_cq_completion(ibv_cq* cq, const int expected_num_wcs, std::vector<WorkCompletion>& polled_wcs) {
+    int num_polled = 0;
+    while (num_polled < expected_num_wcs) {
+        const int ret = poll_cq_chunked(cq, expected_num_wcs - num_polled, polled_wcs);
+        if (ret < 0) {
+            return ret;
         }
+        num_polled += ret;
     }
+    return 0;
+}
 
-    return ret;
+constexpr int RcQueuePair::kPollBatchSize;
+
+int RcQueuePair::wait_until_send_completion(
+    const int expected_num_wcs,
+    std::vector<WorkCompletion>& polled_wcs
+) noexcept {
+    polled_wcs.clear();
+    return wait_until_cq_completion(this->inner->send_cq, expected_num_wcs, polled_wcs);
 }
 
-int RcQueuePair::poll_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs) {
-    if (polled_wcs.size() > 0) {
-        polled_wcs.clear();
-    }
+int RcQueuePair::wait_until_recv_completion(
+    const int expected_num_wcs,
+    std::vector<WorkCompletion>& polled_wcs
+) noexcept {
+    polled_wcs.clear();
+    return wait_until_cq_completion(this->inner->recv_cq, expected_num_wcs, polled_wcs);
+}
 
-    ibv_wc* work_completions = wc_buffer;
+int RcQueuePair::poll_send_cq_once(const int max_num_wcs, std::vector<WorkCompletion>& polled_wcs) noexcept {
+    polled_wcs.clear();
+    return poll_cq_chunked(this->inner->send_cq, max_num_wcs, polled_wcs);
+}
 
-    int ret = ibv_poll_cq(this->inner->recv_cq, max_num_wcs, work_completions);
+int RcQueuePair::poll_recv_cq_once(const int max_num_wcs, std::vector<WorkCompletion>& polled_wcs) noexcept {
+    polled_wcs.clear();
+    return poll_cq_chunked(this->inner->recv_cq, max_num_wcs, polled_wcs);
+}
 
-    if (ret > 0) {
-        for (int i = 0; i < ret; ++i) {
-            WorkCompletion work_completion {};
-            work_completion.wr_id = work_completions[i].wr_id;
-            work_completion.status = work_completions[i].status;
-            work_completion.byte_len = work_completions[i].byte_len;
-            work_completion.opcode = work_completions[i].opcode;
-            work_completion.imm_data = ntohl(work_completions[i].imm_data);
-            polled_wcs.push_back(work_completion);
-        }
-    }
+int RcQueuePair::poll_send_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs) {
+    polled_wcs.clear();
+    return poll_cq_into(this->inner->send_cq, max_num_wcs, wc_buffer, polled_wcs);
+}
 
-    return ret;
+int RcQueuePair::poll_recv_cq_once(const int max_num_wcs, ibv_wc* wc_buffer, std::vector<WorkCompletion>& polled_wcs) {
+    polled_wcs.clear();
+    return poll_cq_into(this->inner->recv_cq, max_num_wcs, wc_buffer, polled_wcs);
 }
 
-MemoryRegion::MemoryRegion(
+SharedReceiveQueue::SharedReceiveQueue(
     rdma_util::Arc<ProtectionDomain> pd,
-    rdma_util::Arc<void> buffer_with_deleter,
-    uint64_t length
+    const SharedReceiveQueueConfig& config
 ) noexcept(false) {
-    auto addr = buffer_with_deleter.get();
+    ASSERT(config.max_wr > 0 && config.max_sge > 0 && config.cq_depth > 0, "SRQ sizes must be positive");
 
-    this->inner_buffer_with_deleter_ = buffer_with_deleter;
     this->pd_ = pd;
-    this->context_ = pd->context_;
-    this->inner = ibv_reg_mr(
-        pd->inner,
-        addr,
-        length,
-        ibv_access_flags::IBV_ACCESS_LOCAL_WRITE | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE
-            | ibv_access_flags::IBV_ACCESS_REMOTE_READ
-    );
-    if (this->inner == nullptr) {
-        throw std::runtime_error("Failed to register memory region");
+    this->config_ = config;
+
+    this->recv_cq_ = ibv_create_cq(pd->context_->inner, config.cq_depth, nullptr, nullptr, 0);
+    if (this->recv_cq_ == nullptr) {
+        throw std::runtime_error("Failed to create completion queue");
     }
-}
 
-MemoryRegion::MemoryRegion(rdma_util::Arc<ProtectionDomain> pd, void* addr, uint64_t length) noexcept(false) {
-    this->inner_buffer_with_deleter_ = nullptr;
-    this->pd_ = pd;
-    this->context_ = pd->context_;
-    this->inner = ibv_reg_mr(
-        pd->inner,
-        addr,
-        length,
-        ibv_access_flags::IBV_ACCESS_LOCAL_WRITE | ibv_access_flags::IBV_ACCESS_REMOTE_WRITE
-            | ibv_access_flags::IBV_ACCESS_REMOTE_READ
-    );
+    ibv_srq_init_attr init_attr {};
+    init_attr.attr.max_wr = config.max_wr;
+    init_attr.attr.max_sge = config.max_sge;
+    this->inner = ibv_create_srq(pd->inner, &init_attr);
     if (this->inner == nullptr) {
-        throw std::runtime_error("Failed to register memory region");
+        ibv_destroy_cq(this->recv_cq_);
+        throw std::runtime_error("Failed to create shared receive queue");
     }
+
+    // ibv_create_srq and ibv_create_cq update the capabilities to the actual ones
+    this->config_.max_wr = init_attr.attr.max_wr;
+    this->config_.max_sge = init_attr.attr.max_sge;
+    this->config_.cq_depth = this->recv_cq_->cqe;
 }
 
-MemoryRegion::~MemoryRegion() {
-    if (this->inner) {
-        ibv_dereg_mr(this->inner);
-    }
+SharedReceiveQueue::~SharedReceiveQueue() {
+    // The attached QPs hold a reference, so all of them are gone by now
+    ibv_destroy_srq(this->inner);
+    ibv_destroy_cq(this->recv_cq_);
 }
 
-Box<MemoryRegion> MemoryRegion::create(
+rdma_util::Arc<SharedReceiveQueue> SharedReceiveQueue::create(
     rdma_util::Arc<ProtectionDomain> pd,
-    rdma_util::Arc<void> buffer_with_deleter,
-    uint64_t length
+    const SharedReceiveQueueConfig& config
 ) noexcept(false) {
-    return Box<MemoryRegion>(new MemoryRegion(pd, buffer_with_deleter, length));
+    return Arc<SharedReceiveQueue>(new SharedReceiveQueue(pd, config));
 }
 
-Box<MemoryRegion> MemoryRegion::create(rdma_util::Arc<ProtectionDomain> pd, void* addr, uint64_t length) noexcept(false
-) {
-    return Box<MemoryRegion>(new MemoryRegion(pd, addr, length));
+int SharedReceiveQueue::post_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey) noexcept {
+    ibv_sge sge {};
+    ibv_recv_wr wr {};
+    ibv_recv_wr* bad_wr = nullptr;
+
+    sge.addr = addr;
+    sge.length = length;
+    sge.lkey = lkey;
+
+    wr.wr_id = wr_id;
+    wr.next = nullptr;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+
+    return ibv_post_srq_recv(this->inner, &wr, &bad_wr);
 }
 
-rdma_util::Arc<TcclContext>
-TcclContext::create(Box<RcQueuePair> qp, bool spawn_polling_thread, uint64_t dop) noexcept(false) {
-    Arc<TcclContext> tccl_context = Arc<TcclContext>(new TcclContext());
-    tccl_context->initialize(std::move(qp), dop);
-    if (spawn_polling_thread) {
-        tccl_context->background_polling_ = true;
-        tccl_context->polling_stopped_.store(false);
-        tccl_context->polling_thread_ = std::thread([tccl_context]() {
-            while (!tccl_context->polling_stopped_.load(std::memory_order_relaxed)) {
-                tccl_context->poll_both_inner();
-            }
-        });
-    } else {
-        tccl_context->background_polling_ = false;
-        tccl_context->polling_stopped_.store(true);
+int SharedReceiveQueue::post_recv_batch(RecvWorkRequestBatch& batch) noexcept {
+    if (batch.empty()) {
+        return 0;
     }
-    return tccl_context;
-}
 
-TcclContext::~TcclContext() {
-    if (this->background_polling_) {
-        this->polling_stopped_.store(true);
-        this->polling_thread_.join();
+    for (uint64_t i = 0; i + 1 < batch.num_wrs_; ++i) {
+        batch.wrs_[i].next = &batch.wrs_[i + 1];
     }
+    batch.wrs_[batch.num_wrs_ - 1].next = nullptr;
+
+    ibv_recv_wr* bad_wr = nullptr;
+    int ret = ibv_post_srq_recv(this->inner, batch.wrs_.data(), &bad_wr);
+    batch.clear();
+    return ret;
 }
 
-void TcclContext::initialize(Box<RcQueuePair> qp, uint64_t dop) noexcept(false) {
-    this->dop_ = dop;
+int SharedReceiveQueue::poll_recv_cq_once(
+    const int max_num_wcs,
+    ibv_wc* wc_buffer,
+    std::vector<WorkCompletion>& polled_wcs
+) {
+    polled_wcs.clear();
+    return poll_cq_into(this->recv_cq_, max_num_wcs, wc_buffer, polled_wcs);
+}
 
-    this->qp_ = std::move(qp);
+SendWorkRequestBatch::SendWorkRequestBatch(uint64_t max_num_wrs, uint64_t max_num_sges_per_wr) :
+    wrs_(max_num_wrs),
+    sges_(max_num_wrs * max_num_sges_per_wr),
+    num_wrs_(0),
+    num_sges_(0) {}
 
-    this->send_ibv_wc_buffer_ = std::vector<ibv_wc>(2 * dop);
-    this->polled_send_wcs_ = std::vector<WorkCompletion>();
-    this->polled_send_wcs_.reserve(2 * this->dop_);
+ibv_send_wr& SendWorkRequestBatch::next_wr(
+    uint64_t wr_id,
+    ibv_wr_opcode opcode,
+    const ibv_sge* sg_list,
+    uint32_t num_sge,
+    bool signaled,
+    bool inlined
+) {
+    assert(!this->full());
+    assert(this->num_sges_ + num_sge <= this->sges_.size());
 
-    this->recv_ibv_wc_buffer_ = std::vector<ibv_wc>(2 * dop);
-    this->polled_recv_wcs_ = std::vector<WorkCompletion>();
-    this->polled_recv_wcs_.reserve(2 * this->dop_);
+    ibv_sge* sges = this->sges_.data() + this->num_sges_;
+    memcpy(sges, sg_list, sizeof(ibv_sge) * num_sge);
+    this->num_sges_ += num_sge;
 
-    this->recv_request_command_queue_ = Queue<Command>();
-    this->send_request_command_queue_ = Queue<Command>();
+    ibv_send_wr& wr = this->wrs_[this->num_wrs_++];
+    wr = ibv_send_wr {};
+    wr.wr_id = wr_id;
+    wr.sg_list = sges;
+    wr.num_sge = num_sge;
+    wr.opcode = opcode;
+    wr.send_flags = signaled ? uint32_t(ibv_send_flags::IBV_SEND_SIGNALED) : 0;
+    if (inlined) {
+        wr.send_flags |= uint32_t(ibv_send_flags::IBV_SEND_INLINE);
+    }
+    return wr;
+}
 
-    this->host_send_buffer_ = MemoryRegion::create(
-        this->qp_->get_pd(),
-        rdma_util::Arc<void>(new Ticket[dop], [](Ticket* p) { delete[] p; }),
-        sizeof(Ticket) * this->dop_
-    );
-    this->send_buffer_addr_ = uint64_t(this->host_send_buffer_->get_addr());
-    this->send_buffer_lkey_ = this->host_send_buffer_->get_lkey();
+void SendWorkRequestBatch::add_send(
+    uint64_t wr_id,
+    uint64_t laddr,
+    uint32_t length,
+    uint32_t lkey,
+    bool signaled,
+    bool inlined
+) {
+    ibv_sge sge {laddr, length, lkey};
+    this->next_wr(wr_id, IBV_WR_SEND, &sge, 1, signaled, inlined);
+}
 
-    this->host_recv_buffer_ = MemoryRegion::create(
-        this->qp_->get_pd(),
-        rdma_util::Arc<void>(new Ticket[2 * dop], [](Ticket* p) { delete[] p; }),
-        sizeof(Ticket) * 2 * this->dop_
+void SendWorkRequestBatch::add_send_with_imm(
+    uint64_t wr_id,
+    uint64_t laddr,
+    uint32_t length,
+    uint32_t lkey,
+    uint32_t imm,
+    bool signaled,
+    bool inlined
+) {
+    ibv_sge sge {laddr, length, lkey};
+    ibv_send_wr& wr = this->next_wr(wr_id, IBV_WR_SEND_WITH_IMM, &sge, 1, signaled, inlined);
+    wr.imm_data = htonl(imm);
+}
+
+void SendWorkRequestBatch::add_read(
+    uint64_t wr_id,
+    uint64_t laddr,
+    uint64_t raddr,
+    uint32_t length,
+    uint32_t lkey,
+    uint32_t rkey,
+    bool signaled
+) {
+    ibv_sge sge {laddr, length, lkey};
+    ibv_send_wr& wr = this->next_wr(wr_id, IBV_WR_RDMA_READ, &sge, 1, signaled, false);
+    wr.wr.rdma.remote_addr = raddr;
+    wr.wr.rdma.rkey = rkey;
+}
+
+void SendWorkRequestBatch::add_write(
+    uint64_t wr_id,
+    uint64_t laddr,
+    uint64_t raddr,
+    uint32_t length,
+    uint32_t lkey,
+    uint32_t rkey,
+    bool signaled,
+    bool inlined
+) {
+    ibv_sge sge {laddr, length, lkey};
+    ibv_send_wr& wr = this->next_wr(wr_id, IBV_WR_RDMA_WRITE, &sge, 1, signaled, inlined);
+    wr.wr.rdma.remote_addr = raddr;
+    wr.wr.rdma.rkey = rkey;
+}
+
+void SendWorkRequestBatch::add_write_with_imm(
+    uint64_t wr_id,
+    uint64_t laddr,
+    uint64_t raddr,
+    uint32_t length,
+    uint32_t imm,
+    uint32_t lkey,
+    uint32_t rkey,
+    bool signaled,
+    bool inlined
+) {
+    ibv_sge sge {laddr, length, lkey};
+    ibv_send_wr& wr = this->next_wr(wr_id, IBV_WR_RDMA_WRITE_WITH_IMM, &sge, 1, signaled, inlined);
+    wr.wr.rdma.remote_addr = raddr;
+    wr.wr.rdma.rkey = rkey;
+    wr.imm_data = htonl(imm);
+}
+
+void SendWorkRequestBatch::add_sg(
+    uint64_t wr_id,
+    ibv_wr_opcode opcode,
+    const ibv_sge* sg_list,
+    uint32_t num_sge,
+    uint64_t raddr,
+    uint32_t rkey,
+    uint32_t imm,
+    bool signaled,
+    bool inlined
+) {
+    ibv_send_wr& wr = this->next_wr(wr_id, opcode, sg_list, num_sge, signaled, inlined);
+    if (opcode == IBV_WR_RDMA_WRITE || opcode == IBV_WR_RDMA_WRITE_WITH_IMM || opcode == IBV_WR_RDMA_READ) {
+        wr.wr.rdma.remote_addr = raddr;
+        wr.wr.rdma.rkey = rkey;
+    }
+    if (opcode == IBV_WR_SEND_WITH_IMM || opcode == IBV_WR_RDMA_WRITE_WITH_IMM) {
+        wr.imm_data = htonl(imm);
+    }
+}
+
+RecvWorkRequestBatch::RecvWorkRequestBatch(uint64_t max_num_wrs, uint64_t max_num_sges_per_wr) :
+    wrs_(max_num_wrs),
+    sges_(max_num_wrs * max_num_sges_per_wr),
+    num_wrs_(0),
+    num_sges_(0) {}
+
+void RecvWorkRequestBatch::add_recv(uint64_t wr_id, uint64_t addr, uint32_t length, uint32_t lkey) {
+    ibv_sge sge {addr, length, lkey};
+    this->add_sg(wr_id, &sge, 1);
+}
+
+void RecvWorkRequestBatch::add_sg(uint64_t wr_id, const ibv_sge* sg_list, uint32_t num_sge) {
+    assert(!this->full());
+    assert(this->num_sges_ + num_sge <= this->sges_.size());
+
+    ibv_sge* sges = this->sges_.data() + this->num_sges_;
+    memcpy(sges, sg_list, sizeof(ibv_sge) * num_sge);
+    this->num_sges_ += num_sge;
+
+    ibv_recv_wr& wr = this->wrs_[this->num_wrs_++];
+    wr = ibv_recv_wr {};
+    wr.wr_id = wr_id;
+    wr.sg_list = sges;
+    wr.num_sge = num_sge;
+}
+
+int MemoryRegionOptions::get_access_flags() const {
+    int access = int(this->access_flags);
+    if (this->relaxed_ordering) {
+        // An optional flag, devices which do not support it ignore it
+        access |= ibv_access_flags::IBV_ACCESS_RELAXED_ORDERING;
+    }
+    return access;
+}
+
+static bool get_env_uint(const char* name, uint64_t& value) {
+    const char* env = getenv(name);
+    if (env == nullptr || *env == '\0') {
+        return false;
+    }
+    char* end = nullptr;
+    value = strtoull(env, &end, 10);
+    if (*end != '\0') {
+        throw std::runtime_error(std::string("Invalid value of ") + name);
+    }
+    return true;
+}
+
+MemoryRegionOptions MemoryRegionOptions::from_env() noexcept(false) {
+    MemoryRegionOptions options;
+    uint64_t value = 0;
+    if (get_env_uint("NANOGDR_IB_RELAXED_ORDERING", value)) {
+        options.relaxed_ordering = value != 0;
+    }
+    return options;
+}
+
+BringUpOptions BringUpOptions::from_env() noexcept(false) {
+    BringUpOptions options;
+    uint64_t value = 0;
+    if (get_env_uint("NANOGDR_IB_MTU", value)) {
+        switch (value) {
+            case 256:
+                options.path_mtu = ibv_mtu::IBV_MTU_256;
+                break;
+            case 512:
+                options.path_mtu = ibv_mtu::IBV_MTU_512;
+                break;
+            case 1024:
+                options.path_mtu = ibv_mtu::IBV_MTU_1024;
+                break;
+            case 2048:
+                options.path_mtu = ibv_mtu::IBV_MTU_2048;
+                break;
+            case 4096:
+                options.path_mtu = ibv_mtu::IBV_MTU_4096;
+                break;
+            default:
+                throw std::runtime_error("NANOGDR_IB_MTU must be one of 256, 512, 1024, 2048 and 4096");
+        }
+    }
+    if (get_env_uint("NANOGDR_IB_GID_INDEX", value)) {
+        options.gid_index = uint8_t(value);
+    }
+    if (get_env_uint("NANOGDR_IB_PORT", value)) {
+        options.port_num = uint8_t(value);
+    }
+    if (get_env_uint("NANOGDR_IB_RD_ATOMIC", value)) {
+        options.max_rd_atomic = uint8_t(value);
+    }
+    if (get_env_uint("NANOGDR_IB_TC", value)) {
+        options.traffic_class = uint8_t(value);
+    }
+    return options;
+}
+
+MemoryRegion::MemoryRegion(
+    rdma_util::Arc<ProtectionDomain> pd,
+    rdma_util::Arc<void> buffer_with_deleter,
+    uint64_t length,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    auto addr = buffer_with_deleter.get();
+
+    this->inner_buffer_with_deleter_ = buffer_with_deleter;
+    this->pd_ = pd;
+    this->context_ = pd->context_;
+    this->inner = ibv_reg_mr(pd->inner, addr, length, options.get_access_flags());
+    if (this->inner == nullptr) {
+        throw std::runtime_error("Failed to register memory region");
+    }
+}
+
+MemoryRegion::MemoryRegion(
+    rdma_util::Arc<ProtectionDomain> pd,
+    void* addr,
+    uint64_t length,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    this->inner_buffer_with_deleter_ = nullptr;
+    this->pd_ = pd;
+    this->context_ = pd->context_;
+    this->inner = ibv_reg_mr(pd->inner, addr, length, options.get_access_flags());
+    if (this->inner == nullptr) {
+        throw std::runtime_error("Failed to register memory region");
+    }
+}
+
+MemoryRegion::MemoryRegion(
+    rdma_util::Arc<ProtectionDomain> pd,
+    int dmabuf_fd,
+    uint64_t offset,
+    uint64_t length,
+    uint64_t iova,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    this->inner_buffer_with_deleter_ = nullptr;
+    this->pd_ = pd;
+    this->context_ = pd->context_;
+    this->inner = ibv_reg_dmabuf_mr(pd->inner, offset, length, iova, dmabuf_fd, options.get_access_flags());
+    if (this->inner == nullptr) {
+        throw std::runtime_error("Failed to register dma-buf memory region");
+    }
+}
+
+MemoryRegion::~MemoryRegion() {
+    if (this->inner) {
+        ibv_dereg_mr(this->inner);
+    }
+}
+
+Box<MemoryRegion> MemoryRegion::create(
+    rdma_util::Arc<ProtectionDomain> pd,
+    rdma_util::Arc<void> buffer_with_deleter,
+    uint64_t length,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    return Box<MemoryRegion>(new MemoryRegion(pd, buffer_with_deleter, length, options));
+}
+
+Box<MemoryRegion> MemoryRegion::create(
+    rdma_util::Arc<ProtectionDomain> pd,
+    void* addr,
+    uint64_t length,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    return Box<MemoryRegion>(new MemoryRegion(pd, addr, length, options));
+}
+
+Box<MemoryRegion> MemoryRegion::create_dmabuf(
+    rdma_util::Arc<ProtectionDomain> pd,
+    int dmabuf_fd,
+    uint64_t offset,
+    uint64_t length,
+    uint64_t iova,
+    const MemoryRegionOptions& options
+) noexcept(false) {
+    return Box<MemoryRegion>(new MemoryRegion(pd, dmabuf_fd, offset, length, iova, options));
+}
+
+constexpr uint64_t MemoryRegionCacheConfig::kDefaultMaxRegisteredBytes;
+constexpr uint64_t MemoryRegionCacheConfig::kDefaultAlignment;
+
+Box<MemoryRegionCache>
+MemoryRegionCache::create(rdma_util::Arc<ProtectionDomain> pd, const MemoryRegionCacheConfig& config) noexcept(false) {
+    ASSERT(
+        config.alignment > 0 && (config.alignment & (config.alignment - 1)) == 0,
+        "Alignment must be a power of two"
+    );
+    Box<MemoryRegionCache> cache = Box<MemoryRegionCache>(new MemoryRegionCache());
+    cache->pd_ = pd;
+    cache->config_ = config;
+    cache->registered_bytes_ = 0;
+    cache->num_hits_ = 0;
+    cache->num_misses_ = 0;
+    return cache;
+}
+
+Arc<MemoryRegion> MemoryRegionCache::get(uint64_t addr, uint64_t length) noexcept(false) {
+    ASSERT(length > 0, "Length must be positive");
+    std::lock_guard<std::mutex> lock(this->mutex_);
+
+    // The only region which may contain addr is the last one starting at or before it
+    auto it = this->entries_.upper_bound(addr);
+    if (it != this->entries_.begin()) {
+        auto prev = std::prev(it);
+        if (addr + length <= prev->first + prev->second.length) {
+            this->lru_.splice(this->lru_.begin(), this->lru_, prev->second.lru_position);
+            this->num_hits_++;
+            return prev->second.mr;
+        }
+    }
+    this->num_misses_++;
+
+    const uint64_t mask = this->config_.alignment - 1;
+    uint64_t start = addr & ~mask;
+    uint64_t end = (addr + length + mask) & ~mask;
+
+    // Absorb the overlapping regions, pinned ones stay alive through their pins
+    it = this->entries_.upper_bound(start);
+    if (it != this->entries_.begin() && std::prev(it)->first + std::prev(it)->second.length > start) {
+        --it;
+    }
+    while (it != this->entries_.end() && it->first < end) {
+        start = std::min(start, it->first);
+        end = std::max(end, it->first + it->second.length);
+        auto next = std::next(it);
+        this->erase_inner(it);
+        it = next;
+    }
+
+    Arc<MemoryRegion> mr = MemoryRegion::create(
+        this->pd_,
+        reinterpret_cast<void*>(start),
+        end - start,
+        this->config_.registration_options
+    );
+    this->lru_.push_front(start);
+    this->entries_[start] = Entry {mr, end - start, this->lru_.begin()};
+    this->registered_bytes_ += end - start;
+    this->evict_inner();
+    return mr;
+}
+
+void MemoryRegionCache::invalidate(uint64_t addr, uint64_t length) noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    auto it = this->entries_.upper_bound(addr);
+    if (it != this->entries_.begin() && std::prev(it)->first + std::prev(it)->second.length > addr) {
+        --it;
+    }
+    while (it != this->entries_.end() && it->first < addr + length) {
+        auto next = std::next(it);
+        this->erase_inner(it);
+        it = next;
+    }
+}
+
+void MemoryRegionCache::clear() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->entries_.clear();
+    this->lru_.clear();
+    this->registered_bytes_ = 0;
+}
+
+void MemoryRegionCache::erase_inner(std::map<uint64_t, Entry>::iterator it) {
+    this->registered_bytes_ -= it->second.length;
+    this->lru_.erase(it->second.lru_position);
+    this->entries_.erase(it);
+}
+
+void MemoryRegionCache::evict_inner() {
+    auto position = this->lru_.end();
+    while (this->registered_bytes_ > this->config_.max_registered_bytes && position != this->lru_.begin()) {
+        --position;
+        auto it = this->entries_.find(*position);
+        // Only the cache holds it, thus no request is using it
+        if (it->second.mr.use_count() == 1) {
+            position = std::next(position);
+            this->erase_inner(it);
+        }
+    }
+}
+
+uint64_t MemoryRegionCache::get_registered_bytes() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->registered_bytes_;
+}
+
+uint64_t MemoryRegionCache::get_num_hits() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->num_hits_;
+}
+
+uint64_t MemoryRegionCache::get_num_misses() noexcept {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    return this->num_misses_;
+}
+
+constexpr uint32_t CompletionSlab::kNil;
+constexpr uint32_t RequestSlots::kNoGroup;
+constexpr uint32_t TcclContext::kNoGroup;
+constexpr uint64_t TcclContext::kBatchChunkSize;
+constexpr uint32_t TcclContext::kGatherSges;
+
+CompletionSlab::CompletionSlab(uint32_t capacity) noexcept(false) {
+    ASSERT(capacity > 0 && capacity < kNil, "Invalid completion slab capacity");
+
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer, alignof(CompletionSlot), sizeof(CompletionSlot) * capacity)) {
+        throw std::runtime_error("Failed to allocate completion slab");
+    }
+
+    this->slots_ = reinterpret_cast<CompletionSlot*>(buffer);
+    this->capacity_ = capacity;
+    for (uint32_t i = 0; i < capacity; ++i) {
+        new (&this->slots_[i]) CompletionSlot();
+        this->slots_[i].generation.store(0, std::memory_order_relaxed);
+        this->slots_[i].waiters.store(0, std::memory_order_relaxed);
+        this->slots_[i].next_free.store(i + 1 < capacity ? i + 1 : kNil, std::memory_order_relaxed);
+    }
+    this->free_head_.store(0, std::memory_order_release);
+}
+
+CompletionSlab::~CompletionSlab() {
+    for (uint32_t i = 0; i < this->capacity_; ++i) {
+        this->slots_[i].~CompletionSlot();
+    }
+    free(this->slots_);
+}
+
+uint32_t CompletionSlab::try_acquire() noexcept {
+    uint64_t head = this->free_head_.load(std::memory_order_acquire);
+    while (uint32_t(head) != kNil) {
+        const uint32_t index = uint32_t(head);
+        const uint32_t next = this->slots_[index].next_free.load(std::memory_order_relaxed);
+        const uint64_t new_head = (((head >> 32) + 1) << 32) | next;
+        if (this->free_head_
+                .compare_exchange_weak(head, new_head, std::memory_order_acq_rel, std::memory_order_acquire)) {
+            return index;
+        }
+    }
+    return kNil;
+}
+
+uint32_t CompletionSlab::acquire() noexcept {
+    uint32_t index = this->try_acquire();
+    while (index == kNil) {
+        std::this_thread::yield();
+        index = this->try_acquire();
+    }
+    return index;
+}
+
+void CompletionSlab::release(uint32_t index) noexcept {
+    uint64_t head = this->free_head_.load(std::memory_order_relaxed);
+    uint64_t new_head = 0;
+    do {
+        this->slots_[index].next_free.store(uint32_t(head), std::memory_order_relaxed);
+        new_head = (((head >> 32) + 1) << 32) | index;
+    } while (!this->free_head_
+                  .compare_exchange_weak(head, new_head, std::memory_order_release, std::memory_order_relaxed));
+}
+
+void CompletionSlab::complete(uint32_t index) noexcept {
+    CompletionSlot& slot = this->slots_[index];
+    slot.generation.store(slot.generation.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+    if (slot.waiters.load(std::memory_order_seq_cst) > 0) {
+        syscall(SYS_futex, &slot.generation, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+    }
+    this->release(index);
+}
+
+constexpr uint64_t Handle::kDefaultSpinCount;
+
+void Handle::wait_blocking(uint64_t spin_count) const {
+    for (uint64_t i = 0; i <= spin_count; ++i) {
+        if (this->is_finished()) {
+            return;
+        }
+    }
+
+    this->slot_->waiters.fetch_add(1, std::memory_order_seq_cst);
+    while (this->slot_->generation.load(std::memory_order_seq_cst) == this->expected_generation_) {
+        // Returns immediately if the generation has moved on since the check above
+        syscall(
+            SYS_futex,
+            &this->slot_->generation,
+            FUTEX_WAIT_PRIVATE,
+            this->expected_generation_,
+            nullptr,
+            nullptr,
+            0
+        );
+    }
+    this->slot_->waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+constexpr uint32_t StreamTable::kEmptySlot;
+constexpr uint64_t StreamTable::kInitialSlots;
+constexpr uint32_t StreamTable::kNumPriorities;
+constexpr uint32_t StreamQos::kDefaultPriority;
+
+constexpr uint64_t TcclContextConfig::kDefaultChunkSize;
+constexpr uint64_t TcclContextConfig::kMaxChunkSize;
+constexpr uint32_t TcclContextConfig::kDefaultMaxInflightRequests;
+constexpr uint32_t TcclContextConfig::kMaxEagerThreshold;
+
+// NUMA node of the RNIC of a PD if the config asks to bind to it, -1 otherwise
+static int get_bound_numa_node(const TcclContextConfig& config, const Arc<ProtectionDomain>& pd) noexcept {
+    if (!config.bind_numa_node) {
+        return -1;
+    }
+    return Topology::get_rdma_device_numa_node(pd->get_context()->get_device_name());
+}
+
+// Host memory of the polling side, placed on the NUMA node unless it is -1
+static Arc<void> allocate_host_buffer(uint64_t size, int numa_node) noexcept(false) {
+    if (numa_node < 0) {
+        return Arc<void>(new char[size], [](char* p) { delete[] p; });
+    }
+    return Topology::allocate_on_numa_node(size, numa_node);
+}
+
+// Pin the polling thread about to start, the CPUs are read before it exists so that errors reach the caller
+static std::vector<uint32_t> get_polling_cpus(int numa_node) noexcept(false) {
+    if (numa_node < 0) {
+        return std::vector<uint32_t>();
+    }
+    return PollingEngine::get_numa_node_cpus(numa_node);
+}
+
+rdma_util::Arc<TcclContext> TcclContext::create(
+    Box<RcQueuePair> qp,
+    bool spawn_polling_thread,
+    uint64_t dop,
+    const TcclContextConfig& config
+) noexcept(false) {
+    return TcclContext::create_inner(std::move(qp), spawn_polling_thread, dop, config, nullptr);
+}
+
+Arc<TcclContext> TcclContext::create_inner(
+    Box<RcQueuePair> qp,
+    bool spawn_polling_thread,
+    uint64_t dop,
+    const TcclContextConfig& config,
+    Arc<RequestSlots> slots
+) noexcept(false) {
+    Arc<TcclContext> tccl_context = Arc<TcclContext>(new TcclContext());
+    tccl_context->initialize(std::move(qp), dop, config, std::move(slots));
+    if (spawn_polling_thread) {
+        tccl_context->background_polling_ = true;
+        tccl_context->polling_stopped_.store(false);
+        const std::vector<uint32_t> cpus = get_polling_cpus(tccl_context->numa_node_);
+        tccl_context->polling_thread_ = std::thread([tccl_context, cpus]() {
+            Topology::pin_current_thread(cpus);
+            tccl_context->polling_loop_inner();
+        });
+    } else {
+        tccl_context->background_polling_ = false;
+        tccl_context->polling_stopped_.store(true);
+    }
+    return tccl_context;
+}
+
+TcclContext::~TcclContext() {
+    if (this->background_polling_) {
+        this->polling_stopped_.store(true);
+        this->wake_up_polling_thread();
+        this->polling_thread_.join();
+    }
+    if (this->wakeup_fd_ >= 0) {
+        close(this->wakeup_fd_);
+    }
+}
+
+QueuePairConfig TcclContext::get_queue_pair_config(uint64_t dop) noexcept {
+    QueuePairConfig config;
+    config.max_send_wr = uint32_t(2 * dop);
+    config.max_recv_wr = uint32_t(2 * dop);
+    config.send_cq_depth = uint32_t(2 * dop);
+    config.recv_cq_depth = uint32_t(2 * dop);
+    config.max_inline_data = std::max<uint32_t>(config.max_inline_data, sizeof(Ticket));
+    config.max_send_sge = std::max<uint32_t>(config.max_send_sge, kGatherSges);
+    return config;
+}
+
+QueuePairConfig TcclContext::get_queue_pair_config(uint64_t dop, const TcclContextConfig& config) noexcept {
+    QueuePairConfig qp_config = TcclContext::get_queue_pair_config(dop);
+    qp_config.use_completion_channel = config.polling_mode == PollingMode::ADAPTIVE_POLLING;
+    return qp_config;
+}
+
+void TcclContext::initialize(
+    Box<RcQueuePair> qp,
+    uint64_t dop,
+    const TcclContextConfig& config,
+    Arc<RequestSlots> slots
+) noexcept(false) {
+    ASSERT(
+        config.chunk_size > 0 && config.chunk_size <= TcclContextConfig::kMaxChunkSize,
+        "Chunk size must be in (0, 1 GiB]"
+    );
+    ASSERT(config.signal_interval > 0, "Signal interval must be positive");
+    ASSERT(config.scheduling_quantum > 0, "Scheduling quantum must be positive");
+    ASSERT(qp->get_max_inline_data() >= sizeof(Ticket), "QP can not inline a Ticket");
+    ASSERT(
+        config.polling_mode == PollingMode::BUSY_POLLING || config.polling_mode == PollingMode::ADAPTIVE_POLLING,
+        "Unknown polling mode"
+    );
+    ASSERT(config.inline_threshold <= qp->get_max_inline_data(), "Inline threshold exceeds max_inline_data");
+    ASSERT(config.eager_threshold <= TcclContextConfig::kMaxEagerThreshold, "Eager threshold exceeds 64 KiB");
+    ASSERT(
+        config.polling_mode != PollingMode::ADAPTIVE_POLLING || qp->get_completion_channel_fd() >= 0,
+        "ADAPTIVE_POLLING needs a QP with use_completion_channel, see get_queue_pair_config"
+    );
+
+    // Send and recv completions are told apart by the CQ they come from
+    const QueuePairConfig& qp_config = qp->get_config();
+    const QueuePairConfig required = TcclContext::get_queue_pair_config(dop);
+    // Recv resources of an SRQ are sized by the TcclContextGroup which owns it
+    const bool shared_recv = qp->get_srq() != nullptr;
+    ASSERT(!qp_config.shared_cq, "TcclContext needs split send and recv CQs");
+    ASSERT(qp_config.max_send_wr >= required.max_send_wr, "max_send_wr of the QP is smaller than 2 * dop");
+    ASSERT(
+        shared_recv || qp_config.max_recv_wr >= required.max_recv_wr,
+        "max_recv_wr of the QP is smaller than 2 * dop"
+    );
+    ASSERT(qp_config.send_cq_depth >= required.send_cq_depth, "Send CQ of the QP is shallower than 2 * dop");
+    ASSERT(
+        shared_recv || qp_config.recv_cq_depth >= required.recv_cq_depth,
+        "Recv CQ of the QP is shallower than 2 * dop"
+    );
+
+    this->dop_ = dop;
+    this->config_ = config;
+    this->shared_recv_ = shared_recv;
+    this->numa_node_ = get_bound_numa_node(config, qp->get_pd());
+
+    if (slots == nullptr) {
+        slots = Arc<RequestSlots>(new RequestSlots(config.max_inflight_requests));
+    }
+    this->slots_ = std::move(slots);
+
+    this->polling_sleeping_.store(false);
+    this->wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (this->wakeup_fd_ < 0) {
+        throw std::runtime_error("Failed to create eventfd");
+    }
+
+    this->qp_ = std::move(qp);
+    this->memory_region_cache_ = DeviceRegistry::get_instance().get_memory_region_cache(this->qp_->get_pd());
+
+    this->send_ibv_wc_buffer_ = std::vector<ibv_wc>(2 * dop);
+    this->send_round_commands_ = std::vector<Command>(this->dop_);
+    this->send_round_tickets_ = std::vector<Ticket>(this->dop_);
+    this->recv_round_commands_ = std::vector<Command>(this->dop_);
+    this->recv_round_tickets_ = std::vector<Ticket>(this->dop_);
+
+    this->recv_ibv_wc_buffer_ = std::vector<ibv_wc>(2 * dop);
+    this->polled_recv_wcs_ = std::vector<WorkCompletion>();
+    this->polled_recv_wcs_.reserve(2 * this->dop_);
+
+    this->recv_request_command_queue_ = Queue<Command>();
+    this->send_request_command_queue_ = Queue<Command>();
+    this->pull_recv_command_queue_ = Queue<Command>();
+    this->send_request_consumer_token_ = Box<ConsumerToken>(new ConsumerToken(this->send_request_command_queue_));
+    this->recv_request_consumer_token_ = Box<ConsumerToken>(new ConsumerToken(this->recv_request_command_queue_));
+    this->pull_recv_consumer_token_ = Box<ConsumerToken>(new ConsumerToken(this->pull_recv_command_queue_));
+    this->stream_qos_queue_ = Queue<std::tuple<uint32_t, StreamQos>>();
+
+    this->inline_tickets_ = std::vector<Ticket>(dop);
+    this->num_inline_tickets_ = 0;
+
+    this->recv_slot_size_ = sizeof(Ticket) + config.eager_threshold;
+    this->recv_buffer_addr_ = 0;
+    this->recv_buffer_lkey_ = 0;
+    if (!shared_recv) {
+        this->host_recv_buffer_ = MemoryRegion::create(
+            this->qp_->get_pd(),
+            allocate_host_buffer(this->recv_slot_size_ * 2 * dop, this->numa_node_),
+            this->recv_slot_size_ * 2 * this->dop_
+        );
+        this->recv_buffer_addr_ = uint64_t(this->host_recv_buffer_->get_addr());
+        this->recv_buffer_lkey_ = this->host_recv_buffer_->get_lkey();
+    }
+
+    // At most dop sends are in flight, so dop staging slots never run out
+    if (config.eager_threshold > 0) {
+        this->eager_send_buffer_ = MemoryRegion::create(
+            this->qp_->get_pd(),
+            allocate_host_buffer(this->recv_slot_size_ * dop, this->numa_node_),
+            this->recv_slot_size_ * this->dop_
+        );
+    }
+    this->free_eager_send_slots_ = RingBuffer<uint32_t>(dop);
+    for (uint32_t index = 0; index < dop; ++index) {
+        this->free_eager_send_slots_.push(index);
+    }
+    this->pending_eager_send_queue_ = std::queue<Command>();
+
+    this->local_recv_request_queue_ = Queue<Ticket>();
+    this->remote_recv_request_queue_ = Queue<Ticket>();
+    this->local_recv_request_producer_token_ =
+        Box<ProducerToken>(new ProducerToken(this->local_recv_request_queue_));
+    this->remote_recv_request_producer_token_ =
+        Box<ProducerToken>(new ProducerToken(this->remote_recv_request_queue_));
+    this->local_recv_request_consumer_token_ =
+        Box<ConsumerToken>(new ConsumerToken(this->local_recv_request_queue_));
+    this->remote_recv_request_consumer_token_ =
+        Box<ConsumerToken>(new ConsumerToken(this->remote_recv_request_queue_));
+
+    this->pending_local_recv_request_queue_ = std::queue<Ticket>();
+    this->stream_table_ = StreamTable();
+
+    this->pending_read_queue_ = std::queue<PendingRead>();
+    this->post_send_write_slot_available_ = this->dop_;
+    this->post_send_send_slot_available_ = this->dop_;
+
+    // Ticket sends and data writes of one round are posted with a single doorbell
+    this->max_gather_sges_ = this->qp_->get_config().max_send_sge;
+    this->gather_sges_ = std::vector<ibv_sge>(this->max_gather_sges_);
+    this->send_batch_ = SendWorkRequestBatch(2 * dop, this->max_gather_sges_);
+    this->inflight_send_queue_ = RingBuffer<SendQueueEntry>(2 * dop);
+    this->next_send_wr_id_ = 0;
+    this->unsignaled_count_ = 0;
+
+    this->pending_recv_request_count_ = 0;
+    this->recv_batch_ = RecvWorkRequestBatch(2 * dop);
+    this->recv_repost_batch_ = &this->recv_batch_;
+    if (shared_recv) {
+        return;
+    }
+    for (uint64_t wr_id = 0; wr_id < 2 * dop; ++wr_id) {
+        this->recv_batch_.add_recv(
+            wr_id,
+            this->recv_buffer_addr_ + wr_id * this->recv_slot_size_,
+            this->recv_slot_size_,
+            this->recv_buffer_lkey_
+        );
+    }
+    if (this->qp_->post_recv_batch(this->recv_batch_)) {
+        throw std::runtime_error("Failed to post recv");
+    }
+}
+
+Handle TcclContext::send(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey, uint32_t padding) {
+    return this->submit_inner(
+        this->send_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        padding,
+        TicketKind::RECV_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclContext::recv(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey, uint32_t padding) {
+    return this->submit_inner(
+        this->recv_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        padding,
+        TicketKind::RECV_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclContext::send(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false) {
+    // Eager messages are copied by the CPU, so they need no registration
+    if (this->is_eager(length)) {
+        return this->send(stream_id, addr, length, 0);
+    }
+    Arc<MemoryRegion> mr = this->memory_region_cache_->get(addr, length);
+    const uint32_t lkey = mr->get_lkey();
+    return this->submit_inner(
+        this->send_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        0,
+        TicketKind::RECV_REQUEST,
+        std::move(mr)
+    );
+}
+
+Handle TcclContext::recv(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false) {
+    if (this->is_eager(length)) {
+        return this->recv(stream_id, addr, length, 0);
+    }
+    Arc<MemoryRegion> mr = this->memory_region_cache_->get(addr, length);
+    const uint32_t rkey = mr->get_rkey();
+    return this->submit_inner(
+        this->recv_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        0,
+        TicketKind::RECV_REQUEST,
+        std::move(mr)
+    );
+}
+
+Handle TcclContext::send_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey) noexcept(false) {
+    return this->submit_inner(
+        this->send_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclContext::recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey) noexcept(false) {
+    return this->submit_inner(
+        this->pull_recv_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclContext::send_pull(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false) {
+    Arc<MemoryRegion> mr = this->memory_region_cache_->get(addr, length);
+    const uint32_t rkey = mr->get_rkey();
+    return this->submit_inner(
+        this->send_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        std::move(mr)
+    );
+}
+
+Handle TcclContext::recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length) noexcept(false) {
+    Arc<MemoryRegion> mr = this->memory_region_cache_->get(addr, length);
+    const uint32_t lkey = mr->get_lkey();
+    return this->submit_inner(
+        this->pull_recv_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        std::move(mr)
+    );
+}
+
+Handle TcclContext::send_signaled(
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t lkey,
+    uint32_t* flag,
+    uint32_t value
+) noexcept(false) {
+    ASSERT(flag != nullptr, "Signal flag is null");
+    return this->submit_inner(
+        this->send_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        0,
+        TicketKind::RECV_REQUEST,
+        nullptr,
+        CompletionSignal {flag, value}
+    );
+}
+
+Handle TcclContext::recv_signaled(
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t rkey,
+    uint32_t* flag,
+    uint32_t value
+) noexcept(false) {
+    ASSERT(flag != nullptr, "Signal flag is null");
+    return this->submit_inner(
+        this->recv_request_command_queue_,
+        nullptr,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        0,
+        TicketKind::RECV_REQUEST,
+        nullptr,
+        CompletionSignal {flag, value}
+    );
+}
+
+Handle TcclContext::submit_inner(
+    Queue<Command>& queue,
+    ProducerToken* token,
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t key,
+    uint32_t padding,
+    TicketKind kind,
+    Arc<MemoryRegion> pin,
+    const CompletionSignal& signal
+) noexcept(false) {
+    const uint32_t slot = this->slots_->slab.acquire();
+    const Handle handle = this->slots_->slab.get_handle(slot);
+    // Published to the polling thread by the enqueue below
+    this->slots_->states[slot].pin = std::move(pin);
+    this->slots_->states[slot].signal = signal;
+    TCCL_STATS(this->record_submit_inner(slot, stream_id, length, &queue == &this->send_request_command_queue_);)
+    Ticket ticket {};
+    ticket.stream_id = stream_id;
+    ticket.addr = addr;
+    ticket.length = length;
+    ticket.key = key;
+    ticket.padding_ = padding;
+    ticket.kind = kind;
+    Command command = std::make_tuple(ticket, slot);
+    if (token != nullptr) {
+        queue.enqueue(*token, command);
+    } else {
+        queue.enqueue(command);
+    }
+    this->wake_up_polling_thread();
+    return handle;
+}
+
+Handle TcclContext::send_batch(const BatchEntry* entries, uint64_t count) noexcept(false) {
+    return this->submit_batch_inner(this->send_request_command_queue_, nullptr, entries, count);
+}
+
+Handle TcclContext::recv_batch(const BatchEntry* entries, uint64_t count) noexcept(false) {
+    return this->submit_batch_inner(this->recv_request_command_queue_, nullptr, entries, count);
+}
+
+Handle TcclContext::submit_batch_inner(
+    Queue<Command>& queue,
+    ProducerToken* token,
+    const BatchEntry* entries,
+    uint64_t count
+) noexcept(false) {
+    ASSERT(count > 0, "Batch is empty");
+    ASSERT(count < this->slots_->slab.get_capacity(), "Batch exceeds max_inflight_requests");
+
+    const uint32_t group = this->slots_->slab.acquire();
+    const Handle handle = this->slots_->slab.get_handle(group);
+    // Published to the polling thread by the first enqueue below
+    this->slots_->states[group].group_remaining = uint32_t(count);
+
+    std::array<Command, kBatchChunkSize> commands;
+    uint64_t submitted = 0;
+    while (submitted < count) {
+        // Members of earlier chunks are already enqueued, so acquire cannot wait on this batch forever
+        const uint64_t chunk = std::min(kBatchChunkSize, count - submitted);
+        for (uint64_t i = 0; i < chunk; ++i) {
+            const BatchEntry& entry = entries[submitted + i];
+            const uint32_t slot = this->slots_->slab.acquire();
+            this->slots_->states[slot].group = group;
+            TCCL_STATS(this->record_submit_inner(
+                slot,
+                entry.stream_id,
+                entry.length,
+                &queue == &this->send_request_command_queue_
+            );)
+            Ticket ticket {};
+            ticket.stream_id = entry.stream_id;
+            ticket.addr = entry.addr;
+            ticket.length = entry.length;
+            ticket.key = entry.key;
+            ticket.kind = TicketKind::RECV_REQUEST;
+            commands[i] = std::make_tuple(ticket, slot);
+        }
+        if (token != nullptr) {
+            queue.enqueue_bulk(*token, commands.begin(), chunk);
+        } else {
+            queue.enqueue_bulk(commands.begin(), chunk);
+        }
+        submitted += chunk;
+    }
+    this->wake_up_polling_thread();
+    return handle;
+}
+
+void TcclContext::set_stream_qos(uint32_t stream_id, const StreamQos& qos) noexcept(false) {
+    ASSERT(qos.priority < StreamTable::kNumPriorities, "Priority out of range");
+    ASSERT(qos.weight > 0, "Weight must be positive");
+    this->stream_qos_queue_.enqueue(std::make_tuple(stream_id, qos));
+    this->wake_up_polling_thread();
+}
+
+Handle TcclContext::sendv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false) {
+    return this->submit_vectored_inner(this->send_request_command_queue_, nullptr, stream_id, segments, count);
+}
+
+Handle TcclContext::recvv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false) {
+    return this->submit_vectored_inner(this->recv_request_command_queue_, nullptr, stream_id, segments, count);
+}
+
+Handle TcclContext::submit_vectored_inner(
+    Queue<Command>& queue,
+    ProducerToken* token,
+    uint32_t stream_id,
+    const IoSegment* segments,
+    uint64_t count
+) noexcept(false) {
+    ASSERT(count > 0, "No segments");
+    ASSERT(count <= UINT32_MAX, "Too many segments");
+    uint64_t length = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        ASSERT(segments[i].length > 0, "Segment is empty");
+        length += segments[i].length;
+    }
+    ASSERT(!this->is_eager(length), "Scattered messages must exceed the eager threshold");
+
+    if (count == 1) {
+        return this->submit_inner(
+            queue,
+            token,
+            stream_id,
+            segments[0].addr,
+            segments[0].length,
+            segments[0].key,
+            0,
+            TicketKind::RECV_REQUEST,
+            nullptr
+        );
+    }
+
+    const uint32_t slot = this->slots_->slab.acquire();
+    const Handle handle = this->slots_->slab.get_handle(slot);
+    // Published to the polling thread by the enqueue below
+    this->slots_->states[slot].segments.assign(segments, segments + count);
+    TCCL_STATS(this->record_submit_inner(slot, stream_id, length, &queue == &this->send_request_command_queue_);)
+    Ticket ticket {};
+    ticket.stream_id = stream_id;
+    ticket.addr = segments[0].addr;
+    ticket.length = length;
+    ticket.key = segments[0].key;
+    ticket.kind = TicketKind::RECV_REQUEST;
+    ticket.segments_left = uint32_t(count - 1);
+    Command command = std::make_tuple(ticket, slot);
+    if (token != nullptr) {
+        queue.enqueue(*token, command);
+    } else {
+        queue.enqueue(command);
+    }
+    this->wake_up_polling_thread();
+    return handle;
+}
+
+TcclContextStatsSnapshot TcclContext::get_stats() noexcept(false) {
+#ifdef ENABLE_STATS
+    return this->stats_.snapshot();
+#else
+    return TcclContextStatsSnapshot();
+#endif
+}
+
+void TcclContext::complete_slot_inner(uint32_t slot) {
+    RequestSlots::State& state = this->slots_->states[slot];
+#ifdef ENABLE_STATS
+    const SlotStats& slot_stats = state.stats;
+    StreamStats& stream_stats = this->stats_.get_stream(slot_stats.stream_id);
+    const uint64_t latency = stats_now_ns() - slot_stats.submit_ns;
+    if (slot_stats.is_send) {
+        stats_bump(stream_stats.num_sends);
+        stats_bump(stream_stats.bytes_sent, slot_stats.length);
+        stream_stats.send_latency.record(latency);
+    } else {
+        stats_bump(stream_stats.num_recvs);
+        stats_bump(stream_stats.bytes_received, slot_stats.length);
+        stream_stats.recv_latency.record(latency);
+    }
+#endif
+
+    // Unpin and ungroup before the slot can be recycled by another submitter
+    state.pin.reset();
+    state.segments.clear();
+    state.remote_segments.clear();
+    const uint32_t group = state.group;
+    state.group = kNoGroup;
+    const CompletionSignal signal = state.signal;
+    if (signal.flag != nullptr) {
+        state.signal.flag = nullptr;
+        // The flag may be mapped into a GPU which polls it, so the data must be visible first
+        __atomic_store_n(signal.flag, signal.value, __ATOMIC_RELEASE);
+    }
+    this->slots_->slab.complete(slot);
+    if (group != kNoGroup && --this->slots_->states[group].group_remaining == 0) {
+        this->slots_->slab.complete(group);
+    }
+}
+
+TcclSubmitter::TcclSubmitter(Arc<TcclContext> context) :
+    context_(context),
+    send_token_(context->send_request_command_queue_),
+    recv_token_(context->recv_request_command_queue_),
+    pull_recv_token_(context->pull_recv_command_queue_) {}
+
+Box<TcclSubmitter> TcclSubmitter::create(Arc<TcclContext> context) noexcept(false) {
+    ASSERT(context != nullptr, "Context is null");
+    auto submitter = Box<TcclSubmitter>(new TcclSubmitter(std::move(context)));
+    ASSERT(
+        submitter->send_token_.valid() && submitter->recv_token_.valid() && submitter->pull_recv_token_.valid(),
+        "Failed to create producer tokens"
+    );
+    return submitter;
+}
+
+Handle TcclSubmitter::send(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey, uint32_t padding) {
+    return this->context_->submit_inner(
+        this->context_->send_request_command_queue_,
+        &this->send_token_,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        padding,
+        TicketKind::RECV_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclSubmitter::recv(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey, uint32_t padding) {
+    return this->context_->submit_inner(
+        this->context_->recv_request_command_queue_,
+        &this->recv_token_,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        padding,
+        TicketKind::RECV_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclSubmitter::send_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t rkey) noexcept(false) {
+    return this->context_->submit_inner(
+        this->context_->send_request_command_queue_,
+        &this->send_token_,
+        stream_id,
+        addr,
+        length,
+        rkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclSubmitter::recv_pull(uint32_t stream_id, uint64_t addr, uint64_t length, uint32_t lkey) noexcept(false) {
+    return this->context_->submit_inner(
+        this->context_->pull_recv_command_queue_,
+        &this->pull_recv_token_,
+        stream_id,
+        addr,
+        length,
+        lkey,
+        0,
+        TicketKind::PULL_REQUEST,
+        nullptr
+    );
+}
+
+Handle TcclSubmitter::sendv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false) {
+    return this->context_->submit_vectored_inner(
+        this->context_->send_request_command_queue_,
+        &this->send_token_,
+        stream_id,
+        segments,
+        count
+    );
+}
+
+Handle TcclSubmitter::recvv(uint32_t stream_id, const IoSegment* segments, uint64_t count) noexcept(false) {
+    return this->context_->submit_vectored_inner(
+        this->context_->recv_request_command_queue_,
+        &this->recv_token_,
+        stream_id,
+        segments,
+        count
+    );
+}
+
+Handle TcclSubmitter::send_batch(const BatchEntry* entries, uint64_t count) noexcept(false) {
+    return this->context_->submit_batch_inner(
+        this->context_->send_request_command_queue_,
+        &this->send_token_,
+        entries,
+        count
+    );
+}
+
+Handle TcclSubmitter::recv_batch(const BatchEntry* entries, uint64_t count) noexcept(false) {
+    return this->context_->submit_batch_inner(
+        this->context_->recv_request_command_queue_,
+        &this->recv_token_,
+        entries,
+        count
+    );
+}
+
+bool TcclContext::poll_both_inner() noexcept(false) {
+    bool progressed = this->poll_recv_one_round_inner();
+    progressed |= this->poll_send_one_round_inner();
+    return progressed;
+}
+
+void TcclContext::polling_loop_inner() noexcept(false) {
+    const auto spin_window = std::chrono::microseconds(this->config_.spin_window_us);
+    auto last_progress = std::chrono::steady_clock::now();
+
+    while (!this->polling_stopped_.load(std::memory_order_relaxed)) {
+        if (this->poll_both_inner()) {
+            last_progress = std::chrono::steady_clock::now();
+        } else if (this->config_.polling_mode == PollingMode::ADAPTIVE_POLLING
+                   && std::chrono::steady_clock::now() - last_progress > spin_window) {
+            this->sleep_until_event_inner();
+            last_progress = std::chrono::steady_clock::now();
+        }
+    }
+}
+
+void TcclContext::sleep_until_event_inner() noexcept(false) {
+    // Pairs with the fence in wake_up_polling_thread, either the submitter sees the flag
+    // or the polling thread sees the submitted command
+    this->polling_sleeping_.store(true, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (this->qp_->arm_completion_notification()) {
+        this->polling_sleeping_.store(false, std::memory_order_relaxed);
+        throw std::runtime_error("Failed to arm completion notification");
+    }
+
+    // Completions which arrived before arming do not raise an event, so poll once more
+    if (this->poll_both_inner() || this->send_request_command_queue_.size_approx() > 0
+        || this->recv_request_command_queue_.size_approx() > 0 || this->pull_recv_command_queue_.size_approx() > 0
+        || this->polling_stopped_.load(std::memory_order_relaxed)) {
+        this->polling_sleeping_.store(false, std::memory_order_relaxed);
+        return;
+    }
+
+    pollfd fds[2] {};
+    fds[0].fd = this->qp_->get_completion_channel_fd();
+    fds[0].events = POLLIN;
+    fds[1].fd = this->wakeup_fd_;
+    fds[1].events = POLLIN;
+
+    // The timeout only bounds the damage of a lost wakeup
+    int ret = poll(fds, 2, 100);
+    this->polling_sleeping_.store(false, std::memory_order_relaxed);
+    if (ret < 0 && errno != EINTR) {
+        throw std::runtime_error("Failed to wait for completion events");
+    }
+
+    this->qp_->ack_completion_events();
+    uint64_t counter = 0;
+    if (read(this->wakeup_fd_, &counter, sizeof(counter)) < 0 && errno != EAGAIN) {
+        throw std::runtime_error("Failed to read eventfd");
+    }
+}
+
+bool TcclContext::try_poll_both_inner() noexcept(false) {
+    if (this->engine_claimed_.exchange(true, std::memory_order_acquire)) {
+        return false;
+    }
+    bool progressed = this->poll_both_inner();
+    this->engine_busy_.store(progressed, std::memory_order_relaxed);
+    this->engine_claimed_.store(false, std::memory_order_release);
+    return progressed;
+}
+
+void TcclContext::wake_up_polling_thread() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (this->polling_sleeping_.load(std::memory_order_relaxed)) {
+        uint64_t one = 1;
+        // The eventfd is non-blocking, a saturated counter still wakes the thread up
+        ssize_t ret = write(this->wakeup_fd_, &one, sizeof(one));
+        (void)ret;
+    }
+}
+
+bool TcclContext::poll_send_one_round_inner() noexcept(false) {
+    ASSERT(this->send_ibv_wc_buffer_.size() > 0, "WC buffer is empty");
+
+    std::vector<Command>& commands = this->send_round_commands_;
+    std::vector<Ticket>& tickets = this->send_round_tickets_;
+
+    uint64_t count_dequeued = 0;
+    bool progressed = false;
+
+    std::tuple<uint32_t, StreamQos> stream_qos;
+    while (this->stream_qos_queue_.try_dequeue(stream_qos)) {
+        this->stream_table_.set_qos(std::get<0>(stream_qos), std::get<1>(stream_qos));
+    }
+
+    // Received from send request
+    if (this->post_send_send_slot_available_ > 0) {
+        count_dequeued = this->send_request_command_queue_.try_dequeue_bulk(
+            *this->send_request_consumer_token_,
+            commands.begin(),
+            this->dop_
+        );
+        for (uint64_t i = 0; i < count_dequeued; ++i) {
+            if (std::get<0>(commands[i]).kind == TicketKind::PULL_REQUEST) {
+                // The buffer is advertised to the remote side, the slot finishes on its PULL_DONE
+                Ticket ticket = std::get<0>(commands[i]);
+                ticket.slot = std::get<1>(commands[i]);
+                this->pending_local_recv_request_queue_.push(ticket);
+            } else if (this->is_eager(std::get<0>(commands[i]).length)) {
+                this->pending_eager_send_queue_.push(commands[i]);
+            } else {
+                this->stream_table_.push_local_send_request(commands[i]);
+            }
+        }
+        progressed |= count_dequeued > 0;
+    }
+
+    // Received from recv_pull
+    count_dequeued =
+        this->pull_recv_command_queue_.try_dequeue_bulk(*this->pull_recv_consumer_token_, commands.begin(), this->dop_);
+    for (uint64_t i = 0; i < count_dequeued; ++i) {
+        this->stream_table_.push_local_pull_recv(commands[i]);
+    }
+    progressed |= count_dequeued > 0;
+
+    // Received from recv request
+    count_dequeued = this->local_recv_request_queue_.try_dequeue_bulk(
+        *this->local_recv_request_consumer_token_,
+        tickets.begin(),
+        this->dop_
+    );
+    for (uint64_t i = 0; i < count_dequeued; ++i) {
+        this->pending_local_recv_request_queue_.push(tickets[i]);
+    }
+    progressed |= count_dequeued > 0;
+
+    // Received from thread_post_recv
+    count_dequeued = this->remote_recv_request_queue_.try_dequeue_bulk(
+        *this->remote_recv_request_consumer_token_,
+        tickets.begin(),
+        this->dop_
+    );
+    for (uint64_t i = 0; i < count_dequeued; ++i) {
+        if (tickets[i].kind == TicketKind::PULL_REQUEST) {
+            this->stream_table_.push_remote_pull_request(tickets[i]);
+        } else {
+            this->stream_table_.push_remote_recv_request(tickets[i]);
+        }
+    }
+    progressed |= count_dequeued > 0;
+
+    // Send local write args to remote side
+    while (this->post_send_send_slot_available_ > 0 && !this->pending_local_recv_request_queue_.empty()) {
+        if (this->num_inline_tickets_ == this->inline_tickets_.size()) {
+            this->flush_send_batch_inner();
+        }
+
+        Ticket& ticket = this->inline_tickets_[this->num_inline_tickets_++];
+        ticket = this->pending_local_recv_request_queue_.front();
+        this->pending_local_recv_request_queue_.pop();
+        // The slot of a PULL_DONE belongs to the remote side
+        TCCL_STATS(if (ticket.kind != TicketKind::PULL_DONE) {
+            const SlotStats& slot_stats = this->slots_->states[ticket.slot].stats;
+            this->stats_.ticket_wait.record(stats_now_ns() - slot_stats.submit_ns);
+        })
+
+        bool signaled = false;
+        uint64_t wr_id = this->track_send_inner(SendQueueEntryKind::TICKET_SEND, 0, signaled);
+        this->send_batch_.add_send(wr_id, uint64_t(&ticket), sizeof(Ticket), 0, signaled, true);
+        this->post_send_send_slot_available_--;
+    }
+
+    this->post_eager_sends_inner();
+
+    // Match remote write args and pulls of every ready stream. Matching posts nothing, the
+    // writes are scheduled across the streams afterwards, so a bulk stream matched first
+    // does not hold the send queue until its whole message is written.
+    uint32_t stream_id = 0;
+    while (this->stream_table_.pop_ready(stream_id)) {
+        StreamState& stream = this->stream_table_.get(stream_id);
+
+        if (!StreamTable::has_push(stream)) {
+            const Ticket remote_pull_request = stream.remote_pull_requests.front();
+            const Ticket local_pull_recv = std::get<0>(stream.local_pull_recvs.front());
+            const uint32_t slot = std::get<1>(stream.local_pull_recvs.front());
+            stream.remote_pull_requests.pop();
+            stream.local_pull_recvs.pop();
+            this->stream_table_.unlink_or_requeue(stream_id);
+
+            if (local_pull_recv.length != remote_pull_request.length) {
+                throw std::runtime_error("Length mismatch");
+            }
+
+            this->slots_->states[slot].pull_peer_slot = remote_pull_request.slot;
+            TCCL_STATS(this->slots_->states[slot].stats.match_ns = stats_now_ns();)
+
+            PendingRead pending_read {};
+            pending_read.stream_id = stream_id;
+            pending_read.slot = slot;
+            pending_read.lkey = local_pull_recv.key;
+            pending_read.rkey = remote_pull_request.key;
+            pending_read.laddr = local_pull_recv.addr;
+            pending_read.raddr = remote_pull_request.addr;
+            pending_read.remaining = local_pull_recv.length;
+            this->pending_read_queue_.push(pending_read);
+            continue;
+        }
+
+        const Ticket remote_recv_request = stream.remote_recv_requests.front();
+        const Ticket local_send_request = std::get<0>(stream.local_send_requests.front());
+        const uint32_t slot = std::get<1>(stream.local_send_requests.front());
+        stream.local_send_requests.pop();
+
+        // The Tickets of a scattered recv are consecutive in the stream, as they are sent in one go
+        const bool vectored = remote_recv_request.segments_left > 0 || local_send_request.segments_left > 0;
+        const uint32_t num_remote_segments = remote_recv_request.segments_left + 1;
+        RequestSlots::State& state = this->slots_->states[slot];
+        uint64_t remote_length = 0;
+        for (uint32_t i = 0; i < num_remote_segments; ++i) {
+            const Ticket& segment = stream.remote_recv_requests.front();
+            if (vectored) {
+                state.remote_segments.push_back(IoSegment {segment.addr, segment.length, segment.key});
+            }
+            remote_length += segment.length;
+            stream.remote_recv_requests.pop();
+        }
+        this->stream_table_.unlink_or_requeue(stream_id);
+
+        if (local_send_request.length != remote_length) {
+            throw std::runtime_error("Length mismatch");
+        }
+
+#ifdef ENABLE_STATS
+        state.stats.match_ns = stats_now_ns();
+        this->stats_.match_wait.record(state.stats.match_ns - state.stats.submit_ns);
+#endif
+
+        PendingWrite pending_write {};
+        pending_write.stream_id = stream_id;
+        pending_write.slot = slot;
+        pending_write.lkey = local_send_request.key;
+        pending_write.rkey = remote_recv_request.key;
+        pending_write.laddr = local_send_request.addr;
+        pending_write.raddr = remote_recv_request.addr;
+        pending_write.remaining = local_send_request.length;
+        pending_write.vectored = vectored;
+        if (vectored && local_send_request.segments_left == 0) {
+            state.segments.assign(
+                1,
+                IoSegment {local_send_request.addr, local_send_request.length, local_send_request.key}
+            );
+        }
+        this->stream_table_.push_pending_write(pending_write);
+    }
+
+    // Reads share the budget of writes, both are data transfers on the send queue
+    this->post_pending_reads_inner();
+    this->post_pending_writes_inner();
+
+    this->flush_send_batch_inner();
+
+    // Only status and wr_id are needed, so the completions are retired in place
+    int ret = this->qp_->visit_send_cq_once(
+        this->send_ibv_wc_buffer_.size(),
+        this->send_ibv_wc_buffer_.data(),
+        [this](const ibv_wc& wc) {
+            if (wc.status != IBV_WC_SUCCESS) {
+                throw std::runtime_error("Failed to send data");
+            }
+            this->retire_sends_inner(wc.wr_id);
+        }
     );
-    this->recv_buffer_addr_ = uint64_t(this->host_recv_buffer_->get_addr());
-    this->recv_buffer_lkey_ = this->host_recv_buffer_->get_lkey();
 
-    this->local_recv_request_queue_ = Queue<Ticket>();
-    this->remote_recv_request_queue_ = Queue<Ticket>();
+    if (ret < 0) {
+        throw std::runtime_error("Failed to poll send CQ");
+    }
+    TCCL_STATS(this->stats_.record_send_poll(ret);)
 
-    this->pending_local_recv_request_queue_ = std::queue<Ticket>();
-    this->pending_remote_recv_request_map_ = MultiMap<Ticket>();
-    this->pending_local_send_request_map_ = MultiMap<Ticket>();
-    this->pending_local_send_flag_map_ = MultiMap<rdma_util::Arc<std::atomic<bool>>>();
+    return progressed || ret > 0;
+}
 
-    this->free_post_send_send_slots_ = std::queue<uint64_t>();
-    this->post_send_write_slot_available_ = this->dop_;
-    this->post_send_send_slot_available_ = this->dop_;
-    for (uint64_t wr_id = 0; wr_id < dop; ++wr_id) {
-        this->free_post_send_send_slots_.push(wr_id);
+void TcclContext::post_pending_writes_inner() noexcept(false) {
+    // Strict priority between the active lists, deficit round robin within one. The chunks of a
+    // stream are posted in order, so the write with imm of a message lands after all the others.
+    uint32_t stream_id = 0;
+    while (this->post_send_write_slot_available_ > 0 && this->stream_table_.pop_active(stream_id)) {
+        StreamState& stream = this->stream_table_.get(stream_id);
+        if (!stream.in_turn) {
+            stream.deficit += this->config_.scheduling_quantum * stream.qos.weight;
+            stream.in_turn = true;
+        }
+
+        while (this->post_send_write_slot_available_ > 0 && StreamTable::has_write(stream)) {
+            PendingWrite& pending_write = stream.pending_writes.front();
+            if (std::min(pending_write.remaining, this->config_.chunk_size) > stream.deficit) {
+                // The turn is over, the deficit carries over to the next one
+                stream.in_turn = false;
+                break;
+            }
+            if (this->send_batch_.full()) {
+                this->flush_send_batch_inner();
+            }
+
+            const uint64_t length = pending_write.vectored ? this->post_vectored_write_inner(pending_write)
+                                                           : this->post_write_chunk_inner(pending_write);
+            stream.deficit -= length;
+            this->stream_table_.acquire_credit(stream_id, length);
+            this->post_send_write_slot_available_--;
+            if (pending_write.remaining == 0) {
+                stream.pending_writes.pop();
+            }
+        }
+
+        // A stream out of credits is activated again once its chunks are retired
+        this->stream_table_.deactivate_or_requeue(stream_id);
     }
+}
 
-    this->pending_recv_request_count_ = 0;
-    this->pending_local_recv_request_map_ = MultiMap<rdma_util::Arc<std::atomic<bool>>>();
-    for (uint64_t wr_id = 0; wr_id < 2 * dop; ++wr_id) {
-        this->qp_->post_recv(
+uint64_t TcclContext::post_write_chunk_inner(PendingWrite& pending_write) noexcept(false) {
+    const uint64_t length = std::min(pending_write.remaining, this->config_.chunk_size);
+
+    bool signaled = false;
+    const bool inlined = length <= this->config_.inline_threshold;
+    if (length == pending_write.remaining) {
+        uint64_t wr_id = this->track_send_inner(
+            SendQueueEntryKind::LAST_WRITE_CHUNK,
+            pending_write.slot,
+            signaled,
+            pending_write.stream_id,
+            uint32_t(length)
+        );
+        this->send_batch_.add_write_with_imm(
             wr_id,
-            this->recv_buffer_addr_ + wr_id * sizeof(Ticket),
-            sizeof(Ticket),
-            this->recv_buffer_lkey_
+            pending_write.laddr,
+            pending_write.raddr,
+            length,
+            pending_write.stream_id,
+            pending_write.lkey,
+            pending_write.rkey,
+            signaled,
+            inlined
+        );
+    } else {
+        uint64_t wr_id = this->track_send_inner(
+            SendQueueEntryKind::WRITE_CHUNK,
+            pending_write.slot,
+            signaled,
+            pending_write.stream_id,
+            uint32_t(length)
+        );
+        this->send_batch_.add_write(
+            wr_id,
+            pending_write.laddr,
+            pending_write.raddr,
+            length,
+            pending_write.lkey,
+            pending_write.rkey,
+            signaled,
+            inlined
         );
+        pending_write.laddr += length;
+        pending_write.raddr += length;
     }
+    pending_write.remaining -= length;
+    return length;
 }
 
-Handle TcclContext::send(uint32_t stream_id, uint64_t addr, uint32_t length, uint32_t lkey, uint32_t padding) {
-    auto flag = std::make_shared<std::atomic<bool>>(false);
-    Ticket ticket {};
-    ticket.stream_id = stream_id;
-    ticket.addr = addr;
-    ticket.length = length;
-    ticket.key = lkey;
-    ticket.padding_ = padding;
-    Command command = std::make_tuple(ticket, flag);
-    this->send_request_command_queue_.enqueue(command);
-    return Handle(flag);
-}
+uint64_t TcclContext::post_vectored_write_inner(PendingWrite& pending_write) noexcept(false) {
+    // A write lands in a single remote segment, so it gathers at most up to the end of it
+    const RequestSlots::State& state = this->slots_->states[pending_write.slot];
+    const std::vector<IoSegment>& local_segments = state.segments;
+    const IoSegment& remote_segment = state.remote_segments[pending_write.remote_index];
+    const uint64_t raddr = remote_segment.addr + pending_write.remote_offset;
+    const uint64_t length = std::min(remote_segment.length - pending_write.remote_offset, this->config_.chunk_size);
+
+    uint32_t num_sges = 0;
+    uint64_t gathered = 0;
+    while (gathered < length && num_sges < this->max_gather_sges_) {
+        const IoSegment& local_segment = local_segments[pending_write.local_index];
+        const uint64_t piece = std::min(local_segment.length - pending_write.local_offset, length - gathered);
+        this->gather_sges_[num_sges++] =
+            ibv_sge {local_segment.addr + pending_write.local_offset, uint32_t(piece), local_segment.key};
+        gathered += piece;
+        pending_write.local_offset += piece;
+        if (pending_write.local_offset == local_segment.length) {
+            pending_write.local_index++;
+            pending_write.local_offset = 0;
+        }
+    }
 
-Handle TcclContext::recv(uint32_t stream_id, uint64_t addr, uint32_t length, uint32_t rkey, uint32_t padding) {
-    auto flag = std::make_shared<std::atomic<bool>>(false);
-    Ticket ticket {};
-    ticket.stream_id = stream_id;
-    ticket.addr = addr;
-    ticket.length = length;
-    ticket.key = rkey;
-    ticket.padding_ = padding;
-    Command command = std::make_tuple(ticket, flag);
-    this->recv_request_command_queue_.enqueue(command);
-    return Handle(flag);
+    pending_write.remote_offset += gathered;
+    if (pending_write.remote_offset == remote_segment.length) {
+        pending_write.remote_index++;
+        pending_write.remote_offset = 0;
+    }
+    pending_write.remaining -= gathered;
+
+    const bool last = pending_write.remaining == 0;
+    bool signaled = false;
+    uint64_t wr_id = this->track_send_inner(
+        last ? SendQueueEntryKind::LAST_WRITE_CHUNK : SendQueueEntryKind::WRITE_CHUNK,
+        pending_write.slot,
+        signaled,
+        pending_write.stream_id,
+        uint32_t(gathered)
+    );
+    this->send_batch_.add_sg(
+        wr_id,
+        last ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_RDMA_WRITE,
+        this->gather_sges_.data(),
+        num_sges,
+        raddr,
+        remote_segment.key,
+        pending_write.stream_id,
+        signaled,
+        gathered <= this->config_.inline_threshold
+    );
+    return gathered;
 }
 
-void TcclContext::poll_both_inner() noexcept(false) {
-    this->poll_recv_one_round_inner();
-    this->poll_send_one_round_inner();
-}
+void TcclContext::post_eager_sends_inner() noexcept(false) {
+    // Eager messages take the place of Tickets in the recv ring of the remote side
+    while (this->post_send_send_slot_available_ > 0 && !this->pending_eager_send_queue_.empty()) {
+        const Ticket& request = std::get<0>(this->pending_eager_send_queue_.front());
+        const uint32_t slot = std::get<1>(this->pending_eager_send_queue_.front());
 
-void TcclContext::poll_send_one_round_inner() noexcept(false) {
-    ASSERT(this->send_ibv_wc_buffer_.size() > 0, "WC buffer is empty");
+        if (this->send_batch_.full()) {
+            this->flush_send_batch_inner();
+        }
 
-    std::vector<Command> commands(this->dop_);
-    std::vector<Ticket> tickets(this->dop_);
+        const uint32_t index = this->free_eager_send_slots_.front();
+        this->free_eager_send_slots_.pop();
+        char* staging = static_cast<char*>(this->eager_send_buffer_->get_addr()) + index * this->recv_slot_size_;
 
-    uint64_t count_dequeued = 0;
+        Ticket header {};
+        header.stream_id = request.stream_id;
+        header.length = request.length;
+        header.kind = TicketKind::EAGER_MESSAGE;
+        memcpy(staging, &header, sizeof(Ticket));
+        memcpy(staging + sizeof(Ticket), reinterpret_cast<const void*>(request.addr), request.length);
 
-    // Received from send request
-    if (this->post_send_send_slot_available_ > 0) {
-        count_dequeued = this->send_request_command_queue_.try_dequeue_bulk(commands.begin(), this->dop_);
-        for (uint64_t i = 0; i < count_dequeued; ++i) {
-            auto ticket = std::get<0>(commands[i]);
-            auto flag = std::get<1>(commands[i]);
-            this->pending_local_send_request_map_[ticket.stream_id].push(ticket);
-            this->pending_local_send_flag_map_[ticket.stream_id].push(flag);
-        }
+        // The payload is staged, so the buffer of the caller is free again
+        this->complete_slot_inner(slot);
+
+        const uint64_t size = sizeof(Ticket) + header.length;
+        bool signaled = false;
+        uint64_t wr_id = this->track_send_inner(SendQueueEntryKind::EAGER_SEND, index, signaled);
+        this->send_batch_.add_send(
+            wr_id,
+            uint64_t(staging),
+            uint32_t(size),
+            this->eager_send_buffer_->get_lkey(),
+            signaled,
+            size <= this->qp_->get_max_inline_data()
+        );
+        this->post_send_send_slot_available_--;
+        this->pending_eager_send_queue_.pop();
     }
+}
 
-    // Received from recv request
-    count_dequeued = this->local_recv_request_queue_.try_dequeue_bulk(tickets.begin(), this->dop_);
-    for (uint64_t i = 0; i < count_dequeued; ++i) {
-        this->pending_local_recv_request_queue_.push(tickets[i]);
+void TcclContext::post_eager_recv_inner(const Command& command) noexcept(false) {
+    const Ticket& request = std::get<0>(command);
+    StreamState& stream = this->stream_table_.get(request.stream_id);
+    if (stream.unexpected_eager_messages.empty()) {
+        stream.local_eager_recvs.push(command);
+        return;
     }
 
-    // Received from thread_post_recv
-    count_dequeued = this->remote_recv_request_queue_.try_dequeue_bulk(tickets.begin(), this->dop_);
-    for (uint64_t i = 0; i < count_dequeued; ++i) {
-        this->pending_remote_recv_request_map_[tickets[i].stream_id].push(tickets[i]);
+    const HeldEagerMessage message = stream.unexpected_eager_messages.front();
+    if (message.length != request.length) {
+        throw std::runtime_error("Length mismatch");
+    }
+    const uint64_t recv_slot_addr = this->recv_buffer_addr_ + message.wr_id * this->recv_slot_size_;
+    const char* payload = reinterpret_cast<const char*>(recv_slot_addr) + sizeof(Ticket);
+    memcpy(reinterpret_cast<void*>(request.addr), payload, message.length);
+    stream.unexpected_eager_messages.pop();
+    this->complete_slot_inner(std::get<1>(command));
+
+    // The payload is copied out, so the recv slot goes back to the QP with the next posted batch
+    this->recv_repost_batch_->add_recv(message.wr_id, recv_slot_addr, this->recv_slot_size_, this->recv_buffer_lkey_);
+}
+
+bool TcclContext::deliver_eager_inner(const Ticket& header, const char* payload, uint64_t wr_id) noexcept(false) {
+    StreamState& stream = this->stream_table_.get(header.stream_id);
+    if (stream.local_eager_recvs.empty()) {
+        // The recv slot holds the payload until the recv is posted, without a copy
+        stream.unexpected_eager_messages.push(HeldEagerMessage {wr_id, header.length});
+        return false;
     }
 
-    // Send local write args to remote side
-    while (this->post_send_send_slot_available_ > 0 && !this->pending_local_recv_request_queue_.empty()) {
-        uint64_t wr_id = this->free_post_send_send_slots_.front();
-        Ticket ticket = this->pending_local_recv_request_queue_.front();
-        this->free_post_send_send_slots_.pop();
-        this->pending_local_recv_request_queue_.pop();
-        memcpy(reinterpret_cast<void*>(this->send_buffer_addr_ + wr_id * sizeof(Ticket)), &ticket, sizeof(Ticket));
+    const Ticket& request = std::get<0>(stream.local_eager_recvs.front());
+    if (request.length != header.length) {
+        throw std::runtime_error("Length mismatch");
+    }
+    memcpy(reinterpret_cast<void*>(request.addr), payload, header.length);
+    this->complete_slot_inner(std::get<1>(stream.local_eager_recvs.front()));
+    stream.local_eager_recvs.pop();
+    return true;
+}
+
+void TcclContext::post_pending_reads_inner() noexcept(false) {
+    // Reads complete in order as well, so the last chunk retires the whole pull
+    while (this->post_send_write_slot_available_ > 0 && !this->pending_read_queue_.empty()) {
+        PendingRead& pending_read = this->pending_read_queue_.front();
+        const uint64_t length = std::min(pending_read.remaining, this->config_.chunk_size);
 
-        this->qp_->post_send_send(
+        if (this->send_batch_.full()) {
+            this->flush_send_batch_inner();
+        }
+
+        bool signaled = false;
+        const bool last = length == pending_read.remaining;
+        uint64_t wr_id = this->track_send_inner(
+            last ? SendQueueEntryKind::LAST_READ_CHUNK : SendQueueEntryKind::READ_CHUNK,
+            pending_read.slot,
+            signaled
+        );
+        this->send_batch_.add_read(
             wr_id,
-            this->send_buffer_addr_ + wr_id * sizeof(Ticket),
-            sizeof(Ticket),
-            this->send_buffer_lkey_,
-            true
+            pending_read.laddr,
+            pending_read.raddr,
+            length,
+            pending_read.lkey,
+            pending_read.rkey,
+            signaled
         );
-        this->post_send_send_slot_available_--;
+        if (last) {
+            this->pending_read_queue_.pop();
+        } else {
+            pending_read.laddr += length;
+            pending_read.raddr += length;
+            pending_read.remaining -= length;
+        }
+
+        this->post_send_write_slot_available_--;
     }
+}
 
-    // Execute remote write args
-    for (auto& item : this->pending_remote_recv_request_map_) {
-        uint32_t stream_id = item.first;
-        std::queue<Ticket>& pending_remote_recv_request_queue = item.second;
-        if (this->post_send_write_slot_available_ == 0) {
-            break;
-        } else if (!pending_remote_recv_request_queue.empty()
-                   && !this->pending_local_send_request_map_[stream_id].empty()) {
-            auto remote_recv_request = pending_remote_recv_request_queue.front();
-            auto local_send_request = this->pending_local_send_request_map_[stream_id].front();
-            pending_remote_recv_request_queue.pop();
-            this->pending_local_send_request_map_[stream_id].pop();
-
-            if (local_send_request.length != remote_recv_request.length) {
-                throw std::runtime_error("Length mismatch");
-            }
+void TcclContext::flush_send_batch_inner() noexcept(false) {
+    if (this->send_batch_.empty()) {
+        return;
+    }
 
-            auto wr_id = stream_id;
-            auto raddr = remote_recv_request.addr;
-            auto rkey = remote_recv_request.key;
-            auto laddr = local_send_request.addr;
-            auto lkey = local_send_request.key;
+    // Work requests after the last signaled one would never be retired otherwise
+    if (this->unsignaled_count_ > 0) {
+        this->send_batch_.signal_last();
+        this->unsignaled_count_ = 0;
+    }
 
-            this->qp_
-                ->post_send_write_with_imm(wr_id, laddr, raddr, local_send_request.length, stream_id, lkey, rkey, true);
-            this->post_send_write_slot_available_--;
-        }
+    // Inlined payloads are copied by ibv_post_send, so the tickets can be reused right after
+    int ret = this->qp_->post_send_batch(this->send_batch_);
+    this->num_inline_tickets_ = 0;
+    if (ret) {
+        throw std::runtime_error("Failed to post send");
     }
+}
 
-    int ret = this->qp_->poll_send_cq_once(
-        this->send_ibv_wc_buffer_.size(),
-        this->send_ibv_wc_buffer_.data(),
-        this->polled_send_wcs_
-    );
+uint64_t TcclContext::track_send_inner(
+    SendQueueEntryKind kind,
+    uint32_t index,
+    bool& signaled,
+    uint32_t stream_id,
+    uint32_t length
+) {
+    SendQueueEntry entry {};
+    entry.wr_id = this->next_send_wr_id_++;
+    entry.kind = kind;
+    entry.index = index;
+    entry.stream_id = stream_id;
+    entry.length = length;
+    this->inflight_send_queue_.push(entry);
+
+    this->unsignaled_count_++;
+    signaled = this->unsignaled_count_ >= this->config_.signal_interval;
+    if (signaled) {
+        this->unsignaled_count_ = 0;
+    }
+    return entry.wr_id;
+}
 
-    if (ret < 0) {
-        throw std::runtime_error("Failed to poll send CQ");
-    } else if (ret > 0) {
-        for (const auto& wc : this->polled_send_wcs_) {
-            if (wc.status != IBV_WC_SUCCESS) {
-                throw std::runtime_error("Failed to send data");
-            } else if (wc.opcode == IBV_WC_SEND) {
-                this->free_post_send_send_slots_.push(wc.wr_id);
+void TcclContext::retire_sends_inner(uint64_t wr_id) {
+    // The send queue completes in order, so a completion retires every work request posted before it
+    while (!this->inflight_send_queue_.empty() && this->inflight_send_queue_.front().wr_id <= wr_id) {
+        const SendQueueEntry& entry = this->inflight_send_queue_.front();
+        switch (entry.kind) {
+            case SendQueueEntryKind::TICKET_SEND:
+                this->post_send_send_slot_available_++;
+                break;
+            case SendQueueEntryKind::EAGER_SEND:
+                this->free_eager_send_slots_.push(entry.index);
                 this->post_send_send_slot_available_++;
-            } else if (wc.opcode == IBV_WC_RDMA_WRITE) {
-                this->pending_local_send_flag_map_[wc.wr_id].front()->store(true);
-                this->pending_local_send_flag_map_[wc.wr_id].pop();
+                break;
+            case SendQueueEntryKind::LAST_WRITE_CHUNK:
+                TCCL_STATS(this->record_transfer_inner(entry.index);)
+                this->complete_slot_inner(entry.index);
+                this->stream_table_.release_credit(entry.stream_id, entry.length);
+                this->post_send_write_slot_available_++;
+                break;
+            case SendQueueEntryKind::WRITE_CHUNK:
+                this->stream_table_.release_credit(entry.stream_id, entry.length);
+                this->post_send_write_slot_available_++;
+                break;
+            case SendQueueEntryKind::READ_CHUNK:
                 this->post_send_write_slot_available_++;
+                break;
+            case SendQueueEntryKind::LAST_READ_CHUNK: {
+                // The sender keeps its buffer until it is told that the pull is finished
+                Ticket pull_done {};
+                pull_done.kind = TicketKind::PULL_DONE;
+                pull_done.slot = this->slots_->states[entry.index].pull_peer_slot;
+                this->pending_local_recv_request_queue_.push(pull_done);
+                TCCL_STATS(this->record_transfer_inner(entry.index);)
+                this->complete_slot_inner(entry.index);
+                this->post_send_write_slot_available_++;
+                break;
             }
         }
+        this->inflight_send_queue_.pop();
     }
 }
 
-void TcclContext::poll_recv_one_round_inner() noexcept(false) {
+bool TcclContext::poll_recv_one_round_inner() noexcept(false) {
     ASSERT(this->recv_ibv_wc_buffer_.size() > 0, "WC buffer is empty");
 
-    std::vector<Command> commands(this->dop_);
-    std::vector<Ticket> tickets(this->dop_);
+    std::vector<Command>& commands = this->recv_round_commands_;
+    std::vector<Ticket>& tickets = this->recv_round_tickets_;
+    bool progressed = false;
 
     if (this->pending_recv_request_count_ < 2 * this->dop_) {
-        const uint64_t dequeued_count =
-            this->recv_request_command_queue_.try_dequeue_bulk(commands.begin(), this->dop_);
+        const uint64_t dequeued_count = this->recv_request_command_queue_.try_dequeue_bulk(
+            *this->recv_request_consumer_token_,
+            commands.begin(),
+            this->dop_
+        );
+        uint64_t ticket_count = 0;
         for (uint64_t i = 0; i < dequeued_count; ++i) {
-            tickets[i] = std::get<0>(commands[i]);
-            this->pending_local_recv_request_map_[tickets[i].stream_id].push(std::get<1>(commands[i]));
-            this->pending_recv_request_count_++;
+            // Eager recvs wait for their message locally, the remote side does not need a Ticket
+            if (this->is_eager(std::get<0>(commands[i]).length)) {
+                this->post_eager_recv_inner(commands[i]);
+                continue;
+            }
+
+            // A scattered recv advertises one Ticket per segment
+            const Ticket& request = std::get<0>(commands[i]);
+            const uint32_t slot = std::get<1>(commands[i]);
+            const uint32_t num_segments = request.segments_left + 1;
+            for (uint32_t j = 0; j < num_segments; ++j) {
+                if (ticket_count == tickets.size()) {
+                    this->local_recv_request_queue_.enqueue_bulk(
+                        *this->local_recv_request_producer_token_,
+                        tickets.begin(),
+                        ticket_count
+                    );
+                    ticket_count = 0;
+                }
+                Ticket& ticket = tickets[ticket_count++];
+                ticket = request;
+                ticket.slot = slot;
+                if (num_segments > 1) {
+                    const IoSegment& segment = this->slots_->states[slot].segments[j];
+                    ticket.addr = segment.addr;
+                    ticket.length = segment.length;
+                    ticket.key = segment.key;
+                    ticket.segments_left = num_segments - 1 - j;
+                }
+            }
+            this->stream_table_.get(request.stream_id).local_recv_slots.push(slot);
+            this->pending_recv_request_count_ += num_segments;
         }
-        this->local_recv_request_queue_.enqueue_bulk(tickets.begin(), dequeued_count);
+        this->local_recv_request_queue_.enqueue_bulk(
+            *this->local_recv_request_producer_token_,
+            tickets.begin(),
+            ticket_count
+        );
+        progressed |= dequeued_count > 0;
+    }
+
+    // The recv CQ of a shared receive queue is polled by the owning TcclContextGroup
+    if (this->shared_recv_) {
+        return progressed;
     }
 
     int ret = this->qp_->poll_recv_cq_once(
@@ -880,38 +2896,441 @@ void TcclContext::poll_recv_one_round_inner() noexcept(false) {
         this->recv_ibv_wc_buffer_.data(),
         this->polled_recv_wcs_
     );
-    if (ret > 0) {
-        for (const auto& wc : this->polled_recv_wcs_) {
-            if (wc.status != IBV_WC_SUCCESS) {
-                throw std::runtime_error("Failed to receive data");
-            } else {
-                auto wr_id = wc.wr_id;
-                if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-                    std::queue<rdma_util::Arc<std::atomic<bool>>>& queue =
-                        this->pending_local_recv_request_map_[wc.imm_data];
-                    queue.front()->store(1);
-                    queue.pop();
-                    this->pending_recv_request_count_--;
-                } else {
-                    Ticket ticket {};
-                    memcpy(
-                        &ticket,
-                        reinterpret_cast<void*>(this->recv_buffer_addr_ + wr_id * sizeof(Ticket)),
-                        sizeof(Ticket)
-                    );
-                    this->remote_recv_request_queue_.enqueue(ticket);
-                }
-                this->qp_->post_recv(
-                    wr_id,
-                    this->recv_buffer_addr_ + wr_id * sizeof(Ticket),
-                    sizeof(Ticket),
-                    this->recv_buffer_lkey_
-                );
+    TCCL_STATS(this->stats_.record_recv_poll(ret);)
+    if (ret < 0) {
+        throw std::runtime_error("Failed to poll recv CQ");
+    }
+    for (const auto& wc : this->polled_recv_wcs_) {
+        const uint64_t recv_slot_addr = this->recv_buffer_addr_ + wc.wr_id * this->recv_slot_size_;
+        if (this->handle_recv_completion_inner(wc, reinterpret_cast<const char*>(recv_slot_addr))) {
+            this->recv_batch_.add_recv(wc.wr_id, recv_slot_addr, this->recv_slot_size_, this->recv_buffer_lkey_);
+        }
+    }
+    // Also carries the slots released by eager recvs of this round
+    if (this->qp_->post_recv_batch(this->recv_batch_)) {
+        throw std::runtime_error("Failed to post recv");
+    }
+
+    return progressed || ret > 0;
+}
+
+bool TcclContext::handle_recv_completion_inner(const WorkCompletion& wc, const char* recv_slot) noexcept(false) {
+    if (wc.status == IBV_WC_LOC_LEN_ERR) {
+        // Only eager messages can overflow a recv slot
+        throw std::runtime_error("Eager message exceeds the recv slot, the peers must use the same eager_threshold");
+    }
+    if (wc.status != IBV_WC_SUCCESS) {
+        throw std::runtime_error("Failed to receive data");
+    }
+
+    if (wc.opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
+        RingBuffer<uint32_t>& local_recv_slots = this->stream_table_.get(wc.imm_data).local_recv_slots;
+        const uint32_t slot = local_recv_slots.front();
+        local_recv_slots.pop();
+        // Only scattered recvs keep their segments, one Ticket was advertised for each of them
+        this->pending_recv_request_count_ -= std::max<uint64_t>(1, this->slots_->states[slot].segments.size());
+        this->complete_slot_inner(slot);
+    } else {
+        Ticket ticket {};
+        memcpy(&ticket, recv_slot, sizeof(Ticket));
+        if (ticket.kind == TicketKind::PULL_DONE) {
+            this->complete_slot_inner(ticket.slot);
+        } else if (ticket.kind == TicketKind::EAGER_MESSAGE) {
+            return this->deliver_eager_inner(ticket, recv_slot + sizeof(Ticket), wc.wr_id);
+        } else {
+            this->remote_recv_request_queue_.enqueue(*this->remote_recv_request_producer_token_, ticket);
+        }
+    }
+    return true;
+}
+
+constexpr uint64_t StripedHandle::kMaxStripes;
+constexpr uint64_t StripedTcclContext::kStripeAlignment;
+constexpr uint64_t StripedTcclContext::kDefaultMinStripeSize;
+
+Arc<StripedTcclContext> StripedTcclContext::create(
+    std::vector<Box<RcQueuePair>> qps,
+    bool spawn_polling_thread,
+    uint64_t dop,
+    uint64_t min_stripe_size,
+    const TcclContextConfig& config
+) noexcept(false) {
+    ASSERT(qps.size() > 0, "No QP to stripe over");
+    ASSERT(qps.size() <= StripedHandle::kMaxStripes, "Too many QPs to stripe over");
+
+    Arc<StripedTcclContext> striped_context = Arc<StripedTcclContext>(new StripedTcclContext());
+    striped_context->min_stripe_size_ = std::max(min_stripe_size, kStripeAlignment);
+    for (auto& qp : qps) {
+        striped_context->contexts_.push_back(TcclContext::create(std::move(qp), spawn_polling_thread, dop, config));
+    }
+    return striped_context;
+}
+
+uint64_t StripedTcclContext::get_stripe_size(uint64_t length) const {
+    // Both peers must derive the same stripe layout from the length alone
+    const uint64_t num_stripes = std::min<uint64_t>(
+        this->contexts_.size(),
+        std::max<uint64_t>(1, (length + this->min_stripe_size_ - 1) / this->min_stripe_size_)
+    );
+    const uint64_t stripe_size = (length + num_stripes - 1) / num_stripes;
+    return (stripe_size + kStripeAlignment - 1) / kStripeAlignment * kStripeAlignment;
+}
+
+void StripedTcclContext::poll_both() noexcept(false) {
+    for (auto& context : this->contexts_) {
+        context->poll_both();
+    }
+}
+
+StripedHandle StripedTcclContext::send(
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    const std::vector<uint32_t>& lkeys
+) noexcept(false) {
+    ASSERT(lkeys.size() == 1 || lkeys.size() == this->contexts_.size(), "Number of lkeys mismatch");
+
+    const uint64_t stripe_size = this->get_stripe_size(length);
+    StripedHandle handles;
+    uint64_t offset = 0;
+    uint64_t index = 0;
+    do {
+        const uint64_t stripe_length = std::min<uint64_t>(stripe_size, length - offset);
+        const uint32_t lkey = lkeys.size() == 1 ? lkeys[0] : lkeys[index];
+        handles.push(this->contexts_[index]->send(stream_id, addr + offset, stripe_length, lkey));
+        offset += stripe_length;
+        index++;
+    } while (offset < length);
+
+    return handles;
+}
+
+StripedHandle StripedTcclContext::recv(
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    const std::vector<uint32_t>& rkeys
+) noexcept(false) {
+    ASSERT(rkeys.size() == 1 || rkeys.size() == this->contexts_.size(), "Number of rkeys mismatch");
+
+    const uint64_t stripe_size = this->get_stripe_size(length);
+    StripedHandle handles;
+    uint64_t offset = 0;
+    uint64_t index = 0;
+    do {
+        const uint64_t stripe_length = std::min<uint64_t>(stripe_size, length - offset);
+        const uint32_t rkey = rkeys.size() == 1 ? rkeys[0] : rkeys[index];
+        handles.push(this->contexts_[index]->recv(stream_id, addr + offset, stripe_length, rkey));
+        offset += stripe_length;
+        index++;
+    } while (offset < length);
+
+    return handles;
+}
+
+void StripedTcclContext::set_stream_qos(uint32_t stream_id, const StreamQos& qos) noexcept(false) {
+    for (auto& context : this->contexts_) {
+        context->set_stream_qos(stream_id, qos);
+    }
+}
+
+Arc<TcclContextGroup> TcclContextGroup::create(
+    Arc<ProtectionDomain> pd,
+    bool spawn_polling_thread,
+    uint64_t dop,
+    const TcclContextConfig& config,
+    const TcclContextGroupConfig& group_config
+) noexcept(false) {
+    ASSERT(group_config.num_recv_slots > 0, "The group needs recv slots");
+
+    Arc<TcclContextGroup> group = Arc<TcclContextGroup>(new TcclContextGroup());
+    group->dop_ = dop;
+    group->config_ = config;
+
+    // Every posted recv completes at most once before it is reposted, so the CQ never overflows
+    SharedReceiveQueueConfig srq_config;
+    srq_config.max_wr = group_config.num_recv_slots;
+    srq_config.max_sge = 1;
+    srq_config.cq_depth = group_config.num_recv_slots;
+    group->srq_ = SharedReceiveQueue::create(pd, srq_config);
+
+    const uint64_t num_recv_slots = group_config.num_recv_slots;
+    const int numa_node = get_bound_numa_node(config, pd);
+    group->recv_slot_size_ = sizeof(Ticket) + config.eager_threshold;
+    group->recv_ring_ = MemoryRegion::create(
+        pd,
+        allocate_host_buffer(group->recv_slot_size_ * num_recv_slots, numa_node),
+        group->recv_slot_size_ * num_recv_slots
+    );
+    group->recv_batch_ = RecvWorkRequestBatch(num_recv_slots);
+    group->slots_ = Arc<RequestSlots>(new RequestSlots(config.max_inflight_requests));
+    group->recv_ibv_wc_buffer_ = std::vector<ibv_wc>(2 * dop);
+    group->polled_recv_wcs_.reserve(2 * dop);
+
+    const uint64_t ring_addr = uint64_t(group->recv_ring_->get_addr());
+    for (uint64_t wr_id = 0; wr_id < num_recv_slots; ++wr_id) {
+        group->recv_batch_.add_recv(
+            wr_id,
+            ring_addr + wr_id * group->recv_slot_size_,
+            group->recv_slot_size_,
+            group->recv_ring_->get_lkey()
+        );
+    }
+    if (group->srq_->post_recv_batch(group->recv_batch_)) {
+        throw std::runtime_error("Failed to post recv");
+    }
+
+    group->version_.store(0);
+    group->seen_version_ = 0;
+
+    // The polling thread only captures the raw pointer, otherwise the group would never be destroyed
+    if (spawn_polling_thread) {
+        group->background_polling_ = true;
+        group->polling_stopped_.store(false);
+        TcclContextGroup* raw = group.get();
+        const std::vector<uint32_t> cpus = get_polling_cpus(numa_node);
+        group->polling_thread_ = std::thread([raw, cpus]() {
+            Topology::pin_current_thread(cpus);
+            while (!raw->polling_stopped_.load(std::memory_order_relaxed)) {
+                raw->poll_once_inner();
+            }
+        });
+    } else {
+        group->background_polling_ = false;
+        group->polling_stopped_.store(true);
+    }
+    return group;
+}
+
+TcclContextGroup::~TcclContextGroup() {
+    if (this->background_polling_) {
+        this->polling_stopped_.store(true);
+        this->polling_thread_.join();
+    }
+}
+
+Box<RcQueuePair> TcclContextGroup::create_queue_pair() noexcept(false) {
+    return RcQueuePair::create(this->srq_, TcclContext::get_queue_pair_config(this->dop_, this->config_));
+}
+
+Arc<TcclContext> TcclContextGroup::add_context(Box<RcQueuePair> qp) noexcept(false) {
+    ASSERT(qp != nullptr && qp->get_srq() == this->srq_, "QP is not attached to the SRQ of the group");
+
+    Arc<TcclContext> context = TcclContext::create_inner(std::move(qp), false, this->dop_, this->config_, this->slots_);
+    // Keeps poll_both and PollingEngine away from the context
+    context->engine_registered_.store(true);
+    // Recv slots held by its eager messages go back to the shared ring, which is posted by poll_once_inner
+    context->recv_buffer_addr_ = uint64_t(this->recv_ring_->get_addr());
+    context->recv_buffer_lkey_ = this->recv_ring_->get_lkey();
+    context->recv_repost_batch_ = &this->recv_batch_;
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    this->contexts_.push_back(context);
+    this->version_.fetch_add(1, std::memory_order_release);
+    return context;
+}
+
+bool TcclContextGroup::deliver_inner(const WorkCompletion& wc) noexcept(false) {
+    auto it = this->contexts_by_qp_num_.find(wc.qp_num);
+    if (it == this->contexts_by_qp_num_.end()) {
+        return false;
+    }
+    const uint64_t recv_slot_addr = uint64_t(this->recv_ring_->get_addr()) + wc.wr_id * this->recv_slot_size_;
+    if (it->second->handle_recv_completion_inner(wc, reinterpret_cast<const char*>(recv_slot_addr))) {
+        this->recv_batch_.add_recv(wc.wr_id, recv_slot_addr, this->recv_slot_size_, this->recv_ring_->get_lkey());
+    }
+    return true;
+}
+
+bool TcclContextGroup::poll_once_inner() noexcept(false) {
+    bool progressed = false;
+
+    uint64_t version = this->version_.load(std::memory_order_acquire);
+    if (version != this->seen_version_) {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->seen_version_ = this->version_.load(std::memory_order_relaxed);
+            this->polled_contexts_ = this->contexts_;
+        }
+        this->contexts_by_qp_num_.clear();
+        for (auto& context : this->polled_contexts_) {
+            this->contexts_by_qp_num_[context->qp_->get_qp_num()] = context.get();
+        }
+
+        // Compact the held back completions in place, keeping their order
+        uint64_t num_kept = 0;
+        for (uint64_t i = 0; i < this->undelivered_wcs_.size(); ++i) {
+            if (!this->deliver_inner(this->undelivered_wcs_[i])) {
+                this->undelivered_wcs_[num_kept++] = this->undelivered_wcs_[i];
             }
         }
-    } else if (ret < 0) {
+        progressed |= num_kept < this->undelivered_wcs_.size();
+        this->undelivered_wcs_.resize(num_kept);
+    }
+
+    // Local recv requests go first, so a write with imm always finds the slot of its recv
+    for (auto& context : this->polled_contexts_) {
+        progressed |= context->poll_recv_one_round_inner();
+    }
+
+    int ret = this->srq_->poll_recv_cq_once(
+        this->recv_ibv_wc_buffer_.size(),
+        this->recv_ibv_wc_buffer_.data(),
+        this->polled_recv_wcs_
+    );
+    if (ret < 0) {
         throw std::runtime_error("Failed to poll recv CQ");
     }
+    for (const auto& wc : this->polled_recv_wcs_) {
+        if (!this->deliver_inner(wc)) {
+            this->undelivered_wcs_.push_back(wc);
+        }
+    }
+    if (this->srq_->post_recv_batch(this->recv_batch_)) {
+        throw std::runtime_error("Failed to post recv");
+    }
+    progressed |= ret > 0;
+
+    for (auto& context : this->polled_contexts_) {
+        progressed |= context->poll_send_one_round_inner();
+    }
+
+    return progressed;
+}
+
+Arc<PollingEngine> PollingEngine::create(const PollingEngineConfig& config) noexcept(false) {
+    ASSERT(config.num_threads > 0, "PollingEngine needs at least one thread");
+
+    Arc<PollingEngine> engine = Arc<PollingEngine>(new PollingEngine());
+    engine->config_ = config;
+    engine->version_.store(0);
+    engine->stopped_.store(false);
+    for (uint64_t i = 0; i < config.num_threads; ++i) {
+        engine->pollers_.push_back(Box<Poller>(new Poller()));
+        engine->pollers_.back()->seen_version.store(0);
+    }
+
+    // The pollers only capture the raw pointer, otherwise the engine would never be destroyed
+    PollingEngine* raw = engine.get();
+    for (uint64_t i = 0; i < config.num_threads; ++i) {
+        engine->pollers_[i]->thread = std::thread([raw, i]() { raw->poller_loop(i); });
+    }
+    return engine;
+}
+
+PollingEngine::~PollingEngine() {
+    this->stopped_.store(true);
+    for (auto& poller : this->pollers_) {
+        poller->thread.join();
+    }
+    for (auto& poller : this->pollers_) {
+        for (auto& context : poller->contexts) {
+            context->engine_registered_.store(false);
+        }
+    }
+}
+
+void PollingEngine::register_context(Arc<TcclContext> context) noexcept(false) {
+    ASSERT(context != nullptr, "Context is null");
+    ASSERT(!context->background_polling_, "Context already has its own polling thread");
+    ASSERT(!context->engine_registered_.exchange(true), "Context is already registered");
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    Poller* target = this->pollers_[0].get();
+    for (auto& poller : this->pollers_) {
+        if (poller->contexts.size() < target->contexts.size()) {
+            target = poller.get();
+        }
+    }
+    target->contexts.push_back(std::move(context));
+    this->version_.fetch_add(1, std::memory_order_release);
+}
+
+void PollingEngine::deregister_context(const Arc<TcclContext>& context) noexcept(false) {
+    uint64_t version = 0;
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        for (auto& poller : this->pollers_) {
+            auto it = std::find(poller->contexts.begin(), poller->contexts.end(), context);
+            if (it != poller->contexts.end()) {
+                poller->contexts.erase(it);
+                found = true;
+                break;
+            }
+        }
+        version = this->version_.fetch_add(1, std::memory_order_release) + 1;
+    }
+    ASSERT(found, "Context is not registered");
+
+    this->wait_for_pollers(version);
+    context->engine_registered_.store(false);
+}
+
+void PollingEngine::wait_for_pollers(uint64_t version) const {
+    for (auto& poller : this->pollers_) {
+        while (poller->seen_version.load(std::memory_order_acquire) < version) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void PollingEngine::poller_loop(uint64_t index) noexcept(false) {
+    Poller* self = this->pollers_[index].get();
+    if (!this->config_.cpus.empty()) {
+        Topology::pin_current_thread({this->config_.cpus[index % this->config_.cpus.size()]});
+    }
+
+    // Private snapshots, refreshed when the registration version moves
+    std::vector<Arc<TcclContext>> own_contexts;
+    std::vector<Arc<TcclContext>> other_contexts;
+    uint64_t seen_version = UINT64_MAX;
+
+    while (!this->stopped_.load(std::memory_order_relaxed)) {
+        uint64_t version = this->version_.load(std::memory_order_acquire);
+        if (version != seen_version) {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            version = this->version_.load(std::memory_order_relaxed);
+            own_contexts = self->contexts;
+            other_contexts.clear();
+            for (auto& poller : this->pollers_) {
+                if (poller.get() != self) {
+                    other_contexts.insert(other_contexts.end(), poller->contexts.begin(), poller->contexts.end());
+                }
+            }
+            seen_version = version;
+            self->seen_version.store(version, std::memory_order_release);
+        }
+
+        bool progressed = false;
+        for (auto& context : own_contexts) {
+            progressed |= context->try_poll_both_inner();
+        }
+
+        if (!progressed) {
+            for (auto& context : other_contexts) {
+                if (context->engine_busy_.load(std::memory_order_relaxed)) {
+                    progressed |= context->try_poll_both_inner();
+                }
+            }
+        }
+
+        if (!progressed) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+std::vector<uint32_t> PollingEngine::get_numa_node_cpus(int numa_node) noexcept(false) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(numa_node) + "/cpulist");
+    ASSERT(file.is_open(), "Failed to open cpulist of the NUMA node");
+    std::string cpu_list;
+    std::getline(file, cpu_list);
+    return Topology::parse_cpu_list(cpu_list);
+}
+
+int PollingEngine::get_device_numa_node(const char* dev_name) noexcept {
+    return Topology::get_rdma_device_numa_node(dev_name);
 }
 
 }  // namespace rdma_util
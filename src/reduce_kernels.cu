@@ -0,0 +1,79 @@
+#include "reduce_kernels.h"
+
+#include <cuda_runtime.h>
+
+#include <cstdint>
+
+namespace reduce_kernels {
+
+// Must match rdma_util::DataType and rdma_util::ReduceOp
+enum { INT32 = 0, INT64 = 1, FLOAT32 = 2, FLOAT64 = 3 };
+enum { SUM = 0, MIN = 1, MAX = 2 };
+
+static constexpr int kThreadsPerBlock = 512;
+static constexpr uint64_t kMaxBlocks = 1024;
+
+template<typename T, int Op>
+__global__ void reduce_kernel(T* dst, const T* src, uint64_t count) {
+    const uint64_t stride = uint64_t(gridDim.x) * blockDim.x;
+    for (uint64_t i = uint64_t(blockIdx.x) * blockDim.x + threadIdx.x; i < count; i += stride) {
+        const T a = dst[i];
+        const T b = src[i];
+        if (Op == SUM) {
+            dst[i] = a + b;
+        } else if (Op == MIN) {
+            dst[i] = b < a ? b : a;
+        } else {
+            dst[i] = a < b ? b : a;
+        }
+    }
+}
+
+template<typename T>
+static cudaError_t launch_typed(void* dst, const void* src, uint64_t count, int op, cudaStream_t stream) {
+    uint64_t blocks = (count + kThreadsPerBlock - 1) / kThreadsPerBlock;
+    blocks = blocks < kMaxBlocks ? blocks : kMaxBlocks;
+    T* typed_dst = static_cast<T*>(dst);
+    const T* typed_src = static_cast<const T*>(src);
+    switch (op) {
+        case SUM:
+            reduce_kernel<T, SUM><<<blocks, kThreadsPerBlock, 0, stream>>>(typed_dst, typed_src, count);
+            break;
+        case MIN:
+            reduce_kernel<T, MIN><<<blocks, kThreadsPerBlock, 0, stream>>>(typed_dst, typed_src, count);
+            break;
+        case MAX:
+            reduce_kernel<T, MAX><<<blocks, kThreadsPerBlock, 0, stream>>>(typed_dst, typed_src, count);
+            break;
+        default:
+            return cudaErrorInvalidValue;
+    }
+    return cudaGetLastError();
+}
+
+cudaError_t launch_reduce(
+    void* dst,
+    const void* src,
+    uint64_t count,
+    int data_type,
+    int op,
+    cudaStream_t stream
+) noexcept {
+    if (count == 0) {
+        return cudaSuccess;
+    }
+    switch (data_type) {
+        case INT32:
+            return launch_typed<int32_t>(dst, src, count, op, stream);
+        case INT64:
+            return launch_typed<int64_t>(dst, src, count, op, stream);
+        case FLOAT32:
+            return launch_typed<float>(dst, src, count, op, stream);
+        case FLOAT64:
+            return launch_typed<double>(dst, src, count, op, stream);
+        default:
+            return cudaErrorInvalidValue;
+    }
+}
+
+}  // namespace reduce_kernels
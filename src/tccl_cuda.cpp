@@ -0,0 +1,164 @@
+#include "tccl_cuda.h"
+
+#include <cuda.h>
+#include <cuda_runtime.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rdma_assert.h"
+
+namespace rdma_util {
+
+constexpr uint32_t CudaStreamTccl::kDefaultNumFlags;
+
+Box<CudaStreamTccl> CudaStreamTccl::create(
+    Arc<TcclContext> context,
+    uint32_t device,
+    uint32_t num_flags
+) noexcept(false) {
+    ASSERT(context != nullptr, "Context is null");
+    ASSERT(num_flags > 0, "num_flags must be positive");
+    ASSERT(cudaSetDevice(device) == cudaSuccess, "Failed to set device");
+
+    void* host_flags = nullptr;
+    void* device_flags = nullptr;
+    ASSERT(
+        cudaHostAlloc(&host_flags, num_flags * sizeof(uint32_t), cudaHostAllocMapped | cudaHostAllocPortable)
+            == cudaSuccess,
+        "Failed to allocate mapped host flags"
+    );
+    if (cudaHostGetDevicePointer(&device_flags, host_flags, 0) != cudaSuccess) {
+        cudaFreeHost(host_flags);
+        throw std::runtime_error("Failed to map host flags into the device");
+    }
+
+    int can_flush = 0;
+    if (cuDeviceGetAttribute(&can_flush, CU_DEVICE_ATTRIBUTE_CAN_FLUSH_REMOTE_WRITES, CUdevice(device))
+        != CUDA_SUCCESS) {
+        can_flush = 0;
+    }
+
+    auto bridge = Box<CudaStreamTccl>(new CudaStreamTccl());
+    bridge->context_ = context;
+    bridge->device_ = device;
+    bridge->host_flags_ = static_cast<uint32_t*>(host_flags);
+    bridge->device_flags_ = uint64_t(device_flags);
+    bridge->num_flags_ = num_flags;
+    bridge->wait_flags_ = CU_STREAM_WAIT_VALUE_GEQ | (can_flush ? CU_STREAM_WAIT_VALUE_FLUSH : 0);
+    bridge->operations_ = std::vector<Operation>(num_flags);
+    bridge->next_operation_ = 0;
+    bridge->failed_.store(false);
+    for (uint32_t i = 0; i < num_flags; ++i) {
+        bridge->host_flags_[i] = 0;
+    }
+    return bridge;
+}
+
+CudaStreamTccl::~CudaStreamTccl() {
+    cudaSetDevice(this->device_);
+    cudaFreeHost(this->host_flags_);
+}
+
+void CudaStreamTccl::send_on_stream(
+    cudaStream_t stream,
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t lkey
+) noexcept(false) {
+    this->enqueue_inner(stream, stream_id, addr, length, lkey, true);
+}
+
+void CudaStreamTccl::recv_on_stream(
+    cudaStream_t stream,
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t rkey
+) noexcept(false) {
+    this->enqueue_inner(stream, stream_id, addr, length, rkey, false);
+}
+
+void CudaStreamTccl::enqueue_inner(
+    cudaStream_t stream,
+    uint32_t stream_id,
+    uint64_t addr,
+    uint64_t length,
+    uint32_t key,
+    bool is_send
+) noexcept(false) {
+    ASSERT(!this->failed_.load(std::memory_order_relaxed), "A stream-ordered transfer failed to submit");
+
+    // The stream must see the host function before the wait, so both are enqueued under the lock
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    const uint32_t index = uint32_t(this->next_operation_ % this->num_flags_);
+    const uint32_t value = uint32_t(this->next_operation_ / this->num_flags_) + 1;
+
+    // The previous transfer of the flag must be finished, otherwise its waiter could be released by this one
+    while (__atomic_load_n(&this->host_flags_[index], __ATOMIC_ACQUIRE) != value - 1) {
+        std::this_thread::yield();
+    }
+
+    Operation& operation = this->operations_[index];
+    operation = Operation {this, index, value, stream_id, addr, length, key, is_send};
+    ASSERT(
+        cudaLaunchHostFunc(stream, CudaStreamTccl::launch_inner, &operation) == cudaSuccess,
+        "Failed to enqueue host function"
+    );
+
+    const CUresult ret = cuStreamWaitValue32(
+        CUstream(stream),
+        CUdeviceptr(this->device_flags_ + index * sizeof(uint32_t)),
+        value,
+        this->wait_flags_
+    );
+    if (ret != CUDA_SUCCESS) {
+        // The host function is enqueued already and will submit, but nothing can wait for it any more
+        this->failed_.store(true);
+        throw std::runtime_error("Failed to enqueue stream wait, stream memory operations may be unsupported");
+    }
+    this->next_operation_++;
+}
+
+void CudaStreamTccl::launch_inner(void* arg) noexcept {
+    Operation* operation = static_cast<Operation*>(arg);
+    CudaStreamTccl* owner = operation->owner;
+    uint32_t* flag = &owner->host_flags_[operation->index];
+
+    // Runs on the callback thread of CUDA, which must not call into CUDA, so the handle is dropped
+    // and the polling thread stores the flag
+    try {
+        if (operation->is_send) {
+            static_cast<void>(owner->context_->send_signaled(
+                operation->stream_id,
+                operation->addr,
+                operation->length,
+                operation->key,
+                flag,
+                operation->value
+            ));
+        } else {
+            static_cast<void>(owner->context_->recv_signaled(
+                operation->stream_id,
+                operation->addr,
+                operation->length,
+                operation->key,
+                flag,
+                operation->value
+            ));
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "Failed to submit stream-ordered transfer: %s\n", e.what());
+        owner->failed_.store(true);
+        __atomic_store_n(flag, operation->value, __ATOMIC_RELEASE);
+    }
+}
+
+}  // namespace rdma_util
@@ -0,0 +1,237 @@
+#include "tccl_stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <sstream>
+#include <string>
+
+namespace rdma_util {
+
+constexpr uint32_t LatencyHistogram::kSubBucketBits;
+constexpr uint32_t LatencyHistogram::kSubBuckets;
+constexpr uint32_t LatencyHistogram::kNumBuckets;
+constexpr uint32_t TcclContextStats::kMaxIndexedStreamId;
+
+double HistogramSnapshot::mean() const {
+    return this->count == 0 ? 0.0 : double(this->sum) / double(this->count);
+}
+
+uint64_t HistogramSnapshot::percentile(double quantile) const {
+    if (this->count == 0) {
+        return 0;
+    }
+    quantile = std::min(std::max(quantile, 0.0), 1.0);
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(quantile * double(this->count))));
+
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < this->buckets.size(); ++i) {
+        seen += this->buckets[i];
+        if (seen >= rank) {
+            // The upper bound of the bucket, which the largest recorded value never exceeds
+            const uint64_t upper = i + 1 < LatencyHistogram::kNumBuckets
+                ? LatencyHistogram::get_bucket_lower_bound(i + 1) - 1
+                : UINT64_MAX;
+            return std::min(upper, this->max);
+        }
+    }
+    return this->max;
+}
+
+void HistogramSnapshot::merge(const HistogramSnapshot& other) {
+    if (this->buckets.size() < other.buckets.size()) {
+        this->buckets.resize(other.buckets.size(), 0);
+    }
+    for (uint64_t i = 0; i < other.buckets.size(); ++i) {
+        this->buckets[i] += other.buckets[i];
+    }
+    this->count += other.count;
+    this->sum += other.sum;
+    this->max = std::max(this->max, other.max);
+}
+
+std::string HistogramSnapshot::to_json() const {
+    std::stringstream ss;
+    ss << "{\"count\": " << this->count << ", \"mean\": " << this->mean() << ", \"p50\": " << this->percentile(0.5)
+       << ", \"p90\": " << this->percentile(0.9) << ", \"p99\": " << this->percentile(0.99)
+       << ", \"p999\": " << this->percentile(0.999) << ", \"max\": " << this->max << ", \"buckets\": [";
+
+    // Only non-empty buckets are exported, as [lower_bound, count] pairs
+    bool first = true;
+    for (uint32_t i = 0; i < this->buckets.size(); ++i) {
+        if (this->buckets[i] == 0) {
+            continue;
+        }
+        ss << (first ? "" : ", ") << "[" << LatencyHistogram::get_bucket_lower_bound(i) << ", " << this->buckets[i]
+           << "]";
+        first = false;
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+LatencyHistogram::LatencyHistogram() {
+    for (auto& bucket : this->buckets_) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    this->count_.store(0, std::memory_order_relaxed);
+    this->sum_.store(0, std::memory_order_relaxed);
+    this->max_.store(0, std::memory_order_relaxed);
+}
+
+HistogramSnapshot LatencyHistogram::snapshot() const {
+    HistogramSnapshot snapshot;
+    snapshot.buckets.resize(kNumBuckets);
+    for (uint32_t i = 0; i < kNumBuckets; ++i) {
+        snapshot.buckets[i] = this->buckets_[i].load(std::memory_order_relaxed);
+    }
+    snapshot.sum = this->sum_.load(std::memory_order_relaxed);
+    snapshot.max = this->max_.load(std::memory_order_relaxed);
+
+    // The writer may be ahead of the buckets read above, keep count and buckets in agreement
+    snapshot.count = 0;
+    for (uint64_t count : snapshot.buckets) {
+        snapshot.count += count;
+    }
+    return snapshot;
+}
+
+std::string StreamStatsSnapshot::to_json() const {
+    std::stringstream ss;
+    ss << "{\"num_sends\": " << this->num_sends << ", \"num_recvs\": " << this->num_recvs
+       << ", \"bytes_sent\": " << this->bytes_sent << ", \"bytes_received\": " << this->bytes_received
+       << ", \"send_latency\": " << this->send_latency.to_json()
+       << ", \"recv_latency\": " << this->recv_latency.to_json() << "}";
+    return ss.str();
+}
+
+std::string TcclContextStatsSnapshot::to_json() const {
+    std::stringstream ss;
+    ss << "{\"enabled\": " << (this->enabled ? "true" : "false") << ", \"ticket_wait\": " << this->ticket_wait.to_json()
+       << ", \"match_wait\": " << this->match_wait.to_json()
+       << ", \"transfer_latency\": " << this->transfer_latency.to_json()
+       << ", \"send_cq\": {\"polls\": " << this->send_cq_polls << ", \"empty_polls\": " << this->send_cq_empty_polls
+       << ", \"wcs\": " << this->send_wcs << "}, \"recv_cq\": {\"polls\": " << this->recv_cq_polls
+       << ", \"empty_polls\": " << this->recv_cq_empty_polls << ", \"wcs\": " << this->recv_wcs
+       << "}, \"streams\": {";
+    bool first = true;
+    for (const auto& stream : this->streams) {
+        ss << (first ? "" : ", ") << "\"" << stream.first << "\": " << stream.second.to_json();
+        first = false;
+    }
+    ss << "}}";
+    return ss.str();
+}
+
+static void append_histogram_line(std::stringstream& ss, const char* name, const HistogramSnapshot& histogram) {
+    char line[256];
+    snprintf(
+        line,
+        sizeof(line),
+        "  %-18s count %10lu  p50 %9.2f us  p99 %9.2f us  max %9.2f us\n",
+        name,
+        histogram.count,
+        histogram.percentile(0.5) / 1000.0,
+        histogram.percentile(0.99) / 1000.0,
+        histogram.max / 1000.0
+    );
+    ss << line;
+}
+
+static double occupancy(uint64_t polls, uint64_t empty_polls) {
+    return polls == 0 ? 0.0 : 100.0 * double(polls - empty_polls) / double(polls);
+}
+
+std::string TcclContextStatsSnapshot::to_string() const {
+    if (!this->enabled) {
+        return "TcclContext stats are disabled, rebuild with -DENABLE_STATS=ON\n";
+    }
+
+    std::stringstream ss;
+    ss << "TcclContext stats:\n";
+    append_histogram_line(ss, "ticket_wait", this->ticket_wait);
+    append_histogram_line(ss, "match_wait", this->match_wait);
+    append_histogram_line(ss, "transfer_latency", this->transfer_latency);
+
+    char line[256];
+    snprintf(
+        line,
+        sizeof(line),
+        "  send CQ: %lu polls, %.1f%% non-empty, %lu wcs\n  recv CQ: %lu polls, %.1f%% non-empty, %lu wcs\n",
+        this->send_cq_polls,
+        occupancy(this->send_cq_polls, this->send_cq_empty_polls),
+        this->send_wcs,
+        this->recv_cq_polls,
+        occupancy(this->recv_cq_polls, this->recv_cq_empty_polls),
+        this->recv_wcs
+    );
+    ss << line;
+
+    for (const auto& stream : this->streams) {
+        snprintf(
+            line,
+            sizeof(line),
+            "  stream %u: %lu sends (%lu bytes), %lu recvs (%lu bytes)\n",
+            stream.first,
+            stream.second.num_sends,
+            stream.second.bytes_sent,
+            stream.second.num_recvs,
+            stream.second.bytes_received
+        );
+        ss << line;
+        if (stream.second.num_sends > 0) {
+            append_histogram_line(ss, "  send_latency", stream.second.send_latency);
+        }
+        if (stream.second.num_recvs > 0) {
+            append_histogram_line(ss, "  recv_latency", stream.second.recv_latency);
+        }
+    }
+    return ss.str();
+}
+
+StreamStats& TcclContextStats::create_stream(uint32_t stream_id) {
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    std::unique_ptr<StreamStats>& stream = this->streams_[stream_id];
+    if (stream == nullptr) {
+        stream = std::unique_ptr<StreamStats>(new StreamStats());
+    }
+    if (stream_id >= kMaxIndexedStreamId) {
+        this->sparse_stream_cache_[stream_id] = stream.get();
+        return *stream;
+    }
+    if (stream_id >= this->stream_cache_.size()) {
+        this->stream_cache_.resize(stream_id + 1, nullptr);
+    }
+    this->stream_cache_[stream_id] = stream.get();
+    return *stream;
+}
+
+TcclContextStatsSnapshot TcclContextStats::snapshot() {
+    TcclContextStatsSnapshot snapshot;
+    snapshot.enabled = true;
+    snapshot.ticket_wait = this->ticket_wait.snapshot();
+    snapshot.match_wait = this->match_wait.snapshot();
+    snapshot.transfer_latency = this->transfer_latency.snapshot();
+    snapshot.send_cq_polls = this->send_cq_polls.load(std::memory_order_relaxed);
+    snapshot.send_cq_empty_polls = this->send_cq_empty_polls.load(std::memory_order_relaxed);
+    snapshot.send_wcs = this->send_wcs.load(std::memory_order_relaxed);
+    snapshot.recv_cq_polls = this->recv_cq_polls.load(std::memory_order_relaxed);
+    snapshot.recv_cq_empty_polls = this->recv_cq_empty_polls.load(std::memory_order_relaxed);
+    snapshot.recv_wcs = this->recv_wcs.load(std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(this->mutex_);
+    for (const auto& entry : this->streams_) {
+        const StreamStats& stats = *entry.second;
+        StreamStatsSnapshot& stream = snapshot.streams[entry.first];
+        stream.num_sends = stats.num_sends.load(std::memory_order_relaxed);
+        stream.num_recvs = stats.num_recvs.load(std::memory_order_relaxed);
+        stream.bytes_sent = stats.bytes_sent.load(std::memory_order_relaxed);
+        stream.bytes_received = stats.bytes_received.load(std::memory_order_relaxed);
+        stream.send_latency = stats.send_latency.snapshot();
+        stream.recv_latency = stats.recv_latency.snapshot();
+    }
+    return snapshot;
+}
+
+}  // namespace rdma_util
@@ -0,0 +1,266 @@
+#include "topology.h"
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "rdma_assert.h"
+
+namespace rdma_util {
+
+static std::string resolve_path(const std::string& path) {
+    char* resolved = realpath(path.c_str(), nullptr);
+    if (resolved == nullptr) {
+        return std::string();
+    }
+    std::string result(resolved);
+    free(resolved);
+    return result;
+}
+
+static bool is_pci_address(const std::string& name) {
+    unsigned domain = 0, bus = 0, device = 0, function = 0;
+    char end = 0;
+    return sscanf(name.c_str(), "%x:%x:%x.%x%c", &domain, &bus, &device, &function, &end) == 4;
+}
+
+const char* to_string(PciDistance distance) noexcept {
+    switch (distance) {
+        case PciDistance::PCIE_SWITCH:
+            return "PCIE_SWITCH";
+        case PciDistance::HOST_BRIDGE:
+            return "HOST_BRIDGE";
+        case PciDistance::NUMA_NODE:
+            return "NUMA_NODE";
+        case PciDistance::SYSTEM:
+            return "SYSTEM";
+    }
+    return "UNKNOWN";
+}
+
+Box<Topology> Topology::create(const std::string& sysfs_root) noexcept(false) {
+    auto topology = Box<Topology>(new Topology());
+    topology->sysfs_root_ = resolve_path(sysfs_root);
+    ASSERT(!topology->sysfs_root_.empty(), "Failed to resolve sysfs root");
+
+    const std::string class_dir = topology->sysfs_root_ + "/class/infiniband";
+    DIR* dir = opendir(class_dir.c_str());
+    if (dir == nullptr) {
+        // A host without RDMA devices has no infiniband class at all
+        return topology;
+    }
+    while (dirent* entry = readdir(dir)) {
+        const std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+        PciDevice device = topology->read_device_inner(class_dir + "/" + name + "/device");
+        device.name = name;
+        topology->rdma_devices_.push_back(device);
+    }
+    closedir(dir);
+
+    std::sort(
+        topology->rdma_devices_.begin(),
+        topology->rdma_devices_.end(),
+        [](const PciDevice& a, const PciDevice& b) { return a.name < b.name; }
+    );
+    return topology;
+}
+
+PciDevice Topology::read_device_inner(const std::string& device_link) const noexcept(false) {
+    PciDevice device {};
+    device.numa_node = -1;
+
+    const std::string path = resolve_path(device_link);
+    if (path.empty()) {
+        return device;
+    }
+
+    // The path is like <root>/devices/pci0000:3a/0000:3a:00.0/0000:3b:00.0, virtual devices live elsewhere
+    std::stringstream ss(path.substr(std::min(path.size(), this->sysfs_root_.size())));
+    std::string component;
+    while (std::getline(ss, component, '/')) {
+        if (component.compare(0, 3, "pci") == 0 && device.pci_path.empty()) {
+            device.pci_path.push_back(component);
+        } else if (!device.pci_path.empty() && is_pci_address(component)) {
+            device.pci_path.push_back(Topology::normalize_pci_address(component));
+        }
+    }
+    if (device.pci_path.size() > 1) {
+        device.pci_address = device.pci_path.back();
+    } else {
+        device.pci_path.clear();
+    }
+
+    std::ifstream file(path + "/numa_node");
+    if (!(file >> device.numa_node) || device.numa_node < 0) {
+        device.numa_node = -1;
+    }
+    return device;
+}
+
+const PciDevice& Topology::get_rdma_device(const std::string& name) const noexcept(false) {
+    for (const auto& device : this->rdma_devices_) {
+        if (device.name == name) {
+            return device;
+        }
+    }
+    throw std::runtime_error("RDMA device not found: " + name);
+}
+
+PciDevice Topology::get_pci_device(const std::string& pci_address) const noexcept(false) {
+    const std::string address = Topology::normalize_pci_address(pci_address);
+    PciDevice device = this->read_device_inner(this->sysfs_root_ + "/bus/pci/devices/" + address);
+    if (device.pci_address.empty()) {
+        throw std::runtime_error("PCI device not found: " + address);
+    }
+    return device;
+}
+
+const PciDevice& Topology::get_nearest_rdma_device(const std::string& pci_address) const noexcept(false) {
+    ASSERT(!this->rdma_devices_.empty(), "No RDMA device");
+    const PciDevice target = this->get_pci_device(pci_address);
+
+    const PciDevice* nearest = nullptr;
+    PciDistance nearest_distance = PciDistance::SYSTEM;
+    uint32_t nearest_hops = UINT32_MAX;
+    for (const auto& device : this->rdma_devices_) {
+        const PciDistance distance = Topology::get_distance(target, device);
+        const uint32_t hops = Topology::get_num_hops(target, device);
+        if (nearest == nullptr || distance < nearest_distance
+            || (distance == nearest_distance && hops < nearest_hops)) {
+            nearest = &device;
+            nearest_distance = distance;
+            nearest_hops = hops;
+        }
+    }
+    return *nearest;
+}
+
+std::vector<uint32_t> Topology::get_numa_node_cpus(int numa_node) const noexcept(false) {
+    std::ifstream file(this->sysfs_root_ + "/devices/system/node/node" + std::to_string(numa_node) + "/cpulist");
+    ASSERT(file.is_open(), "Failed to open cpulist of the NUMA node");
+    std::string cpu_list;
+    std::getline(file, cpu_list);
+    return Topology::parse_cpu_list(cpu_list);
+}
+
+PciDistance Topology::get_distance(const PciDevice& a, const PciDevice& b) noexcept {
+    if (!a.pci_path.empty() && !b.pci_path.empty() && a.pci_path[0] == b.pci_path[0]) {
+        // Devices which share a bridge below the root port are behind the same switch
+        uint64_t common = 0;
+        while (common < a.pci_path.size() && common < b.pci_path.size() && a.pci_path[common] == b.pci_path[common]) {
+            ++common;
+        }
+        return common >= 3 ? PciDistance::PCIE_SWITCH : PciDistance::HOST_BRIDGE;
+    }
+    if (a.numa_node >= 0 && a.numa_node == b.numa_node) {
+        return PciDistance::NUMA_NODE;
+    }
+    return PciDistance::SYSTEM;
+}
+
+uint32_t Topology::get_num_hops(const PciDevice& a, const PciDevice& b) noexcept {
+    if (a.pci_path.empty() || b.pci_path.empty() || a.pci_path[0] != b.pci_path[0]) {
+        return UINT32_MAX;
+    }
+    uint64_t common = 0;
+    while (common < a.pci_path.size() && common < b.pci_path.size() && a.pci_path[common] == b.pci_path[common]) {
+        ++common;
+    }
+    return uint32_t(a.pci_path.size() + b.pci_path.size() - 2 * common);
+}
+
+std::string Topology::normalize_pci_address(const std::string& pci_address) noexcept {
+    std::string address = pci_address;
+    std::transform(address.begin(), address.end(), address.begin(), [](char c) { return char(tolower(c)); });
+
+    // 00000000:3b:00.0 has a domain of 8 digits, which sysfs writes with 4
+    const size_t colon = address.find(':');
+    if (colon != std::string::npos && colon > 4) {
+        address = address.substr(colon - 4);
+    }
+    return address;
+}
+
+std::vector<uint32_t> Topology::parse_cpu_list(const std::string& cpu_list) noexcept {
+    std::vector<uint32_t> cpus;
+    std::stringstream ss(cpu_list);
+    std::string range;
+    while (std::getline(ss, range, ',')) {
+        uint32_t first = 0, last = 0;
+        int matched = sscanf(range.c_str(), "%u-%u", &first, &last);
+        if (matched <= 0) {
+            continue;
+        }
+        if (matched == 1) {
+            last = first;
+        }
+        for (uint32_t cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+int Topology::get_rdma_device_numa_node(const char* dev_name) noexcept {
+    std::ifstream file(std::string("/sys/class/infiniband/") + dev_name + "/device/numa_node");
+    int numa_node = -1;
+    if (!(file >> numa_node) || numa_node < 0) {
+        return -1;
+    }
+    return numa_node;
+}
+
+bool Topology::pin_current_thread(const std::vector<uint32_t>& cpus) noexcept {
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    for (uint32_t cpu : cpus) {
+        if (cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &cpu_set);
+        }
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+}
+
+Arc<void> Topology::allocate_on_numa_node(uint64_t size, int numa_node) noexcept(false) {
+    ASSERT(size > 0, "Size must be positive");
+    const uint64_t page_size = uint64_t(sysconf(_SC_PAGESIZE));
+    const uint64_t length = (size + page_size - 1) / page_size * page_size;
+    void* addr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(addr != MAP_FAILED, "Failed to map host memory");
+
+    // The policy must be set before the first touch, which is what places a page
+    if (numa_node >= 0) {
+        const uint64_t kBitsPerWord = sizeof(unsigned long) * 8;
+        std::vector<unsigned long> node_mask(uint64_t(numa_node) / kBitsPerWord + 1, 0);
+        node_mask[uint64_t(numa_node) / kBitsPerWord] |= 1ul << (uint64_t(numa_node) % kBitsPerWord);
+        if (syscall(SYS_mbind, addr, length, MPOL_PREFERRED, node_mask.data(), node_mask.size() * kBitsPerWord + 1, 0)
+            != 0) {
+            fprintf(stderr, "Failed to bind host memory to NUMA node %d\n", numa_node);
+        }
+    }
+    return Arc<void>(addr, [length](void* p) { munmap(p, length); });
+}
+
+}  // namespace rdma_util
@@ -0,0 +1,85 @@
+#include <gtest/gtest.h>
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bootstrap.h"
+
+static std::vector<rdma_util::QueuePairInfo> make_infos(uint64_t count, uint32_t base) {
+    std::vector<rdma_util::QueuePairInfo> infos(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        infos[i] = rdma_util::QueuePairInfo {};
+        infos[i].handshake_data.qp_num = base + uint32_t(i);
+        infos[i].dop = 16;
+    }
+    return infos;
+}
+
+TEST(Bootstrap, ExchangeOverTcp) {
+    auto listener = rdma_util::BootstrapListener::create(0, "127.0.0.1");
+    const uint16_t port = listener->get_port();
+
+    // Large enough to overflow the socket buffers if both sides sent before they received
+    constexpr uint64_t kCount = 100000;
+    std::vector<rdma_util::QueuePairInfo> client_received;
+    std::thread client([port, &client_received]() {
+        auto connection = rdma_util::BootstrapConnection::connect("127.0.0.1", port);
+        client_received = connection->exchange(make_infos(kCount, 1000000));
+    });
+
+    auto connection = listener->accept();
+    auto server_received = connection->exchange(make_infos(kCount, 0));
+    client.join();
+
+    ASSERT_EQ(server_received.size(), kCount);
+    ASSERT_EQ(client_received.size(), kCount);
+    for (uint64_t i = 0; i < kCount; ++i) {
+        ASSERT_EQ(server_received[i].handshake_data.qp_num, 1000000 + i);
+        ASSERT_EQ(client_received[i].handshake_data.qp_num, i);
+    }
+}
+
+TEST(Bootstrap, ExchangeAllOverUnix) {
+    const std::string path = "/tmp/nanogdr_test_bootstrap_" + std::to_string(getpid());
+    auto listener = rdma_util::BootstrapListener::create_unix(path.c_str());
+
+    constexpr uint64_t kNumPeers = 4;
+    std::vector<std::thread> peers;
+    std::vector<uint64_t> received_counts(kNumPeers);
+    for (uint64_t peer = 0; peer < kNumPeers; ++peer) {
+        peers.push_back(std::thread([&path, &received_counts, peer]() {
+            auto connection = rdma_util::BootstrapConnection::connect_unix(path.c_str());
+            received_counts[peer] = connection->exchange(make_infos(peer + 1, uint32_t(peer) * 100)).size();
+        }));
+    }
+
+    auto connections = listener->accept_all(kNumPeers);
+    std::vector<rdma_util::BootstrapConnection*> raw_connections;
+    std::vector<std::vector<rdma_util::QueuePairInfo>> local;
+    for (auto& connection : connections) {
+        raw_connections.push_back(connection.get());
+        local.push_back(make_infos(8, 0));
+    }
+    auto remote = rdma_util::exchange_all(raw_connections, local);
+    for (auto& peer : peers) {
+        peer.join();
+    }
+
+    // Peers connect in any order, but each one tells its index by the first qp_num
+    ASSERT_EQ(remote.size(), kNumPeers);
+    for (const auto& infos : remote) {
+        ASSERT_EQ(infos.size(), infos[0].handshake_data.qp_num / 100 + 1);
+    }
+    for (uint64_t peer = 0; peer < kNumPeers; ++peer) {
+        ASSERT_EQ(received_counts[peer], 8);
+    }
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,75 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "collective.h"
+
+using rdma_util::Communicator;
+
+TEST(Communicator, SegmentOffsets) {
+    // The first count % world_size segments hold one extra element
+    ASSERT_EQ(Communicator::get_segment_offsets(10, 3, 4), (std::vector<uint64_t> {0, 16, 28, 40}));
+    ASSERT_EQ(Communicator::get_segment_offsets(9, 3, 8), (std::vector<uint64_t> {0, 24, 48, 72}));
+
+    // Fewer elements than ranks leave the last segments empty
+    ASSERT_EQ(Communicator::get_segment_offsets(2, 4, 4), (std::vector<uint64_t> {0, 4, 8, 8, 8}));
+}
+
+TEST(Communicator, PipelineChunks) {
+    ASSERT_EQ(Communicator::get_pipeline_chunk_size(10, 4), 8);
+    ASSERT_EQ(Communicator::get_pipeline_chunk_size(3, 8), 8);
+
+    ASSERT_EQ(Communicator::get_num_chunks(0, 8), 0);
+    ASSERT_EQ(Communicator::get_num_chunks(16, 8), 2);
+    ASSERT_EQ(Communicator::get_num_chunks(20, 8), 3);
+    ASSERT_EQ(Communicator::get_chunk_length(20, 8, 1), 8);
+    ASSERT_EQ(Communicator::get_chunk_length(20, 8, 2), 4);
+
+    rdma_util::CommunicatorConfig config;
+    config.base_stream_id = 100;
+    config.num_lanes = 3;
+    ASSERT_EQ(Communicator::get_lane_stream_id(config, 0), 100);
+    ASSERT_EQ(Communicator::get_lane_stream_id(config, 4), 101);
+    ASSERT_EQ(Communicator::get_lane_stream_id(config, 5), 102);
+}
+
+TEST(HostReducer, ReduceOps) {
+    rdma_util::HostReducer reducer;
+    const std::vector<int32_t> src = {5, -1, 7};
+
+    std::vector<int32_t> dst = {1, 2, 3};
+    reducer.launch(0, dst.data(), src.data(), src.size(), rdma_util::DataType::INT32, rdma_util::ReduceOp::SUM);
+    reducer.synchronize(0);
+    ASSERT_EQ(dst, (std::vector<int32_t> {6, 1, 10}));
+
+    dst = {1, 2, 3};
+    reducer.launch(0, dst.data(), src.data(), src.size(), rdma_util::DataType::INT32, rdma_util::ReduceOp::MIN);
+    ASSERT_EQ(dst, (std::vector<int32_t> {1, -1, 3}));
+
+    dst = {1, 2, 3};
+    reducer.launch(0, dst.data(), src.data(), src.size(), rdma_util::DataType::INT32, rdma_util::ReduceOp::MAX);
+    ASSERT_EQ(dst, (std::vector<int32_t> {5, 2, 7}));
+
+    // Only `count` elements are touched
+    std::vector<double> dst_f64 = {0.5, 1.0};
+    const std::vector<double> src_f64 = {0.25, 8.0};
+    reducer.launch(0, dst_f64.data(), src_f64.data(), 1, rdma_util::DataType::FLOAT64, rdma_util::ReduceOp::SUM);
+    ASSERT_EQ(dst_f64, (std::vector<double> {0.75, 1.0}));
+}
+
+TEST(HostReducer, UnknownDataType) {
+    rdma_util::HostReducer reducer;
+    int32_t value = 0;
+    ASSERT_THROW(
+        reducer.launch(0, &value, &value, 1, rdma_util::DataType(42), rdma_util::ReduceOp::SUM),
+        std::runtime_error
+    );
+    ASSERT_THROW(rdma_util::get_data_type_size(rdma_util::DataType(42)), std::runtime_error);
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
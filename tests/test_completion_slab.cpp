@@ -0,0 +1,93 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "rdma_util.h"
+
+TEST(CompletionSlab, AcquireComplete) {
+    rdma_util::CompletionSlab slab(4);
+
+    std::set<uint32_t> slots;
+    for (int i = 0; i < 4; ++i) {
+        slots.insert(slab.try_acquire());
+    }
+    ASSERT_EQ(slots.size(), 4);
+    ASSERT_EQ(slab.try_acquire(), UINT32_MAX);
+
+    uint32_t slot = *slots.begin();
+    rdma_util::Handle handle = slab.get_handle(slot);
+    ASSERT_FALSE(handle.is_finished());
+
+    slab.complete(slot);
+    ASSERT_TRUE(handle.is_finished());
+
+    // The recycled slot must not resurrect the finished handle
+    ASSERT_EQ(slab.try_acquire(), slot);
+    rdma_util::Handle recycled_handle = slab.get_handle(slot);
+    ASSERT_TRUE(handle.is_finished());
+    ASSERT_FALSE(recycled_handle.is_finished());
+}
+
+TEST(CompletionSlab, DefaultHandleIsFinished) {
+    rdma_util::Handle handle;
+    ASSERT_TRUE(handle.is_finished());
+    handle.wait();
+}
+
+TEST(CompletionSlab, BlockingWait) {
+    rdma_util::CompletionSlab slab(4);
+    uint32_t slot = slab.acquire();
+    rdma_util::Handle handle = slab.get_handle(slot);
+
+    std::thread completer([&slab, slot]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        slab.complete(slot);
+    });
+
+    // No spinning, the waiter goes straight to the futex
+    handle.wait_blocking(0);
+    ASSERT_TRUE(handle.is_finished());
+    completer.join();
+
+    rdma_util::Handle().wait_blocking(0);
+}
+
+TEST(CompletionSlab, ConcurrentAcquire) {
+    constexpr uint32_t kCapacity = 64;
+    constexpr uint64_t kIterations = 100000;
+    rdma_util::CompletionSlab slab(kCapacity);
+    std::vector<std::atomic<uint32_t>> owners(kCapacity);
+    for (auto& owner : owners) {
+        owner.store(0);
+    }
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t <= 4; ++t) {
+        threads.push_back(std::thread([&slab, &owners, t]() {
+            for (uint64_t i = 0; i < kIterations; ++i) {
+                uint32_t slot = slab.acquire();
+                ASSERT_EQ(owners[slot].exchange(t), 0);
+                ASSERT_EQ(owners[slot].exchange(0), t);
+                slab.complete(slot);
+            }
+        }));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (uint32_t i = 0; i < kCapacity; ++i) {
+        ASSERT_NE(slab.try_acquire(), UINT32_MAX);
+    }
+    ASSERT_EQ(slab.try_acquire(), UINT32_MAX);
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
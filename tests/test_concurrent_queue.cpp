@@ -1,6 +1,8 @@
 #include <concurrentqueue.h>
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <utility>
 #include <vector>
 
 class Object {
@@ -35,6 +37,40 @@ TEST(Dequeue, DequeueBulk) {
     ASSERT_EQ(objects[2].value, 3);
 }
 
+TEST(Dequeue, ProducerTokenKeepsPerProducerOrder) {
+    constexpr int kNumProducers = 4;
+    constexpr int kNumItems = 10000;
+
+    // Items are (producer, sequence) pairs, like the requests of the submitters of a TcclContext
+    moodycamel::ConcurrentQueue<std::pair<int, int>> queue;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kNumProducers; ++p) {
+        producers.push_back(std::thread([&queue, p]() {
+            moodycamel::ProducerToken token(queue);
+            for (int i = 0; i < kNumItems; ++i) {
+                queue.enqueue(token, std::make_pair(p, i));
+            }
+        }));
+    }
+
+    moodycamel::ConsumerToken token(queue);
+    std::vector<int> next(kNumProducers, 0);
+    std::vector<std::pair<int, int>> items(64);
+    int received = 0;
+    while (received < kNumProducers * kNumItems) {
+        const size_t count = queue.try_dequeue_bulk(token, items.begin(), items.size());
+        for (size_t i = 0; i < count; ++i) {
+            ASSERT_EQ(items[i].second, next[items[i].first]);
+            next[items[i].first]++;
+        }
+        received += int(count);
+    }
+
+    for (auto& producer : producers) {
+        producer.join();
+    }
+}
+
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
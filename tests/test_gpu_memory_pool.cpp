@@ -0,0 +1,97 @@
+#include <gtest/gtest.h>
+
+#ifdef USE_CUDA
+
+#include <cstdint>
+#include <stdexcept>
+
+#include "gpu_mem_util.h"
+#include "rdma_util.h"
+
+using gpu_mem_util::GpuMemoryPool;
+
+static constexpr uint32_t kGPU = 0;
+static const char* kDevName = "mlx5_0";
+static constexpr uint64_t kMiB = 1024 * 1024;
+
+TEST(GpuMemoryPool, SizeClass) {
+    ASSERT_EQ(GpuMemoryPool::get_size_class(1), 0);
+    ASSERT_EQ(GpuMemoryPool::get_size_class(GpuMemoryPool::kMinBlockSize), 0);
+    ASSERT_EQ(GpuMemoryPool::get_size_class(GpuMemoryPool::kMinBlockSize + 1), 1);
+    ASSERT_EQ(GpuMemoryPool::get_size_class(2 * GpuMemoryPool::kMinBlockSize), 1);
+    ASSERT_EQ(GpuMemoryPool::get_size_class(kMiB), 4);
+    ASSERT_EQ(GpuMemoryPool::get_size_class(kMiB + 1), 5);
+}
+
+TEST(GpuMemoryPool, SlabLength) {
+    // Small classes get a few blocks of their own instead of a whole slab
+    ASSERT_EQ(GpuMemoryPool::get_slab_length(GpuMemoryPool::kMinBlockSize, 256 * kMiB), 2 * kMiB);
+    ASSERT_EQ(GpuMemoryPool::get_slab_length(kMiB, 256 * kMiB), 16 * kMiB);
+    ASSERT_EQ(GpuMemoryPool::get_slab_length(64 * kMiB, 256 * kMiB), 256 * kMiB);
+    // Blocks beyond the slab size get a dedicated slab
+    ASSERT_EQ(GpuMemoryPool::get_slab_length(512 * kMiB, 256 * kMiB), 512 * kMiB);
+}
+
+TEST(GpuMemoryPool, DeallocatedBlocksAreReused) {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    auto pool = GpuMemoryPool::create(kGPU, std::move(pd));
+
+    auto block = pool->allocate(1000);
+    ASSERT_EQ(block.size, GpuMemoryPool::kMinBlockSize);
+    const uint64_t reserved = pool->get_reserved_bytes();
+    ASSERT_EQ(reserved, GpuMemoryPool::get_slab_length(block.size, GpuMemoryPool::kDefaultSlabSize));
+
+    pool->deallocate(block);
+    auto reused = pool->allocate(GpuMemoryPool::kMinBlockSize);
+    ASSERT_EQ(reused.addr, block.addr);
+    ASSERT_EQ(reused.lkey, block.lkey);
+    ASSERT_EQ(pool->get_reserved_bytes(), reserved);
+
+    // Another size class carves its own slab
+    auto larger = pool->allocate(kMiB);
+    ASSERT_EQ(larger.size, kMiB);
+    const uint64_t larger_slab = GpuMemoryPool::get_slab_length(kMiB, GpuMemoryPool::kDefaultSlabSize);
+    ASSERT_EQ(pool->get_reserved_bytes(), reserved + larger_slab);
+
+    pool->deallocate(reused);
+    pool->deallocate(larger);
+}
+
+TEST(GpuMemoryPool, DedicatedSlabIsCached) {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    auto pool = GpuMemoryPool::create(kGPU, std::move(pd), 4 * kMiB);
+
+    auto block = pool->allocate(8 * kMiB);
+    ASSERT_EQ(pool->get_reserved_bytes(), 8 * kMiB);
+    pool->deallocate(block);
+    ASSERT_EQ(pool->allocate(8 * kMiB).addr, block.addr);
+    ASSERT_EQ(pool->get_reserved_bytes(), 8 * kMiB);
+
+    pool->deallocate(block);
+    ASSERT_THROW(pool->deallocate(gpu_mem_util::GpuBlock {block.addr, 3 * kMiB, 0, 0}), std::runtime_error);
+}
+
+TEST(GpuMemoryPool, DmabufSlabs) {
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd =
+        rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    auto pool = GpuMemoryPool::create(kGPU, pd, 4 * kMiB, true);
+    auto block = pool->allocate(kMiB);
+    pool->deallocate(block);
+
+    // A buffer which does not start at its allocation is registered at its offset in the dma-buf
+    void* d_ptr = gpu_mem_util::malloc_gpu_buffer(4 * kMiB, kGPU);
+    ASSERT_NE(d_ptr, nullptr);
+    void* inner = static_cast<char*>(d_ptr) + 4096 + 256;
+    auto mr = gpu_mem_util::register_gpu_buffer_dmabuf(pd, inner, kMiB);
+    ASSERT_EQ(mr->get_addr(), inner);
+    ASSERT_THROW(gpu_mem_util::register_gpu_buffer_dmabuf(pd, inner, 4 * kMiB), std::runtime_error);
+    mr.reset();
+    gpu_mem_util::free_gpu_buffer(d_ptr, kGPU);
+}
+
+#endif
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
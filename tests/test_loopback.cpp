@@ -1,11 +1,16 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <memory>
+#include <stdexcept>
 #include <thread>
 #include <vector>
 
+#include "collective.h"
 #include "rdma_util.h"
 
 static uint8_t buffer[1024];
@@ -18,6 +23,70 @@ TEST(OpenDevice, CreateQP) {
     ASSERT_EQ(qp->query_qp_state(), rdma_util::QueuePairState::RTS);
 }
 
+TEST(OpenDevice, CreateQPWithConfig) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
+    rdma_util::QueuePairConfig config = rdma_util::TcclContext::get_queue_pair_config(256);
+    rdma_util::Arc<rdma_util::RcQueuePair> qp = rdma_util::RcQueuePair::create(context, config);
+
+    // The device may round the sizes up but never down
+    ASSERT_GE(qp->get_config().max_send_wr, 512);
+    ASSERT_GE(qp->get_config().max_recv_wr, 512);
+    ASSERT_GE(qp->get_config().send_cq_depth, 512);
+    ASSERT_GE(qp->get_config().recv_cq_depth, 512);
+    ASSERT_GE(qp->get_max_inline_data(), sizeof(rdma_util::Ticket));
+    ASSERT_EQ(qp->get_completion_channel_fd(), -1);
+
+    // Only the polling mode which blocks on the CQs gets a completion channel
+    rdma_util::TcclContextConfig tccl_config;
+    tccl_config.polling_mode = rdma_util::PollingMode::ADAPTIVE_POLLING;
+    ASSERT_GE(rdma_util::RcQueuePair::create(context, rdma_util::TcclContext::get_queue_pair_config(256, tccl_config))
+                  ->get_completion_channel_fd(),
+              0);
+
+    config.shared_cq = true;
+    qp = rdma_util::RcQueuePair::create(context, config);
+    ASSERT_EQ(qp->get_completion_channel_fd(), -1);
+    qp->bring_up(qp->get_handshake_data());
+    ASSERT_EQ(qp->query_qp_state(), rdma_util::QueuePairState::RTS);
+}
+
+TEST(OpenDevice, SendRecvWithSrq) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::ProtectionDomain> pd =
+        rdma_util::ProtectionDomain::create(rdma_util::Context::create(dev_name));
+    auto srq = rdma_util::SharedReceiveQueue::create(pd);
+    auto mr = rdma_util::MemoryRegion::create(pd, buffer, sizeof(buffer));
+
+    // Both QPs take their recvs from the same SRQ
+    auto qp1 = rdma_util::RcQueuePair::create(srq, rdma_util::QueuePairConfig());
+    auto qp2 = rdma_util::RcQueuePair::create(srq, rdma_util::QueuePairConfig());
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+
+    ASSERT_EQ(srq->post_recv(0, uint64_t(buffer), 512, mr->get_lkey()), 0);
+    ASSERT_EQ(srq->post_recv(1, uint64_t(buffer) + 512, 512, mr->get_lkey()), 0);
+    ASSERT_EQ(qp1->post_send_send(0, uint64_t(buffer), 64, mr->get_lkey(), true), 0);
+    ASSERT_EQ(qp2->post_send_send(0, uint64_t(buffer), 64, mr->get_lkey(), true), 0);
+
+    std::vector<uint32_t> qp_nums;
+    std::vector<ibv_wc> wc_buffer(2);
+    std::vector<rdma_util::WorkCompletion> polled_wcs;
+    while (qp_nums.size() < 2) {
+        ASSERT_GE(srq->poll_recv_cq_once(2, wc_buffer.data(), polled_wcs), 0);
+        for (const auto& wc : polled_wcs) {
+            ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+            qp_nums.push_back(wc.qp_num);
+        }
+    }
+    std::sort(qp_nums.begin(), qp_nums.end());
+    std::vector<uint32_t> expected;
+    expected.push_back(qp1->get_qp_num());
+    expected.push_back(qp2->get_qp_num());
+    std::sort(expected.begin(), expected.end());
+    ASSERT_EQ(qp_nums, expected);
+}
+
 TEST(OpenDevice, SendRecv) {
     const char* dev_name = "mlx5_0";
     rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
@@ -41,6 +110,36 @@ TEST(OpenDevice, SendRecv) {
     }
 }
 
+TEST(OpenDevice, PollBeyondPollBatchSize) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
+    rdma_util::Arc<rdma_util::RcQueuePair> qp = rdma_util::RcQueuePair::create(context);
+    qp->bring_up(qp->get_handshake_data());
+
+    // More completions than fit in the stack buffer of one poll round
+    const int num_wrs = 2 * rdma_util::RcQueuePair::kPollBatchSize + 1;
+    auto mr = rdma_util::MemoryRegion::create(qp->get_pd(), buffer, 1024);
+    for (int i = 0; i < num_wrs; ++i) {
+        ASSERT_EQ(0, qp->post_recv(i, reinterpret_cast<uint64_t>(buffer), 1024, mr->get_lkey()));
+        ASSERT_EQ(0, qp->post_send_send(i, reinterpret_cast<uint64_t>(buffer), 16, mr->get_lkey(), true));
+    }
+
+    std::vector<rdma_util::WorkCompletion> polled_send_wcs;
+    ASSERT_EQ(0, qp->wait_until_send_completion(num_wrs, polled_send_wcs));
+    ASSERT_EQ(polled_send_wcs.size(), uint64_t(num_wrs));
+
+    std::vector<ibv_wc> wc_buffer(num_wrs);
+    int num_visited = 0;
+    while (num_visited < num_wrs) {
+        const int ret = qp->visit_recv_cq_once(num_wrs, wc_buffer.data(), [&](const ibv_wc& wc) {
+            ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+            ASSERT_EQ(wc.wr_id, uint64_t(num_visited));
+            ++num_visited;
+        });
+        ASSERT_GE(ret, 0);
+    }
+}
+
 TEST(OpenDevice, SendRecvError) {
     const char* dev_name = "mlx5_0";
     rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
@@ -71,6 +170,558 @@ TEST(OpenDevice, SendRecvError) {
     }
 }
 
+TEST(OpenDevice, SendRecvBatch) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
+    rdma_util::Arc<rdma_util::RcQueuePair> qp = rdma_util::RcQueuePair::create(context);
+    qp->bring_up(qp->get_handshake_data());
+    ASSERT_EQ(qp->query_qp_state(), rdma_util::QueuePairState::RTS);
+
+    auto mr = rdma_util::MemoryRegion::create(qp->get_pd(), buffer, 1024);
+    const uint64_t addr = reinterpret_cast<uint64_t>(buffer);
+    std::vector<rdma_util::WorkCompletion> polled_recv_wcs, polled_send_wcs;
+
+    rdma_util::RecvWorkRequestBatch recv_batch(4);
+    for (uint64_t i = 0; i < 4; ++i) {
+        recv_batch.add_recv(i, addr + i * 128, 128, mr->get_lkey());
+    }
+    ASSERT_TRUE(recv_batch.full());
+    ASSERT_EQ(0, qp->post_recv_batch(recv_batch));
+    ASSERT_TRUE(recv_batch.empty());
+
+    // Two sends gathering from two buffers each, only the last one is signaled
+    rdma_util::SendWorkRequestBatch send_batch(4, 2);
+    for (uint64_t i = 0; i < 2; ++i) {
+        ibv_sge sges[2] = {
+            {addr + 512 + i * 128, 64, mr->get_lkey()},
+            {addr + 576 + i * 128, 64, mr->get_lkey()},
+        };
+        send_batch.add_sg(i, IBV_WR_SEND, sges, 2, 0, 0, 0, i == 1);
+    }
+    send_batch.add_send_with_imm(2, addr + 768, 128, mr->get_lkey(), 1234, false);
+    send_batch.add_send(3, addr + 896, 128, mr->get_lkey(), true);
+    ASSERT_EQ(0, qp->post_send_batch(send_batch));
+
+    ASSERT_EQ(0, qp->wait_until_send_completion(2, polled_send_wcs));
+    ASSERT_EQ(0, qp->wait_until_recv_completion(4, polled_recv_wcs));
+
+    for (const auto& wc : polled_send_wcs) {
+        ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+    }
+
+    for (const auto& wc : polled_recv_wcs) {
+        ASSERT_EQ(wc.status, IBV_WC_SUCCESS);
+        ASSERT_EQ(wc.byte_len, 128);
+    }
+    ASSERT_EQ(polled_recv_wcs[2].imm_data, 1234);
+}
+
+TEST(OpenDevice, RegistrySharesProtectionDomain) {
+    auto qp1 = rdma_util::RcQueuePair::create("mlx5_0");
+    auto qp2 = rdma_util::RcQueuePair::create("mlx5_0");
+    ASSERT_EQ(qp1->get_pd(), qp2->get_pd());
+    ASSERT_EQ(qp1->get_context(), rdma_util::DeviceRegistry::get_instance().get_context("mlx5_0"));
+}
+
+TEST(OpenDevice, BringUpAllAndReuseFromPool) {
+    const char* dev_name = "mlx5_0";
+    constexpr uint64_t kNumPairs = 16;
+    auto pool = rdma_util::QueuePairPool::create(rdma_util::DeviceRegistry::get_instance().get_pd(dev_name));
+    pool->reserve(2 * kNumPairs);
+    ASSERT_EQ(pool->get_num_idle(), 2 * kNumPairs);
+    auto mr = rdma_util::MemoryRegion::create(pool->get_pd(), buffer, sizeof(buffer));
+    const uint64_t addr = reinterpret_cast<uint64_t>(buffer);
+
+    // The second round reconnects the QPs released by the first one
+    for (int round = 0; round < 2; ++round) {
+        std::vector<rdma_util::Box<rdma_util::RcQueuePair>> qps;
+        std::vector<rdma_util::BringUpRequest> requests;
+        for (uint64_t i = 0; i < 2 * kNumPairs; ++i) {
+            qps.push_back(pool->acquire());
+        }
+        for (uint64_t i = 0; i < 2 * kNumPairs; ++i) {
+            requests.push_back({qps[i].get(), qps[i ^ 1]->get_handshake_data()});
+        }
+        rdma_util::RcQueuePair::bring_up_all(requests, rdma_util::BringUpOptions(), 4);
+        ASSERT_EQ(pool->get_num_idle(), 0);
+
+        std::vector<rdma_util::WorkCompletion> polled_recv_wcs, polled_send_wcs;
+        for (uint64_t i = 0; i < kNumPairs; ++i) {
+            ASSERT_EQ(qps[2 * i]->query_qp_state(), rdma_util::QueuePairState::RTS);
+            ASSERT_EQ(0, qps[2 * i + 1]->post_recv(i, addr + 512, 64, mr->get_lkey()));
+            ASSERT_EQ(0, qps[2 * i]->post_send_send(i, addr, 64, mr->get_lkey(), true));
+            ASSERT_EQ(0, qps[2 * i]->wait_until_send_completion(1, polled_send_wcs));
+            ASSERT_EQ(0, qps[2 * i + 1]->wait_until_recv_completion(1, polled_recv_wcs));
+            ASSERT_EQ(polled_send_wcs[0].status, IBV_WC_SUCCESS);
+            ASSERT_EQ(polled_recv_wcs[0].status, IBV_WC_SUCCESS);
+        }
+
+        for (auto& qp : qps) {
+            pool->release(std::move(qp));
+        }
+        ASSERT_EQ(pool->get_num_idle(), 2 * kNumPairs);
+    }
+}
+
+TEST(OpenDevice, TcclSendRecvSignaled) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
+    auto qp1 = rdma_util::RcQueuePair::create(context, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(context, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+    auto mr1 = rdma_util::MemoryRegion::create(qp1->get_pd(), buffer, 512);
+    auto mr2 = rdma_util::MemoryRegion::create(qp2->get_pd(), buffer + 512, 512);
+
+    auto context1 = rdma_util::TcclContext::create(std::move(qp1));
+    auto context2 = rdma_util::TcclContext::create(std::move(qp2));
+    uint32_t send_flag = 0;
+    uint32_t recv_flag = 0;
+    const uint64_t addr = reinterpret_cast<uint64_t>(buffer);
+    auto recv_handle = context2->recv_signaled(3, addr + 512, 512, mr2->get_rkey(), &recv_flag, 7);
+    auto send_handle = context1->send_signaled(3, addr, 512, mr1->get_lkey(), &send_flag, 9);
+    send_handle.wait();
+    recv_handle.wait();
+
+    // The flags are stored before the handles finish
+    ASSERT_EQ(__atomic_load_n(&send_flag, __ATOMIC_ACQUIRE), 9);
+    ASSERT_EQ(__atomic_load_n(&recv_flag, __ATOMIC_ACQUIRE), 7);
+}
+
+TEST(OpenDevice, TcclSendvRecvv) {
+    const char* dev_name = "mlx5_0";
+    rdma_util::Arc<rdma_util::Context> context = rdma_util::Context::create(dev_name);
+    auto qp1 = rdma_util::RcQueuePair::create(context, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(context, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+    auto mr1 = rdma_util::MemoryRegion::create(qp1->get_pd(), buffer, 512);
+    auto mr2 = rdma_util::MemoryRegion::create(qp2->get_pd(), buffer + 512, 512);
+
+    // Small chunks split the remote segments into several writes
+    rdma_util::TcclContextConfig config;
+    config.chunk_size = 64;
+    auto context1 = rdma_util::TcclContext::create(std::move(qp1), true, 16, config);
+    auto context2 = rdma_util::TcclContext::create(std::move(qp2), true, 16, config);
+
+    const uint64_t addr = reinterpret_cast<uint64_t>(buffer);
+    for (uint64_t i = 0; i < 512; ++i) {
+        buffer[i] = uint8_t(i);
+        buffer[512 + i] = 0;
+    }
+
+    // Gather [0, 100) [200, 300) [400, 500) into [512, 662) [800, 950)
+    const uint32_t lkey = mr1->get_lkey();
+    const uint32_t rkey = mr2->get_rkey();
+    std::vector<rdma_util::IoSegment> sources = {{addr, 100, lkey}, {addr + 200, 100, lkey}, {addr + 400, 100, lkey}};
+    std::vector<rdma_util::IoSegment> destinations = {{addr + 512, 150, rkey}, {addr + 800, 150, rkey}};
+    auto recv_handle = context2->recvv(5, destinations);
+    auto send_handle = context1->sendv(5, sources);
+    send_handle.wait();
+    recv_handle.wait();
+
+    std::vector<uint8_t> expected;
+    for (const auto& source : sources) {
+        expected.insert(expected.end(), buffer + (source.addr - addr), buffer + (source.addr - addr) + source.length);
+    }
+    ASSERT_TRUE(std::equal(expected.begin(), expected.begin() + 150, buffer + 512));
+    ASSERT_TRUE(std::equal(expected.begin() + 150, expected.end(), buffer + 800));
+    ASSERT_EQ(buffer[662], 0);
+
+    // A contiguous recv takes a scattered send of the same total length
+    auto contiguous_recv = context2->recv(5, addr + 512, 300, rkey);
+    auto scattered_send = context1->sendv(5, sources.data(), sources.size());
+    scattered_send.wait();
+    contiguous_recv.wait();
+    ASSERT_TRUE(std::equal(expected.begin(), expected.end(), buffer + 512));
+}
+
+TEST(OpenDevice, TcclEagerSendRecv) {
+    const char* dev_name = "mlx5_0";
+    auto qp1 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+
+    // Messages up to 256 bytes are eager, larger ones are written in chunks of 64 bytes
+    rdma_util::TcclContextConfig config;
+    config.eager_threshold = 256;
+    config.chunk_size = 64;
+    auto context1 = rdma_util::TcclContext::create(std::move(qp1), true, 16, config);
+    auto context2 = rdma_util::TcclContext::create(std::move(qp2), true, 16, config);
+
+    static uint8_t src[4096];
+    static uint8_t dst[4096];
+    auto src_mr = rdma_util::MemoryRegion::create(context1->get_memory_region_cache()->get_pd(), src, sizeof(src));
+    auto dst_mr = rdma_util::MemoryRegion::create(context2->get_memory_region_cache()->get_pd(), dst, sizeof(dst));
+    const uint64_t src_addr = uint64_t(src);
+    const uint64_t dst_addr = uint64_t(dst);
+    for (uint64_t i = 0; i < sizeof(src); ++i) {
+        src[i] = uint8_t(i * 7 + 1);
+    }
+
+    // The message arrives before its recv, so it waits in the unexpected queue
+    std::fill(dst, dst + sizeof(dst), 0);
+    context1->send(1, src_addr, 100, src_mr->get_lkey()).wait();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    context2->recv(1, dst_addr, 100, dst_mr->get_rkey()).wait();
+    ASSERT_TRUE(std::equal(src, src + 100, dst));
+
+    // The recv is posted first and takes the message right away
+    std::fill(dst, dst + sizeof(dst), 0);
+    auto recv_handle = context2->recv(1, dst_addr, 200, dst_mr->get_rkey());
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    context1->send(1, src_addr + 100, 200, src_mr->get_lkey()).wait();
+    recv_handle.wait();
+    ASSERT_TRUE(std::equal(src + 100, src + 300, dst));
+
+    // Eager and rendezvous messages interleaved on one stream each land in their own recv
+    std::fill(dst, dst + sizeof(dst), 0);
+    const uint64_t lengths[] = {16, 1000, 256, 257, 8, 600};
+    std::vector<rdma_util::Handle> recv_handles;
+    std::vector<rdma_util::Handle> send_handles;
+    uint64_t offset = 0;
+    for (uint64_t length : lengths) {
+        recv_handles.push_back(context2->recv(3, dst_addr + offset, length, dst_mr->get_rkey()));
+        offset += length;
+    }
+    offset = 0;
+    for (uint64_t length : lengths) {
+        send_handles.push_back(context1->send(3, src_addr + offset, length, src_mr->get_lkey()));
+        offset += length;
+    }
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+    for (const auto& handle : recv_handles) {
+        handle.wait();
+    }
+    ASSERT_TRUE(std::equal(src, src + offset, dst));
+
+    // More unexpected messages than recv slots, the sender is held back until the recvs drain the ring
+    std::fill(dst, dst + sizeof(dst), 0);
+    constexpr uint64_t kNumMessages = 4 * 16;
+    constexpr uint64_t kMessageSize = sizeof(src) / kNumMessages;
+    send_handles.clear();
+    for (uint64_t i = 0; i < kNumMessages; ++i) {
+        send_handles.push_back(context1->send(5, src_addr + i * kMessageSize, kMessageSize, src_mr->get_lkey()));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (uint64_t i = 0; i < kNumMessages; ++i) {
+        context2->recv(5, dst_addr + i * kMessageSize, kMessageSize, dst_mr->get_rkey()).wait();
+    }
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+    ASSERT_TRUE(std::equal(src, src + sizeof(src), dst));
+}
+
+TEST(OpenDevice, TcclPullChunked) {
+    const char* dev_name = "mlx5_0";
+    auto qp1 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+
+    rdma_util::TcclContextConfig config;
+    config.chunk_size = 64;
+    auto sender = rdma_util::TcclContext::create(std::move(qp1), true, 16, config);
+    auto receiver = rdma_util::TcclContext::create(std::move(qp2), true, 16, config);
+
+    constexpr uint32_t kNumStreams = 4;
+    constexpr uint64_t kMessageSize = 1000;
+    std::vector<uint8_t> send_buffer(kNumStreams * kMessageSize);
+    std::vector<uint8_t> recv_buffer(kNumStreams * kMessageSize, 0);
+    for (uint64_t i = 0; i < send_buffer.size(); ++i) {
+        send_buffer[i] = uint8_t(i * 13 + 5);
+    }
+
+    // A send_pull only finishes once the receiver has read the whole buffer
+    std::vector<rdma_util::Handle> send_handles;
+    for (uint32_t i = 0; i < kNumStreams; ++i) {
+        send_handles.push_back(sender->send_pull(i, uint64_t(send_buffer.data() + i * kMessageSize), kMessageSize));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (const auto& handle : send_handles) {
+        ASSERT_FALSE(handle.is_finished());
+    }
+
+    for (uint32_t i = kNumStreams; i-- > 0;) {
+        receiver->recv_pull(i, uint64_t(recv_buffer.data() + i * kMessageSize), kMessageSize).wait();
+    }
+    for (const auto& handle : send_handles) {
+        handle.wait();
+    }
+    ASSERT_EQ(send_buffer, recv_buffer);
+}
+
+TEST(OpenDevice, TcclStreamQos) {
+    const char* dev_name = "mlx5_0";
+    auto qp1 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+
+    rdma_util::TcclContextConfig config;
+    config.chunk_size = 64;
+    config.scheduling_quantum = 128;
+    auto sender = rdma_util::TcclContext::create(std::move(qp1), true, 16, config);
+    auto receiver = rdma_util::TcclContext::create(std::move(qp2), true, 16, config);
+
+    // Stream 0 is urgent, stream 1 has twice the share of stream 2, and stream 3 posts one chunk at a time
+    rdma_util::StreamQos urgent;
+    urgent.priority = 0;
+    sender->set_stream_qos(0, urgent);
+    rdma_util::StreamQos heavy;
+    heavy.weight = 2;
+    sender->set_stream_qos(1, heavy);
+    rdma_util::StreamQos limited;
+    limited.max_outstanding_bytes = 64;
+    sender->set_stream_qos(3, limited);
+
+    rdma_util::StreamQos invalid;
+    invalid.priority = rdma_util::StreamTable::kNumPriorities;
+    ASSERT_THROW(sender->set_stream_qos(4, invalid), std::runtime_error);
+    invalid = rdma_util::StreamQos();
+    invalid.weight = 0;
+    ASSERT_THROW(sender->set_stream_qos(4, invalid), std::runtime_error);
+
+    constexpr uint32_t kNumStreams = 4;
+    constexpr uint32_t kMessagesPerStream = 8;
+    constexpr uint64_t kMessageSize = 1000;
+    std::vector<uint8_t> send_buffer(kNumStreams * kMessagesPerStream * kMessageSize);
+    std::vector<uint8_t> recv_buffer(send_buffer.size(), 0);
+    for (uint64_t i = 0; i < send_buffer.size(); ++i) {
+        send_buffer[i] = uint8_t(i * 31 + 3);
+    }
+
+    std::vector<rdma_util::Handle> handles;
+    for (uint32_t m = 0; m < kMessagesPerStream; ++m) {
+        for (uint32_t s = 0; s < kNumStreams; ++s) {
+            const uint64_t offset = (s * kMessagesPerStream + m) * kMessageSize;
+            handles.push_back(receiver->recv(s, uint64_t(recv_buffer.data() + offset), kMessageSize));
+        }
+    }
+    for (uint32_t m = 0; m < kMessagesPerStream; ++m) {
+        for (uint32_t s = 0; s < kNumStreams; ++s) {
+            const uint64_t offset = (s * kMessagesPerStream + m) * kMessageSize;
+            handles.push_back(sender->send(s, uint64_t(send_buffer.data() + offset), kMessageSize));
+        }
+    }
+    for (const auto& handle : handles) {
+        handle.wait();
+    }
+    ASSERT_EQ(send_buffer, recv_buffer);
+}
+
+TEST(OpenDevice, TcclSubmitterPerThread) {
+    const char* dev_name = "mlx5_0";
+    auto qp1 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(dev_name, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+    auto sender = rdma_util::TcclContext::create(std::move(qp1));
+    auto receiver = rdma_util::TcclContext::create(std::move(qp2));
+
+    // Every thread owns two streams, one fed by single sends and one by a send_batch
+    constexpr uint32_t kNumThreads = 4;
+    constexpr uint32_t kMessagesPerStream = 16;
+    constexpr uint64_t kMessageSize = 256;
+    constexpr uint64_t kStreamSize = kMessagesPerStream * kMessageSize;
+    std::vector<uint8_t> send_buffer(kNumThreads * 2 * kStreamSize);
+    std::vector<uint8_t> recv_buffer(send_buffer.size(), 0);
+    for (uint64_t i = 0; i < send_buffer.size(); ++i) {
+        // Every message of a stream carries a different pattern
+        send_buffer[i] = uint8_t(i / kMessageSize * 37 + i);
+    }
+    auto send_mr = rdma_util::MemoryRegion::create(
+        sender->get_memory_region_cache()->get_pd(),
+        send_buffer.data(),
+        send_buffer.size()
+    );
+    auto recv_mr = rdma_util::MemoryRegion::create(
+        receiver->get_memory_region_cache()->get_pd(),
+        recv_buffer.data(),
+        recv_buffer.size()
+    );
+    const uint64_t send_addr = uint64_t(send_buffer.data());
+    const uint64_t recv_addr = uint64_t(recv_buffer.data());
+    const uint32_t lkey = send_mr->get_lkey();
+    const uint32_t rkey = recv_mr->get_rkey();
+
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < kNumThreads; ++t) {
+        threads.emplace_back([&, t] {
+            auto send_submitter = rdma_util::TcclSubmitter::create(sender);
+            auto recv_submitter = rdma_util::TcclSubmitter::create(receiver);
+            const uint32_t single_stream = 2 * t;
+            const uint32_t batch_stream = 2 * t + 1;
+            const uint64_t single_offset = single_stream * kStreamSize;
+            const uint64_t batch_offset = batch_stream * kStreamSize;
+
+            std::vector<rdma_util::Handle> single_recvs;
+            std::vector<rdma_util::Handle> batch_recvs;
+            for (uint32_t m = 0; m < kMessagesPerStream; ++m) {
+                const uint64_t offset = m * kMessageSize;
+                single_recvs.push_back(
+                    recv_submitter->recv(single_stream, recv_addr + single_offset + offset, kMessageSize, rkey)
+                );
+                batch_recvs.push_back(
+                    recv_submitter->recv(batch_stream, recv_addr + batch_offset + offset, kMessageSize, rkey)
+                );
+            }
+
+            std::vector<rdma_util::Handle> single_sends;
+            std::vector<rdma_util::BatchEntry> entries;
+            for (uint32_t m = 0; m < kMessagesPerStream; ++m) {
+                const uint64_t offset = m * kMessageSize;
+                single_sends.push_back(
+                    send_submitter->send(single_stream, send_addr + single_offset + offset, kMessageSize, lkey)
+                );
+                entries.push_back(
+                    rdma_util::BatchEntry {batch_stream, send_addr + batch_offset + offset, kMessageSize, lkey}
+                );
+            }
+            auto batch_send = send_submitter->send_batch(entries);
+
+            // The recvs of a stream finish in the order they were matched
+            for (const auto* recvs : {&single_recvs, &batch_recvs}) {
+                for (uint32_t m = 0; m < kMessagesPerStream; ++m) {
+                    (*recvs)[m].wait();
+                    for (uint32_t earlier = 0; earlier < m; ++earlier) {
+                        ASSERT_TRUE((*recvs)[earlier].is_finished());
+                    }
+                }
+            }
+            for (const auto& handle : single_sends) {
+                handle.wait();
+            }
+            batch_send.wait();
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    // Every recv holds the message sent at the same position of its stream
+    ASSERT_EQ(send_buffer, recv_buffer);
+}
+
+TEST(OpenDevice, TcclContextGroupSendRecv) {
+    // Both ends live in one group, so they share its recv ring and completion slots
+    auto group = rdma_util::TcclContextGroup::create(rdma_util::DeviceRegistry::get_instance().get_pd("mlx5_0"));
+    auto qp1 = group->create_queue_pair();
+    auto qp2 = group->create_queue_pair();
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+    auto context1 = group->add_context(std::move(qp1));
+    auto context2 = group->add_context(std::move(qp2));
+
+    constexpr uint32_t kNumMessages = 32;
+    constexpr uint64_t kMessageSize = 512;
+    std::vector<uint8_t> buffer1(kNumMessages * kMessageSize);
+    std::vector<uint8_t> buffer2(kNumMessages * kMessageSize);
+    std::vector<uint8_t> recv_buffer1(buffer1.size(), 0);
+    std::vector<uint8_t> recv_buffer2(buffer2.size(), 0);
+    for (uint64_t i = 0; i < buffer1.size(); ++i) {
+        buffer1[i] = uint8_t(i * 3 + 1);
+        buffer2[i] = uint8_t(i * 5 + 2);
+    }
+
+    // Traffic in both directions at once keeps slots of both contexts in flight
+    std::vector<rdma_util::Handle> handles;
+    for (uint32_t i = 0; i < kNumMessages; ++i) {
+        const uint64_t offset = i * kMessageSize;
+        handles.push_back(context2->recv(i % 4, uint64_t(recv_buffer2.data() + offset), kMessageSize));
+        handles.push_back(context1->recv(i % 4, uint64_t(recv_buffer1.data() + offset), kMessageSize));
+        handles.push_back(context1->send(i % 4, uint64_t(buffer1.data() + offset), kMessageSize));
+        handles.push_back(context2->send(i % 4, uint64_t(buffer2.data() + offset), kMessageSize));
+    }
+    for (const auto& handle : handles) {
+        handle.wait();
+    }
+    ASSERT_EQ(recv_buffer2, buffer1);
+    ASSERT_EQ(recv_buffer1, buffer2);
+}
+
+// Contexts between every pair of ranks of this process, the one of rank i to rank j is mesh[i][j]
+static std::vector<std::vector<rdma_util::Arc<rdma_util::TcclContext>>> create_full_mesh(uint32_t world_size) {
+    std::vector<std::vector<rdma_util::Arc<rdma_util::TcclContext>>> mesh(
+        world_size,
+        std::vector<rdma_util::Arc<rdma_util::TcclContext>>(world_size)
+    );
+    for (uint32_t i = 0; i < world_size; ++i) {
+        for (uint32_t j = i + 1; j < world_size; ++j) {
+            auto qp1 = rdma_util::RcQueuePair::create("mlx5_0", rdma_util::TcclContext::get_queue_pair_config(16));
+            auto qp2 = rdma_util::RcQueuePair::create("mlx5_0", rdma_util::TcclContext::get_queue_pair_config(16));
+            qp1->bring_up(qp2->get_handshake_data());
+            qp2->bring_up(qp1->get_handshake_data());
+            mesh[i][j] = rdma_util::TcclContext::create(std::move(qp1));
+            mesh[j][i] = rdma_util::TcclContext::create(std::move(qp2));
+        }
+    }
+    return mesh;
+}
+
+static void run_on_ranks(uint32_t world_size, const std::function<void(uint32_t)>& function) {
+    std::vector<std::thread> threads;
+    for (uint32_t rank = 0; rank < world_size; ++rank) {
+        threads.emplace_back(function, rank);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+TEST(OpenDevice, CommunicatorAllreduceAndBroadcast) {
+    constexpr uint32_t kWorldSize = 3;
+    constexpr uint64_t kCount = 1001;
+    auto mesh = create_full_mesh(kWorldSize);
+
+    // Small chunks over two lanes, and a count which does not split evenly into segments
+    rdma_util::CommunicatorConfig config;
+    config.pipeline_chunk_size = 64;
+    config.num_lanes = 2;
+    std::vector<rdma_util::Box<rdma_util::Communicator>> communicators;
+    std::vector<std::vector<int32_t>> buffers(kWorldSize, std::vector<int32_t>(kCount));
+    for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+        communicators.push_back(rdma_util::Communicator::create(rank, mesh[rank], config));
+        for (uint64_t i = 0; i < kCount; ++i) {
+            buffers[rank][i] = int32_t(rank * kCount + i);
+        }
+    }
+
+    run_on_ranks(kWorldSize, [&](uint32_t rank) {
+        using rdma_util::DataType;
+        using rdma_util::ReduceOp;
+        communicators[rank]->allreduce(buffers[rank].data(), kCount, DataType::INT32, ReduceOp::SUM);
+    });
+    for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+        for (uint64_t i = 0; i < kCount; ++i) {
+            ASSERT_EQ(buffers[rank][i], int32_t(3 * kCount + 3 * i));
+        }
+    }
+
+    const rdma_util::CollectiveAlgorithm algorithms[] = {
+        rdma_util::CollectiveAlgorithm::RING,
+        rdma_util::CollectiveAlgorithm::TREE,
+    };
+    for (auto algorithm : algorithms) {
+        for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+            for (uint64_t i = 0; i < kCount; ++i) {
+                buffers[rank][i] = rank == 1 ? int32_t(7 * i) : 0;
+            }
+        }
+        run_on_ranks(kWorldSize, [&](uint32_t rank) {
+            communicators[rank]->broadcast(buffers[rank].data(), kCount, rdma_util::DataType::INT32, 1, algorithm);
+        });
+        for (uint32_t rank = 0; rank < kWorldSize; ++rank) {
+            ASSERT_EQ(buffers[rank], buffers[1]);
+        }
+        ASSERT_EQ(buffers[0][kCount - 1], int32_t(7 * (kCount - 1)));
+    }
+}
+
 int main(int argc, char** argv) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
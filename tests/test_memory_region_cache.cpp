@@ -0,0 +1,125 @@
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+
+#include <cstdint>
+#include <cstdlib>
+
+#include "rdma_util.h"
+
+static const char* kDevName = "mlx5_0";
+static constexpr uint64_t kBufferSize = 1024 * 1024;
+
+TEST(MemoryRegionCache, SubRangeHits) {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    auto cache = rdma_util::MemoryRegionCache::create(std::move(pd));
+    void* buffer = aligned_alloc(4096, kBufferSize);
+    const uint64_t addr = uint64_t(buffer);
+
+    auto mr = cache->get(addr, kBufferSize);
+    ASSERT_EQ(cache->get_num_misses(), 1);
+    ASSERT_EQ(cache->get(addr + 4096, 4096), mr);
+    ASSERT_EQ(cache->get(addr + kBufferSize - 1, 1), mr);
+    ASSERT_EQ(cache->get_num_hits(), 2);
+
+    cache->clear();
+    free(buffer);
+}
+
+TEST(MemoryRegionCache, OverlappingRegionsAreMerged) {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    auto cache = rdma_util::MemoryRegionCache::create(std::move(pd));
+    void* buffer = aligned_alloc(4096, kBufferSize);
+    const uint64_t addr = uint64_t(buffer);
+
+    auto first = cache->get(addr, 4096);
+    auto second = cache->get(addr + 8192, 4096);
+    ASSERT_NE(first, second);
+    ASSERT_EQ(cache->get_registered_bytes(), 8192);
+
+    auto merged = cache->get(addr, 3 * 4096);
+    ASSERT_EQ(uint64_t(merged->get_addr()), addr);
+    ASSERT_EQ(merged->get_length(), 3 * 4096);
+    ASSERT_EQ(cache->get_registered_bytes(), 3 * 4096);
+
+    // The absorbed regions stay valid while they are pinned
+    ASSERT_EQ(uint64_t(first->get_addr()), addr);
+
+    cache->clear();
+    free(buffer);
+}
+
+TEST(MemoryRegionCache, EvictOnlyUnpinned) {
+    auto pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    rdma_util::MemoryRegionCacheConfig config;
+    config.max_registered_bytes = 8192;
+    auto cache = rdma_util::MemoryRegionCache::create(std::move(pd), config);
+    void* buffer = aligned_alloc(4096, kBufferSize);
+    const uint64_t addr = uint64_t(buffer);
+
+    auto pinned = cache->get(addr, 4096);
+    cache->get(addr + 8192, 4096);
+    cache->get(addr + 16384, 4096);
+    ASSERT_EQ(cache->get_registered_bytes(), 8192);
+
+    // The pinned region survives, the unpinned one in the middle is gone
+    ASSERT_EQ(cache->get(addr, 4096), pinned);
+    cache->get(addr + 8192, 4096);
+    ASSERT_EQ(cache->get_num_misses(), 4);
+
+    cache->invalidate(addr, kBufferSize);
+    ASSERT_EQ(cache->get_registered_bytes(), 0);
+    free(buffer);
+}
+
+TEST(MemoryRegionCache, SharedPerProtectionDomain) {
+    rdma_util::DeviceRegistry& registry = rdma_util::DeviceRegistry::get_instance();
+    auto pd = registry.get_pd(kDevName);
+    auto cache = registry.get_memory_region_cache(pd);
+    ASSERT_EQ(cache->get_pd(), pd);
+    ASSERT_EQ(registry.get_memory_region_cache(pd), cache);
+
+    auto other_pd = rdma_util::ProtectionDomain::create(rdma_util::Context::create(kDevName));
+    ASSERT_NE(registry.get_memory_region_cache(std::move(other_pd)), cache);
+
+    // QPs created from the device name land in its default PD, so their contexts share the cache
+    auto qp1 = rdma_util::RcQueuePair::create(kDevName, rdma_util::TcclContext::get_queue_pair_config(16));
+    auto qp2 = rdma_util::RcQueuePair::create(kDevName, rdma_util::TcclContext::get_queue_pair_config(16));
+    qp1->bring_up(qp2->get_handshake_data());
+    qp2->bring_up(qp1->get_handshake_data());
+    auto context1 = rdma_util::TcclContext::create(std::move(qp1));
+    auto context2 = rdma_util::TcclContext::create(std::move(qp2));
+    ASSERT_EQ(context1->get_memory_region_cache(), cache);
+    ASSERT_EQ(context2->get_memory_region_cache(), cache);
+}
+
+TEST(MemoryRegionCache, RegistryInvalidateOnFree) {
+    rdma_util::DeviceRegistry& registry = rdma_util::DeviceRegistry::get_instance();
+    auto cache = registry.get_memory_region_cache(registry.get_pd(kDevName));
+    const uint64_t num_misses = cache->get_num_misses();
+
+    void* buffer = mmap(nullptr, kBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_NE(buffer, MAP_FAILED);
+    const uint64_t addr = uint64_t(buffer);
+    cache->get(addr, kBufferSize);
+    ASSERT_EQ(cache->get_num_misses(), num_misses + 1);
+
+    // The free hook runs before the memory goes away, then a new allocation lands at the same address
+    registry.invalidate(addr, kBufferSize);
+    ASSERT_EQ(munmap(buffer, kBufferSize), 0);
+    void* reused = mmap(buffer, kBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    ASSERT_EQ(reused, buffer);
+
+    // The new pages are registered afresh instead of hitting the region of the old ones
+    auto mr = cache->get(addr, kBufferSize);
+    ASSERT_EQ(cache->get_num_misses(), num_misses + 2);
+    ASSERT_EQ(uint64_t(mr->get_addr()), addr);
+
+    mr.reset();
+    registry.invalidate(addr, kBufferSize);
+    munmap(buffer, kBufferSize);
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,197 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <tuple>
+
+#include "rdma_util.h"
+
+static rdma_util::Ticket make_ticket(uint32_t stream_id, uint64_t length) {
+    rdma_util::Ticket ticket {};
+    ticket.stream_id = stream_id;
+    ticket.length = length;
+    return ticket;
+}
+
+TEST(RingBuffer, PushPopGrow) {
+    rdma_util::RingBuffer<uint64_t> ring(4);
+    ASSERT_EQ(ring.capacity(), 4);
+    ASSERT_TRUE(ring.empty());
+
+    // Wrap around before growing
+    ring.push(0);
+    ring.push(1);
+    ring.pop();
+    ring.pop();
+    for (uint64_t i = 0; i < 10; ++i) {
+        ring.push(i);
+    }
+    ASSERT_EQ(ring.size(), 10);
+    ASSERT_EQ(ring.capacity(), 16);
+
+    for (uint64_t i = 0; i < 10; ++i) {
+        ASSERT_EQ(ring.front(), i);
+        ring.pop();
+    }
+    ASSERT_TRUE(ring.empty());
+}
+
+TEST(RingBuffer, AllocateOnFirstPush) {
+    rdma_util::RingBuffer<uint64_t> ring;
+    ASSERT_EQ(ring.capacity(), 0);
+    ring.push(1);
+    ASSERT_EQ(ring.capacity(), rdma_util::RingBuffer<uint64_t>::kInitialCapacity);
+    ASSERT_EQ(ring.front(), 1);
+}
+
+TEST(StreamTable, SparseStreamIds) {
+    rdma_util::StreamTable table;
+    const uint32_t stream_ids[] = {0, 1u << 15, 1u << 16, 123456789, UINT32_MAX};
+    for (uint32_t stream_id : stream_ids) {
+        table.push_local_send_request(std::make_tuple(make_ticket(stream_id, 1), stream_id));
+    }
+    for (uint32_t i = 0; i < 1000; ++i) {
+        table.get(i * 7919);
+    }
+    ASSERT_EQ(table.get_num_streams(), 1000 + 4);
+
+    for (uint32_t stream_id : stream_ids) {
+        ASSERT_EQ(std::get<1>(table.get(stream_id).local_send_requests.front()), stream_id);
+    }
+    ASSERT_TRUE(table.get(42).local_send_requests.empty());
+}
+
+TEST(StreamTable, OnlyMatchableStreamsAreReady) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    table.push_local_send_request(std::make_tuple(make_ticket(7, 1), 0u));
+    table.push_remote_recv_request(make_ticket(3, 1));
+    ASSERT_FALSE(table.pop_ready(stream_id));
+
+    table.push_remote_recv_request(make_ticket(7, 1));
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 7);
+    ASSERT_FALSE(table.pop_ready(stream_id));
+}
+
+TEST(StreamTable, PullRequestsOnlyMatchPullRecvs) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    rdma_util::Ticket pull_request = make_ticket(5, 1);
+    pull_request.kind = rdma_util::TicketKind::PULL_REQUEST;
+    table.push_remote_pull_request(pull_request);
+    table.push_local_send_request(std::make_tuple(make_ticket(5, 1), 0u));
+    ASSERT_FALSE(table.pop_ready(stream_id));
+
+    table.push_local_pull_recv(std::make_tuple(make_ticket(5, 1), 1u));
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 5);
+    ASSERT_TRUE(rdma_util::StreamTable::has_pull(table.get(5)));
+    ASSERT_FALSE(rdma_util::StreamTable::has_push(table.get(5)));
+}
+
+TEST(StreamTable, ScatteredRecvWaitsForAllTickets) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    table.push_local_send_request(std::make_tuple(make_ticket(2, 3), 0u));
+    for (uint32_t segments_left = 2; segments_left > 0; --segments_left) {
+        rdma_util::Ticket segment = make_ticket(2, 1);
+        segment.segments_left = segments_left;
+        table.push_remote_recv_request(segment);
+        ASSERT_FALSE(table.pop_ready(stream_id));
+    }
+
+    table.push_remote_recv_request(make_ticket(2, 1));
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 2);
+}
+
+TEST(StreamTable, ReadyStreamsAreRoundRobin) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        table.push_local_send_request(std::make_tuple(make_ticket(1, i), i));
+        table.push_remote_recv_request(make_ticket(1, i));
+    }
+    table.push_local_send_request(std::make_tuple(make_ticket(2, 0), 2u));
+    table.push_remote_recv_request(make_ticket(2, 0));
+
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 1);
+    table.get(1).local_send_requests.pop();
+    table.get(1).remote_recv_requests.pop();
+    table.unlink_or_requeue(1);
+
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 2);
+    table.get(2).local_send_requests.pop();
+    table.get(2).remote_recv_requests.pop();
+    table.unlink_or_requeue(2);
+
+    ASSERT_TRUE(table.pop_ready(stream_id));
+    ASSERT_EQ(stream_id, 1);
+    ASSERT_EQ(std::get<1>(table.get(1).local_send_requests.front()), 1);
+    table.get(1).local_send_requests.pop();
+    table.get(1).remote_recv_requests.pop();
+    table.unlink_or_requeue(1);
+
+    ASSERT_FALSE(table.pop_ready(stream_id));
+}
+
+static rdma_util::PendingWrite make_write(uint32_t stream_id, uint64_t length) {
+    rdma_util::PendingWrite pending_write {};
+    pending_write.stream_id = stream_id;
+    pending_write.remaining = length;
+    return pending_write;
+}
+
+TEST(StreamTable, HigherPriorityIsActiveFirst) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    rdma_util::StreamQos urgent;
+    urgent.priority = 0;
+    table.set_qos(4, urgent);
+
+    table.push_pending_write(make_write(3, 1));
+    table.push_pending_write(make_write(4, 1));
+    ASSERT_TRUE(table.pop_active(stream_id));
+    ASSERT_EQ(stream_id, 4);
+    table.get(4).pending_writes.pop();
+    table.deactivate_or_requeue(4);
+
+    ASSERT_TRUE(table.pop_active(stream_id));
+    ASSERT_EQ(stream_id, 3);
+    table.deactivate_or_requeue(3);
+
+    // A stream with writes left is requeued
+    ASSERT_TRUE(table.pop_active(stream_id));
+    ASSERT_EQ(stream_id, 3);
+}
+
+TEST(StreamTable, StreamWithoutCreditIsParked) {
+    rdma_util::StreamTable table;
+    uint32_t stream_id = 0;
+
+    rdma_util::StreamQos limited;
+    limited.max_outstanding_bytes = 100;
+    table.set_qos(6, limited);
+
+    table.push_pending_write(make_write(6, 200));
+    ASSERT_TRUE(table.pop_active(stream_id));
+    table.acquire_credit(6, 100);
+    table.deactivate_or_requeue(6);
+    ASSERT_FALSE(table.pop_active(stream_id));
+
+    table.release_credit(6, 100);
+    ASSERT_TRUE(table.pop_active(stream_id));
+    ASSERT_EQ(stream_id, 6);
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,79 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+#include "tccl_stats.h"
+
+using rdma_util::LatencyHistogram;
+
+TEST(LatencyHistogram, BucketBoundsRoundTrip) {
+    for (uint32_t bucket = 0; bucket < LatencyHistogram::kNumBuckets; ++bucket) {
+        const uint64_t lower = LatencyHistogram::get_bucket_lower_bound(bucket);
+        ASSERT_EQ(LatencyHistogram::get_bucket(lower), bucket);
+        if (bucket > 0) {
+            ASSERT_EQ(LatencyHistogram::get_bucket(lower - 1), bucket - 1);
+        }
+    }
+    ASSERT_EQ(LatencyHistogram::get_bucket(UINT64_MAX), LatencyHistogram::kNumBuckets - 1);
+}
+
+TEST(LatencyHistogram, PercentilesStayWithinRelativeError) {
+    LatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        histogram.record(value);
+    }
+
+    const rdma_util::HistogramSnapshot snapshot = histogram.snapshot();
+    ASSERT_EQ(snapshot.count, 100000);
+    ASSERT_EQ(snapshot.max, 100000);
+    ASSERT_DOUBLE_EQ(snapshot.mean(), 50000.5);
+
+    const double max_error = 1.0 / LatencyHistogram::kSubBuckets;
+    ASSERT_NEAR(snapshot.percentile(0.5), 50000.0, 50000.0 * max_error);
+    ASSERT_NEAR(snapshot.percentile(0.99), 99000.0, 99000.0 * max_error);
+    ASSERT_EQ(snapshot.percentile(1.0), 100000);
+}
+
+TEST(LatencyHistogram, MergeAddsUp) {
+    LatencyHistogram small;
+    LatencyHistogram large;
+    for (uint64_t i = 0; i < 90; ++i) {
+        small.record(10);
+    }
+    for (uint64_t i = 0; i < 10; ++i) {
+        large.record(1000000);
+    }
+
+    rdma_util::HistogramSnapshot merged = small.snapshot();
+    merged.merge(large.snapshot());
+    ASSERT_EQ(merged.count, 100);
+    ASSERT_EQ(merged.percentile(0.9), 10);
+    ASSERT_EQ(merged.max, 1000000);
+    ASSERT_GE(merged.percentile(0.95), 1000000 - 1000000 / LatencyHistogram::kSubBuckets);
+}
+
+TEST(TcclContextStats, SnapshotCoversEveryStream) {
+    rdma_util::TcclContextStats stats;
+    rdma_util::stats_bump(stats.get_stream(3).num_sends);
+    stats.get_stream(3).send_latency.record(500);
+    rdma_util::stats_bump(stats.get_stream(70000).num_recvs, 2);
+    ASSERT_EQ(&stats.get_stream(70000), &stats.get_stream(70000));
+    stats.record_send_poll(0);
+    stats.record_send_poll(4);
+
+    const rdma_util::TcclContextStatsSnapshot snapshot = stats.snapshot();
+    ASSERT_TRUE(snapshot.enabled);
+    ASSERT_EQ(snapshot.streams.size(), 2);
+    ASSERT_EQ(snapshot.streams.at(3).num_sends, 1);
+    ASSERT_EQ(snapshot.streams.at(3).send_latency.count, 1);
+    ASSERT_EQ(snapshot.streams.at(70000).num_recvs, 2);
+    ASSERT_EQ(snapshot.send_cq_polls, 2);
+    ASSERT_EQ(snapshot.send_cq_empty_polls, 1);
+    ASSERT_EQ(snapshot.send_wcs, 4);
+    ASSERT_NE(snapshot.to_json().find("\"70000\""), std::string::npos);
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
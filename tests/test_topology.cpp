@@ -0,0 +1,131 @@
+#include <gtest/gtest.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "topology.h"
+
+// A fake sysfs tree:
+//   pci0000:00 - 0000:00:01.0 - 0000:01:00.0 (switch) - 0000:02:08.0 - 0000:03:00.0 (GPU)
+//                                                     - 0000:02:10.0 - 0000:04:00.0 (mlx5_0)
+//              - 0000:00:02.0 - 0000:05:00.0 (mlx5_1)
+//   pci0000:40 - 0000:40:01.0 - 0000:41:00.0 (mlx5_2), NUMA node 0
+//   pci0000:80 - 0000:80:01.0 - 0000:81:00.0 (mlx5_3), NUMA node 1
+class FakeSysfs {
+  private:
+    std::string root_;
+
+    void make_dirs(const std::string& path) {
+        for (uint64_t i = 1; i <= path.size(); ++i) {
+            if (i == path.size() || path[i] == '/') {
+                mkdir(path.substr(0, i).c_str(), 0755);
+            }
+        }
+    }
+
+    void write_file(const std::string& path, const std::string& content) {
+        std::ofstream file(path);
+        file << content << "\n";
+    }
+
+  public:
+    FakeSysfs() {
+        char pattern[] = "/tmp/test_topology_XXXXXX";
+        root_ = mkdtemp(pattern);
+        this->add_device("pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:08.0/0000:03:00.0", 0, "");
+        this->add_device("pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:10.0/0000:04:00.0", 0, "mlx5_0");
+        this->add_device("pci0000:00/0000:00:02.0/0000:05:00.0", 0, "mlx5_1");
+        this->add_device("pci0000:40/0000:40:01.0/0000:41:00.0", 0, "mlx5_2");
+        this->add_device("pci0000:80/0000:80:01.0/0000:81:00.0", 1, "mlx5_3");
+        this->make_dirs(root_ + "/devices/system/node/node0");
+        this->write_file(root_ + "/devices/system/node/node0/cpulist", "0-3,8");
+    }
+
+    ~FakeSysfs() {
+        std::string command = "rm -rf " + root_;
+        if (system(command.c_str()) != 0) {
+            fprintf(stderr, "Failed to remove %s\n", root_.c_str());
+        }
+    }
+
+    void add_device(const std::string& path, int numa_node, const std::string& rdma_name) {
+        const std::string device_dir = root_ + "/devices/" + path;
+        this->make_dirs(device_dir);
+        this->write_file(device_dir + "/numa_node", std::to_string(numa_node));
+
+        this->make_dirs(root_ + "/bus/pci/devices");
+        const std::string address = path.substr(path.rfind('/') + 1);
+        EXPECT_EQ(symlink(device_dir.c_str(), (root_ + "/bus/pci/devices/" + address).c_str()), 0);
+        if (!rdma_name.empty()) {
+            this->make_dirs(root_ + "/class/infiniband/" + rdma_name);
+            EXPECT_EQ(symlink(device_dir.c_str(), (root_ + "/class/infiniband/" + rdma_name + "/device").c_str()), 0);
+        }
+    }
+
+    inline const std::string& get_root() const {
+        return root_;
+    }
+};
+
+TEST(Topology, DiscoverRdmaDevices) {
+    FakeSysfs sysfs;
+    auto topology = rdma_util::Topology::create(sysfs.get_root());
+    const auto& devices = topology->get_rdma_devices();
+    ASSERT_EQ(devices.size(), 4);
+    ASSERT_EQ(devices[0].name, "mlx5_0");
+    ASSERT_EQ(devices[0].pci_address, "0000:04:00.0");
+    ASSERT_EQ(devices[0].pci_path.size(), 5);
+    ASSERT_EQ(devices[0].pci_path[0], "pci0000:00");
+    ASSERT_EQ(devices[3].numa_node, 1);
+}
+
+TEST(Topology, DistanceLevels) {
+    FakeSysfs sysfs;
+    auto topology = rdma_util::Topology::create(sysfs.get_root());
+    const rdma_util::PciDevice gpu = topology->get_pci_device("0000:03:00.0");
+    ASSERT_EQ(gpu.numa_node, 0);
+
+    using rdma_util::PciDistance;
+    ASSERT_EQ(rdma_util::Topology::get_distance(gpu, topology->get_rdma_device("mlx5_0")), PciDistance::PCIE_SWITCH);
+    ASSERT_EQ(rdma_util::Topology::get_distance(gpu, topology->get_rdma_device("mlx5_1")), PciDistance::HOST_BRIDGE);
+    ASSERT_EQ(rdma_util::Topology::get_distance(gpu, topology->get_rdma_device("mlx5_2")), PciDistance::NUMA_NODE);
+    ASSERT_EQ(rdma_util::Topology::get_distance(gpu, topology->get_rdma_device("mlx5_3")), PciDistance::SYSTEM);
+    ASSERT_EQ(rdma_util::Topology::get_num_hops(gpu, topology->get_rdma_device("mlx5_0")), 4);
+}
+
+TEST(Topology, NearestRdmaDevice) {
+    FakeSysfs sysfs;
+    auto topology = rdma_util::Topology::create(sysfs.get_root());
+
+    // CUDA reports upper case addresses, NVML adds 4 more digits to the domain
+    ASSERT_EQ(topology->get_nearest_rdma_device("0000:03:00.0").name, "mlx5_0");
+    ASSERT_EQ(topology->get_nearest_rdma_device("00000000:03:00.0").name, "mlx5_0");
+    ASSERT_EQ(topology->get_nearest_rdma_device("0000:81:00.0").name, "mlx5_3");
+    ASSERT_THROW(topology->get_nearest_rdma_device("0000:99:00.0"), std::runtime_error);
+}
+
+TEST(Topology, NumaNodeCpus) {
+    FakeSysfs sysfs;
+    auto topology = rdma_util::Topology::create(sysfs.get_root());
+    ASSERT_EQ(topology->get_numa_node_cpus(0), (std::vector<uint32_t> {0, 1, 2, 3, 8}));
+    ASSERT_EQ(rdma_util::Topology::normalize_pci_address("0000:3B:00.0"), "0000:3b:00.0");
+}
+
+TEST(Topology, AllocateOnNumaNode) {
+    auto buffer = rdma_util::Topology::allocate_on_numa_node(10000, 0);
+    ASSERT_NE(buffer, nullptr);
+    ASSERT_EQ(uint64_t(buffer.get()) % uint64_t(sysconf(_SC_PAGESIZE)), 0);
+    static_cast<char*>(buffer.get())[9999] = 1;
+}
+
+int main(int argc, char** argv) {
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}